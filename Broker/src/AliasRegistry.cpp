@@ -0,0 +1,55 @@
+#include "AliasRegistry.h"
+
+AliasRegistry::AliasRegistry()
+	: _count(0)
+{
+	memset(_topics, 0, sizeof(_topics));
+	memset(_hashes, 0, sizeof(_hashes));
+}
+
+uint8_t AliasRegistry::add(const char * topic)
+{
+	uint8_t id = find(topic);
+	if(id != 0)
+		return id;
+
+	size_t length = strlen(topic);
+	if(length == 0 || length >= ALIAS_REGISTRY_TOPIC_SIZE || _count >= ALIAS_MAX ||
+		strpbrk(topic, "+#") != nullptr || TopicAlias::parse(topic) != 0)
+		return 0;
+
+	memcpy(_topics[_count], topic, length + 1);
+	_hashes[_count] = hash(topic);
+	return ++_count;
+}
+
+uint8_t AliasRegistry::find(const char * topic) const
+{
+	if(_count == 0)
+		return 0;
+
+	uint32_t h = hash(topic);
+	for(uint8_t i = 0; i < _count; i++)
+	{
+		if(_hashes[i] == h && !strcmp(_topics[i], topic))
+			return i + 1;
+	}
+	return 0;
+}
+
+const char * AliasRegistry::topic(uint8_t id) const
+{
+	return id != 0 && id <= _count ? _topics[id - 1] : nullptr;
+}
+
+// FNV-1a
+uint32_t AliasRegistry::hash(const char * topic)
+{
+	uint32_t h = 2166136261UL;
+	while(*topic)
+	{
+		h ^= (uint8_t)*topic++;
+		h *= 16777619UL;
+	}
+	return h;
+}
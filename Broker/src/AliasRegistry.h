@@ -0,0 +1,39 @@
+#ifndef ALIAS_REGISTRY_H
+#define ALIAS_REGISTRY_H
+
+#include <Arduino.h>
+#include <TopicAlias.h>
+
+// Longest topic that gets an alias, terminator included
+#define ALIAS_REGISTRY_TOPIC_SIZE 48
+
+/* Topics the broker handed out aliases for, see TopicAlias.h.
+ *
+ * Ids are given in order and never taken back, so a device registering
+ * again gets the same ones. Every topic keeps a 32-bit hash next to it:
+ * find() runs on every message the broker handles and only compares the
+ * strings of a topic whose hash matches. */
+class AliasRegistry
+{
+public:
+	AliasRegistry();
+
+	// Id of topic, a new one if it has none yet. 0 if topic is a filter, is
+	// too long or the table is full.
+	uint8_t add(const char * topic);
+	// Id of topic, 0 if it has no alias
+	uint8_t find(const char * topic) const;
+	// Topic of id, nullptr if id is unused
+	const char * topic(uint8_t id) const;
+
+	uint8_t count() const { return _count; }
+
+private:
+	static uint32_t hash(const char * topic);
+
+	char _topics[ALIAS_MAX][ALIAS_REGISTRY_TOPIC_SIZE];
+	uint32_t _hashes[ALIAS_MAX];
+	uint8_t _count;
+};
+
+#endif
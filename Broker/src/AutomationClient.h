@@ -4,16 +4,53 @@
 #include <uMQTTBroker.h>
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
-#include <EEPROM.h>
-#include <Logger.h>
+#include <ConfigJournal.h>
+#include <RingLog.h>
+#include <Trace.h>
+#include <MemStats.h>
+#include <StateCache.h>
+#include <WeatherHistory.h>
+#include <WindowRule.h>
+#include <FixedString.h>
+#include <type_traits>
 
 #define TOPIC_MAX_LENGTH 128
+// A root topic and the longest subtopic below it
+#define TOPIC_BUFFER_SIZE (TOPIC_MAX_LENGTH + 32)
+// Longest payload of a state topic: the rule or the weather topic
+#define AUTOMATED_WINDOW_STATE_SIZE (RULE_SOURCE_SIZE > TOPIC_MAX_LENGTH ? RULE_SOURCE_SIZE : TOPIC_MAX_LENGTH)
+// Weather report with the current weather, two forecasts and the trace
+#define AUTOMATED_WINDOW_REPORT_JSON_SIZE (JSON_ARRAY_SIZE(3) + JSON_OBJECT_SIZE(2) + 3*JSON_OBJECT_SIZE(8) + JSON_OBJECT_SIZE(3) + 310)
+// Document of /config/get and /config/set, topics copied in
+#define AUTOMATED_WINDOW_CONFIG_JSON_SIZE (JSON_OBJECT_SIZE(11) + 2*JSON_OBJECT_SIZE(2) + 2*TOPIC_MAX_LENGTH + RULE_SOURCE_SIZE + 64)
+// Text of that document, keys and numbers around both topics and the rule
+#define AUTOMATED_WINDOW_CONFIG_SIZE (2*TOPIC_MAX_LENGTH + RULE_SOURCE_SIZE + 256)
+// Longest message of err()
+#define AUTOMATED_WINDOW_ERROR_SIZE 160
+// Longest command payload but /config/set, terminated: a reply topic or a value
+#define AUTOMATED_WINDOW_VALUE_SIZE (TOPIC_BUFFER_SIZE > RULE_SOURCE_SIZE ? TOPIC_BUFFER_SIZE : RULE_SOURCE_SIZE)
+
+// Command topics below the root topic
+static const char * const AUTOMATED_WINDOW_COMMANDS[] = {
+	"/wid/get", "/wid/set", "/temp/get", "/temp/set", "/wind/get", "/wind/set",
+	"/humidity/get", "/humidity/set", "/forecast/get", "/forecast/set", "/topic/get", "/topic/set",
+	"/activate", "/deactivate", "/save", "/load", "/config/get", "/config/set", "/rule/get", "/rule/set"
+};
+
+// Bump whenever config_t, wlconditions_t or WindowRule::program_t change
+#define AUTOMATED_WINDOW_RECORD_VERSION 3
 
 template<typename T>
 class AutomatedWindow
 {
 public:
-	typedef Logger<T> Log;
+	// Wind the current weather is checked with
+	enum WindBasis : uint8_t
+	{
+		WIND_NOW = 0,		// Of the last report
+		WIND_MEAN,			// Rolling mean over the history
+		WIND_MAX			// Rolling maximum over the history
+	};
 
 	// Weather Limiting Conditions
 	// These are conditions for window to be OPEN
@@ -32,96 +69,231 @@ public:
 		// close window instead of current weather.
 		// It still uses current weather info to open the window.
 		uint8_t forecast = 1;
+
+		uint8_t windBasis = WIND_NOW;
+		uint16_t history = 30;		// Minutes the rolling aggregates cover
 	} wlconditions_t;
 
 	typedef struct
 	{
-		char mqttTopic[TOPIC_MAX_LENGTH];
-		char weatherTopic[TOPIC_MAX_LENGTH];
+		FixedString<TOPIC_MAX_LENGTH> mqttTopic = "";
+		FixedString<TOPIC_MAX_LENGTH> weatherTopic = "weather";
 		bool active = true;
 	} config_t;
 
+	typedef struct
+	{
+		config_t conf;
+		wlconditions_t wlcond;
+		WindowRule::program_t rule;
+	} record_t;
+	static_assert(std::is_trivially_copyable<record_t>::value, "record_t is saved and loaded as bytes.");
+
+	// Fields of the retained <root>/state/<field> topics
+	enum StateField : uint8_t
+	{
+		STATE_WID = 0,
+		STATE_TEMP,
+		STATE_WIND,
+		STATE_HUMIDITY,
+		STATE_FORECAST,
+		STATE_ACTIVE,
+		STATE_WIND_BASIS,
+		STATE_HISTORY,
+		STATE_RULE,
+		STATE_WEATHER_TOPIC,
+		STATE_FIELDS
+	};
+
+	// Commands, in the order of AUTOMATED_WINDOW_COMMANDS
+	enum Command : uint8_t
+	{
+		CMD_WID_GET = 0, CMD_WID_SET, CMD_TEMP_GET, CMD_TEMP_SET, CMD_WIND_GET, CMD_WIND_SET,
+		CMD_HUMIDITY_GET, CMD_HUMIDITY_SET, CMD_FORECAST_GET, CMD_FORECAST_SET, CMD_TOPIC_GET, CMD_TOPIC_SET,
+		CMD_ACTIVATE, CMD_DEACTIVATE, CMD_SAVE, CMD_LOAD, CMD_CONFIG_GET, CMD_CONFIG_SET, CMD_RULE_GET, CMD_RULE_SET,
+		CMD_COUNT
+	};
+	static_assert(sizeof(AUTOMATED_WINDOW_COMMANDS)/sizeof(AUTOMATED_WINDOW_COMMANDS[0]) == CMD_COUNT,
+		"Command and AUTOMATED_WINDOW_COMMANDS differ.");
+
 	static const int WID_MIN = 800;
 	static const int WID_MAX = 804;
 
-	AutomatedWindow(T * mqttClient, String mqttTopic = "automatedWindow")
-		: _mqttClient(mqttClient), _mqttTopic(mqttTopic) {}
+	// The report document is allocated here, once, and reused by decide()
+	AutomatedWindow(T * mqttClient, const char * mqttTopic = "automatedWindow")
+		: _mqttClient(mqttClient), _report(AUTOMATED_WINDOW_REPORT_JSON_SIZE)
+	{
+		_conf.mqttTopic.assign(mqttTopic);
+	}
 
-	// wpl: weather data payload
-	bool decide(String wpl)
+	// payload: weather report, as WeatherClient publishes it
+	bool decide(const char * payload, size_t length)
 	{
-		// Parses string
-		const size_t capacity = JSON_ARRAY_SIZE(3) + JSON_OBJECT_SIZE(1) + 3*JSON_OBJECT_SIZE(8) + 310;
-		DynamicJsonDocument doc(capacity);
+		MemScope mem(MEM_OP_DECIDE);
 
-		deserializeJson<String>(doc, wpl);
+		JsonDocument & doc = _report;
+		deserializeJson(doc, payload, length);
 		JsonArray weather = doc["weather"];
 
-		// Stays true only if all OPEN conditions are matched
+		// The current weather counts in the aggregates it is checked with
+		JsonObject current = weather[0];
+		if(!current.isNull())
+		{
+			_history.setWindow(_wlcond.history*60UL);
+			_history.add(current["temp"], current["wind"], current["humidity"], millis());
+		}
+
+		// Stays true only if all OPEN conditions are matched. A rule replaces
+		// the conditions.
 		bool match = true;
-		for(int i = 0; i < (_wlcond.forecast<=2 ? _wlcond.forecast+1 : 2); i++)
+		if(!_rule.empty())
+			match = evaluateRule(weather);
+		else for(int i = 0; i < (_wlcond.forecast<=2 ? _wlcond.forecast+1 : 2); i++)
 		{
+			float wind = weather[i]["wind"];
+			if(i == 0 && _history.count() > 0 && _wlcond.windBasis != WIND_NOW)
+				wind = _wlcond.windBasis == WIND_MAX ? _history.max(WEATHER_WIND) : _history.mean(WEATHER_WIND);
+
 			match &= weather[i]["id"] >= _wlcond.wid[0] && weather[i]["id"] <= _wlcond.wid[1];
 			match &= weather[i]["temp"] >= _wlcond.temp[0] && weather[i]["temp"] <= _wlcond.temp[1];
-			match &= weather[i]["wind"] <= _wlcond.wind;
-			match &= weather[i]["humidity"] <= _wlcond.wind;
+			match &= wind <= _wlcond.wind;
+			match &= weather[i]["humidity"] <= _wlcond.humidity;
 		}
 
-		char dummy = '\0';
-		if(match)
+		// A traced weather report passes its trace on to the window, see Trace.h
+		trace_t trace;
+		char traceJson[TRACE_JSON_SIZE];
+		bool traced = Trace::read(doc["trace"], trace);
+
+		MemScope memPublish(MEM_OP_PUBLISH);
+		char command[TOPIC_BUFFER_SIZE];
+		_windowTopic.join(command, sizeof(command), match ? "/open" : "/close");
+		bool published;
+		if(traced)
 		{
-			// Opens Window
-			_mqttClient->publish(String(_windowTopic + "/open").c_str(),&dummy,sizeof(dummy));
+			trace.decide = millis();
+			size_t n = Trace::print(trace, traceJson, sizeof(traceJson));
+			published = _mqttClient->publish(command,(uint8_t*)traceJson,n);
 		}
 		else
 		{
-			// Closes Window
-			_mqttClient->publish(String(_windowTopic + "/close").c_str(),&dummy,sizeof(dummy));
+			uint8_t dummy = 0;
+			// Opens or closes the window
+			published = _mqttClient->publish(command,&dummy,sizeof(dummy));
+		}
+
+		if(!published)
+		{
+			snprintf(_err, sizeof(_err), "Publish error! Could not publish to topic <%s>.", command);
+			LOG_ERROR("%s", _err);
+		}
+		return published;
+	}
+
+	// Replaces the conditions by a rule, see WindowRule.h. An empty rule
+	// brings the conditions back.
+	bool setRule(const char * source)
+	{
+		if(!_rule.compile(source))
+		{
+			snprintf(_err, sizeof(_err), "%s", WindowRule::err());
+			LOG_ERROR("%s", _err);
+			return false;
 		}
+		return true;
 	}
+	const char * getRule() { return _rule.source(); }
 
 	void setConditions(wlconditions_t & cond) { _wlcond = cond; }
 	wlconditions_t getConditions() { return _wlcond; }
 
-	void setMqttTopic(String topic) {_mqttTopic = topic;}
-	String getMqttTopic() {return _mqttTopic;}
+	// False, keeping the topic, if it is too long
+	bool setMqttTopic(const char * topic) { return _conf.mqttTopic.assign(topic); }
+	const FixedString<TOPIC_MAX_LENGTH> & getMqttTopic() const { return _conf.mqttTopic; }
+
+	bool setWeatherTopic(const char * topic) { return _conf.weatherTopic.assign(topic); }
+	const FixedString<TOPIC_MAX_LENGTH> & getWeatherTopic() const { return _conf.weatherTopic; }
 
-	void setWeatherTopic(String topic) { _weatherTopic = topic; }
-	String getWeatherTopic() { return _weatherTopic; }
+	void activate() { _conf.active = true; }
+	void deactivate(){ _conf.active = false; }
+	bool active() { return _conf.active; }
 
-	void activate() { _active = true; }
-	void deactivate(){ _active = false; }
-	bool active() { return _active; }
+	// Activates or deactivates and (un)subscribes the weather topic
+	// Keeps the state as it was if the subscription cannot be changed
+	bool setActive(bool active)
+	{
+		if(active && !_mqttClient->subscribe(_conf.weatherTopic.c_str()))
+		{
+			snprintf(_err, sizeof(_err), "Could not subscribe to <%s>", _conf.weatherTopic.c_str());
+			LOG_ERROR("%s", _err);
+			return false;
+		}
+		if(!active && !_mqttClient->unsubscribe(_conf.weatherTopic.c_str()))
+		{
+			snprintf(_err, sizeof(_err), "Could not unsubscribe from <%s>", _conf.weatherTopic.c_str());
+			LOG_ERROR("%s", _err);
+			return false;
+		}
+		_conf.active = active;
+		return true;
+	}
 
-	void setEEPROMAddress(int add) {_eepromAdd = add;}
-	int getEEPROMAddress() {return _eepromAdd;}
+	// Moves every subscription to the new root topic, keeps the old one on failure
+	bool changeMqttTopic(const char * topic)
+	{
+		if(strlen(topic) > TOPIC_MAX_LENGTH - 1)
+		{
+			snprintf(_err, sizeof(_err), "Given topic is too long.");
+			LOG_ERROR("%s", _err);
+			return false;
+		}
+
+		clearState();
+		if(!unsubscribe())
+			return false;
+
+		FixedString<TOPIC_MAX_LENGTH> hold = getMqttTopic();
+
+		setMqttTopic(topic);
+
+		if(!subscribe())
+		{
+			snprintf(_err, sizeof(_err), "Given topic is might unvalid.");
+			LOG_ERROR("%s", _err);
+			_conf.mqttTopic = hold;
+			if(!subscribe())
+			{
+				snprintf(_err, sizeof(_err), "Could not resubscribe to MQTT topic. New given topic was discarded.");
+				LOG_ERROR("%s", _err);
+			}
+			return false;
+		}
+		return true;
+	}
+
+	// Journal record the configuration is saved under
+	void setRecordId(uint8_t id) {_recordId = id;}
+	uint8_t getRecordId() {return _recordId;}
 
 	bool subscribe(bool a=false)
 	{
 		bool ret = true;
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/wid/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/wid/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/temp/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/temp/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/wind/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/wind/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/humidity/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/humidity/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/forecast/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/forecast/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/topic/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/topic/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/activate").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/deactivate").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/save").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/load").c_str());
-		if(_active)
-			ret &= _mqttClient->subscribe(_weatherTopic.c_str());
+		char topic[TOPIC_BUFFER_SIZE];
+		for(const char * command : AUTOMATED_WINDOW_COMMANDS)
+			ret &= _mqttClient->subscribe(getMqttTopic().join(topic, sizeof(topic), command));
+		if(_conf.active)
+			ret &= _mqttClient->subscribe(_conf.weatherTopic.c_str());
 		
 		if(!ret)
 		{
-			_err = "subscribe(): failed.";
-			Log::error(_err);
+			snprintf(_err, sizeof(_err), "subscribe(): failed.");
+			LOG_ERROR("%s", _err);
+		}
+		else
+		{
+			// New root topic or new connection: the whole state again
+			_state.clear();
+			publishState();
 		}
 
 		return ret;
@@ -130,28 +302,15 @@ public:
 	bool unsubscribe(bool a=false)
 	{
 		bool ret = true;
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/wid/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/wid/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/temp/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/temp/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/wind/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/wind/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/humidity/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/humidity/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/forecast/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/forecast/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/topic/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/topic/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/activate").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/deactivate").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/save").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/load").c_str());
-		_mqttClient->unsubscribe(_weatherTopic.c_str());
+		char topic[TOPIC_BUFFER_SIZE];
+		for(const char * command : AUTOMATED_WINDOW_COMMANDS)
+			ret &= _mqttClient->unsubscribe(getMqttTopic().join(topic, sizeof(topic), command));
+		_mqttClient->unsubscribe(_conf.weatherTopic.c_str());
 
 		if(!ret)
 		{
-			_err = "unsubscribe(): failed.";
-			Log::error(_err);
+			snprintf(_err, sizeof(_err), "unsubscribe(): failed.");
+			LOG_ERROR("%s", _err);
 		}
 
 		return ret;
@@ -163,260 +322,547 @@ public:
 			return false;
 		return subscribe();
 	}
-	
 
-	bool save(int const address)
+	// Publishes the fields that changed since the last call to their retained
+	// <root>/state/<field> topic. Runs after every command, so clients only
+	// need to subscribe to follow the configuration.
+	bool publishState()
 	{
-		config_t conf;
-		conf.active = _active;
-		strlcpy(conf.weatherTopic,(const char*)getWeatherTopic().c_str(),TOPIC_MAX_LENGTH);
-		strlcpy(conf.mqttTopic,(const char*)getMqttTopic().c_str(),TOPIC_MAX_LENGTH);
-
 		bool ret = true;
-
-		// A fazer: dar um jeito de verificar se isso aqui vai dar certo
-		EEPROM.begin(sizeof(wlconditions_t) + sizeof(config_t));
-		EEPROM.put<config_t>(address,conf);
-		EEPROM.put<wlconditions_t>(address+sizeof(conf),_wlcond);
-		ret &= EEPROM.commit();
-		EEPROM.end();
-
-		if(!ret)
+		char value[AUTOMATED_WINDOW_STATE_SIZE];
+		char topic[TOPIC_BUFFER_SIZE];
+		for(uint8_t i = 0; i < STATE_FIELDS; i++)
 		{
-			_err = "Could not save on EEPROM.";
-			Log::error(_err);
+			stateValue(i, value, sizeof(value));
+			if(!_state.update(i, value))
+				continue;
+
+			snprintf(topic, sizeof(topic), "%s" STATE_TOPIC "%s", getMqttTopic().c_str(), stateName(i));
+			if(!_mqttClient->publish(topic, value, true))
+			{
+				_state.forget(i);
+				snprintf(_err, sizeof(_err), "Publish error! Could not publish <%.24s> to topic <%.80s>.", value, topic);
+				LOG_ERROR("%s", _err);
+				ret = false;
+			}
 		}
 		return ret;
 	}
-	
-	bool save(void)
+
+	// Removes the retained state and history topics below the current root topic
+	void clearState()
 	{
-		return save(_eepromAdd);
+		char topic[TOPIC_BUFFER_SIZE];
+		for(uint8_t i = 0; i < STATE_FIELDS; i++)
+		{
+			snprintf(topic, sizeof(topic), "%s" STATE_TOPIC "%s", getMqttTopic().c_str(), stateName(i));
+			_mqttClient->publish(topic, "", true);
+		}
+		_mqttClient->publish(getMqttTopic().join(topic, sizeof(topic), HISTORY_TOPIC), "", true);
+		_state.clear();
 	}
 
-	bool load(int const address)
+	// Publishes the rolling aggregates of the weather reports to the retained
+	// <root>/history topic, so dashboards need not keep the history themselves
+	bool publishHistory()
 	{
-		config_t conf;
-
-		bool ret = true;
-
-		// A fazer: dar um jeito de verificar se isso aqui vai dar certo
-		EEPROM.begin(sizeof(wlconditions_t) + sizeof(config_t));
-		EEPROM.get<config_t>(address,conf);
-		EEPROM.get<wlconditions_t>(address+sizeof(conf),_wlcond);
-		EEPROM.end();
-
-		if(!ret)
+		char json[WEATHER_HISTORY_JSON_SIZE];
+		char topic[TOPIC_BUFFER_SIZE];
+		getMqttTopic().join(topic, sizeof(topic), HISTORY_TOPIC);
+		if(_history.print(json, sizeof(json)) == 0 || !_mqttClient->publish(topic, json, true))
 		{
-			_err = "Could not read from EEPROM.";
-			Log::error(_err);
+			snprintf(_err, sizeof(_err), "Publish error! Could not publish the weather history to topic <%s>.", topic);
+			LOG_ERROR("%s", _err);
 			return false;
 		}
-
-		_active = conf.active;
-		setMqttTopic(String(conf.mqttTopic));
-		setWeatherTopic(String(conf.weatherTopic));
-
-		return ret;
+		return true;
 	}
 
-	bool load(void)
-	{
-		return load(_eepromAdd);
-	}
+	const WeatherHistory & history() const { return _history; }
 
-	bool callback(const char* topic, const char* payload, unsigned int length)
+	// Every parameter in one JSON document in buf, see /config/get. Returns
+	// its length, 0 if it does not fit.
+	size_t getConfig(char * buf, size_t size)
 	{
-		String stopic = String(topic);
-		char msg[length+1];
-	    for (int i = 0; i < length; i++) {
-	        msg[i] = (char)payload[i];
-	    }
-	    msg[length] = '\0';
-
-	    return this->callback(stopic, String(msg));
+		StaticJsonDocument<AUTOMATED_WINDOW_CONFIG_JSON_SIZE> doc;
+		JsonObject wid = doc.createNestedObject("wid");
+		wid["min"] = _wlcond.wid[0];
+		wid["max"] = _wlcond.wid[1];
+		JsonObject temp = doc.createNestedObject("temp");
+		temp["min"] = _wlcond.temp[0];
+		temp["max"] = _wlcond.temp[1];
+		doc["wind"] = _wlcond.wind;
+		doc["humidity"] = _wlcond.humidity;
+		doc["forecast"] = _wlcond.forecast;
+		doc["windBasis"] = windBasisName(_wlcond.windBasis);
+		doc["history"] = _wlcond.history;
+		doc["rule"] = getRule();
+		doc["active"] = _conf.active;
+		doc["topic"] = getMqttTopic().c_str();
+		doc["weatherTopic"] = getWeatherTopic().c_str();
+
+		if(measureJson(doc) >= size)
+		{
+			snprintf(_err, sizeof(_err), "Configuration does not fit in %u bytes.", (unsigned)size);
+			LOG_ERROR("%s", _err);
+			return 0;
+		}
+		return serializeJson(doc, buf, size);
 	}
 
-	// Call this method inside your callback functions with raw arguments
-	// returns false in case of error
-	bool callback(String topic, String payload)
+	// Partial update from a JSON object with any keys of getConfig() but
+	// weatherTopic. Every value is checked before anything changes, so a
+	// bad one leaves the configuration as it was. Of the changes only the
+	// topic can fail afterwards: it goes first and undoes itself. json need
+	// not be terminated.
+	bool setConfig(const char * json, size_t length)
 	{
-		if(topic == _weatherTopic)
+		StaticJsonDocument<AUTOMATED_WINDOW_CONFIG_JSON_SIZE> doc;
+		DeserializationError error = deserializeJson(doc, json, length);
+		if(error || !doc.is<JsonObject>())
 		{
-			decide(payload);
+			snprintf(_err, sizeof(_err), "Configuration is not a JSON object: %s", error.c_str());
+			LOG_ERROR("%s", _err);
+			return false;
 		}
-		else if(topic == getMqttTopic() +"/wid/get")
+
+		wlconditions_t cond = _wlcond;
+		WindowRule rule = _rule;
+		bool active = _conf.active;
+		FixedString<TOPIC_MAX_LENGTH> topic = getMqttTopic();
+
+		for(JsonPair kv : doc.as<JsonObject>())
 		{
-			DynamicJsonDocument doc(JSON_OBJECT_SIZE(2));
-			doc["min"] = _wlcond.wid[0];
-			doc["max"] = _wlcond.wid[1];
-			String data = "";
-			serializeJson(doc,data);
-			if(!_mqttClient->publish(payload.c_str(),data.c_str()))
+			const char * key = kv.key().c_str();
+			JsonVariant value = kv.value();
+			bool valid = false;
+
+			if(!strcmp(key, "wid"))
+				valid = readInterval(value, cond.wid) && cond.wid[0] >= WID_MIN && cond.wid[1] <= WID_MAX;
+			else if(!strcmp(key, "temp"))
+				valid = readInterval(value, cond.temp);
+			else if(!strcmp(key, "wind") && value.is<float>() && value.as<float>() >= 0)
 			{
-				_err = "Publish error! Could not publish <" + data + "> to topic <" + payload + ">.";
-				Log::error(_err);
-				return false;
+				cond.wind = value.as<float>();
+				valid = true;
 			}
-		}
-		else if(topic == getMqttTopic() +"/wid/set")
-		{
-			DynamicJsonDocument doc(JSON_OBJECT_SIZE(2) + 10);
-			deserializeJson(doc, payload);
-			if(doc["max"] > WID_MAX || doc["min"] < WID_MIN)
+			else if(!strcmp(key, "humidity") && value.is<int>() && value.as<int>() >= 0 && value.as<int>() <= 100)
 			{
-				_err = "WeatherID values out of bonds.";
-				Log::error(_err);
-				return false;
+				cond.humidity = value.as<int>();
+				valid = true;
 			}
-			_wlcond.wid[0] = doc["min"];
-			_wlcond.wid[1] = doc["max"];
-		}
-		else if(topic == getMqttTopic() +"/temp/get")
-		{
-			DynamicJsonDocument doc(JSON_OBJECT_SIZE(2));
-			doc["min"] = _wlcond.temp[0];
-			doc["max"] = _wlcond.temp[1];
-			String data = "";
-			serializeJson(doc,data);
-			if(!_mqttClient->publish(payload.c_str(),data.c_str()))
+			else if(!strcmp(key, "forecast") && value.is<uint8_t>())
 			{
-				_err = "Publish error! Could not publish <" + data + "> to topic <" + payload + ">.";
-				Log::error(_err);
-				return false;
+				cond.forecast = value.as<uint8_t>();
+				valid = true;
 			}
-		}
-		else if(topic == getMqttTopic() +"/temp/set")
-		{
-			DynamicJsonDocument doc(JSON_OBJECT_SIZE(2) + 10);
-			deserializeJson(doc, payload);
-			_wlcond.temp[0] = doc["min"];
-			_wlcond.temp[1] = doc["max"];
-		}
-		else if(topic == getMqttTopic() +"/wind/get")
-		{
-			if(!_mqttClient->publish(payload.c_str(),String(_wlcond.wind).c_str()))
+			else if(!strcmp(key, "windBasis") && value.is<const char*>())
+			{
+				for(uint8_t b = WIND_NOW; b <= WIND_MAX && !valid; b++)
+				{
+					valid = !strcmp(value.as<const char*>(), windBasisName(b));
+					cond.windBasis = b;
+				}
+			}
+			else if(!strcmp(key, "history") && value.is<int>() && value.as<int>() > 0 && value.as<int>() <= 24*60)
+			{
+				cond.history = value.as<int>();
+				valid = true;
+			}
+			else if(!strcmp(key, "rule") && value.is<const char*>())
 			{
-				_err = "Publish error! Could not publish <" + String(_wlcond.wind) + "> to topic <" + payload + ">.";
-				Log::error(_err);
+				if(!rule.compile(value.as<const char*>()))
+				{
+					snprintf(_err, sizeof(_err), "%s Nothing was changed.", WindowRule::err());
+					LOG_ERROR("%s", _err);
+					return false;
+				}
+				valid = true;
+			}
+			else if(!strcmp(key, "active") && value.is<bool>())
+			{
+				active = value.as<bool>();
+				valid = true;
+			}
+			else if(!strcmp(key, "topic") && value.is<const char*>())
+				valid = topic.assign(value.as<const char*>()) && !topic.empty();
+
+			if(!valid)
+			{
+				snprintf(_err, sizeof(_err), "Configuration parameter <%s> is unknown or out of bonds. Nothing was changed.", key);
+				LOG_ERROR("%s", _err);
 				return false;
 			}
 		}
-		else if(topic == getMqttTopic() +"/wind/set")
+
+		// What can fail first, undone if the next one does
+		bool wasActive = _conf.active;
+		if(active != wasActive && !setActive(active))
+			return false;
+		if(topic != getMqttTopic() && !changeMqttTopic(topic.c_str()))
 		{
-			_wlcond.wind = payload.toFloat();
+			if(active != wasActive)
+				setActive(wasActive);
+			return false;
 		}
-		else if(topic == getMqttTopic() +"/humidity/get")
+
+		_wlcond = cond;
+		_rule = rule;
+		return true;
+	}
+
+	bool setConfig(const char * json) { return setConfig(json, strlen(json)); }
+	
+
+	bool save(uint8_t const id)
+	{
+		// Copied part by part into zeroed bytes, so the padding between the
+		// parts never makes an unchanged record look dirty
+		uint8_t rec[sizeof(record_t)] = {};
+		memcpy(rec + offsetof(record_t, conf), &_conf, sizeof(_conf));
+		memcpy(rec + offsetof(record_t, wlcond), &_wlcond, sizeof(_wlcond));
+		memcpy(rec + offsetof(record_t, rule), &_rule.program(), sizeof(WindowRule::program_t));
+
+		ConfigJournal::Result res = ConfigStore.write(id, AUTOMATED_WINDOW_RECORD_VERSION, rec, sizeof(rec));
+		if(res == ConfigJournal::JOURNAL_ERROR)
 		{
-			if(!_mqttClient->publish(payload.c_str(),String(_wlcond.humidity).c_str()))
-			{
-				_err = "Publish error! Could not publish <" + String(_wlcond.humidity) + "> to topic <" + payload + ">.";
-				Log::error(_err);
-				return false;
-			}
+			snprintf(_err, sizeof(_err), "Could not save configuration: %s", ConfigStore.err());
+			LOG_ERROR("%s", _err);
+			return false;
 		}
-		else if(topic == getMqttTopic() +"/humidity/set")
+		if(res == ConfigJournal::JOURNAL_UNCHANGED)
+			LOG_INFO("Configuration unchanged, nothing written.");
+		return true;
+	}
+	
+	bool save(void)
+	{
+		return save(_recordId);
+	}
+
+	bool load(uint8_t const id)
+	{
+		record_t rec;
+
+		if(!ConfigStore.read(id, AUTOMATED_WINDOW_RECORD_VERSION, &rec, sizeof(rec)))
 		{
-			_wlcond.humidity = payload.toInt();
+			snprintf(_err, sizeof(_err), "Could not load configuration: %s", ConfigStore.err());
+			LOG_WARNING("%s", _err);
+			return false;
 		}
-		else if(topic == getMqttTopic() +"/forecast/get")
+
+		rec.conf.mqttTopic.terminate();
+		rec.conf.weatherTopic.terminate();
+
+		// The record is the state: topics and flags in one copy
+		_conf = rec.conf;
+		_wlcond = rec.wlcond;
+		if(!_rule.load(rec.rule))
 		{
-			if(!_mqttClient->publish(payload.c_str(),String(_wlcond.forecast).c_str()))
-			{
-				_err = "Publish error! Could not publish <" + String(_wlcond.forecast) + "> to topic <" + payload + ">.";
-				Log::error(_err);
-				return false;
-			}
+			// The conditions still hold
+			_rule.clear();
+			LOG_WARNING("%s", WindowRule::err());
 		}
-		else if(topic == getMqttTopic() +"/forecast/set")
+
+		return true;
+	}
+
+	bool load(void)
+	{
+		return load(_recordId);
+	}
+
+	// Call this method inside your callback functions with raw arguments,
+	// the payload need not be terminated. Returns false in case of error.
+	bool callback(const char* topic, const char* payload, unsigned int length)
+	{
+		// Weather reports take the short way, without a copy
+		if(_conf.weatherTopic == topic)
 		{
-			_wlcond.forecast = payload.toInt();
+			decide(payload, length);
+			// After the command, it must not wait for this
+			return publishHistory();
 		}
-		else if(topic == getMqttTopic() +"/activate")
+
+		// A command index: the topic is compared with the command table once
+		int c = commandOf(topic);
+		if(c < 0)
+			return true;
+
+		// Terminated, on the stack: the reply topic or the value to set.
+		// /config/set parses the payload as it is.
+		char msg[AUTOMATED_WINDOW_VALUE_SIZE] = "";
+		if(c != CMD_CONFIG_SET)
 		{
-			_active = true;
-			if(!_mqttClient->subscribe(_weatherTopic.c_str()))
+			if(length >= sizeof(msg))
 			{
-				_err = "Could not subscribe to <" + _weatherTopic; + ">";
-				Log::error(_err);
+				snprintf(_err, sizeof(_err), "Payload of %u bytes is too long.", length);
+				LOG_ERROR("%s", _err);
 				return false;
 			}
+			memcpy(msg, payload, length);
+			msg[length] = '\0';
 		}
-		else if(topic == getMqttTopic() +"/deactivate")
+		char data[AUTOMATED_WINDOW_STATE_SIZE];
+
+		switch(c)
 		{
-			_active = false;
-			if(!_mqttClient->unsubscribe(_weatherTopic.c_str()))
-			{
-				_err = "Could not unsubscribe from <" + _weatherTopic; + ">";
-				Log::error(_err);
+		case CMD_WID_GET:
+			stateValue(STATE_WID, data, sizeof(data));
+			if(!reply(msg, data))
 				return false;
-			}
-		}
-		else if(topic == getMqttTopic() +"/topic/get")
+			break;
+		case CMD_WID_SET:
 		{
-			if(!_mqttClient->publish(payload.c_str(),getMqttTopic().c_str()))
+			StaticJsonDocument<JSON_OBJECT_SIZE(2)> doc;
+			deserializeJson(doc, msg);
+			if(doc["max"] > WID_MAX || doc["min"] < WID_MIN)
 			{
-				_err = "Publish error! Could not publish <" + getMqttTopic() + "> to topic <" + payload + ">.";
-				Log::error(_err);
+				snprintf(_err, sizeof(_err), "WeatherID values out of bonds.");
+				LOG_ERROR("%s", _err);
 				return false;
 			}
+			_wlcond.wid[0] = doc["min"];
+			_wlcond.wid[1] = doc["max"];
+			break;
 		}
-		else if(topic == getMqttTopic() +"/topic/set")
+		case CMD_TEMP_GET:
+			stateValue(STATE_TEMP, data, sizeof(data));
+			if(!reply(msg, data))
+				return false;
+			break;
+		case CMD_TEMP_SET:
 		{
-			if(!unsubscribe())
+			StaticJsonDocument<JSON_OBJECT_SIZE(2)> doc;
+			deserializeJson(doc, msg);
+			_wlcond.temp[0] = doc["min"];
+			_wlcond.temp[1] = doc["max"];
+			break;
+		}
+		case CMD_WIND_GET:
+			stateValue(STATE_WIND, data, sizeof(data));
+			if(!reply(msg, data))
 				return false;
-
-			String hold = getMqttTopic();
-
-			setMqttTopic(payload);
-
-			if(!subscribe())
-			{
-				_err = "Given topic is might unvalid.";
-				Log::error(_err);
-				setMqttTopic(hold);
-				if(!subscribe())
-				{
-					_err = "Could not resubscribe to MQTT topic. New given topic was discarded.";
-					Log::error(_err);
-				}
+			break;
+		case CMD_WIND_SET:
+			_wlcond.wind = atof(msg);
+			break;
+		case CMD_HUMIDITY_GET:
+			stateValue(STATE_HUMIDITY, data, sizeof(data));
+			if(!reply(msg, data))
 				return false;
-			}
-		}
-		else if(topic == getMqttTopic() +"/save")
+			break;
+		case CMD_HUMIDITY_SET:
+			_wlcond.humidity = atoi(msg);
+			break;
+		case CMD_FORECAST_GET:
+			stateValue(STATE_FORECAST, data, sizeof(data));
+			if(!reply(msg, data))
+				return false;
+			break;
+		case CMD_FORECAST_SET:
+			_wlcond.forecast = atoi(msg);
+			break;
+		case CMD_TOPIC_GET:
+			if(!reply(msg, getMqttTopic().c_str()))
+				return false;
+			break;
+		case CMD_TOPIC_SET:
+			if(!changeMqttTopic(msg))
+				return false;
+			break;
+		case CMD_ACTIVATE:
+		case CMD_DEACTIVATE:
+			if(!setActive(c == CMD_ACTIVATE))
+				return false;
+			break;
+		case CMD_SAVE:
+			if(!save(getRecordId()))
+				return false;
+			break;
+		case CMD_LOAD:
+			if(!load(getRecordId()))
+				return false;
+			break;
+		case CMD_CONFIG_GET:
 		{
-			if(!save(getEEPROMAddress()))
+			char config[AUTOMATED_WINDOW_CONFIG_SIZE];
+			if(getConfig(config, sizeof(config)) == 0 || !reply(msg, config))
 				return false;
+			break;
 		}
-		else if(topic == getMqttTopic() +"/load")
-		{
-			if(!load(getEEPROMAddress()))
+		case CMD_CONFIG_SET:
+			if(!setConfig(payload, length))
+				return false;
+			break;
+		case CMD_RULE_GET:
+			if(!reply(msg, getRule()))
+				return false;
+			break;
+		case CMD_RULE_SET:
+			if(!setRule(msg))
 				return false;
+			break;
 		}
 
+		// Any command may have changed a field
+		publishState();
 		return true;
 	}
 
-	String err()
+	bool callback(char* topic, byte* payload, unsigned int length)
 	{
-		String ret = _err;
-		_err = "";
-		return ret;
+		return callback((const char*)topic, (const char*)payload, length);
 	}
 
+	// Message of the last error
+	const char * err() const { return _err; }
+
 
 
 protected:
 	T * _mqttClient;
-	String _err;
+	char _err[AUTOMATED_WINDOW_ERROR_SIZE] = "";
 
 private:
-	String _mqttTopic;
-	String _weatherTopic = "weather";
-	String _windowTopic = "smarthome/window";
-	int _eepromAdd = 0;
+	// Command of topic, -1 if it is none: the subtopic below the root topic
+	// looked up in AUTOMATED_WINDOW_COMMANDS
+	int commandOf(const char * topic) const
+	{
+		const char * suffix = getMqttTopic().after(topic);
+		if(suffix == nullptr)
+			return -1;
+		for(uint8_t c = 0; c < CMD_COUNT; c++)
+		{
+			if(!strcmp(suffix, AUTOMATED_WINDOW_COMMANDS[c]))
+				return c;
+		}
+		return -1;
+	}
+
+	// Publishes the value a /get command asked for to its reply topic
+	bool reply(const char * topic, const char * value)
+	{
+		if(_mqttClient->publish(topic, value))
+			return true;
+		snprintf(_err, sizeof(_err), "Publish error! Could not publish <%.24s> to topic <%.80s>.", value, topic);
+		LOG_ERROR("%s", _err);
+		return false;
+	}
+
+	static const char * stateName(uint8_t field)
+	{
+		static const char * const names[STATE_FIELDS] =
+			{"wid", "temp", "wind", "humidity", "forecast", "active", "windBasis", "history", "rule", "weatherTopic"};
+		return names[field];
+	}
+
+	static const char * windBasisName(uint8_t basis)
+	{
+		static const char * const names[] = {"now", "mean", "max"};
+		return names[basis <= WIND_MAX ? basis : WIND_NOW];
+	}
+
+	// Payload of a state topic, same format as the /get topics
+	void stateValue(uint8_t field, char * buf, size_t size)
+	{
+		switch(field)
+		{
+		case STATE_WID:
+			snprintf(buf, size, "{\"min\":%d,\"max\":%d}", _wlcond.wid[0], _wlcond.wid[1]);
+			break;
+		case STATE_TEMP:
+			snprintf(buf, size, "{\"min\":%d,\"max\":%d}", _wlcond.temp[0], _wlcond.temp[1]);
+			break;
+		case STATE_WIND:
+			snprintf(buf, size, "%.2f", _wlcond.wind);
+			break;
+		case STATE_HUMIDITY:
+			snprintf(buf, size, "%d", _wlcond.humidity);
+			break;
+		case STATE_FORECAST:
+			snprintf(buf, size, "%u", _wlcond.forecast);
+			break;
+		case STATE_ACTIVE:
+			snprintf(buf, size, "%s", _conf.active ? "true" : "false");
+			break;
+		case STATE_WIND_BASIS:
+			snprintf(buf, size, "%s", windBasisName(_wlcond.windBasis));
+			break;
+		case STATE_HISTORY:
+			snprintf(buf, size, "%u", _wlcond.history);
+			break;
+		case STATE_RULE:
+			snprintf(buf, size, "%s", getRule());
+			break;
+		default:
+			snprintf(buf, size, "%s", getWeatherTopic().c_str());
+		}
+	}
+
+	// Values of the current report, the history and the precipitation of the
+	// forecasts the rule looks at
+	bool evaluateRule(JsonArray weather)
+	{
+		float vars[RULE_VARS];
+		JsonObject current = weather[0];
+		vars[RULE_VAR_ID] = current["id"];
+		vars[RULE_VAR_TEMP] = current["temp"];
+		vars[RULE_VAR_WIND] = current["wind"];
+		vars[RULE_VAR_HUMIDITY] = current["humidity"];
+		for(uint8_t m = 0; m < WEATHER_METRICS; m++)
+		{
+			vars[RULE_VAR_MIN_TEMP + m] = _history.min(m);
+			vars[RULE_VAR_MAX_TEMP + m] = _history.max(m);
+			vars[RULE_VAR_MEAN_TEMP + m] = _history.mean(m);
+		}
+
+		// Thunderstorm, drizzle, rain and snow. The reports end at the first
+		// one without an id.
+		uint8_t rain = 0;
+		uint8_t reports = 0;
+		for(; reports <= _rule.horizon() && !weather[reports]["id"].isNull(); reports++)
+		{
+			int id = weather[reports]["id"];
+			if(id >= 200 && id < 700)
+				rain |= 1 << reports;
+		}
+		if(reports <= _rule.horizon())
+			LOG_WARNING("Report has %u of the %u forecasts of the rule, the missing ones count as rain.",
+				reports > 0 ? reports - 1 : 0, _rule.horizon());
+		return _rule.evaluate(vars, rain, reports);
+	}
+
+	// {"min": .., "max": ..}, either may be left out
+	static bool readInterval(JsonVariant value, int (&interval)[2])
+	{
+		if(!value.is<JsonObject>())
+			return false;
+
+		JsonVariant min = value["min"];
+		JsonVariant max = value["max"];
+		if((!min.isNull() && !min.is<int>()) || (!max.isNull() && !max.is<int>()))
+			return false;
+
+		int from = min.isNull() ? interval[0] : min.as<int>();
+		int to = max.isNull() ? interval[1] : max.as<int>();
+		if(from > to)
+			return false;
+
+		interval[0] = from;
+		interval[1] = to;
+		return true;
+	}
+
+	// The configuration as it is saved, see record_t
+	config_t _conf;
 	wlconditions_t _wlcond;
-	bool _active = true;
+	FixedString<TOPIC_MAX_LENGTH> _windowTopic = "smarthome/window";
+	uint8_t _recordId = JOURNAL_ID_AUTOMATED_WINDOW;
+	DynamicJsonDocument _report;
+	StateCache _state;
+	WeatherHistory _history;
+	WindowRule _rule;
 };
 
 #endif
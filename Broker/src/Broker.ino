@@ -2,19 +2,40 @@
 #include <uMQTTBroker.h>
 #include <WiFiUdp.h>
 #include <NTPClient.h>
-#include <Logger.h>
+#include <RingLog.h>
+#include <MemStats.h>
+#include <WiFiJoin.h>
+#include <BootStats.h>
+#include <TimerWheel.h>
 #include "AutomationClient.h"
 #include "myBroker.h"
 #include "definitions.h"
 
 myMQTTBroker myBroker(mqtt_broker_port,mqtt_max_subscriptions,mqtt_max_retained_topics);
-typedef Logger<myMQTTBroker> Log;
 
 WiFiUDP ntpUDP;
 NTPClient timeClient(ntpUDP, "pool.ntp.org");
 
 AutomatedWindow<myMQTTBroker> autoWindow(&myBroker);
 
+bool logPublish(const char * topic, const char * payload)
+{
+  return myBroker.publish(topic, (uint8_t*)payload, strlen(payload));
+}
+
+unsigned long logClock()
+{
+  return timeClient.getEpochTime();
+}
+
+// The update blocks for up to a second, the broker runs meanwhile
+void ntpResyncDue(void *)
+{
+  if(!timeClient.forceUpdate())
+    LOG_WARNING("Could not get the time.");
+}
+Timer ntpResync(ntpResyncDue);
+
 void setup_wifi()
 {
 	// Set your Static IP address
@@ -29,61 +50,178 @@ void setup_wifi()
 
 	// Configures static IP address
   if (!WiFi.config(local_IP, gateway, subnet)) {
-    Log::error("STA Failed to configure!");
+    LOG_ERROR("STA Failed to configure!");
+  }
+
+  // Joined from loop(), see bootRun()
+  BootStats::start(BOOT_WIFI);
+  WiFiJoin::begin(ssid, psk);
+}
+
+// Brings up the network and then the broker, one step per loop
+void bootRun()
+{
+  if(!BootStats::done(BOOT_WIFI))
+  {
+    if(!WiFiJoin::run())
+      return;
+    BootStats::finish(BOOT_WIFI);
+    LOG_INFO("IP address: %s", WiFi.localIP().toString().c_str());
+
+    BootStats::start(BOOT_NTP);
+    if(!timeClient.update())
+      LOG_WARNING("Could not get the time.");
+    BootStats::finish(BOOT_NTP);
+    Timers.start(ntpResync, NTP_RESYNC_MS, NTP_RESYNC_MS);
   }
+  if(BootStats::done(BOOT_MQTT))
+    return;
 
-	Log::info("Connecting to " + String(ssid));
+  BootStats::start(BOOT_MQTT);
+  LOG_INFO("Starting MQTT broker");
+  myBroker.init();
+  RingLog::setSink(logPublish, "log");
+  LOG_INFO("The MQTT broker is alive!");
 
-	WiFi.mode(WIFI_STA);
-	WiFi.begin(ssid, psk);
+  LOG_INFO("Setting up the Automated Window Client...");
+  autoWindowRoute();
+  autoWindow.subscribe();
+  char topic[TOPIC_BUFFER_SIZE];
+  myBroker.on(autoWindow.getMqttTopic().join(topic, sizeof(topic), "/mem/get"), memGet);
+  myBroker.subscribe(topic);
+  myBroker.on(autoWindow.getMqttTopic().join(topic, sizeof(topic), "/mem/reset"), memReset);
+  myBroker.subscribe(topic);
+  myBroker.on(autoWindow.getMqttTopic().join(topic, sizeof(topic), "/capture/start"), captureStart);
+  myBroker.subscribe(topic);
+  myBroker.on(autoWindow.getMqttTopic().join(topic, sizeof(topic), "/capture/stop"), captureStop);
+  myBroker.subscribe(topic);
+  myBroker.on(autoWindow.getMqttTopic().join(topic, sizeof(topic), "/capture/get"), captureGet);
+  myBroker.subscribe(topic);
+  myBroker.on(ALIAS_REGISTER_TOPIC, aliasRegister);
+  myBroker.subscribe(ALIAS_REGISTER_TOPIC);
+
+  // Weather and its state from before the reboot, published again before
+  // any client connects: the Automated Window decides right away. Its own
+  // state topics come from its configuration, see subscribe().
+  myBroker.snapshotTopic(autoWindow.getWeatherTopic().c_str());
+  myBroker.snapshotTopic(autoWindow.getWeatherTopic().join(topic, sizeof(topic), "/state/#"));
+  myBroker.restoreSnapshot();
+  BootStats::finish(BOOT_MQTT);
+  bootPublish();
+  LOG_INFO("Ready!");
+}
 
-	while (WiFi.status() != WL_CONNECTED) {
-		delay(500);
-		Log::info("Trying to connect...");
-	}
+// Retained, so the report is there whenever a client looks
+void bootPublish()
+{
+  char json[BOOT_JSON_SIZE];
+  char topic[TOPIC_BUFFER_SIZE];
+  if(BootStats::print(json, sizeof(json)) == 0 ||
+    !myBroker.publish(autoWindow.getMqttTopic().join(topic, sizeof(topic), BOOT_TOPIC), json, true))
+    LOG_WARNING("Boot report was not published.");
+}
 
-	timeClient.update();
+// Payload: response topic
+void memGet(const char* topic, const char* payload, uint32_t length, void* context)
+{
+  MemScope mem(MEM_OP_CALLBACK);
+  static char memJson[MEM_STATS_JSON_SIZE];
+  size_t n = MemStats::print(memJson, sizeof(memJson));
+  myBroker.publish(payload, (uint8_t*)memJson, n);
+}
 
-	Log::info("WiFi Connected!");
-	Log::info("IP address: " + WiFi.localIP().toString());
+void memReset(const char* topic, const char* payload, uint32_t length, void* context)
+{
+  MemStats::reset();
 }
 
-void callback(const char* topic, const char* payload, unsigned int length)
+// Payload: topic filter, empty for what the broker sees anyway. The
+// configuration goes first, as if received on CAPTURE_CONFIG_TOPIC, so a
+// replay decides like the broker did.
+void captureStart(const char* topic, const char* payload, uint32_t length, void* context)
 {
+  if(!myBroker.startCapture(payload))
+    return;
+  char config[AUTOMATED_WINDOW_CONFIG_SIZE];
+  size_t n = autoWindow.getConfig(config, sizeof(config));
+  char configTopic[TOPIC_BUFFER_SIZE];
+  autoWindow.getMqttTopic().join(configTopic, sizeof(configTopic), CAPTURE_CONFIG_TOPIC);
+  myBroker.capture.record(configTopic, (const uint8_t*)config, n, CAPTURE_IN);
+}
+
+void captureStop(const char* topic, const char* payload, uint32_t length, void* context)
+{
+  myBroker.stopCapture();
+}
+
+// Payload: response topic
+void captureGet(const char* topic, const char* payload, uint32_t length, void* context)
+{
+  myBroker.publishCapture(payload);
+}
+
+// Payload: reply topic, then the topics to alias, one per line. See TopicAlias.h.
+void aliasRegister(const char* topic, const char* payload, uint32_t length, void* context)
+{
+  myBroker.registerAliases(payload);
+}
+
+void autoWindowHandler(const char* topic, const char* payload, uint32_t length, void* context)
+{
+  MemScope mem(MEM_OP_CALLBACK);
   autoWindow.callback(topic,payload,length);
+  // topic/set, config/set and load may move it
+  autoWindowRoute();
+}
+
+// Routes the root and weather topics of the Automated Window to it, again
+// whenever they changed
+void autoWindowRoute()
+{
+  static int8_t routes[2] = {-1, -1};
+  static FixedString<TOPIC_MAX_LENGTH> root, weather;
+  if(routes[0] >= 0 && root == autoWindow.getMqttTopic() && weather == autoWindow.getWeatherTopic())
+    return;
+
+  myBroker.off(routes[0]);
+  myBroker.off(routes[1]);
+  root = autoWindow.getMqttTopic();
+  weather = autoWindow.getWeatherTopic();
+  char topic[TOPIC_BUFFER_SIZE];
+  routes[0] = myBroker.on(root.join(topic, sizeof(topic), "/#"), autoWindowHandler);
+  routes[1] = myBroker.on(weather.c_str(), autoWindowHandler);
 }
 
 void setup()
 {
   Serial.begin(115200);
-  Log::setLevel(Log::LOG_LEVEL_INFO);
-  Log::setSerial(&Serial);
-  Log::setPrefix("Broker");
+  RingLog::setLevel(RingLog::LEVEL_INFO);
+  RingLog::setSerial(&Serial);
+  RingLog::setPrefix("Broker");
 
   // Load automated window configs
+  BootStats::start(BOOT_CONFIG);
   autoWindow.load();
-
-  // Start WiFi
-  setup_wifi();
+  BootStats::finish(BOOT_CONFIG);
 
   timeClient.begin();
   timeClient.setTimeOffset(3600*-3);
-  Log::setNTP(&timeClient);
-
-  // Start the broker
-  Log::info("Starting MQTT broker");
-  myBroker.init();
-  Log::setMQTT(&myBroker,"log");
-  Log::info("The MQTT broker is alive!");
+  RingLog::setClock(logClock);
+  RetainedSnapshot::setClock(logClock);
+  TrafficCapture::setClock(logClock);
 
-  Log::info("Setting up the Automated Window Client...");
-  myBroker.set_callback(callback);
-  autoWindow.subscribe();
-  Log::info("Ready!");
+  // Start WiFi, the broker follows in loop()
+  setup_wifi();
 }
 
 void loop()
 {
-  // do anything here
-  delay(1000);
+  Timers.run();
+  bootRun();
+  if(BootStats::done(BOOT_MQTT))
+    myBroker.snapshot.run();
+
+  // Lines logged by the broker callbacks go out in one message
+  RingLog::flush();
+  delay(100);
 }
@@ -0,0 +1,202 @@
+#include "RetainedSnapshot.h"
+#include <ConfigJournal.h>
+#include <RingLog.h>
+
+// Epochs below this come from a clock that was never set
+#define SNAPSHOT_VALID_EPOCH 1000000000UL
+// Topic length, payload length
+#define SNAPSHOT_ENTRY_HEADER 3
+
+unsigned long (*RetainedSnapshot::_clock)() = nullptr;
+
+RetainedSnapshot::RetainedSnapshot()
+	: _filterCount(0), _dirty(false), _err("")
+{
+	memset(&_record, 0, sizeof(_record));
+	memset(_filters, 0, sizeof(_filters));
+}
+
+bool RetainedSnapshot::addFilter(const char * filter)
+{
+	if(_filterCount >= SNAPSHOT_FILTERS || strlen(filter) >= SNAPSHOT_FILTER_SIZE)
+	{
+		_err = "Snapshot filter list is full or the filter is too long.";
+		return false;
+	}
+
+	strcpy(_filters[_filterCount++], filter);
+	return true;
+}
+
+bool RetainedSnapshot::matches(const char * topic) const
+{
+	for(uint8_t i = 0; i < _filterCount; i++)
+	{
+		if(topicMatches(_filters[i], topic))
+			return true;
+	}
+	return false;
+}
+
+bool RetainedSnapshot::topicMatches(const char * filter, const char * topic)
+{
+	while(*filter != '\0')
+	{
+		if(filter[0] == '#')
+			return true;
+
+		if(filter[0] == '+')
+		{
+			// One whole level
+			while(*topic != '\0' && *topic != '/')
+				topic++;
+			filter++;
+		}
+		else
+		{
+			if(*filter != *topic)
+			{
+				// "a/#" also matches "a"
+				return *topic == '\0' && filter[0] == '/' && filter[1] == '#' && filter[2] == '\0';
+			}
+			filter++;
+			topic++;
+		}
+	}
+	return *topic == '\0';
+}
+
+uint16_t RetainedSnapshot::find(const char * topic) const
+{
+	uint16_t offset = 0;
+	while(offset < _record.used)
+	{
+		const uint8_t * e = _record.data + offset;
+		uint16_t length = e[1] | (e[2] << 8);
+		if(strcmp((const char*)e + SNAPSHOT_ENTRY_HEADER, topic) == 0)
+			return offset;
+		offset += SNAPSHOT_ENTRY_HEADER + e[0] + length;
+	}
+	return _record.used;
+}
+
+void RetainedSnapshot::remove(uint16_t offset)
+{
+	const uint8_t * e = _record.data + offset;
+	uint16_t size = SNAPSHOT_ENTRY_HEADER + e[0] + (e[1] | (e[2] << 8));
+
+	memmove(_record.data + offset, _record.data + offset + size, _record.used - offset - size);
+	_record.used -= size;
+	_record.count--;
+	// Unused bytes stay zero, so an unchanged snapshot is not written again
+	memset(_record.data + _record.used, 0, size);
+}
+
+bool RetainedSnapshot::capture(const char * topic, const char * payload, uint32_t length)
+{
+	if(!matches(topic))
+		return false;
+
+	uint16_t offset = find(topic);
+	if(offset < _record.used)
+	{
+		const uint8_t * e = _record.data + offset;
+		if((uint32_t)(e[1] | (e[2] << 8)) == length &&
+			memcmp(e + SNAPSHOT_ENTRY_HEADER + e[0], payload, length) == 0)
+			return true;
+		remove(offset);
+		_dirty = true;
+	}
+	if(length == 0)
+		return true;
+
+	size_t topicLength = strlen(topic) + 1;
+	size_t size = SNAPSHOT_ENTRY_HEADER + topicLength + length;
+	if(topicLength > 255 || _record.used + size > SNAPSHOT_DATA_SIZE)
+	{
+		LOG_WARNING("Snapshot has no room for %s (%lu bytes).", topic, (unsigned long)size);
+		return false;
+	}
+
+	uint8_t * e = _record.data + _record.used;
+	e[0] = topicLength;
+	e[1] = length & 0xFF;
+	e[2] = length >> 8;
+	memcpy(e + SNAPSHOT_ENTRY_HEADER, topic, topicLength);
+	memcpy(e + SNAPSHOT_ENTRY_HEADER + topicLength, payload, length);
+	_record.used += size;
+	_record.count++;
+	_dirty = true;
+	return true;
+}
+
+void RetainedSnapshot::run()
+{
+	if(_dirty && !_holdoff.active())
+		save();
+}
+
+bool RetainedSnapshot::save()
+{
+	if(!_dirty)
+		return true;
+
+	unsigned long now = _clock != nullptr ? _clock() : 0;
+	_record.epoch = now >= SNAPSHOT_VALID_EPOCH ? now : 0;
+
+	// Also on errors, so a failing flash is not retried on every loop
+	Timers.start(_holdoff, SNAPSHOT_PERIOD_MS);
+	if(ConfigStore.write(JOURNAL_ID_BROKER_SNAPSHOT, SNAPSHOT_RECORD_VERSION, &_record, sizeof(_record)) == ConfigJournal::JOURNAL_ERROR)
+	{
+		_err = ConfigStore.err();
+		LOG_ERROR("Snapshot was not saved: %s", _err);
+		return false;
+	}
+
+	_dirty = false;
+	LOG_DEBUG("Snapshot saved: %u topics, %u bytes.", _record.count, _record.used);
+	return true;
+}
+
+bool RetainedSnapshot::load()
+{
+	record_t record;
+	if(!ConfigStore.read(JOURNAL_ID_BROKER_SNAPSHOT, SNAPSHOT_RECORD_VERSION, &record, sizeof(record)))
+	{
+		_err = "There is no snapshot.";
+		return false;
+	}
+	if(record.used > SNAPSHOT_DATA_SIZE)
+	{
+		_err = "Snapshot is corrupted.";
+		return false;
+	}
+
+	unsigned long now = _clock != nullptr ? _clock() : 0;
+	if(record.epoch >= SNAPSHOT_VALID_EPOCH && now >= SNAPSHOT_VALID_EPOCH && now - record.epoch > SNAPSHOT_MAX_AGE_S)
+	{
+		_err = "Snapshot is too old.";
+		return false;
+	}
+
+	memcpy(&_record, &record, sizeof(_record));
+	// It is what the flash holds already
+	_dirty = false;
+	return true;
+}
+
+uint16_t RetainedSnapshot::next(uint16_t offset, const char ** topic, const uint8_t ** payload, uint16_t * length) const
+{
+	if(offset + SNAPSHOT_ENTRY_HEADER > _record.used)
+		return 0;
+
+	const uint8_t * e = _record.data + offset;
+	uint16_t size = SNAPSHOT_ENTRY_HEADER + e[0] + (e[1] | (e[2] << 8));
+	if(offset + size > _record.used)
+		return 0;
+
+	*topic = (const char*)e + SNAPSHOT_ENTRY_HEADER;
+	*payload = e + SNAPSHOT_ENTRY_HEADER + e[0];
+	*length = e[1] | (e[2] << 8);
+	return offset + size;
+}
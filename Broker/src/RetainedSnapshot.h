@@ -0,0 +1,94 @@
+#ifndef RETAINED_SNAPSHOT_H
+#define RETAINED_SNAPSHOT_H
+
+#include <Arduino.h>
+#include <TimerWheel.h>
+
+// Bytes of topics and payloads one snapshot holds
+#ifndef SNAPSHOT_DATA_SIZE
+#define SNAPSHOT_DATA_SIZE 1024
+#endif
+#define SNAPSHOT_FILTERS 4
+#define SNAPSHOT_FILTER_SIZE 64
+// Least time between two flash writes, the snapshot is written at most this often
+#ifndef SNAPSHOT_PERIOD_MS
+#define SNAPSHOT_PERIOD_MS (30*60*1000UL)
+#endif
+// Older snapshots are not restored, if both the snapshot and the clock have a time
+#ifndef SNAPSHOT_MAX_AGE_S
+#define SNAPSHOT_MAX_AGE_S (60*60UL)
+#endif
+// Bump whenever the record changes
+#define SNAPSHOT_RECORD_VERSION 1
+
+/* Copy of selected retained topics kept in the configuration journal.
+ *
+ * The broker hands every message matching one of the filters to capture(),
+ * which keeps the last payload per topic in one packed block:
+ *   [topic length][payload length, 2 bytes][topic, '\0' included][payload]
+ * An empty payload removes the topic, as it does for retained messages.
+ * run() writes the block when it changed, the first time right away and
+ * then at most every SNAPSHOT_PERIOD_MS to spare the flash. After a reboot
+ * load() reads it back and next() walks the topics, so they can be
+ * published again before any client connects.
+ *
+ * Only list topics that are published retained: the broker does not tell
+ * whether a message was. */
+class RetainedSnapshot
+{
+public:
+	RetainedSnapshot();
+
+	// MQTT filter, + and # allowed. Fails when the list is full or too long.
+	bool addFilter(const char * filter);
+	bool matches(const char * topic) const;
+
+	// Keeps payload as the last one of topic if a filter matches it
+	bool capture(const char * topic, const char * payload, uint32_t length);
+
+	// Call on every loop, writes the snapshot when due
+	void run();
+	// Writes now if anything changed
+	bool save();
+
+	// Reads the last snapshot. Fails if there is none or it is too old.
+	bool load();
+	// Topic at offset, 0 for the first one. Returns the offset of the one
+	// after it, or 0 if there is no topic at offset.
+	uint16_t next(uint16_t offset, const char ** topic, const uint8_t ** payload, uint16_t * length) const;
+
+	uint8_t count() const { return _record.count; }
+	uint16_t used() const { return _record.used; }
+
+	// Epoch seconds for the age of the snapshot, 0 while unknown
+	static void setClock(unsigned long (*clock)()) { _clock = clock; }
+
+	static bool topicMatches(const char * filter, const char * topic);
+
+	const char * err() { return _err; }
+
+private:
+	typedef struct
+	{
+		uint32_t epoch;		// Of the write, 0 if unknown
+		uint16_t used;
+		uint8_t count;
+		uint8_t reserved;
+		uint8_t data[SNAPSHOT_DATA_SIZE];
+	} record_t;
+
+	// Offset of topic in the block, or used if it is not there
+	uint16_t find(const char * topic) const;
+	void remove(uint16_t offset);
+
+	record_t _record;
+	char _filters[SNAPSHOT_FILTERS][SNAPSHOT_FILTER_SIZE];
+	uint8_t _filterCount;
+	bool _dirty;
+	Timer _holdoff;		// On Timers from a write, no other one while active
+	const char * _err;
+
+	static unsigned long (*_clock)();
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include "TopicTrie.h"
+
+TopicTrie::TopicTrie()
+	: _used(1), _err("")
+{
+	memset(_nodes, 0, sizeof(_nodes));
+
+	// Node 0 is the root, above the first level
+	_nodes[0].parent = TRIE_NONE;
+	_nodes[0].child = TRIE_NONE;
+	_nodes[0].sibling = TRIE_NONE;
+
+	for(uint8_t i = 1; i < TRIE_NODES; i++)
+		_nodes[i].sibling = i + 1 < TRIE_NODES ? i + 1 : TRIE_NONE;
+	_free = TRIE_NODES > 1 ? 1 : TRIE_NONE;
+}
+
+uint8_t TopicTrie::child(uint8_t node, const char * name, size_t length) const
+{
+	for(uint8_t c = _nodes[node].child; c != TRIE_NONE; c = _nodes[c].sibling)
+	{
+		if(strlen(_nodes[c].name) == length && strncmp(_nodes[c].name, name, length) == 0)
+			return c;
+	}
+	return TRIE_NONE;
+}
+
+uint8_t TopicTrie::find(const char * filter) const
+{
+	uint8_t node = 0;
+	const char * level = filter;
+	for(;;)
+	{
+		const char * end = strchr(level, '/');
+		size_t length = end != nullptr ? end - level : strlen(level);
+
+		node = child(node, level, length);
+		if(node == TRIE_NONE || end == nullptr)
+			return node;
+		level = end + 1;
+	}
+}
+
+uint8_t TopicTrie::insert(const char * filter)
+{
+	uint8_t node = 0;
+	const char * level = filter;
+	for(;;)
+	{
+		const char * end = strchr(level, '/');
+		size_t length = end != nullptr ? end - level : strlen(level);
+
+		// + and # stand alone in their level, # only at the end
+		bool wildcard = memchr(level, '+', length) != nullptr || memchr(level, '#', length) != nullptr;
+		if(wildcard && (length != 1 || (level[0] == '#' && end != nullptr)))
+		{
+			_err = "Invalid topic filter.";
+			release(node);
+			return TRIE_NONE;
+		}
+		if(length >= TRIE_LEVEL_SIZE)
+		{
+			_err = "Topic level is too long.";
+			release(node);
+			return TRIE_NONE;
+		}
+
+		// Levels created for a filter that fails go back to the pool
+		uint8_t next = child(node, level, length);
+		if(next == TRIE_NONE)
+		{
+			if(_free == TRIE_NONE)
+			{
+				_err = "No topic trie node left.";
+				release(node);
+				return TRIE_NONE;
+			}
+
+			next = _free;
+			_free = _nodes[next].sibling;
+			_used++;
+
+			node_t & n = _nodes[next];
+			memcpy(n.name, level, length);
+			n.name[length] = '\0';
+			n.parent = node;
+			n.child = TRIE_NONE;
+			n.subscriptions = 0;
+			n.handlers = 0;
+			n.sibling = _nodes[node].child;
+			_nodes[node].child = next;
+		}
+
+		node = next;
+		if(end == nullptr)
+			return node;
+		level = end + 1;
+	}
+}
+
+void TopicTrie::release(uint8_t node)
+{
+	while(node != 0 && node != TRIE_NONE)
+	{
+		node_t & n = _nodes[node];
+		if(n.handlers != 0 || n.subscriptions != 0 || n.child != TRIE_NONE)
+			return;
+
+		// Unlink from the parent
+		uint8_t parent = n.parent;
+		uint8_t * link = &_nodes[parent].child;
+		while(*link != node)
+			link = &_nodes[*link].sibling;
+		*link = n.sibling;
+
+		memset(&n, 0, sizeof(n));
+		n.sibling = _free;
+		_free = node;
+		_used--;
+
+		node = parent;
+	}
+}
+
+uint32_t TopicTrie::match(uint8_t node, const char * level) const
+{
+	const char * end = nullptr;
+	size_t length = 0;
+	if(level != nullptr)
+	{
+		end = strchr(level, '/');
+		length = end != nullptr ? end - level : strlen(level);
+	}
+
+	uint32_t mask = 0;
+	for(uint8_t c = _nodes[node].child; c != TRIE_NONE; c = _nodes[c].sibling)
+	{
+		const node_t & n = _nodes[c];
+
+		// "a/#" also matches "a", where level is past the end
+		if(n.name[0] == '#')
+		{
+			mask |= n.handlers;
+			continue;
+		}
+		if(level == nullptr)
+			continue;
+
+		if((n.name[0] == '+' && n.name[1] == '\0') ||
+			(strlen(n.name) == length && strncmp(n.name, level, length) == 0))
+		{
+			if(end == nullptr)
+				mask |= n.handlers | match(c, nullptr);
+			else
+				mask |= match(c, end + 1);
+		}
+	}
+	return mask;
+}
+
+bool TopicTrie::matches(const char * filter, const char * topic)
+{
+	for(;;)
+	{
+		if(!strcmp(filter, "#"))
+			return true;
+
+		const char * filterEnd = strchr(filter, '/');
+		const char * topicEnd = strchr(topic, '/');
+		size_t length = filterEnd != nullptr ? filterEnd - filter : strlen(filter);
+		size_t topicLength = topicEnd != nullptr ? topicEnd - topic : strlen(topic);
+		bool any = length == 1 && filter[0] == '+';
+		if(!any && (length != topicLength || strncmp(filter, topic, length) != 0))
+			return false;
+
+		// "a/#" also matches "a"
+		if(topicEnd == nullptr)
+			return filterEnd == nullptr || !strcmp(filterEnd + 1, "#");
+		if(filterEnd == nullptr)
+			return false;
+		filter = filterEnd + 1;
+		topic = topicEnd + 1;
+	}
+}
@@ -0,0 +1,76 @@
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+
+#include <Arduino.h>
+
+// Topic levels all filters together may have
+#ifndef TRIE_NODES
+#define TRIE_NODES 64
+#endif
+// Longest topic level of a filter, terminator included
+#define TRIE_LEVEL_SIZE 24
+// Handlers, one bit each in a node
+#define TRIE_HANDLERS 32
+#define TRIE_NONE 0xFF
+
+/* MQTT topic filters stored level by level, so matching a topic walks its
+ * levels instead of comparing it with every filter.
+ *
+ * Every node is one level of one or more filters: "a/+/c" and "a/b" share
+ * the node of "a". A node holds a bit per handler whose filter ends there
+ * and a count of the broker subscriptions to that exact filter. match()
+ * follows the literal level and the + child at each step and takes every #
+ * child on the way, so its cost grows with the depth of the topic and the
+ * number of wildcard branches, not with the number of filters. It returns
+ * the handlers as a mask, each one once however many of its filters match.
+ *
+ * The nodes come from a fixed pool; a node goes back to it when no handler,
+ * subscription or child needs it any more. */
+class TopicTrie
+{
+public:
+	TopicTrie();
+
+	// Node of filter, created as needed. TRIE_NONE if the filter is invalid,
+	// has a level longer than TRIE_LEVEL_SIZE or the pool is full.
+	uint8_t insert(const char * filter);
+	// Node of filter, TRIE_NONE if there is none
+	uint8_t find(const char * filter) const;
+	// Gives node and its parents back to the pool once nothing needs them
+	void release(uint8_t node);
+
+	// Handlers whose filter matches topic
+	uint32_t match(const char * topic) const { return match(0, topic); }
+	// Whether filter matches topic, by the rules of match() without a trie
+	static bool matches(const char * filter, const char * topic);
+
+	uint32_t & handlers(uint8_t node) { return _nodes[node].handlers; }
+	uint8_t & subscriptions(uint8_t node) { return _nodes[node].subscriptions; }
+
+	// Nodes in use, the root included
+	uint8_t used() const { return _used; }
+
+	const char * err() { return _err; }
+
+private:
+	typedef struct
+	{
+		char name[TRIE_LEVEL_SIZE];		// Level, "+" or "#"
+		uint8_t parent;
+		uint8_t child;					// First child, TRIE_NONE if none
+		uint8_t sibling;				// Next child of the parent
+		uint8_t subscriptions;
+		uint32_t handlers;
+	} node_t;
+
+	// level: rest of the topic from the level below node, nullptr past its end
+	uint32_t match(uint8_t node, const char * level) const;
+	uint8_t child(uint8_t node, const char * name, size_t length) const;
+
+	node_t _nodes[TRIE_NODES];
+	uint8_t _free;						// First free node, linked through sibling
+	uint8_t _used;
+	const char * _err;
+};
+
+#endif
@@ -0,0 +1,151 @@
+#include "TrafficCapture.h"
+#include "RetainedSnapshot.h"
+
+unsigned long (*TrafficCapture::_clock)() = nullptr;
+
+TrafficCapture::TrafficCapture()
+	: _active(false), _start(0), _records(0), _sink(nullptr), _err("")
+{
+	memset(&_segment, 0, sizeof(_segment));
+	memset(_filter, 0, sizeof(_filter));
+}
+
+bool TrafficCapture::start(const char * filter)
+{
+	if(filter == nullptr)
+		filter = "";
+	if(strlen(filter) >= CAPTURE_FILTER_SIZE)
+	{
+		_err = "Capture filter is too long.";
+		return false;
+	}
+
+	strcpy(_filter, filter);
+	_start = millis();
+	_records = 0;
+	clear();
+	_segment.header.dropped = 0;
+	_segment.header.epoch = _clock != nullptr ? _clock() : 0;
+	_active = true;
+	return true;
+}
+
+void TrafficCapture::clear()
+{
+	_segment.header.magic = CAPTURE_MAGIC;
+	_segment.header.version = CAPTURE_VERSION;
+	_segment.header.headerSize = sizeof(segment_t);
+	_segment.header.bytes = 0;
+	_segment.header.records = 0;
+}
+
+void TrafficCapture::record(const char * topic, const uint8_t * payload, uint32_t length, uint8_t flags)
+{
+	if(!_active || (_filter[0] != '\0' && !RetainedSnapshot::topicMatches(_filter, topic)))
+		return;
+
+	size_t topicLength = strlen(topic);
+	size_t bytes = sizeof(record_t) + topicLength + length;
+	if(topicLength > 0xFF || length > 0xFFFF || bytes > CAPTURE_DATA_SIZE)
+	{
+		_segment.header.dropped++;
+		return;
+	}
+	if(_segment.header.bytes + bytes > CAPTURE_DATA_SIZE && (_sink == nullptr || !flush()))
+	{
+		_segment.header.dropped++;
+		return;
+	}
+
+	record_t r;
+	r.ms = millis() - _start;
+	r.length = length;
+	r.topicLength = topicLength;
+	r.flags = flags;
+
+	uint8_t * p = _segment.data + _segment.header.bytes;
+	memcpy(p, &r, sizeof(r));
+	memcpy(p + sizeof(r), topic, topicLength);
+	memcpy(p + sizeof(r) + topicLength, payload, length);
+	_segment.header.bytes += bytes;
+	_segment.header.records++;
+	_records++;
+}
+
+bool TrafficCapture::flush()
+{
+	if(_sink == nullptr)
+	{
+		_err = "Capture has no sink.";
+		return false;
+	}
+	if(_segment.header.records == 0)
+		return true;
+	if(!_sink(data(), size()))
+	{
+		_err = "Capture sink failed, capture stopped.";
+		_active = false;
+		return false;
+	}
+
+	// Drops are told once, by the segment after them
+	clear();
+	_segment.header.dropped = 0;
+	return true;
+}
+
+bool TrafficCapture::next(const uint8_t * data, size_t size, cursor_t & cursor, entry_t & entry)
+{
+	// Next segment, skipping empty ones
+	while(cursor.offset >= cursor.end)
+	{
+		if(cursor.offset >= size)
+		{
+			_err = "";
+			return false;
+		}
+
+		segment_t h;
+		if(size - cursor.offset < sizeof(h))
+		{
+			_err = "Capture ends inside a segment header.";
+			return false;
+		}
+		memcpy(&h, data + cursor.offset, sizeof(h));
+		if(h.magic != CAPTURE_MAGIC || h.version != CAPTURE_VERSION || h.headerSize < sizeof(h) ||
+			size - cursor.offset < h.headerSize || size - cursor.offset - h.headerSize < h.bytes)
+		{
+			_err = "Capture segment is damaged or of another version.";
+			return false;
+		}
+
+		if(cursor.epoch == 0)
+			cursor.epoch = h.epoch;
+		cursor.dropped += h.dropped;
+		cursor.offset += h.headerSize;
+		cursor.end = cursor.offset + h.bytes;
+	}
+
+	record_t r;
+	if(cursor.end - cursor.offset < sizeof(r))
+	{
+		_err = "Capture record is cut.";
+		return false;
+	}
+	memcpy(&r, data + cursor.offset, sizeof(r));
+	if(cursor.end - cursor.offset - sizeof(r) < (size_t)r.topicLength + r.length)
+	{
+		_err = "Capture record is cut.";
+		return false;
+	}
+
+	const uint8_t * p = data + cursor.offset + sizeof(r);
+	entry.ms = r.ms;
+	entry.flags = r.flags;
+	memcpy(entry.topic, p, r.topicLength);
+	entry.topic[r.topicLength] = '\0';
+	entry.payload = p + r.topicLength;
+	entry.length = r.length;
+	cursor.offset += sizeof(r) + r.topicLength + r.length;
+	return true;
+}
@@ -0,0 +1,132 @@
+#ifndef TRAFFIC_CAPTURE_H
+#define TRAFFIC_CAPTURE_H
+
+#include <Arduino.h>
+
+// Bytes of records one segment holds
+#ifndef CAPTURE_DATA_SIZE
+#define CAPTURE_DATA_SIZE 4096
+#endif
+#define CAPTURE_FILTER_SIZE 64
+// Payload bytes per message when a capture is published
+#define CAPTURE_CHUNK_SIZE 768
+// Below the Automated Window root: its configuration when the capture started
+#define CAPTURE_CONFIG_TOPIC "/capture/config"
+#define CAPTURE_MAGIC 0x31434853UL		// "SHC1"
+// Bump whenever segment_t or record_t change
+#define CAPTURE_VERSION 1
+
+// Direction and kind of a captured message
+enum CaptureFlags : uint8_t
+{
+	CAPTURE_IN = 0,				// Handed to onData()
+	CAPTURE_OUT = 1 << 0,		// Published by the broker itself
+	CAPTURE_RETAIN = 1 << 1		// Published retained (outgoing only)
+};
+
+/* Recorder of the MQTT traffic through the broker, to replay it on a host
+ * (see Simulation/src/capture_replay.cpp).
+ *
+ * A capture is one or more segments back to back, each a header followed by
+ * packed records:
+ *   [ms, 4 bytes][payload length, 2][topic length, 1][flags, 1][topic][payload]
+ * The topic has no terminator and ms counts from the start of the capture.
+ * Everything is little-endian, like both the ESP8266 and x86.
+ *
+ * The segment lives in RAM. When it is full, the records go to the sink if
+ * there is one and a new segment starts; without a sink further records are
+ * only counted as dropped. */
+class TrafficCapture
+{
+public:
+	typedef struct
+	{
+		uint32_t magic;
+		uint16_t version;
+		uint16_t headerSize;	// sizeof(segment_t), to skip fields added later
+		uint32_t epoch;			// Start of the capture, 0 if unknown
+		uint32_t bytes;			// Of the records in this segment
+		uint32_t records;
+		uint32_t dropped;		// Records lost before this segment was written
+	} segment_t;
+
+	typedef struct
+	{
+		uint32_t ms;
+		uint16_t length;
+		uint8_t topicLength;
+		uint8_t flags;
+	} record_t;
+
+	// One record read back, topic terminated
+	typedef struct
+	{
+		uint32_t ms;
+		uint8_t flags;
+		char topic[256];
+		const uint8_t * payload;
+		uint16_t length;
+	} entry_t;
+
+	// Position of next() in a capture
+	typedef struct
+	{
+		size_t offset = 0;
+		size_t end = 0;			// Of the current segment
+		uint32_t epoch = 0;
+		uint32_t dropped = 0;	// Over the segments read so far
+	} cursor_t;
+
+	// Takes a whole segment, false to stop the capture
+	typedef bool (*Sink)(const uint8_t * data, size_t length);
+
+	TrafficCapture();
+
+	// Starts over. Only topics matching filter (+ and # allowed) are kept,
+	// all of them if it is empty.
+	bool start(const char * filter = "");
+	void stop() { _active = false; }
+	bool active() const { return _active; }
+	const char * filter() const { return _filter; }
+
+	// Adds a record if the capture runs and the filter matches topic
+	void record(const char * topic, const uint8_t * payload, uint32_t length, uint8_t flags);
+
+	void setSink(Sink sink) { _sink = sink; }
+	// Hands the records so far to the sink, as a segment of their own
+	bool flush();
+
+	// Current segment, header included
+	const uint8_t * data() const { return (const uint8_t*)&_segment; }
+	size_t size() const { return sizeof(segment_t) + _segment.header.bytes; }
+	uint32_t records() const { return _records; }
+	uint32_t dropped() const { return _segment.header.dropped; }
+
+	// Reads the record at the cursor, across segments. False at the end and
+	// on a damaged capture, with err() telling which.
+	bool next(const uint8_t * data, size_t size, cursor_t & cursor, entry_t & entry);
+
+	// Epoch seconds for the start of a capture, 0 while unknown
+	static void setClock(unsigned long (*clock)()) { _clock = clock; }
+
+	const char * err() { return _err; }
+
+private:
+	void clear();
+
+	struct
+	{
+		segment_t header;
+		uint8_t data[CAPTURE_DATA_SIZE];
+	} _segment;
+	char _filter[CAPTURE_FILTER_SIZE];
+	bool _active;
+	unsigned long _start;
+	uint32_t _records;
+	Sink _sink;
+	const char * _err;
+
+	static unsigned long (*_clock)();
+};
+
+#endif
@@ -16,4 +16,7 @@
 #define mqtt_max_retained_topics 30
 /* ************************************************************************* */
 
+// The clock is set again from NTP this often
+#define NTP_RESYNC_MS (60*60*1000UL)
+
 #endif
@@ -2,46 +2,401 @@
 #define MY_BROKER_H
 
 #include <uMQTTBroker.h>
-#include <Logger.h>
+#include <RingLog.h>
+#include "AliasRegistry.h"
+#include "RetainedSnapshot.h"
+#include "TopicTrie.h"
+#include "TrafficCapture.h"
+
+// In-broker handler of the messages matching a filter, see myMQTTBroker::on()
+typedef void (*TopicHandler)(const char * topic, const char * payload, uint32_t length, void * context);
+
+// Handlers whose filter the topic trie has no room for, matched one by one
+#ifndef BROKER_FALLBACK_HANDLERS
+#define BROKER_FALLBACK_HANDLERS 4
+#endif
+#define BROKER_FALLBACK_FILTER_SIZE 128
 
 class myMQTTBroker: public uMQTTBroker
 {
 public:
-    typedef Logger<myMQTTBroker> Log;
-
     myMQTTBroker(uint16_t portno=1883, uint16_t max_subscriptions=10000, uint16_t max_retained_topics=30)
-        : uMQTTBroker(portno,max_subscriptions,max_retained_topics), callback(nullptr)
-    { /* ... */ }
+        : uMQTTBroker(portno,max_subscriptions,max_retained_topics), callback(nullptr), bridging(false)
+    {
+      memset(handlers, 0, sizeof(handlers));
+      for(uint8_t f = 0; f < BROKER_FALLBACK_HANDLERS; f++)
+        fallback[f].id = -1;
+    }
 
     virtual bool onConnect(IPAddress addr, uint16_t client_count)
     {
-      Log::info(addr.toString()+" connected");
+      LOG_INFO("%s connected", addr.toString().c_str());
       return true;
     }
     
     virtual bool onAuth(String username, String password)
     {
-      Log::info("Username/Password: "+username+"/"+password);
+      LOG_INFO("Username/Password: %s/%s", username.c_str(), password.c_str());
       return true;
     }
     
     virtual void onData(String topic, const char *data, uint32_t length)
     {
+      // The other form of a message handled already, see bridge()
+      if(bridging)
+        return;
+
       char data_str[length+1];
       os_memcpy(data_str, data, length);
       data_str[length] = '\0';
-      
-      if(callback)
-        callback(topic.c_str(),data,length);
+
+      // Past here a message has its full topic, whichever form it came in
+      const char * name = topic.c_str();
+      char alias[ALIAS_TOPIC_SIZE];
+      uint8_t aliasId = TopicAlias::parse(name);
+      if(aliasId != 0 && aliases.topic(aliasId) != nullptr)
+      {
+        name = aliases.topic(aliasId);
+        bridge(name, data, length);
+      }
+      else if((aliasId = aliases.find(name)) != 0)
+        bridge(TopicAlias::print(aliasId, alias, sizeof(alias)), data, length);
+
+      snapshot.capture(name, data, length);
+      capture.record(name, (const uint8_t*)data, length, CAPTURE_IN);
+
+      // Each handler once, in the order of their ids. A handler may remove
+      // others meanwhile.
+      uint32_t mask = topics.match(name) | fallbackMatch(name);
+      bool handled = mask != 0 || aliasId != 0;
+      for(uint8_t id = 0; mask != 0; id++, mask >>= 1)
+      {
+        if((mask & 1) && handlers[id].handler != nullptr)
+          handlers[id].handler(name, data_str, length, handlers[id].context);
+      }
+
+      if(!handled && callback)
+        callback(name,data,length);
+    }
+
+    // Calls handler for every message matching filter (+ and # allowed), with
+    // the payload terminated. Returns its id for off(), -1 on errors. Matching
+    // goes through a topic trie, see TopicTrie.h; a filter the trie cannot
+    // take is matched on its own, up to BROKER_FALLBACK_HANDLERS of them.
+    // Only routes: subscribe to the topics as well, unless the messages
+    // arrive anyway.
+    int8_t on(const char * filter, TopicHandler handler, void * context = nullptr)
+    {
+      int8_t id = 0;
+      while(id < TRIE_HANDLERS && handlers[id].handler != nullptr)
+        id++;
+      if(id >= TRIE_HANDLERS)
+      {
+        LOG_ERROR("Handler for <%s> was not added: no handler left.", filter);
+        return -1;
+      }
+
+      uint8_t node = topics.insert(filter);
+      if(node == TRIE_NONE)
+      {
+        uint8_t f = 0;
+        while(f < BROKER_FALLBACK_HANDLERS && fallback[f].id >= 0)
+          f++;
+        if(f >= BROKER_FALLBACK_HANDLERS || strlen(filter) >= BROKER_FALLBACK_FILTER_SIZE)
+        {
+          LOG_ERROR("Handler for <%s> was not added: %s", filter, topics.err());
+          return -1;
+        }
+        LOG_WARNING("Handler for <%s> is matched without the trie: %s", filter, topics.err());
+        strcpy(fallback[f].filter, filter);
+        fallback[f].id = id;
+      }
+      else
+        topics.handlers(node) |= 1UL << id;
+
+      handlers[id].handler = handler;
+      handlers[id].context = context;
+      handlers[id].node = node;
+      return id;
+    }
+
+    void off(int8_t id)
+    {
+      if(id < 0 || id >= TRIE_HANDLERS || handlers[id].handler == nullptr)
+        return;
+
+      uint8_t node = handlers[id].node;
+      if(node != TRIE_NONE)
+      {
+        topics.handlers(node) &= ~(1UL << id);
+        topics.release(node);
+      }
+      for(uint8_t f = 0; f < BROKER_FALLBACK_HANDLERS; f++)
+      {
+        if(fallback[f].id == id)
+          fallback[f].id = -1;
+      }
+      handlers[id].handler = nullptr;
     }
 
+    // Counted per filter, so services that share a topic subscribe the broker
+    // once: uMQTTBroker would otherwise hand each message over once per
+    // subscription. A filter the trie cannot take is subscribed uncounted.
+    bool subscribe(const String & filter, uint8_t qos = 0)
+    {
+      uint8_t node = topics.insert(filter.c_str());
+      if(node == TRIE_NONE)
+      {
+        LOG_WARNING("Subscribing to <%s> uncounted: %s", filter.c_str(), topics.err());
+        return uMQTTBroker::subscribe(filter, qos);
+      }
+      if(topics.subscriptions(node) > 0)
+      {
+        topics.subscriptions(node)++;
+        return true;
+      }
+
+      if(!uMQTTBroker::subscribe(filter, qos))
+      {
+        topics.release(node);
+        return false;
+      }
+      topics.subscriptions(node) = 1;
+      return true;
+    }
+
+    bool unsubscribe(const String & filter)
+    {
+      uint8_t node = topics.find(filter.c_str());
+      if(node == TRIE_NONE || topics.subscriptions(node) == 0)
+        return uMQTTBroker::unsubscribe(filter);
+      if(--topics.subscriptions(node) > 0)
+        return true;
+
+      topics.release(node);
+      return uMQTTBroker::unsubscribe(filter);
+    }
+
+    // Every publish of the broker passes here, so a capture sees it. A topic
+    // with an alias goes out in both forms.
+    bool publish(const char * topic, uint8_t * data, uint16_t data_length, uint8_t qos = 0, uint8_t retain = 0)
+    {
+      capture.record(topic, data, data_length, retain ? CAPTURE_OUT | CAPTURE_RETAIN : CAPTURE_OUT);
+      uint8_t id = aliases.find(topic);
+      if(id == 0)
+        return localPublish(topic, data, data_length, qos, retain);
+
+      // The broker subscribes to both forms, onData() must not bridge them again
+      char alias[ALIAS_TOPIC_SIZE];
+      bridging = true;
+      bool ok = localPublish(topic, data, data_length, qos, retain);
+      ok &= localPublish(TopicAlias::print(id, alias, sizeof(alias)), data, data_length, qos, retain);
+      bridging = false;
+      return ok;
+    }
+
+    bool publish(String topic, String data, uint8_t qos = 0, uint8_t retain = 0)
+    {
+      return publish(topic.c_str(), (uint8_t*)data.c_str(), data.length(), qos, retain);
+    }
+
+    // Same call as PubSubClient, so services publish retained topics alike on both
+    bool publish(const char * topic, const char * payload, bool retained)
+    {
+      return publish(topic, (uint8_t*)payload, strlen(payload), 0, retained);
+    }
+
+    // Keeps the topics matching filter across reboots, see RetainedSnapshot.h
+    bool snapshotTopic(const char * filter)
+    {
+      if(!snapshot.addFilter(filter))
+      {
+        LOG_ERROR("%s", snapshot.err());
+        return false;
+      }
+      return subscribe(filter);
+    }
+
+    // Publishes the last snapshot again, retained. Call right after init(),
+    // before any client connects. Returns the number of topics.
+    uint8_t restoreSnapshot()
+    {
+      if(!snapshot.load())
+      {
+        LOG_INFO("%s", snapshot.err());
+        return 0;
+      }
+
+      const char * topic;
+      const uint8_t * payload;
+      uint16_t length;
+      uint8_t n = 0;
+      for(uint16_t o = snapshot.next(0, &topic, &payload, &length); o != 0; o = snapshot.next(o, &topic, &payload, &length))
+      {
+        if(localPublish(topic, payload, length, 0, true))
+          n++;
+      }
+      LOG_INFO("Restored %u of %u snapshot topics.", n, snapshot.count());
+      return n;
+    }
+
+    // Records the traffic, see TrafficCapture.h. A filter also subscribes the
+    // broker to it, else only what reaches onData() and what the broker
+    // publishes is seen.
+    bool startCapture(const char * filter)
+    {
+      stopCapture();
+      if(!capture.start(filter))
+      {
+        LOG_ERROR("%s", capture.err());
+        return false;
+      }
+      if(filter[0] != '\0' && !subscribe(filter))
+      {
+        capture.stop();
+        return false;
+      }
+      LOG_INFO("Capturing <%s>.", filter[0] != '\0' ? filter : "*");
+      return true;
+    }
+
+    void stopCapture()
+    {
+      if(!capture.active())
+        return;
+      capture.stop();
+      if(capture.filter()[0] != '\0')
+        unsubscribe(capture.filter());
+      LOG_INFO("Captured %lu messages, %lu dropped.", (unsigned long)capture.records(), (unsigned long)capture.dropped());
+    }
+
+    // Stops the capture and publishes it to topic in chunks of
+    // CAPTURE_CHUNK_SIZE bytes, in order. Returns the number of chunks.
+    uint16_t publishCapture(const char * topic)
+    {
+      stopCapture();
+      const uint8_t * data = capture.data();
+      size_t size = capture.size();
+      uint16_t n = 0;
+      for(size_t offset = 0; offset < size; offset += CAPTURE_CHUNK_SIZE, n++)
+      {
+        size_t length = size - offset < CAPTURE_CHUNK_SIZE ? size - offset : CAPTURE_CHUNK_SIZE;
+        if(!localPublish(topic, data + offset, length))
+        {
+          LOG_ERROR("Capture chunk %u was not published.", n);
+          break;
+        }
+      }
+      return n;
+    }
+
+    // Hands out aliases for the topics of a request to ALIAS_REGISTER_TOPIC
+    // and publishes the ids to its reply topic, see TopicAlias.h. The broker
+    // subscribes to both forms of every new alias, so onData() bridges the
+    // messages of clients that use the other one.
+    bool registerAliases(const char * request)
+    {
+      const char * end = strchr(request, '\n');
+      if(end == nullptr || end == request || end - request >= ALIAS_REGISTRY_TOPIC_SIZE)
+      {
+        LOG_ERROR("Alias request without a reply topic.");
+        return false;
+      }
+      char replyTopic[ALIAS_REGISTRY_TOPIC_SIZE];
+      memcpy(replyTopic, request, end - request);
+      replyTopic[end - request] = '\0';
+
+      static char reply[ALIAS_REPLY_SIZE];
+      size_t n = 0;
+      reply[0] = '\0';
+      for(uint8_t i = 0; *end != '\0' && end[1] != '\0' && i < ALIAS_REQUEST_TOPICS; i++)
+      {
+        const char * line = end + 1;
+        end = strchr(line, '\n');
+        if(end == nullptr)
+          end = line + strlen(line);
+
+        char topic[ALIAS_REGISTRY_TOPIC_SIZE];
+        uint8_t id = 0;
+        if((size_t)(end - line) < sizeof(topic))
+        {
+          memcpy(topic, line, end - line);
+          topic[end - line] = '\0';
+          uint8_t known = aliases.count();
+          id = aliases.add(topic);
+          if(id > known && !bridgeAlias(id))
+            id = 0;
+        }
+        n += snprintf(reply + n, sizeof(reply) - n, n > 0 ? " %u" : "%u", id);
+      }
+
+      LOG_INFO("%u topic aliases handed out.", aliases.count());
+      return publish(replyTopic, (uint8_t*)reply, strlen(reply));
+    }
+
+    RetainedSnapshot snapshot;
+    TopicTrie topics;
+    TrafficCapture capture;
+    AliasRegistry aliases;
+
+    // Gets the messages no handler of on() matched
     void set_callback(void (*foo)(const char*,const char*,unsigned int))
     {
         callback = foo;
     }
 
 private:
+    // Publishes through the C call of the library, as uMQTTBroker::publish()
+    // does after making a String of the topic
+    static bool localPublish(const char * topic, const uint8_t * data, uint16_t length, uint8_t qos = 0, uint8_t retain = 0)
+    {
+      return MQTT_local_publish((uint8_t*)topic, (uint8_t*)data, length, qos, retain);
+    }
+
+    // Publishes a message received in one form of an alias in the other
+    void bridge(const char * topic, const char * data, uint32_t length)
+    {
+      bridging = true;
+      localPublish(topic, (const uint8_t*)data, length);
+      bridging = false;
+    }
+
+    bool bridgeAlias(uint8_t id)
+    {
+      char alias[ALIAS_TOPIC_SIZE];
+      if(subscribe(aliases.topic(id)) && subscribe(TopicAlias::print(id, alias, sizeof(alias))))
+        return true;
+      LOG_ERROR("Could not subscribe to the alias of <%s>.", aliases.topic(id));
+      return false;
+    }
+
+    // Handlers of the fallback filters that match topic
+    uint32_t fallbackMatch(const char * topic) const
+    {
+      uint32_t mask = 0;
+      for(uint8_t f = 0; f < BROKER_FALLBACK_HANDLERS; f++)
+      {
+        if(fallback[f].id >= 0 && TopicTrie::matches(fallback[f].filter, topic))
+          mask |= 1UL << fallback[f].id;
+      }
+      return mask;
+    }
+
+    struct
+    {
+      TopicHandler handler;
+      void * context;
+      uint8_t node;               // TRIE_NONE for a fallback filter
+    } handlers[TRIE_HANDLERS];
+
+    struct
+    {
+      char filter[BROKER_FALLBACK_FILTER_SIZE];
+      int8_t id;                  // Of the handler, -1 if free
+    } fallback[BROKER_FALLBACK_HANDLERS];
+
     void (*callback)(const char*,const char*,uint32_t);
+    bool bridging;
 };
 
 #endif
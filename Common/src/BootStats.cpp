@@ -0,0 +1,68 @@
+#include "BootStats.h"
+#include "WiFiJoin.h"
+
+BootStats::phase_t BootStats::_phases[BOOT_PHASES];
+
+static const char * const BOOT_PHASE_NAMES[BOOT_PHASES] =
+{
+	"config", "actuator", "home", "wifi", "ntp", "mqtt", "publish"
+};
+
+void BootStats::start(uint8_t phase)
+{
+	if(phase >= BOOT_PHASES || _phases[phase].started)
+		return;
+
+	_phases[phase].at = millis();
+	_phases[phase].started = true;
+}
+
+void BootStats::finish(uint8_t phase)
+{
+	if(phase >= BOOT_PHASES || _phases[phase].done)
+		return;
+
+	start(phase);
+	_phases[phase].ms = millis() - _phases[phase].at;
+	_phases[phase].done = true;
+}
+
+size_t BootStats::print(char * buf, size_t len)
+{
+	uint32_t ready = 0;
+	for(const phase_t & p : _phases)
+	{
+		if(p.done && p.at + p.ms > ready)
+			ready = p.at + p.ms;
+	}
+
+#if defined(ESP8266)
+	String reset = ESP.getResetReason();
+#else
+	String reset = "Host";
+#endif
+
+	int n = snprintf(buf, len, "{\"reset\":\"%s\",\"ready\":%lu,\"wifiFast\":%s",
+		reset.c_str(), (unsigned long)ready, WiFiJoin::fast() ? "true" : "false");
+
+	for(uint8_t i = 0; i < BOOT_PHASES; i++)
+	{
+		const phase_t & p = _phases[i];
+		if(!p.started)
+			continue;
+		if(n < 0 || (size_t)n >= len)
+			return 0;
+
+		if(p.done)
+			n += snprintf(buf + n, len - n, ",\"%s\":{\"at\":%lu,\"ms\":%lu}",
+				BOOT_PHASE_NAMES[i], (unsigned long)p.at, (unsigned long)p.ms);
+		else
+			n += snprintf(buf + n, len - n, ",\"%s\":{\"at\":%lu}", BOOT_PHASE_NAMES[i], (unsigned long)p.at);
+	}
+
+	if(n < 0 || (size_t)n + 2 > len)
+		return 0;
+	buf[n++] = '}';
+	buf[n] = '\0';
+	return n;
+}
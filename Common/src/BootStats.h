@@ -0,0 +1,53 @@
+#ifndef BOOT_STATS_H
+#define BOOT_STATS_H
+
+#include <Arduino.h>
+
+// Topic the boot report is published to, below the root topic of the node
+#define BOOT_TOPIC "/boot"
+// Longest BootStats::print() output, terminator included
+#define BOOT_JSON_SIZE 384
+
+// Boot phases of the nodes, each node runs those it needs
+enum BootPhase : uint8_t
+{
+	BOOT_CONFIG = 0,		// Configuration read from flash
+	BOOT_ACTUATOR,			// SmartWindow: actuators and limit switches
+	BOOT_HOME,				// SmartWindow: every window moved onto a limit switch
+	BOOT_WIFI,				// Joining the network
+	BOOT_NTP,				// First time update
+	BOOT_MQTT,				// Connected and subscribed, or broker started
+	BOOT_PUBLISH,			// WeatherClient waking from deep sleep: report fetched and published
+	BOOT_PHASES
+};
+
+/* Start and duration of each boot phase, in millis() since power-up.
+ * Phases may overlap: SmartWindow drives its windows while the network
+ * comes up. Each node publishes the report, retained, to <root>/boot once
+ * its MQTT connection is ready. */
+class BootStats
+{
+public:
+	static void start(uint8_t phase);
+	static void finish(uint8_t phase);
+
+	static bool started(uint8_t phase) { return phase < BOOT_PHASES && _phases[phase].started; }
+	static bool done(uint8_t phase) { return phase < BOOT_PHASES && _phases[phase].done; }
+
+	// {"reset":..,"ready":..,"wifiFast":..,"config":{"at":..,"ms":..},..},
+	// phases not started are left out
+	static size_t print(char * buf, size_t len);
+
+private:
+	typedef struct
+	{
+		uint32_t at;
+		uint32_t ms;
+		bool started;
+		bool done;
+	} phase_t;
+
+	static phase_t _phases[BOOT_PHASES];
+};
+
+#endif
@@ -0,0 +1,450 @@
+#include "ConfigJournal.h"
+
+#if defined(ESP8266)
+#include <flash_hal.h>
+#else
+static uint8_t _hostFlash[CONFIG_JOURNAL_SECTORS * CONFIG_JOURNAL_SECTOR_SIZE];
+static bool _hostFlashErased = false;
+#endif
+
+// Bytes copied through the stack at once. Flash accesses must be word aligned.
+#define CHUNK_SIZE 64
+
+ConfigJournal ConfigStore;
+
+
+ConfigJournal::ConfigJournal(uint8_t sectors)
+{
+	_sectors = sectors;
+	memset(_entries, 0, sizeof(_entries));
+}
+
+bool ConfigJournal::begin()
+{
+	if(_ready)
+		return true;
+
+	if(_sectors < 2)
+	{
+		_err = "The journal needs at least two sectors.";
+		return false;
+	}
+
+#if defined(ESP8266)
+	if(FS_PHYS_SIZE < (uint32_t)_sectors * CONFIG_JOURNAL_SECTOR_SIZE)
+	{
+		_err = "Flash layout has no room for the journal. Select a layout with a file system.";
+		return false;
+	}
+#else
+	if(_sectors > CONFIG_JOURNAL_SECTORS)
+	{
+		_err = "The host flash has fewer sectors than requested.";
+		return false;
+	}
+	if(!_hostFlashErased)
+	{
+		memset(_hostFlash, 0xFF, sizeof(_hostFlash));
+		_hostFlashErased = true;
+	}
+#endif
+
+	memset(_entries, 0, sizeof(_entries));
+	_seq = 0;
+	_active = 0;
+	_offset = 0;
+
+	// The sector holding the highest sequence number is the one being appended to
+	uint32_t best = 0;
+	uint32_t used = 0;
+	for(uint8_t s = 0; s < _sectors; s++)
+	{
+		uint32_t maxSeq = 0;
+		uint32_t end = 0;
+		uint32_t programmed = 0;
+
+		if(!scanSector(s, maxSeq, end, programmed))
+			return false;
+
+		if(maxSeq > best || s == 0)
+		{
+			best = maxSeq;
+			_active = s;
+			_offset = end;
+			used = programmed;
+		}
+	}
+	_seq = best;
+	_ready = true;
+
+	// A write cut before its header left payload behind the last record.
+	// Appending over it would corrupt the next record, and the records after
+	// it would be out of reach of the scan: move on to a clean sector.
+	bool torn = used > _offset;
+	if(torn)
+		_offset = used;
+
+	// A reset in the middle of a rollover leaves records behind in the
+	// previous sector, which the next rollover would erase. Finish the copy.
+	for(uint8_t id = 0; id < CONFIG_JOURNAL_MAX_IDS; id++)
+	{
+		entry_t & e = _entries[id];
+		if(!e.valid || sectorOf(e.address) == _active)
+			continue;
+
+		if(_offset + recordSize(e.length) > CONFIG_JOURNAL_SECTOR_SIZE)
+			break;
+		if(!append(id, e.version, e.length, nullptr, e.address + sizeof(header_t)))
+			return false;
+	}
+
+	if(torn)
+	{
+		for(uint8_t id = 0; id < CONFIG_JOURNAL_MAX_IDS; id++)
+		{
+			// Rolling over would erase a record the copy above did not fit
+			if(_entries[id].valid && sectorOf(_entries[id].address) != _active)
+				return true;
+		}
+		return rollover(CONFIG_JOURNAL_MAX_IDS, 0);
+	}
+	return true;
+}
+
+// Records follow each other from the start of the sector, each header
+// giving the length of its payload. The chain ends at the first header slot
+// that is erased, or that a cut write left without a valid magic.
+bool ConfigJournal::scanSector(uint8_t sector, uint32_t & maxSeq, uint32_t & end, uint32_t & programmed)
+{
+	uint32_t base = sectorAddress(sector);
+	uint32_t words[CHUNK_SIZE/4];
+
+	uint32_t off = 0;
+	while(off + sizeof(header_t) <= CONFIG_JOURNAL_SECTOR_SIZE)
+	{
+		header_t h;
+		if(!flashRead(base + off, &h, sizeof(h)))
+			return false;
+
+		if(h.magic != MAGIC || off + recordSize(h.length) > CONFIG_JOURNAL_SECTOR_SIZE)
+			break;
+
+		uint32_t crc = crc32(0, (const uint8_t*)&h, offsetof(header_t, crc));
+		for(uint32_t i = 0; i < h.length; i += CHUNK_SIZE)
+		{
+			size_t n = h.length - i < CHUNK_SIZE ? h.length - i : CHUNK_SIZE;
+			if(!flashRead(base + off + sizeof(header_t) + i, words, (n + 3) & ~3))
+				return false;
+			crc = crc32(crc, (const uint8_t*)words, n);
+		}
+
+		// Its length still leads to the next record
+		if(crc != h.crc || h.id >= CONFIG_JOURNAL_MAX_IDS)
+		{
+			off += recordSize(h.length);
+			continue;
+		}
+
+		entry_t & e = _entries[h.id];
+		if(!e.valid || h.seq > e.seq)
+		{
+			e.address = base + off;
+			e.seq = h.seq;
+			e.version = h.version;
+			e.crc = h.crc;
+			e.length = h.length;
+			e.valid = true;
+		}
+		if(h.seq > maxSeq)
+			maxSeq = h.seq;
+
+		off += recordSize(h.length);
+	}
+	end = off;
+
+	// Anything programmed past the chain is the payload of a cut write
+	programmed = end;
+	for(uint32_t at = end & ~(CHUNK_SIZE - 1); at < CONFIG_JOURNAL_SECTOR_SIZE; at += CHUNK_SIZE)
+	{
+		if(!flashRead(base + at, words, CHUNK_SIZE))
+			return false;
+		for(uint8_t w = 0; w < CHUNK_SIZE/4; w++)
+		{
+			if(at + w*4 >= end && words[w] != 0xFFFFFFFF)
+				programmed = at + (w + 1)*4;
+		}
+	}
+	return true;
+}
+
+
+bool ConfigJournal::read(uint8_t id, uint32_t version, void * data, size_t length)
+{
+	if(!begin())
+		return false;
+
+	if(id >= CONFIG_JOURNAL_MAX_IDS || !_entries[id].valid)
+	{
+		_err = "No record saved under this id.";
+		return false;
+	}
+
+	const entry_t & e = _entries[id];
+	if(e.version != version || e.length != length)
+	{
+		_err = "Saved record has another version. Ignoring it.";
+		return false;
+	}
+
+	uint32_t buf[CHUNK_SIZE/4];
+	for(size_t i = 0; i < length; i += CHUNK_SIZE)
+	{
+		size_t n = length - i < CHUNK_SIZE ? length - i : CHUNK_SIZE;
+		if(!flashRead(e.address + sizeof(header_t) + i, buf, (n + 3) & ~3))
+			return false;
+		memcpy((uint8_t*)data + i, buf, n);
+	}
+	return true;
+}
+
+ConfigJournal::Result ConfigJournal::write(uint8_t id, uint32_t version, const void * data, size_t length)
+{
+	if(!begin())
+		return JOURNAL_ERROR;
+
+	if(id >= CONFIG_JOURNAL_MAX_IDS)
+	{
+		_err = "Record id out of range.";
+		return JOURNAL_ERROR;
+	}
+	if(recordSize(length) > CONFIG_JOURNAL_SECTOR_SIZE / 2)
+	{
+		_err = "Record too large for the journal.";
+		return JOURNAL_ERROR;
+	}
+
+	const entry_t & e = _entries[id];
+	if(e.valid && e.version == version && e.length == length && samePayload(e, data, length))
+	{
+		_skipped++;
+		return JOURNAL_UNCHANGED;
+	}
+
+	if(_offset + recordSize(length) > CONFIG_JOURNAL_SECTOR_SIZE && !rollover(id, recordSize(length)))
+		return JOURNAL_ERROR;
+
+	if(!append(id, version, length, data, 0))
+		return JOURNAL_ERROR;
+
+	_writes++;
+	return JOURNAL_OK;
+}
+
+bool ConfigJournal::contains(uint8_t id)
+{
+	return begin() && id < CONFIG_JOURNAL_MAX_IDS && _entries[id].valid;
+}
+
+bool ConfigJournal::format()
+{
+	for(uint8_t s = 0; s < _sectors; s++)
+	{
+		if(!flashErase(s))
+			return false;
+	}
+
+	memset(_entries, 0, sizeof(_entries));
+	_active = 0;
+	_offset = 0;
+	_seq = 0;
+	_ready = true;
+	return true;
+}
+
+
+bool ConfigJournal::rollover(uint8_t skipId, size_t needed)
+{
+	// Everything still live has to fit in the next sector with the new record
+	size_t live = needed;
+	for(uint8_t id = 0; id < CONFIG_JOURNAL_MAX_IDS; id++)
+	{
+		if(id != skipId && _entries[id].valid)
+			live += recordSize(_entries[id].length);
+	}
+	if(live > CONFIG_JOURNAL_SECTOR_SIZE)
+	{
+		_err = "Journal sector too small for the saved records.";
+		return false;
+	}
+
+	uint8_t next = (_active + 1) % _sectors;
+	if(!flashErase(next))
+		return false;
+
+	_active = next;
+	_offset = 0;
+
+	// Carry the newest record of every other id forward. Until this is done
+	// the older sectors still hold them, so a reset here loses nothing.
+	for(uint8_t id = 0; id < CONFIG_JOURNAL_MAX_IDS; id++)
+	{
+		entry_t & e = _entries[id];
+		if(id == skipId || !e.valid)
+			continue;
+
+		if(!append(id, e.version, e.length, nullptr, e.address + sizeof(header_t)))
+			return false;
+	}
+	return true;
+}
+
+bool ConfigJournal::append(uint8_t id, uint32_t version, uint16_t length, const void * data, uint32_t fromAddress)
+{
+	uint32_t address = sectorAddress(_active) + _offset;
+
+	header_t h;
+	h.magic = MAGIC;
+	h.id = id;
+	h.flags = 0;
+	h.length = length;
+	h.reserved = 0xFFFF;
+	h.version = version;
+	h.seq = _seq + 1;
+
+	// Payload first, header last: a record is only visible once complete
+	uint32_t crc = crc32(0, (const uint8_t*)&h, offsetof(header_t, crc));
+	uint32_t buf[CHUNK_SIZE/4];
+
+	for(uint32_t i = 0; i < length; i += CHUNK_SIZE)
+	{
+		size_t n = length - i < CHUNK_SIZE ? length - i : CHUNK_SIZE;
+
+		if(data)
+			memcpy(buf, (const uint8_t*)data + i, n);
+		else if(!flashRead(fromAddress + i, buf, (n + 3) & ~3))
+			return false;
+
+		// Padding is programmed as zeros, like the rest of the record
+		memset((uint8_t*)buf + n, 0x00, CHUNK_SIZE - n);
+		crc = crc32(crc, (const uint8_t*)buf, n);
+
+		if(!flashWrite(address + sizeof(header_t) + i, buf, (n + 3) & ~3))
+			return false;
+	}
+
+	h.crc = crc;
+	if(!flashWrite(address, &h, sizeof(h)))
+		return false;
+
+	entry_t & e = _entries[id];
+	e.address = address;
+	e.seq = h.seq;
+	e.version = version;
+	e.crc = crc;
+	e.length = length;
+	e.valid = true;
+
+	_seq = h.seq;
+	_offset += recordSize(length);
+	return true;
+}
+
+bool ConfigJournal::samePayload(const entry_t & e, const void * data, size_t length)
+{
+	uint32_t buf[CHUNK_SIZE/4];
+	for(size_t i = 0; i < length; i += CHUNK_SIZE)
+	{
+		size_t n = length - i < CHUNK_SIZE ? length - i : CHUNK_SIZE;
+		if(!flashRead(e.address + sizeof(header_t) + i, buf, (n + 3) & ~3))
+			return false;
+		if(memcmp(buf, (const uint8_t*)data + i, n) != 0)
+			return false;
+	}
+	return true;
+}
+
+
+uint8_t ConfigJournal::sectorOf(uint32_t address)
+{
+	return (address - sectorAddress(0)) / CONFIG_JOURNAL_SECTOR_SIZE;
+}
+
+uint32_t ConfigJournal::sectorAddress(uint8_t sector)
+{
+#if defined(ESP8266)
+	// Last sectors of the file system area, which the sketch does not mount
+	return FS_PHYS_ADDR + FS_PHYS_SIZE - (uint32_t)(_sectors - sector) * CONFIG_JOURNAL_SECTOR_SIZE;
+#else
+	return (uint32_t)sector * CONFIG_JOURNAL_SECTOR_SIZE;
+#endif
+}
+
+size_t ConfigJournal::recordSize(size_t length)
+{
+	return (sizeof(header_t) + length + 3) & ~3;
+}
+
+uint32_t ConfigJournal::crc32(uint32_t crc, const uint8_t * data, size_t length)
+{
+	// CRC-32 (IEEE), four bits at a time to keep the table small
+	static const uint32_t table[16] =
+	{
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+
+	crc = ~crc;
+	for(size_t i = 0; i < length; i++)
+	{
+		crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+		crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+	}
+	return ~crc;
+}
+
+
+bool ConfigJournal::flashRead(uint32_t address, void * data, size_t length)
+{
+#if defined(ESP8266)
+	if(!ESP.flashRead(address, (uint32_t*)data, length))
+	{
+		_err = "Could not read from flash.";
+		return false;
+	}
+#else
+	memcpy(data, _hostFlash + address, length);
+#endif
+	return true;
+}
+
+bool ConfigJournal::flashWrite(uint32_t address, const void * data, size_t length)
+{
+#if defined(ESP8266)
+	if(!ESP.flashWrite(address, (uint32_t*)data, length))
+	{
+		_err = "Could not write to flash.";
+		return false;
+	}
+#else
+	// NOR flash only clears bits
+	for(size_t i = 0; i < length; i++)
+		_hostFlash[address + i] &= ((const uint8_t*)data)[i];
+#endif
+	return true;
+}
+
+bool ConfigJournal::flashErase(uint8_t sector)
+{
+#if defined(ESP8266)
+	if(!ESP.flashEraseSector(sectorAddress(sector) / CONFIG_JOURNAL_SECTOR_SIZE))
+	{
+		_err = "Could not erase flash sector.";
+		return false;
+	}
+#else
+	memset(_hostFlash + sectorAddress(sector), 0xFF, CONFIG_JOURNAL_SECTOR_SIZE);
+	_hostFlashErased = true;
+#endif
+	_erases++;
+	return true;
+}
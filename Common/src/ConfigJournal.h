@@ -0,0 +1,122 @@
+#ifndef CONFIG_JOURNAL_H
+#define CONFIG_JOURNAL_H
+
+#include <Arduino.h>
+
+// Flash sectors used by the journal, taken from the end of the FS area
+#ifndef CONFIG_JOURNAL_SECTORS
+#define CONFIG_JOURNAL_SECTORS 4
+#endif
+#define CONFIG_JOURNAL_SECTOR_SIZE 4096
+#define CONFIG_JOURNAL_MAX_IDS 16
+
+// Record ids in use across the nodes
+#define JOURNAL_ID_SMART_WINDOW 0		// + window index
+#define JOURNAL_ID_AUTOMATED_WINDOW 8
+#define JOURNAL_ID_WEATHER 9
+#define JOURNAL_ID_WIFI 10				// Last access point, see WiFiJoin.h
+#define JOURNAL_ID_BROKER_SNAPSHOT 11	// Retained topics, see Broker/src/RetainedSnapshot.h
+
+/* Append-only configuration storage on raw flash.
+ *
+ * EEPROM.commit() erases and rewrites a whole flash sector on every save.
+ * The journal instead appends records to the current sector, so a sector is
+ * only erased once it is full, and it rotates over several sectors.
+ * Every record carries its id, a schema version, a sequence number and a
+ * CRC; at boot the newest valid record of each id wins. Records with
+ * another schema version are never handed out, so a firmware update that
+ * changes a layout boots with defaults instead of garbage.
+ *
+ * Writes that do not change the stored payload do not touch the flash. */
+class ConfigJournal
+{
+public:
+	enum Result
+	{
+		JOURNAL_ERROR = 0,
+		JOURNAL_OK,
+		JOURNAL_UNCHANGED
+	};
+
+	ConfigJournal(uint8_t sectors = CONFIG_JOURNAL_SECTORS);
+
+	// Scans the flash once. Called implicitly by read() and write().
+	bool begin();
+
+	// Copies the newest record of id into data. Fails if there is none,
+	// or if it was written with another version or length.
+	bool read(uint8_t id, uint32_t version, void * data, size_t length);
+
+	// Appends a record unless it equals the newest one of the same id
+	Result write(uint8_t id, uint32_t version, const void * data, size_t length);
+
+	bool contains(uint8_t id);
+
+	// Erases every journal sector
+	bool format();
+
+	uint32_t erases() { return _erases; }
+	uint32_t writes() { return _writes; }
+	uint32_t skipped() { return _skipped; }
+
+	const char * err() { return _err; }
+
+	// CRC-32 (IEEE) of data, continuing crc (0 to start)
+	static uint32_t crc32(uint32_t crc, const uint8_t * data, size_t length);
+
+private:
+	typedef struct
+	{
+		uint16_t magic;
+		uint8_t id;
+		uint8_t flags;
+		uint16_t length;
+		uint16_t reserved;
+		uint32_t version;
+		uint32_t seq;
+		uint32_t crc;		// Over the fields above and the payload
+	} header_t;
+
+	typedef struct
+	{
+		uint32_t address;	// Of the header
+		uint32_t seq;
+		uint32_t version;
+		uint32_t crc;
+		uint16_t length;
+		bool valid;
+	} entry_t;
+
+	static const uint16_t MAGIC = 0x4A43;
+
+	// end: after the last record, programmed: after the last programmed word
+	bool scanSector(uint8_t sector, uint32_t & maxSeq, uint32_t & end, uint32_t & programmed);
+	bool rollover(uint8_t skipId, size_t needed);
+	bool append(uint8_t id, uint32_t version, uint16_t length, const void * data, uint32_t fromAddress);
+	bool samePayload(const entry_t & e, const void * data, size_t length);
+
+	uint32_t sectorAddress(uint8_t sector);
+	uint8_t sectorOf(uint32_t address);
+	static size_t recordSize(size_t length);
+
+	// Flash back end: ESP8266 SPI flash on the target, RAM on the host
+	bool flashRead(uint32_t address, void * data, size_t length);
+	bool flashWrite(uint32_t address, const void * data, size_t length);
+	bool flashErase(uint8_t sector);
+
+	uint8_t _sectors;
+	uint8_t _active = 0;
+	uint32_t _offset = 0;		// Free space in the active sector
+	uint32_t _seq = 0;			// Last sequence number in use
+	bool _ready = false;
+	entry_t _entries[CONFIG_JOURNAL_MAX_IDS];
+
+	uint32_t _erases = 0;
+	uint32_t _writes = 0;
+	uint32_t _skipped = 0;
+	const char * _err = "";
+};
+
+extern ConfigJournal ConfigStore;
+
+#endif
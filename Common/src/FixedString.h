@@ -0,0 +1,87 @@
+#ifndef FIXED_STRING_H
+#define FIXED_STRING_H
+
+#include <Arduino.h>
+
+/* String of at most N-1 characters in a char[N], for the fields a service
+ * keeps in its configuration record. It has the layout of the array it
+ * replaces, so the record is the state itself: saved and loaded as it is,
+ * without copies into String members and without the heap.
+ *
+ * The bytes after the terminator stay zero, so equal strings make equal
+ * records and an unchanged configuration does not look dirty to the
+ * journal. Topics below a root are matched with after() and built with
+ * join() into a buffer on the stack.
+ *
+ * The default constructor is trivial, so a record of them can be zeroed and
+ * copied as bytes. Like a char array it leaves the string uninitialized:
+ * record fields start from = "" or from a zeroed record. */
+template<size_t N>
+class FixedString
+{
+public:
+	FixedString() = default;
+	FixedString(const char * s) { if(!assign(s)) memset(_s, 0, N); }
+
+	// False, leaving the string as it was, if s does not fit
+	bool assign(const char * s) { return assign(s, s != nullptr ? strlen(s) : 0); }
+	bool assign(const char * s, size_t length)
+	{
+		if(length >= N)
+			return false;
+		memmove(_s, s, length);
+		memset(_s + length, 0, N - length);
+		return true;
+	}
+	template<size_t M>
+	bool assign(const FixedString<M> & s) { return assign(s.c_str(), s.length()); }
+
+	// After a raw copy from flash
+	void terminate() { _s[N-1] = '\0'; }
+
+	const char * c_str() const { return _s; }
+	size_t length() const { return strlen(_s); }
+	bool empty() const { return _s[0] == '\0'; }
+	static constexpr size_t capacity() { return N - 1; }
+
+	bool operator==(const char * s) const { return s != nullptr && !strcmp(_s, s); }
+	bool operator!=(const char * s) const { return !(*this == s); }
+	template<size_t M>
+	bool operator==(const FixedString<M> & s) const { return !strcmp(_s, s.c_str()); }
+	template<size_t M>
+	bool operator!=(const FixedString<M> & s) const { return !(*this == s); }
+
+	// The rest of s after this string, nullptr unless s starts with it
+	const char * after(const char * s) const
+	{
+		size_t n = length();
+		return strncmp(s, _s, n) == 0 ? s + n : nullptr;
+	}
+
+	// Whether s is this string followed by suffix
+	bool equals(const char * s, const char * suffix) const
+	{
+		const char * rest = after(s);
+		return rest != nullptr && !strcmp(rest, suffix);
+	}
+
+	// This string followed by suffix in buf, which it returns. Empty if it
+	// does not fit.
+	const char * join(char * buf, size_t size, const char * suffix) const
+	{
+		int n = snprintf(buf, size, "%s%s", _s, suffix);
+		if(n < 0 || (size_t)n >= size)
+			buf[0] = '\0';
+		return buf;
+	}
+
+private:
+	char _s[N];
+};
+
+template<size_t N>
+bool operator==(const char * s, const FixedString<N> & f) { return f == s; }
+template<size_t N>
+bool operator!=(const char * s, const FixedString<N> & f) { return f != s; }
+
+#endif
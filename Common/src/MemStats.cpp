@@ -0,0 +1,169 @@
+#include "MemStats.h"
+
+#if !defined(ESP8266)
+#include <new>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+MemStats::op_t MemStats::_ops[MEM_OP_COUNT];
+uint32_t MemStats::_minFree = 0;
+uint32_t MemStats::_minStack = 0;
+
+static const char * const MEM_OP_NAMES[MEM_OP_COUNT] =
+{
+	"callback", "publish", "decide", "weatherGet", "configWrite"
+};
+
+// Allocation counters of the host build, they stay 0 on the ESP8266
+static uint32_t hostAllocations = 0;
+static uint32_t hostInUse = 0;
+static uint32_t hostPeak = 0;
+
+#if !defined(ESP8266) && !defined(MEM_STATS_NO_HOST_ALLOCATOR)
+// Every block starts with its size, padded to keep the alignment of malloc
+static const size_t HOST_HEADER = alignof(max_align_t);
+
+static void * hostAlloc(size_t size)
+{
+	uint8_t * p = (uint8_t*)malloc(size + HOST_HEADER);
+	if(p == nullptr)
+		throw std::bad_alloc();
+
+	*(size_t*)p = size;
+	hostAllocations++;
+	hostInUse += size;
+	if(hostInUse > hostPeak)
+		hostPeak = hostInUse;
+	return p + HOST_HEADER;
+}
+
+static void hostFree(void * ptr)
+{
+	if(ptr == nullptr)
+		return;
+
+	uint8_t * p = (uint8_t*)ptr - HOST_HEADER;
+	hostInUse -= *(size_t*)p;
+	free(p);
+}
+
+void * operator new(size_t size) { return hostAlloc(size); }
+void * operator new[](size_t size) { return hostAlloc(size); }
+void operator delete(void * p) noexcept { hostFree(p); }
+void operator delete[](void * p) noexcept { hostFree(p); }
+void operator delete(void * p, size_t) noexcept { hostFree(p); }
+void operator delete[](void * p, size_t) noexcept { hostFree(p); }
+#endif
+
+
+uint32_t MemStats::freeHeap()
+{
+#if defined(ESP8266)
+	return ESP.getFreeHeap();
+#else
+	return hostInUse < MEM_STATS_HOST_HEAP ? MEM_STATS_HOST_HEAP - hostInUse : 0;
+#endif
+}
+
+uint32_t MemStats::maxBlock()
+{
+#if defined(ESP8266)
+	return ESP.getMaxFreeBlockSize();
+#else
+	return freeHeap();
+#endif
+}
+
+uint32_t MemStats::allocations() { return hostAllocations; }
+uint32_t MemStats::bytesInUse() { return hostInUse; }
+uint32_t MemStats::peakBytes() { return hostPeak; }
+
+void MemStats::reset()
+{
+	memset(_ops, 0, sizeof(_ops));
+	_minFree = 0;
+	_minStack = 0;
+}
+
+size_t MemStats::print(char * buf, size_t len)
+{
+	int n = snprintf(buf, len, "{\"free\":%lu,\"block\":%lu,\"minFree\":%lu,\"minStack\":%lu,\"ops\":{",
+		(unsigned long)freeHeap(), (unsigned long)maxBlock(), (unsigned long)_minFree, (unsigned long)_minStack);
+	bool first = true;
+
+	for(uint8_t i = 0; i < MEM_OP_COUNT; i++)
+	{
+		const op_t & o = _ops[i];
+		if(o.calls == 0)
+			continue;
+		if(n < 0 || (size_t)n >= len)
+			return 0;
+
+		n += snprintf(buf + n, len - n,
+			"%s\"%s\":{\"n\":%lu,\"free\":%lu,\"block\":%lu,\"frag\":%u,\"retained\":%ld,\"peak\":%lu,\"allocs\":%lu}",
+			first ? "" : ",", MEM_OP_NAMES[i], (unsigned long)o.calls, (unsigned long)o.minFree,
+			(unsigned long)o.minBlock, o.maxFragmentation, (long)o.maxRetained,
+			(unsigned long)o.maxPeak, (unsigned long)o.maxAllocations);
+		first = false;
+	}
+
+	if(n >= 0 && (size_t)n < len)
+		n += snprintf(buf + n, len - n, "}}");
+	if(n < 0 || (size_t)n >= len)
+		return 0;
+	return n;
+}
+
+
+MemScope::MemScope(uint8_t op)
+	: _op(op < MEM_OP_COUNT ? op : MEM_OP_CALLBACK)
+{
+	_free = MemStats::freeHeap();
+	_allocations = hostAllocations;
+	_inUse = hostInUse;
+	// Peak of this scope alone, the outer one is restored at the end
+	_outerPeak = hostPeak;
+	hostPeak = hostInUse;
+}
+
+MemScope::~MemScope()
+{
+	uint32_t free = MemStats::freeHeap();
+	uint32_t block = MemStats::maxBlock();
+	uint8_t fragmentation = 0;
+	uint32_t stack = 0;
+#if defined(ESP8266)
+	fragmentation = ESP.getHeapFragmentation();
+	stack = ESP.getFreeContStack();
+#endif
+
+	MemStats::op_t & o = MemStats::_ops[_op];
+	int32_t retained = (int32_t)_free - (int32_t)free;
+	uint32_t peak = hostPeak - _inUse;
+	uint32_t allocations = hostAllocations - _allocations;
+
+	if(o.calls == 0 || free < o.minFree)
+		o.minFree = free;
+	if(o.calls == 0 || block < o.minBlock)
+		o.minBlock = block;
+	if(o.calls == 0 || retained > o.maxRetained)
+		o.maxRetained = retained;
+	if(fragmentation > o.maxFragmentation)
+		o.maxFragmentation = fragmentation;
+	if(peak > o.maxPeak)
+		o.maxPeak = peak;
+	if(allocations > o.maxAllocations)
+		o.maxAllocations = allocations;
+	o.calls++;
+
+	if(MemStats::_minFree == 0 || free < MemStats::_minFree)
+		MemStats::_minFree = free;
+	if(stack > 0 && (MemStats::_minStack == 0 || stack < MemStats::_minStack))
+		MemStats::_minStack = stack;
+
+	if(hostPeak < _outerPeak)
+		hostPeak = _outerPeak;
+}
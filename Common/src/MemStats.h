@@ -0,0 +1,93 @@
+#ifndef MEM_STATS_H
+#define MEM_STATS_H
+
+#include <Arduino.h>
+
+// Operations measured across the nodes
+enum MemOp : uint8_t
+{
+	MEM_OP_CALLBACK = 0,		// One received MQTT message, whole handler
+	MEM_OP_PUBLISH,				// Building and publishing a report
+	MEM_OP_DECIDE,				// AutomatedWindow::decide
+	MEM_OP_WEATHER_GET,			// Weather::get
+	MEM_OP_CONFIG_WRITE,		// SmartWindow configWrite (JSON patch)
+	MEM_OP_COUNT
+};
+
+// Longest MemStats::print() output, terminator included
+#define MEM_STATS_JSON_SIZE 1024
+// Heap the host build pretends to have, to report free figures
+#define MEM_STATS_HOST_HEAP 49152
+
+/* Worst-case heap figures per operation.
+ *
+ * A MemScope around a handler reads the free heap when it starts and, when
+ * it ends, the free heap, the largest free block and the fragmentation.
+ * Per operation only the worst values are kept: lowest free heap and
+ * largest block, highest fragmentation and the most heap the operation
+ * still held after returning. Fragmentation is measured once per scope, at
+ * the end, as it walks the whole heap.
+ *
+ * On the host (any build without ESP8266) the global operator new and
+ * delete count every allocation instead, so a harness can also check the
+ * peak heap and the number of allocations of an operation. Define
+ * MEM_STATS_NO_HOST_ALLOCATOR to keep the default allocator. */
+class MemStats
+{
+public:
+	typedef struct
+	{
+		uint32_t calls;
+		uint32_t minFree;			// Lowest free heap after it
+		uint32_t minBlock;			// Lowest largest free block after it
+		uint8_t maxFragmentation;	// Highest fragmentation after it, %
+		int32_t maxRetained;		// Most heap still held after it returned
+		uint32_t maxPeak;			// Host: most heap it had in use at once
+		uint32_t maxAllocations;	// Host: most allocations it made
+	} op_t;
+
+	static const op_t & op(uint8_t op) { return _ops[op < MEM_OP_COUNT ? op : 0]; }
+
+	// Lowest free heap and free stack seen by any scope since the last reset
+	static uint32_t minFree() { return _minFree; }
+	static uint32_t minStack() { return _minStack; }
+
+	static void reset();
+
+	// {"free":..,"block":..,"minFree":..,"minStack":..,"ops":{"decide":{..},..}},
+	// measured operations only
+	static size_t print(char * buf, size_t len);
+
+	// Current figures, for logs
+	static uint32_t freeHeap();
+	static uint32_t maxBlock();
+
+	// Host build: allocations since start, bytes in use and their peak
+	static uint32_t allocations();
+	static uint32_t bytesInUse();
+	static uint32_t peakBytes();
+
+private:
+	friend class MemScope;
+
+	static op_t _ops[MEM_OP_COUNT];
+	static uint32_t _minFree;
+	static uint32_t _minStack;
+};
+
+// Measures the enclosing block as operation op
+class MemScope
+{
+public:
+	MemScope(uint8_t op);
+	~MemScope();
+
+private:
+	uint8_t _op;
+	uint32_t _free;
+	uint32_t _allocations;
+	uint32_t _inUse;
+	uint32_t _outerPeak;
+};
+
+#endif
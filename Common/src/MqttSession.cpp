@@ -0,0 +1,99 @@
+#include "MqttSession.h"
+#include <RingLog.h>
+
+void MqttSession::begin(Client & net, const char * id, const char * user, const char * password, SubscribeHook subscribe)
+{
+	_id = id;
+	_user = user;
+	_password = password;
+	_subscribe = subscribe;
+	snprintf(_probeTopic, sizeof(_probeTopic), "%s%s", id, MQTT_PROBE_TOPIC);
+
+	net.setTimeout(MQTT_CONNECT_TIMEOUT_MS);
+	_client.setSocketTimeout((MQTT_CONNECT_TIMEOUT_MS + 999)/1000);
+}
+
+bool MqttSession::run(bool mayConnect)
+{
+	if(_client.connected())
+	{
+		if(_state == MQTT_PROBING && !_probe.active())
+		{
+			LOG_INFO("MQTT session was not kept, subscribing again.");
+			subscribe();
+		}
+		return _state == MQTT_READY;
+	}
+
+	if(_state != MQTT_WAITING)
+	{
+		LOG_WARNING("MQTT connection lost, rc=%d.", _client.state());
+		_state = MQTT_WAITING;
+		_lostAt = millis();
+		Timers.stop(_retry);
+		Timers.stop(_probe);
+		_retryMs = 0;
+		_attempts = 0;
+	}
+
+	if(!mayConnect || _retry.active())
+		return false;
+
+	_attempts++;
+	if(!_client.connect(_id, _user, _password, nullptr, 0, false, nullptr, false))
+	{
+		_retryMs = _retryMs == 0 ? MQTT_RETRY_MIN_MS : 2*_retryMs;
+		if(_retryMs > MQTT_RETRY_MAX_MS)
+			_retryMs = MQTT_RETRY_MAX_MS;
+		uint32_t wait = _retryMs/2 + random(_retryMs/2 + 1);
+		Timers.start(_retry, wait);
+		LOG_ERROR("MQTT connect failed, rc=%d, retry in %lu ms.", _client.state(), (unsigned long)wait);
+		return false;
+	}
+
+	_connectedAt = millis();
+	_connections++;
+	if(!_subscribed)
+	{
+		subscribe();
+		return true;
+	}
+
+	// Comes back only if the broker kept the subscriptions
+	_state = MQTT_PROBING;
+	Timers.start(_probe, MQTT_PROBE_TIMEOUT_MS);
+	if(!_client.publish(_probeTopic, ""))
+		subscribe();
+	return _state == MQTT_READY;
+}
+
+bool MqttSession::handle(const char * topic)
+{
+	if(strcmp(topic, _probeTopic) != 0)
+		return false;
+
+	if(_state == MQTT_PROBING)
+		setReady(true);
+	return true;
+}
+
+void MqttSession::subscribe()
+{
+	_client.subscribe(_probeTopic);
+	if(_subscribe != nullptr)
+		_subscribe();
+	_subscribed = true;
+	setReady(false);
+}
+
+void MqttSession::setReady(bool sessionKept)
+{
+	_state = MQTT_READY;
+	Timers.stop(_probe);
+	_retryMs = 0;
+	_setupMs = millis() - _connectedAt;
+	_outageMs = millis() - _lostAt;
+	LOG_INFO("MQTT ready after %lu ms offline: %u attempts, %s in %lu ms.",
+		(unsigned long)_outageMs, _attempts, sessionKept ? "session kept" : "subscribed",
+		(unsigned long)_setupMs);
+}
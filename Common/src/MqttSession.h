@@ -0,0 +1,104 @@
+#ifndef MQTT_SESSION_H
+#define MQTT_SESSION_H
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include <TimerWheel.h>
+
+// Delay before the first retry, doubled after every failed connect up to
+// the maximum. Each delay is then drawn from its upper half (jitter).
+#ifndef MQTT_RETRY_MIN_MS
+#define MQTT_RETRY_MIN_MS 500
+#endif
+#ifndef MQTT_RETRY_MAX_MS
+#define MQTT_RETRY_MAX_MS 60000
+#endif
+// Longest a connect attempt may block, for the TCP connect and the CONNACK
+#ifndef MQTT_CONNECT_TIMEOUT_MS
+#define MQTT_CONNECT_TIMEOUT_MS 2000
+#endif
+// Time for the probe to come back before the subscriptions are replayed
+#ifndef MQTT_PROBE_TIMEOUT_MS
+#define MQTT_PROBE_TIMEOUT_MS 1000
+#endif
+// Probe topic, below the client id
+#define MQTT_PROBE_TOPIC "/session"
+#define MQTT_PROBE_TOPIC_SIZE 64
+
+/* MQTT connection kept up from loop() without blocking it.
+ *
+ * run() makes at most one connect attempt per call and only when the
+ * backoff timer has expired, so the rest of the loop keeps running while the
+ * broker is away. A connect still blocks, at most MQTT_CONNECT_TIMEOUT_MS.
+ *
+ * The client connects with cleanSession=false, so the broker keeps its
+ * subscriptions across reconnects. PubSubClient does not report whether
+ * the broker actually had the session, so after a reconnect the node
+ * publishes to its own probe topic: if the message comes back the
+ * subscriptions are there. Otherwise (broker restarted, or it does not
+ * keep sessions) the subscribe hook replays them. The first connect after
+ * boot always subscribes.
+ *
+ * The backoff and the probe timeout are deadlines on Timers, the loop has
+ * to run the wheel. */
+class MqttSession
+{
+public:
+	enum State : uint8_t
+	{
+		MQTT_WAITING = 0,	// Not connected, next attempt after the backoff
+		MQTT_PROBING,		// Connected, waiting for the probe
+		MQTT_READY			// Connected and subscribed
+	};
+
+	// Subscribes every topic of the node
+	typedef void (*SubscribeHook)();
+
+	MqttSession(PubSubClient & client) : _client(client) {}
+
+	// net: the client below PubSubClient, to shorten its connect timeout
+	void begin(Client & net, const char * id, const char * user, const char * password, SubscribeHook subscribe);
+
+	// Call on every loop. Connect attempts are skipped while mayConnect is
+	// false, e.g. while steps are due. Returns whether the client is ready.
+	bool run(bool mayConnect = true);
+
+	// Call first in the MQTT callback, true if the message was the probe
+	bool handle(const char * topic);
+
+	bool ready() { return _state == MQTT_READY; }
+	State state() { return _state; }
+
+	// Last time from losing the connection to ready, and from the CONNACK to
+	// ready (probe or subscriptions)
+	uint32_t outageMs() { return _outageMs; }
+	uint32_t setupMs() { return _setupMs; }
+	// Connect attempts in the last outage, and connections since boot
+	uint16_t attempts() { return _attempts; }
+	uint16_t connections() { return _connections; }
+
+private:
+	void subscribe();
+	void setReady(bool sessionKept);
+
+	PubSubClient & _client;
+	const char * _id = nullptr;
+	const char * _user = nullptr;
+	const char * _password = nullptr;
+	SubscribeHook _subscribe = nullptr;
+	char _probeTopic[MQTT_PROBE_TOPIC_SIZE] = {0};
+
+	State _state = MQTT_WAITING;
+	bool _subscribed = false;			// Subscriptions made at least once
+	uint32_t _retryMs = 0;
+	Timer _retry;						// Backoff, no attempt while active
+	Timer _probe;						// Probe timeout
+	unsigned long _lostAt = 0;
+	unsigned long _connectedAt = 0;
+	uint32_t _outageMs = 0;
+	uint32_t _setupMs = 0;
+	uint16_t _attempts = 0;
+	uint16_t _connections = 0;
+};
+
+#endif
@@ -0,0 +1,171 @@
+#include "RingLog.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+#if !defined(ESP8266)
+#define vsnprintf_P vsnprintf
+#endif
+
+RingLog::line_t RingLog::_ring[RING_LOG_SLOTS];
+uint8_t RingLog::_head = 0;
+uint8_t RingLog::_count = 0;
+
+uint8_t RingLog::_level = RingLog::LEVEL_INFO;
+Print * RingLog::_serial = nullptr;
+const char * RingLog::_prefix = nullptr;
+RingLog::Clock RingLog::_clock = nullptr;
+RingLog::Sink RingLog::_sink = nullptr;
+char RingLog::_topic[RING_LOG_TOPIC_SIZE] = "log";
+char RingLog::_batch[RING_LOG_BATCH_SIZE];
+unsigned long RingLog::_lastFlush = 0;
+
+uint32_t RingLog::_lines = 0;
+uint32_t RingLog::_dropped = 0;
+uint32_t RingLog::_unreported = 0;
+uint32_t RingLog::_unechoed = 0;
+uint32_t RingLog::_batches = 0;
+
+static const char * const LEVEL_NAMES[] = {"", "ERROR", "WARNING", "INFO", "DEBUG"};
+
+
+void RingLog::setSink(Sink sink, const char * topic)
+{
+	_sink = sink;
+	snprintf(_topic, sizeof(_topic), "%s", topic != nullptr ? topic : "log");
+}
+
+void RingLog::write(uint8_t level, const char * format, ...)
+{
+	if(level == LEVEL_SILENT || level > _level)
+		return;
+
+	_lines++;
+	if(_count == RING_LOG_SLOTS)
+	{
+		// Keeps the start of a burst, which is usually what explains it
+		_dropped++;
+		_unreported++;
+		_unechoed++;
+		return;
+	}
+
+	line_t & line = _ring[(_head + _count) % RING_LOG_SLOTS];
+	line.stamp = millis();
+	line.level = level;
+	line.echoed = false;
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf_P(line.text, sizeof(line.text), format, args);
+	va_end(args);
+
+	_count++;
+}
+
+
+size_t RingLog::header(const line_t & line, char * buf, size_t len)
+{
+	int n;
+	const char * name = LEVEL_NAMES[line.level <= LEVEL_DEBUG ? line.level : 0];
+	const char * prefix = _prefix != nullptr ? _prefix : "";
+	const char * separator = _prefix != nullptr ? ": " : "";
+
+	if(_clock != nullptr)
+	{
+		// The clock is read now, so step back by the age of the line
+		unsigned long t = _clock() - (millis() - line.stamp)/1000;
+		n = snprintf(buf, len, "%02lu:%02lu:%02lu [%s] %s%s",
+			(t/3600)%24, (t/60)%60, t%60, name, prefix, separator);
+	}
+	else
+	{
+		n = snprintf(buf, len, "%lu.%03lu [%s] %s%s",
+			line.stamp/1000, line.stamp%1000, name, prefix, separator);
+	}
+
+	if(n < 0)
+		return 0;
+	return (size_t)n < len ? n : len - 1;
+}
+
+bool RingLog::flush(bool force)
+{
+	if(_count == 0 && _unreported == 0)
+		return true;
+	if(!force && _count < RING_LOG_SLOTS/2 && millis() - _lastFlush < RING_LOG_FLUSH_MS)
+		return true;
+	_lastFlush = millis();
+
+	char head[48];
+
+	// Serial gets every line once, even if the sink refuses it
+	if(_serial != nullptr)
+	{
+		for(uint8_t i = 0; i < _count; i++)
+		{
+			line_t & line = _ring[(_head + i) % RING_LOG_SLOTS];
+			if(line.echoed)
+				continue;
+			header(line, head, sizeof(head));
+			_serial->print(head);
+			_serial->println(line.text);
+			line.echoed = true;
+		}
+		if(_unechoed > 0)
+		{
+			_serial->print(_unechoed);
+			_serial->println(" log lines dropped");
+		}
+	}
+	_unechoed = 0;
+
+	if(_sink == nullptr)
+	{
+		_head = (_head + _count) % RING_LOG_SLOTS;
+		_count = 0;
+		_unreported = 0;
+		return true;
+	}
+
+	// As many lines as fit into one payload, the rest goes with the next flush
+	size_t n = 0;
+	uint8_t taken = 0;
+
+	if(_unreported > 0)
+		n = snprintf(_batch, sizeof(_batch), "%lu log lines dropped\n", (unsigned long)_unreported);
+
+	while(taken < _count)
+	{
+		const line_t & line = _ring[(_head + taken) % RING_LOG_SLOTS];
+		size_t h = header(line, head, sizeof(head));
+		size_t t = strlen(line.text);
+		if(n + h + t + 2 > sizeof(_batch))
+			break;
+
+		memcpy(_batch + n, head, h);
+		memcpy(_batch + n + h, line.text, t);
+		n += h + t;
+		_batch[n++] = '\n';
+		taken++;
+	}
+	// No trailing newline
+	_batch[n > 0 ? n - 1 : 0] = '\0';
+
+	if(!_sink(_topic, _batch))
+	{
+		// Kept for the next flush, unless newer lines would be dropped for them
+		if(_count < RING_LOG_SLOTS)
+			return false;
+		_dropped += taken;
+		_unreported += taken;
+		_head = (_head + taken) % RING_LOG_SLOTS;
+		_count -= taken;
+		return false;
+	}
+
+	_head = (_head + taken) % RING_LOG_SLOTS;
+	_count -= taken;
+	_unreported = 0;
+	_batches++;
+	return true;
+}
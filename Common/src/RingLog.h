@@ -0,0 +1,145 @@
+#ifndef RING_LOG_H
+#define RING_LOG_H
+
+#include <Arduino.h>
+
+// Highest level compiled in: 0 silent, 1 error, 2 warning, 3 info, 4 debug.
+// Calls above it expand to nothing, their arguments are not even evaluated.
+// Define it before the first include to change it for a sketch.
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX 3
+#endif
+
+// Lines kept until the next flush, and the length of each formatted line
+#ifndef RING_LOG_SLOTS
+#define RING_LOG_SLOTS 16
+#endif
+#ifndef RING_LOG_LINE_SIZE
+#define RING_LOG_LINE_SIZE 96
+#endif
+// Largest payload published by one flush
+#ifndef RING_LOG_BATCH_SIZE
+#define RING_LOG_BATCH_SIZE 512
+#endif
+#define RING_LOG_TOPIC_SIZE 144
+// Minimum time between two flushes, unless the ring is half full. A gap
+// since the last flush rather than a deadline, so flush() checks it itself.
+#define RING_LOG_FLUSH_MS 100
+
+#ifndef PSTR
+#define PSTR(s) (s)
+#endif
+
+class Print;
+
+/* Log front end shared by all nodes.
+ *
+ * LOG_INFO("Window %u has no actuator.", w) formats straight into a fixed
+ * slot of a ring buffer: nothing is allocated, printed or published on the
+ * caller's path. flush(), called from loop(), echoes the pending lines to
+ * the serial port and publishes them joined by newlines as one MQTT message.
+ * If the ring is full new lines are dropped and counted; the next batch
+ * starts with the number of lines lost.
+ *
+ * Format strings stay in flash. Pass plain C strings to %s, e.g. with
+ * String::c_str(). */
+class RingLog
+{
+public:
+	enum Level : uint8_t
+	{
+		LEVEL_SILENT = 0,
+		LEVEL_ERROR,
+		LEVEL_WARNING,
+		LEVEL_INFO,
+		LEVEL_DEBUG
+	};
+
+	// Publishes a batch. Returns false to keep the lines for the next flush.
+	typedef bool (*Sink)(const char * topic, const char * payload);
+	// Seconds since the epoch, for timestamps
+	typedef unsigned long (*Clock)();
+
+	static void setLevel(uint8_t level) { _level = level; }
+	static uint8_t getLevel() { return _level; }
+	static bool enabled(uint8_t level) { return level <= _level; }
+
+	static void setSerial(Print * serial) { _serial = serial; }
+	// Kept by pointer, pass a literal
+	static void setPrefix(const char * prefix) { _prefix = prefix; }
+	static void setClock(Clock clock) { _clock = clock; }
+	// Lines written before a sink is set, or with nullptr, only go to serial
+	static void setSink(Sink sink, const char * topic = "log");
+
+	static void write(uint8_t level, const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+	// Sends the pending lines. Without force, waits RING_LOG_FLUSH_MS since
+	// the last flush unless the ring is half full. Returns false if the sink
+	// refused the batch.
+	static bool flush(bool force = false);
+
+	static uint8_t pending() { return _count; }
+	static uint32_t lines() { return _lines; }
+	static uint32_t dropped() { return _dropped; }
+	static uint32_t batches() { return _batches; }
+
+private:
+	typedef struct
+	{
+		unsigned long stamp;		// millis()
+		uint8_t level;
+		bool echoed;				// Already printed to serial
+		char text[RING_LOG_LINE_SIZE];
+	} line_t;
+
+	static size_t header(const line_t & line, char * buf, size_t len);
+
+	static line_t _ring[RING_LOG_SLOTS];
+	static uint8_t _head;
+	static uint8_t _count;
+
+	static uint8_t _level;
+	static Print * _serial;
+	static const char * _prefix;
+	static Clock _clock;
+	static Sink _sink;
+	static char _topic[RING_LOG_TOPIC_SIZE];
+	static char _batch[RING_LOG_BATCH_SIZE];
+	static unsigned long _lastFlush;
+
+	static uint32_t _lines;
+	static uint32_t _dropped;
+	static uint32_t _unreported;	// Dropped since the last batch
+	static uint32_t _unechoed;		// Dropped since the last serial output
+	static uint32_t _batches;
+};
+
+#if LOG_LEVEL_MAX >= 1
+#define LOG_ERROR(format, ...) do { if(RingLog::enabled(RingLog::LEVEL_ERROR)) \
+	RingLog::write(RingLog::LEVEL_ERROR, PSTR(format), ##__VA_ARGS__); } while(0)
+#else
+#define LOG_ERROR(format, ...) do {} while(0)
+#endif
+
+#if LOG_LEVEL_MAX >= 2
+#define LOG_WARNING(format, ...) do { if(RingLog::enabled(RingLog::LEVEL_WARNING)) \
+	RingLog::write(RingLog::LEVEL_WARNING, PSTR(format), ##__VA_ARGS__); } while(0)
+#else
+#define LOG_WARNING(format, ...) do {} while(0)
+#endif
+
+#if LOG_LEVEL_MAX >= 3
+#define LOG_INFO(format, ...) do { if(RingLog::enabled(RingLog::LEVEL_INFO)) \
+	RingLog::write(RingLog::LEVEL_INFO, PSTR(format), ##__VA_ARGS__); } while(0)
+#else
+#define LOG_INFO(format, ...) do {} while(0)
+#endif
+
+#if LOG_LEVEL_MAX >= 4
+#define LOG_DEBUG(format, ...) do { if(RingLog::enabled(RingLog::LEVEL_DEBUG)) \
+	RingLog::write(RingLog::LEVEL_DEBUG, PSTR(format), ##__VA_ARGS__); } while(0)
+#else
+#define LOG_DEBUG(format, ...) do {} while(0)
+#endif
+
+#endif
@@ -0,0 +1,102 @@
+#include "RtcState.h"
+#include <ConfigJournal.h>
+
+#if defined(ESP8266)
+#include <user_interface.h>
+#else
+static uint32_t _hostRtc[RTC_STATE_SIZE/4];
+#endif
+
+const char * RtcState::_err = "";
+
+static_assert(RTC_STATE_OFFSET*4 + RTC_STATE_SIZE <= 512, "RTC state does not fit the user RTC memory.");
+static_assert(RTC_STATE_MAX_LENGTH + 16 == RTC_STATE_SIZE, "RTC_STATE_MAX_LENGTH does not match the header.");
+
+// Records are moved through here, RTC memory is accessed in whole words
+static uint32_t _buf[RTC_STATE_SIZE/4];
+
+size_t RtcState::read(uint32_t version, void * data, size_t size)
+{
+	header_t * h = (header_t*)_buf;
+	if(!rtcRead(_buf, sizeof(header_t)) || (h->length <= RTC_STATE_MAX_LENGTH &&
+		!rtcRead(_buf, (sizeof(header_t) + h->length + 3) & ~3)))
+	{
+		_err = "Could not read the RTC memory.";
+		return 0;
+	}
+
+	if(h->magic != MAGIC || h->length > RTC_STATE_MAX_LENGTH || h->crc != ConfigJournal::crc32(
+		ConfigJournal::crc32(0, (const uint8_t*)h, offsetof(header_t, crc)), (const uint8_t*)(h + 1), h->length))
+	{
+		_err = "No RTC state.";
+		return 0;
+	}
+	if(h->version != version || h->length > size)
+	{
+		_err = "RTC state has another layout.";
+		return 0;
+	}
+
+	memcpy(data, h + 1, h->length);
+	return h->length;
+}
+
+bool RtcState::write(uint32_t version, const void * data, size_t length)
+{
+	header_t * h = (header_t*)_buf;
+	if(length > RTC_STATE_MAX_LENGTH)
+	{
+		_err = "RTC state is too long.";
+		return false;
+	}
+
+	h->magic = MAGIC;
+	h->version = version;
+	h->length = length;
+	h->crc = ConfigJournal::crc32(0, (const uint8_t*)h, offsetof(header_t, crc));
+	h->crc = ConfigJournal::crc32(h->crc, (const uint8_t*)data, length);
+	memcpy(h + 1, data, length);
+
+	if(!rtcWrite(_buf, (sizeof(header_t) + length + 3) & ~3))
+	{
+		_err = "Could not write the RTC memory.";
+		return false;
+	}
+	return true;
+}
+
+void RtcState::clear()
+{
+	header_t h;
+	memset(&h, 0, sizeof(h));
+	rtcWrite((const uint32_t*)&h, sizeof(h));
+}
+
+bool RtcState::woke()
+{
+#if defined(ESP8266)
+	return ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
+#else
+	return false;
+#endif
+}
+
+bool RtcState::rtcRead(uint32_t * data, size_t length)
+{
+#if defined(ESP8266)
+	return ESP.rtcUserMemoryRead(RTC_STATE_OFFSET, data, length);
+#else
+	memcpy(data, _hostRtc, length);
+	return true;
+#endif
+}
+
+bool RtcState::rtcWrite(const uint32_t * data, size_t length)
+{
+#if defined(ESP8266)
+	return ESP.rtcUserMemoryWrite(RTC_STATE_OFFSET, (uint32_t*)data, length);
+#else
+	memcpy(_hostRtc, data, length);
+	return true;
+#endif
+}
@@ -0,0 +1,53 @@
+#ifndef RTC_STATE_H
+#define RTC_STATE_H
+
+#include <Arduino.h>
+
+// User RTC memory of the ESP8266 is 512 bytes. The first 128 hold the
+// command of a pending OTA update, the state goes after them.
+#define RTC_STATE_OFFSET 32		// 4-byte blocks
+#define RTC_STATE_SIZE 384		// Bytes, header included
+// Longest record
+#define RTC_STATE_MAX_LENGTH (RTC_STATE_SIZE - 16)
+
+/* One record in RTC memory, which keeps its content through deep sleep but
+ * not through a power loss.
+ *
+ * A node that sleeps between two pieces of work keeps its state here, so a
+ * wake does not read the configuration journal. The record carries a magic
+ * number, a version, its length and a CRC-32: after a power-up, or with a
+ * firmware that changed the layout, read() finds nothing and the node boots
+ * as usual. On the host the record is kept in RAM. */
+class RtcState
+{
+public:
+	// Copies the record into data and returns its length. 0 if there is
+	// none, if it was written with another version or if it is longer than size.
+	static size_t read(uint32_t version, void * data, size_t size);
+	static bool write(uint32_t version, const void * data, size_t length);
+	// The next read() finds nothing
+	static void clear();
+
+	// This boot is a wake from deep sleep, not a power-up or a reset
+	static bool woke();
+
+	static const char * err() { return _err; }
+
+private:
+	typedef struct
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t length;
+		uint32_t crc;		// Over the fields above and the payload
+	} header_t;
+
+	static const uint32_t MAGIC = 0x52544353;
+
+	static bool rtcRead(uint32_t * data, size_t length);
+	static bool rtcWrite(const uint32_t * data, size_t length);
+
+	static const char * _err;
+};
+
+#endif
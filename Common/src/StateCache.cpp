@@ -0,0 +1,43 @@
+#include "StateCache.h"
+
+bool StateCache::update(uint8_t field, const char * value)
+{
+	if(field >= STATE_CACHE_FIELDS)
+		return true;
+
+	uint32_t h = hash(value);
+	if(known(field) && _hashes[field] == h)
+		return false;
+
+	_hashes[field] = h;
+	_known |= 1 << field;
+	return true;
+}
+
+void StateCache::forget(uint8_t field)
+{
+	if(field < STATE_CACHE_FIELDS)
+		_known &= ~(1 << field);
+}
+
+void StateCache::clear()
+{
+	_known = 0;
+}
+
+bool StateCache::known(uint8_t field) const
+{
+	return field < STATE_CACHE_FIELDS && (_known & (1 << field));
+}
+
+// FNV-1a
+uint32_t StateCache::hash(const char * value)
+{
+	uint32_t h = 2166136261UL;
+	while(*value)
+	{
+		h ^= (uint8_t)*value++;
+		h *= 16777619UL;
+	}
+	return h;
+}
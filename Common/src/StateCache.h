@@ -0,0 +1,38 @@
+#ifndef STATE_CACHE_H
+#define STATE_CACHE_H
+
+#include <Arduino.h>
+
+// Subtopic of the retained state topics, below the root topic of a service
+#define STATE_TOPIC "/state/"
+// Fields one cache can follow
+#define STATE_CACHE_FIELDS 16
+
+/* What a service last published to its retained <root>/state/<field>
+ * topics, so it republishes only the fields that changed.
+ *
+ * Only a 32-bit hash of each value is kept, not the value: a few bytes per
+ * field instead of a String on the heap. Two different values with the
+ * same hash would hide a change; the cache is cleared whenever the root
+ * topic changes or the client reconnects, which republishes everything. */
+class StateCache
+{
+public:
+	// Records value for field and returns true if it differs from the last one
+	bool update(uint8_t field, const char * value);
+
+	// The next update of field, or of every field, counts as a change
+	void forget(uint8_t field);
+	void clear();
+
+	// Whether field was published since the last clear()
+	bool known(uint8_t field) const;
+
+private:
+	static uint32_t hash(const char * value);
+
+	uint32_t _hashes[STATE_CACHE_FIELDS] = {0};
+	uint16_t _known = 0;
+};
+
+#endif
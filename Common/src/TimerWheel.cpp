@@ -0,0 +1,181 @@
+#include "TimerWheel.h"
+
+static_assert(TIMER_WHEEL_SLOTS <= 64, "The slot bitmaps of TimerWheel hold 64 slots.");
+static_assert(TIMER_WHEEL_LEVELS*TIMER_WHEEL_BITS < 32, "TimerWheel reaches past a timer delay.");
+
+TimerWheel Timers;
+
+Timer::~Timer()
+{
+	if(_wheel != nullptr)
+		_wheel->stop(*this);
+}
+
+uint64_t TimerWheel::now()
+{
+	static uint32_t last = 0;
+	static uint32_t wraps = 0;
+
+	uint32_t ms = (uint32_t)millis();
+	if(ms < last)
+		wraps++;
+	last = ms;
+	return ((uint64_t)wraps << 32) | ms;
+}
+
+void TimerWheel::start(Timer & timer, uint32_t delay, uint32_t period)
+{
+	if(timer._wheel != nullptr)
+		timer._wheel->remove(timer);
+
+	timer._expires = now() + delay;
+	// Never into the slot being expired, nor behind the wheel
+	if(timer._expires <= _time)
+		timer._expires = _time + 1;
+	timer._period = period;
+	insert(timer);
+}
+
+void TimerWheel::stop(Timer & timer)
+{
+	if(timer._wheel == this)
+		remove(timer);
+}
+
+uint32_t TimerWheel::remaining(const Timer & timer)
+{
+	if(timer._wheel != this)
+		return 0;
+	uint64_t time = now();
+	return timer._expires > time ? (uint32_t)(timer._expires - time) : 0;
+}
+
+void TimerWheel::advance(uint64_t time)
+{
+	_target = time;
+	while(_time < time)
+	{
+		// Nothing happens before the next event, so the wheel jumps to it
+		uint64_t next = _count > 0 ? nextEvent() : time;
+		if(next > time)
+		{
+			_time = time;
+			break;
+		}
+		_time = next;
+		tick();
+	}
+}
+
+void TimerWheel::insert(Timer & timer)
+{
+	// 0 only for a timer cascading on its own tick, it expires in this one
+	uint64_t delta = timer._expires - _time;
+	uint8_t level = 0;
+	while(level < TIMER_WHEEL_LEVELS - 1 && (delta >> (TIMER_WHEEL_BITS*(level + 1))) != 0)
+		level++;
+
+	// Beyond the last level: parked in its farthest slot, placed again from there
+	uint64_t at = timer._expires;
+	if((delta >> (TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS)) != 0)
+		at = _time + ((uint64_t)1 << (TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS)) - 1;
+
+	uint8_t slot = (at >> (TIMER_WHEEL_BITS*level)) & MASK;
+	Timer *& head = _slots[level][slot];
+	timer._wheel = this;
+	timer._level = level;
+	timer._slot = slot;
+	timer._prev = nullptr;
+	timer._next = head;
+	if(head != nullptr)
+		head->_prev = &timer;
+	head = &timer;
+	_used[level] |= (uint64_t)1 << slot;
+	_count++;
+}
+
+void TimerWheel::remove(Timer & timer)
+{
+	if(timer._prev != nullptr)
+		timer._prev->_next = timer._next;
+	else
+		_slots[timer._level][timer._slot] = timer._next;
+	if(timer._next != nullptr)
+		timer._next->_prev = timer._prev;
+	if(_slots[timer._level][timer._slot] == nullptr)
+		_used[timer._level] &= ~((uint64_t)1 << timer._slot);
+
+	timer._wheel = nullptr;
+	timer._next = timer._prev = nullptr;
+	_count--;
+}
+
+// Handles tick _time: the slots of the upper levels that start on it move
+// down, then the level 0 slot expires
+void TimerWheel::tick()
+{
+	for(uint8_t level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+	{
+		uint8_t shift = TIMER_WHEEL_BITS*level;
+		if((_time & (((uint64_t)1 << shift) - 1)) == 0)
+			cascade(level, (_time >> shift) & MASK);
+	}
+	expire(_time & MASK);
+}
+
+void TimerWheel::cascade(uint8_t level, uint8_t slot)
+{
+	Timer * timer = _slots[level][slot];
+	_slots[level][slot] = nullptr;
+	_used[level] &= ~((uint64_t)1 << slot);
+
+	while(timer != nullptr)
+	{
+		Timer * next = timer->_next;
+		_count--;
+		insert(*timer);
+		timer = next;
+	}
+}
+
+void TimerWheel::expire(uint8_t slot)
+{
+	// One at a time, a callback may stop any other timer of the slot
+	while(_slots[0][slot] != nullptr)
+	{
+		Timer & timer = *_slots[0][slot];
+		remove(timer);
+
+		if(timer._period != 0)
+		{
+			timer._expires += timer._period;
+			if(timer._expires <= _target)
+				timer._expires += ((_target - timer._expires)/timer._period + 1)*timer._period;
+			insert(timer);
+		}
+		if(timer._callback != nullptr)
+			timer._callback(timer._ctx);
+	}
+}
+
+// Tick of the next expiry or cascade. The lowest level holding timers has
+// it: either its next slot in use in this turn, or the start of its next
+// turn, which comes before anything of the levels above.
+uint64_t TimerWheel::nextEvent()
+{
+	for(uint8_t level = 0; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		if(_used[level] == 0)
+			continue;
+
+		uint8_t shift = TIMER_WHEEL_BITS*level;
+		uint64_t turn = (_time >> shift) & ~MASK;
+		uint8_t index = (_time >> shift) & MASK;
+		// Slots up to index are in the next turn
+		uint64_t ahead = index == MASK ? 0 : _used[level] & (~(uint64_t)0 << (index + 1));
+		if(ahead != 0)
+			return (turn + __builtin_ctzll(ahead)) << shift;
+		return (turn + TIMER_WHEEL_SLOTS) << shift;
+	}
+	return _target;
+}
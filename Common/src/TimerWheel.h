@@ -0,0 +1,108 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <Arduino.h>
+
+// Slots per level are 1 << TIMER_WHEEL_BITS, a tick is 1 ms. Four levels of
+// 64 slots reach 2^24 ms (4.6 h) ahead, later timers are placed again.
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+class TimerWheel;
+
+/* Periodic or one-shot piece of work, owned by the caller and linked into
+ * the wheel while it is armed, so arming never allocates. Without a
+ * callback a timer is a deadline: it stays active() until it expires. */
+class Timer
+{
+public:
+	typedef void (*Callback)(void * ctx);
+
+	Timer(Callback callback = nullptr, void * ctx = nullptr) : _callback(callback), _ctx(ctx) {}
+	~Timer();
+	// The wheel links to the timer itself
+	Timer(const Timer &) = delete;
+	Timer & operator=(const Timer &) = delete;
+
+	bool active() const { return _wheel != nullptr; }
+	// ms on the TimerWheel::now() clock, of the next expiry if active
+	uint64_t expires() const { return _expires; }
+	uint32_t period() const { return _period; }
+
+private:
+	friend class TimerWheel;
+
+	TimerWheel * _wheel = nullptr;
+	Timer * _next = nullptr;
+	Timer * _prev = nullptr;
+	uint64_t _expires = 0;
+	uint32_t _period = 0;
+	Callback _callback;
+	void * _ctx;
+	uint8_t _level = 0;
+	uint8_t _slot = 0;
+};
+
+/* Hierarchical timer wheel every periodic and timeout piece of work of a
+ * node registers with, instead of comparing millis() in its own loop.
+ *
+ * Level 0 has a slot per millisecond, each level above has slots as long as
+ * a whole turn of the one below. A timer goes into the lowest level whose
+ * turn reaches its expiry, and moves down a level when the wheel gets to
+ * its slot (cascade). Starting and stopping a timer is O(1); so is each
+ * expiry, apart from the cascades a timer goes through, at most one per
+ * level. A bitmap of the slots in use lets the wheel jump over empty ones,
+ * so a loop that stalled, or a host that skips ahead, costs no more than
+ * the timers that are actually due.
+ *
+ * Time is counted in 64 bits on the millis() clock, so it never wraps. On
+ * the host that clock is the virtual one of the simulation: the wheel runs
+ * unchanged, and advance() moves it to any time. */
+class TimerWheel
+{
+public:
+	// ms since boot. Follows the wraps of millis() as long as it is called
+	// at least once per turn of it, 49 days: run() does.
+	static uint64_t now();
+
+	// Arms timer to expire in delay ms, then every period ms unless period is
+	// 0. An active timer is moved. It expires on the first run() after the
+	// delay, one tick later at the earliest.
+	void start(Timer & timer, uint32_t delay, uint32_t period = 0);
+	void stop(Timer & timer);
+	// ms until timer expires, 0 if it is not active
+	uint32_t remaining(const Timer & timer);
+
+	// Calls the callbacks of the timers that expired, in the order they
+	// expired. A periodic timer is armed again before its callback; if it
+	// fell behind by whole periods, those are skipped. Call on every loop.
+	void run() { advance(now()); }
+	// Moves the wheel to time (ms), expiring the timers on the way
+	void advance(uint64_t time);
+
+	uint16_t count() const { return _count; }
+	// Time the wheel has been moved to, ms
+	uint64_t time() const { return _time; }
+
+private:
+	static const uint64_t MASK = TIMER_WHEEL_SLOTS - 1;
+
+	void insert(Timer & timer);
+	void remove(Timer & timer);
+	void tick();
+	void cascade(uint8_t level, uint8_t slot);
+	void expire(uint8_t slot);
+	uint64_t nextEvent();
+
+	Timer * _slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS] = {};
+	uint64_t _used[TIMER_WHEEL_LEVELS] = {};	// Bitmaps of the slots with timers
+	uint64_t _time = 0;		// Last tick handled
+	uint64_t _target = 0;	// Of the running advance()
+	uint16_t _count = 0;
+};
+
+// The wheel of the node, zero-initialized so it can be used from any constructor
+extern TimerWheel Timers;
+
+#endif
@@ -0,0 +1,64 @@
+#include "TopicAlias.h"
+
+void TopicAlias::clear()
+{
+	memset(_command, 0xFF, sizeof(_command));
+	_count = 0;
+}
+
+uint8_t TopicAlias::accept(const char * reply, uint8_t count)
+{
+	clear();
+	const char * p = reply;
+	for(uint8_t i = 0; i < count && *p != '\0'; i++)
+	{
+		char * end;
+		unsigned long id = strtoul(p, &end, 10);
+		if(end == p)
+			break;
+		p = end;
+
+		if(id == 0 || id > ALIAS_MAX || _command[id] != 0xFF)
+			continue;
+		_command[id] = i;
+		_count++;
+	}
+	return _count;
+}
+
+int TopicAlias::command(const char * topic) const
+{
+	uint8_t id = parse(topic);
+	return id != 0 && _command[id] != 0xFF ? _command[id] : -1;
+}
+
+uint8_t TopicAlias::id(uint8_t command) const
+{
+	for(uint8_t id = 1; id <= ALIAS_MAX; id++)
+	{
+		if(_command[id] == command)
+			return id;
+	}
+	return 0;
+}
+
+uint8_t TopicAlias::parse(const char * topic)
+{
+	if(topic[0] != ALIAS_PREFIX || topic[1] < '1' || topic[1] > '9')
+		return 0;
+
+	unsigned id = 0;
+	for(const char * p = topic + 1; *p != '\0'; p++)
+	{
+		if(*p < '0' || *p > '9' || p - topic >= ALIAS_TOPIC_SIZE - 1)
+			return 0;
+		id = 10*id + (*p - '0');
+	}
+	return id <= ALIAS_MAX ? id : 0;
+}
+
+const char * TopicAlias::print(uint8_t id, char * buf, size_t size)
+{
+	snprintf(buf, size, "%c%u", ALIAS_PREFIX, id);
+	return buf;
+}
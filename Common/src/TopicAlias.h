@@ -0,0 +1,64 @@
+#ifndef TOPIC_ALIAS_H
+#define TOPIC_ALIAS_H
+
+#include <Arduino.h>
+
+// Aliases one broker hands out, ids 1 to ALIAS_MAX (0: none)
+#ifndef ALIAS_MAX
+#define ALIAS_MAX 64
+#endif
+// Alias topics are the prefix followed by the id, e.g. "~12"
+#define ALIAS_PREFIX '~'
+// Longest alias topic, terminator included
+#define ALIAS_TOPIC_SIZE 6
+// Topics one request may hold, and the longest reply to it
+#define ALIAS_REQUEST_TOPICS 128
+#define ALIAS_REPLY_SIZE (4*ALIAS_REQUEST_TOPICS)
+// Devices ask the broker for aliases here
+#define ALIAS_REGISTER_TOPIC "alias/register"
+
+/* Short numeric aliases for the topics of a device, in the spirit of the
+ * topic aliases of MQTT 5, which neither uMQTTBroker nor PubSubClient speak.
+ *
+ * A device publishes the topics it wants aliases for to ALIAS_REGISTER_TOPIC,
+ * one per line after the topic the reply goes to:
+ *   SWALPHA01/alias\nSWALPHA01/open\nSWALPHA01/close
+ * The broker answers with the ids in the same order, 0 for a topic it has
+ * no alias for (wildcards, too long, table full):
+ *   3 4
+ * From then on the device subscribes and publishes to "~3" instead of
+ * SWALPHA01/open. The broker bridges both forms, so clients that do not
+ * use aliases keep working. Ids hold until the broker restarts; devices
+ * register again whenever their subscriptions were lost.
+ *
+ * On the device a TopicAlias maps each id to the index of a command, so
+ * dispatching a message takes parsing the id and an array lookup instead of
+ * comparing strings. */
+class TopicAlias
+{
+public:
+	TopicAlias() { clear(); }
+
+	void clear();
+
+	// Reply to a request of count topics: the i-th id goes to command i.
+	// Replaces the aliases before and returns how many there are now.
+	uint8_t accept(const char * reply, uint8_t count);
+
+	// Command of an alias topic, -1 if topic is none of ours
+	int command(const char * topic) const;
+	// Alias id of command, 0 if it has none
+	uint8_t id(uint8_t command) const;
+	uint8_t count() const { return _count; }
+
+	// Id of an alias topic, 0 if topic is none
+	static uint8_t parse(const char * topic);
+	// Alias topic of id in buf, which it returns
+	static const char * print(uint8_t id, char * buf, size_t size);
+
+private:
+	uint8_t _command[ALIAS_MAX + 1];	// By id, 0xFF if unused
+	uint8_t _count;
+};
+
+#endif
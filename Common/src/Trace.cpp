@@ -0,0 +1,64 @@
+#include "Trace.h"
+
+// Keys in the order they are printed, with the member they map to
+static const struct
+{
+	const char * key;
+	uint32_t trace_t::* member;
+} TRACE_FIELDS[] =
+{
+	{"id", &trace_t::id},
+	{"fetch", &trace_t::fetch},
+	{"pub", &trace_t::publish},
+	{"decide", &trace_t::decide},
+	{"recv", &trace_t::received},
+	{"start", &trace_t::started},
+	{"end", &trace_t::finished}
+};
+
+
+bool Trace::read(JsonVariantConst obj, trace_t & t)
+{
+	t = trace_t();
+	if(!obj.is<JsonObjectConst>())
+		return false;
+
+	for(const auto & f : TRACE_FIELDS)
+		t.*f.member = obj[f.key] | (uint32_t)0;
+	return t.id != 0;
+}
+
+bool Trace::parse(const char * json, trace_t & t)
+{
+	// Keys are copied out of the payload
+	StaticJsonDocument<JSON_OBJECT_SIZE(sizeof(TRACE_FIELDS)/sizeof(TRACE_FIELDS[0])) + 64> doc;
+
+	t = trace_t();
+	if(json == nullptr || json[0] != '{' || deserializeJson(doc, json))
+		return false;
+	return read(doc.as<JsonVariantConst>(), t);
+}
+
+size_t Trace::print(const trace_t & t, char * buf, size_t len)
+{
+	size_t n = 0;
+
+	for(const auto & f : TRACE_FIELDS)
+	{
+		uint32_t value = t.*f.member;
+		// Stamps not taken yet are left out, the id never is
+		if(value == 0 && f.member != &trace_t::id)
+			continue;
+
+		int w = snprintf(buf + n, len - n, "%c\"%s\":%lu", n == 0 ? '{' : ',', f.key, (unsigned long)value);
+		if(w < 0 || (size_t)w >= len - n)
+			return 0;
+		n += w;
+	}
+
+	if(n + 2 > len)
+		return 0;
+	buf[n++] = '}';
+	buf[n] = '\0';
+	return n;
+}
@@ -0,0 +1,44 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Topic SmartWindow reports finished traces to, below its root topic
+#define TRACE_TOPIC "/trace"
+// Longest trace_t printed as JSON, terminator included
+#define TRACE_JSON_SIZE 128
+
+/* Latency trace of one weather decision, from the fetch on WeatherClient to
+ * the end of the window move it caused.
+ *
+ * The record travels inside the payloads: WeatherClient adds it to the
+ * weather JSON as "trace", the broker sends it as the payload of the
+ * open/close command and SmartWindow publishes the completed record to
+ * <root>/trace. Each node stamps its fields with its own millis(), so
+ * differences are exact within a node. Simulation/src/trace_report.cpp
+ * aligns the nodes with the time it received the messages. */
+typedef struct
+{
+	uint32_t id = 0;			// 0: not traced
+	uint32_t fetch = 0;			// WeatherClient: request sent
+	uint32_t publish = 0;		// WeatherClient: weather published
+	uint32_t decide = 0;		// Broker: command published
+	uint32_t received = 0;		// SmartWindow: command received
+	uint32_t started = 0;		// SmartWindow: move started
+	uint32_t finished = 0;		// SmartWindow: move finished
+} trace_t;
+
+class Trace
+{
+public:
+	// Fills t from a JSON object, false if it carries no trace id
+	static bool read(JsonVariantConst obj, trace_t & t);
+	// Same from a payload, which may also be empty or plain text
+	static bool parse(const char * json, trace_t & t);
+
+	// JSON object with the id and the stamps taken so far
+	static size_t print(const trace_t & t, char * buf, size_t len);
+};
+
+#endif
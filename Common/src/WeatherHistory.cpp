@@ -0,0 +1,126 @@
+#include "WeatherHistory.h"
+
+static const char * const WEATHER_METRIC_NAMES[WEATHER_METRICS] = {"temp", "wind", "humidity"};
+
+WeatherHistory::WeatherHistory(uint32_t windowS)
+	: _windowMs(windowS*1000)
+{
+	clear();
+}
+
+void WeatherHistory::clear()
+{
+	memset(_min, 0, sizeof(_min));
+	memset(_max, 0, sizeof(_max));
+	memset(_sum, 0, sizeof(_sum));
+	_head = 0;
+	_count = 0;
+}
+
+void WeatherHistory::pop()
+{
+	for(uint8_t m = 0; m < WEATHER_METRICS; m++)
+	{
+		// The oldest sample is at the front of a queue if it is in it at all
+		if(_min[m].size > 0 && at(_min[m], 0) == _head)
+		{
+			_min[m].head = (_min[m].head + 1) % WEATHER_HISTORY_SIZE;
+			_min[m].size--;
+		}
+		if(_max[m].size > 0 && at(_max[m], 0) == _head)
+		{
+			_max[m].head = (_max[m].head + 1) % WEATHER_HISTORY_SIZE;
+			_max[m].size--;
+		}
+		_sum[m] -= _values[m][_head];
+	}
+
+	_head = (_head + 1) % WEATHER_HISTORY_SIZE;
+	_count--;
+	// No rounding left over once empty
+	if(_count == 0)
+		memset(_sum, 0, sizeof(_sum));
+}
+
+void WeatherHistory::expire(unsigned long now)
+{
+	while(_count > 0 && now - _times[_head] > _windowMs)
+		pop();
+}
+
+void WeatherHistory::add(float temp, float wind, float humidity, unsigned long now)
+{
+	expire(now);
+	if(_count == WEATHER_HISTORY_SIZE)
+		pop();
+
+	uint8_t i = (_head + _count) % WEATHER_HISTORY_SIZE;
+	const float values[WEATHER_METRICS] = {temp, wind, humidity};
+	_times[i] = now;
+	_count++;
+
+	for(uint8_t m = 0; m < WEATHER_METRICS; m++)
+	{
+		float v = values[m];
+		_values[m][i] = v;
+		_sum[m] += v;
+
+		queue_t & lo = _min[m];
+		while(lo.size > 0 && _values[m][back(lo)] >= v)
+			lo.size--;
+		lo.index[(lo.head + lo.size++) % WEATHER_HISTORY_SIZE] = i;
+
+		queue_t & hi = _max[m];
+		while(hi.size > 0 && _values[m][back(hi)] <= v)
+			hi.size--;
+		hi.index[(hi.head + hi.size++) % WEATHER_HISTORY_SIZE] = i;
+	}
+}
+
+uint32_t WeatherHistory::span() const
+{
+	if(_count == 0)
+		return 0;
+	return (_times[(_head + _count - 1) % WEATHER_HISTORY_SIZE] - _times[_head])/1000;
+}
+
+float WeatherHistory::min(uint8_t metric) const
+{
+	if(_count == 0 || metric >= WEATHER_METRICS)
+		return 0;
+	return _values[metric][at(_min[metric], 0)];
+}
+
+float WeatherHistory::max(uint8_t metric) const
+{
+	if(_count == 0 || metric >= WEATHER_METRICS)
+		return 0;
+	return _values[metric][at(_max[metric], 0)];
+}
+
+float WeatherHistory::mean(uint8_t metric) const
+{
+	if(_count == 0 || metric >= WEATHER_METRICS)
+		return 0;
+	return _sum[metric]/_count;
+}
+
+size_t WeatherHistory::print(char * buf, size_t len) const
+{
+	int n = snprintf(buf, len, "{\"window\":%lu,\"span\":%lu,\"n\":%u",
+		(unsigned long)window(), (unsigned long)span(), _count);
+
+	for(uint8_t m = 0; m < WEATHER_METRICS && _count > 0; m++)
+	{
+		if(n < 0 || (size_t)n >= len)
+			return 0;
+		n += snprintf(buf + n, len - n, ",\"%s\":{\"min\":%.2f,\"max\":%.2f,\"mean\":%.2f}",
+			WEATHER_METRIC_NAMES[m], min(m), max(m), mean(m));
+	}
+
+	if(n < 0 || (size_t)n + 2 > len)
+		return 0;
+	buf[n++] = '}';
+	buf[n] = '\0';
+	return n;
+}
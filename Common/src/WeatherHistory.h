@@ -0,0 +1,87 @@
+#ifndef WEATHER_HISTORY_H
+#define WEATHER_HISTORY_H
+
+#include <Arduino.h>
+
+// Weather reports kept, at the default period of 1 min a bit over an hour
+#ifndef WEATHER_HISTORY_SIZE
+#define WEATHER_HISTORY_SIZE 64
+#endif
+// Default time the aggregates cover
+#define WEATHER_HISTORY_WINDOW_S (30*60UL)
+// Subtopic of the retained aggregates, below the root topic of a service
+#define HISTORY_TOPIC "/history"
+// Longest WeatherHistory::print() output, terminator included
+#define WEATHER_HISTORY_JSON_SIZE 320
+
+enum WeatherMetric : uint8_t
+{
+	WEATHER_TEMP = 0,		// Degree Celsius
+	WEATHER_WIND,			// m/s
+	WEATHER_HUMIDITY,		// %
+	WEATHER_METRICS
+};
+
+/* Rolling minimum, maximum and mean of the recent weather reports.
+ *
+ * Samples older than the window, or beyond WEATHER_HISTORY_SIZE, drop out
+ * of a ring. Per metric a running sum gives the mean, and two monotonic
+ * queues of ring indices give the extremes: the minimum queue only keeps
+ * samples smaller than every newer one, so its front is the minimum, and
+ * the maximum queue alike. Adding a sample pops the queue back while it
+ * beats it and expiring one pops the front if it is there, so every sample
+ * enters and leaves each queue once: O(1) per report, no sorting, nothing
+ * allocated. */
+class WeatherHistory
+{
+public:
+	WeatherHistory(uint32_t windowS = WEATHER_HISTORY_WINDOW_S);
+
+	// Time the aggregates cover; older samples drop out on the next add()
+	void setWindow(uint32_t seconds) { _windowMs = seconds*1000; }
+	uint32_t window() const { return _windowMs/1000; }
+
+	void add(float temp, float wind, float humidity, unsigned long now);
+	// Drops the samples older than the window
+	void expire(unsigned long now);
+	void clear();
+
+	uint8_t count() const { return _count; }
+	// Seconds between the oldest and the newest sample
+	uint32_t span() const;
+
+	// 0 while there are no samples
+	float min(uint8_t metric) const;
+	float max(uint8_t metric) const;
+	float mean(uint8_t metric) const;
+
+	// {"window":..,"span":..,"n":..,"temp":{"min":..,"max":..,"mean":..},"wind":{..},"humidity":{..}},
+	// the metrics only if there are samples
+	size_t print(char * buf, size_t len) const;
+
+private:
+	// Ring indices, oldest first
+	typedef struct
+	{
+		uint8_t index[WEATHER_HISTORY_SIZE];
+		uint8_t head;
+		uint8_t size;
+	} queue_t;
+
+	static uint8_t at(const queue_t & q, uint8_t i) { return q.index[(q.head + i) % WEATHER_HISTORY_SIZE]; }
+	static uint8_t back(const queue_t & q) { return at(q, q.size - 1); }
+
+	// Drops the oldest sample
+	void pop();
+
+	unsigned long _times[WEATHER_HISTORY_SIZE];
+	float _values[WEATHER_METRICS][WEATHER_HISTORY_SIZE];
+	queue_t _min[WEATHER_METRICS];		// Values rise from the front
+	queue_t _max[WEATHER_METRICS];		// Values fall from the front
+	double _sum[WEATHER_METRICS];
+	uint8_t _head;						// Oldest sample
+	uint8_t _count;
+	uint32_t _windowMs;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include "WiFiJoin.h"
+#include <ESP8266WiFi.h>
+#include <ConfigJournal.h>
+#include <RingLog.h>
+
+const char * WiFiJoin::_ssid = nullptr;
+const char * WiFiJoin::_psk = nullptr;
+WiFiJoin::State WiFiJoin::_state = WiFiJoin::WIFI_IDLE;
+bool WiFiJoin::_fast = false;
+bool WiFiJoin::_journal = true;
+unsigned long WiFiJoin::_since = 0;
+Timer WiFiJoin::_fastTimeout;
+
+void WiFiJoin::begin(const char * network, const char * password, const ap_t * ap)
+{
+	_ssid = network;
+	_psk = password;
+	_fast = false;
+	_journal = ap == nullptr;
+	_since = millis();
+
+	WiFi.mode(WIFI_STA);
+
+	ap_t cache;
+	if(ap == nullptr && ConfigStore.read(JOURNAL_ID_WIFI, WIFI_JOIN_RECORD_VERSION, &cache, sizeof(cache)))
+		ap = &cache;
+	if(ap != nullptr && strncmp(ap->network, network, sizeof(ap->network)) == 0)
+	{
+		LOG_INFO("Connecting to %s on channel %ld.", network, (long)ap->channel);
+		WiFi.begin(network, password, ap->channel, ap->bssid);
+		_state = WIFI_FAST;
+		Timers.start(_fastTimeout, WIFI_JOIN_FAST_TIMEOUT_MS);
+		return;
+	}
+
+	LOG_INFO("Connecting to %s", network);
+	WiFi.begin(network, password);
+	_state = WIFI_SCAN;
+}
+
+bool WiFiJoin::run()
+{
+	if(_state == WIFI_CONNECTED || _state == WIFI_IDLE)
+		return WiFi.status() == WL_CONNECTED;
+
+	if(WiFi.status() == WL_CONNECTED)
+	{
+		_fast = _state == WIFI_FAST;
+		_state = WIFI_CONNECTED;
+		Timers.stop(_fastTimeout);
+		LOG_INFO("WiFi connected in %lu ms%s.", millis() - _since, _fast ? " (cached access point)" : "");
+		if(_journal)
+			save();
+		return true;
+	}
+
+	if(_state == WIFI_FAST && !_fastTimeout.active())
+	{
+		LOG_WARNING("Cached access point did not answer, scanning.");
+		WiFi.disconnect();
+		WiFi.begin(_ssid, _psk);
+		_state = WIFI_SCAN;
+	}
+	return false;
+}
+
+void WiFiJoin::current(ap_t & ap)
+{
+	// Zeroed so unused bytes never make an unchanged record look dirty
+	memset(&ap, 0, sizeof(ap));
+	strlcpy(ap.network, _ssid, sizeof(ap.network));
+	memcpy(ap.bssid, WiFi.BSSID(), sizeof(ap.bssid));
+	ap.channel = WiFi.channel();
+}
+
+void WiFiJoin::save()
+{
+	ap_t cache;
+	current(cache);
+
+	if(ConfigStore.write(JOURNAL_ID_WIFI, WIFI_JOIN_RECORD_VERSION, &cache, sizeof(cache)) == ConfigJournal::JOURNAL_ERROR)
+		LOG_WARNING("Could not cache the access point: %s", ConfigStore.err());
+}
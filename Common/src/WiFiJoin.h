@@ -0,0 +1,70 @@
+#ifndef WIFI_JOIN_H
+#define WIFI_JOIN_H
+
+#include <Arduino.h>
+#include <TimerWheel.h>
+
+// Time the cached access point gets before falling back to a full scan
+#ifndef WIFI_JOIN_FAST_TIMEOUT_MS
+#define WIFI_JOIN_FAST_TIMEOUT_MS 3000
+#endif
+// Bump whenever the cached record changes
+#define WIFI_JOIN_RECORD_VERSION 1
+
+/* Joins the WiFi network from loop() instead of waiting in setup().
+ *
+ * The BSSID and channel of the last access point are kept in the
+ * configuration journal. With them the station skips the channel scan,
+ * which takes most of a normal join. If that access point does not answer
+ * within WIFI_JOIN_FAST_TIMEOUT_MS, the join starts over with a scan. The
+ * record is written only when the access point changed.
+ *
+ * A node waking from deep sleep passes the access point it kept in RTC
+ * memory instead, so the join does not touch the flash at all. */
+class WiFiJoin
+{
+public:
+	enum State : uint8_t
+	{
+		WIFI_IDLE = 0,
+		WIFI_FAST,			// Joining the cached access point
+		WIFI_SCAN,			// Joining after a full scan
+		WIFI_CONNECTED
+	};
+
+	// Access point the station joined, the record of the journal
+	typedef struct
+	{
+		char network[33];		// SSID, the sketches define ssid as a macro
+		uint8_t bssid[6];
+		int32_t channel;
+	} ap_t;
+
+	// Starts joining, both strings must outlive the join. The sketches
+	// define ssid and psk as macros, hence the names. Without ap the cached
+	// access point is read from the journal, and saved once connected.
+	static void begin(const char * network, const char * password, const ap_t * ap = nullptr);
+
+	// Access point of the connection, zeroed past the strings
+	static void current(ap_t & ap);
+
+	// Call on every loop, returns whether the station is connected
+	static bool run();
+
+	static State state() { return _state; }
+	// Connected through the cached access point
+	static bool fast() { return _fast; }
+
+private:
+	static void save();
+
+	static const char * _ssid;
+	static const char * _psk;
+	static State _state;
+	static bool _fast;
+	static bool _journal;		// The cache is kept in the journal
+	static unsigned long _since;
+	static Timer _fastTimeout;	// On Timers, while joining the cached access point
+};
+
+#endif
@@ -0,0 +1,434 @@
+#include "WindowRule.h"
+
+char WindowRule::_error[RULE_ERROR_SIZE] = "";
+
+static const char * const RULE_VAR_NAMES[] = {"id", "temp", "wind", "humidity"};
+static const char * const RULE_AGGREGATES[] = {"min", "max", "mean"};
+
+void WindowRule::clear()
+{
+	// Zeroed so an unchanged rule never makes a saved record look dirty
+	memset(&_program, 0, sizeof(_program));
+}
+
+int8_t WindowRule::effect(uint8_t op)
+{
+	switch(op)
+	{
+	case RULE_OP_CONST:
+	case RULE_OP_VAR:
+	case RULE_OP_RAIN:
+		return 1;
+	case RULE_OP_IN:
+		return -2;
+	case RULE_OP_NOT:
+	case RULE_OP_END:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+uint8_t WindowRule::operandSize(uint8_t op)
+{
+	switch(op)
+	{
+	case RULE_OP_CONST:
+		return sizeof(float);
+	case RULE_OP_VAR:
+	case RULE_OP_RAIN:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+bool WindowRule::compile(const char * source)
+{
+	program_t hold = _program;
+	clear();
+	_error[0] = '\0';
+
+	if(strlen(source) >= RULE_SOURCE_SIZE)
+	{
+		snprintf(_error, sizeof(_error), "Rule is longer than %u characters.", RULE_SOURCE_SIZE - 1);
+		_program = hold;
+		return false;
+	}
+	strcpy(_program.source, source);
+
+	_src = source;
+	_pos = source;
+	_depth = 0;
+	_maxDepth = 0;
+	_nesting = 0;
+
+	skipSpace();
+	if(*_pos == '\0')
+	{
+		// No rule
+		clear();
+		return true;
+	}
+
+	bool ok = parseOr();
+	skipSpace();
+	if(ok && *_pos != '\0')
+		ok = fail("expected && or ||");
+	if(ok)
+		ok = emit(RULE_OP_END);
+
+	if(!ok)
+	{
+		_program = hold;
+		return false;
+	}
+	return true;
+}
+
+bool WindowRule::load(const program_t & program)
+{
+	if(!verify(program))
+	{
+		snprintf(_error, sizeof(_error), "Saved rule code is invalid.");
+		return false;
+	}
+
+	_program = program;
+	_program.source[RULE_SOURCE_SIZE-1] = '\0';
+	return true;
+}
+
+bool WindowRule::verify(const program_t & program)
+{
+	if(program.length == 0)
+		return true;
+	if(program.length > RULE_CODE_SIZE || program.horizon > RULE_MAX_NEXT)
+		return false;
+
+	int depth = 0;
+	uint8_t pc = 0;
+	while(pc < program.length)
+	{
+		uint8_t op = program.code[pc++];
+		if(op >= RULE_OP_COUNT || pc + operandSize(op) > program.length)
+			return false;
+
+		// Operands are stack slots, they must be there
+		int8_t e = effect(op);
+		int needs = op == RULE_OP_IN ? 3 : op == RULE_OP_NOT ? 1 : e < 0 ? 2 : 0;
+		if(depth < needs)
+			return false;
+		if(op == RULE_OP_VAR && program.code[pc] >= RULE_VARS)
+			return false;
+		if(op == RULE_OP_RAIN && program.code[pc] > program.horizon)
+			return false;
+
+		depth += e;
+		if(depth > RULE_STACK_SIZE)
+			return false;
+		pc += operandSize(op);
+
+		if(op == RULE_OP_END)
+			return depth == 1 && pc == program.length;
+	}
+	return false;
+}
+
+bool WindowRule::evaluate(const float * vars, uint8_t rain, uint8_t reports) const
+{
+	if(reports < 8)
+		rain |= (uint8_t)(0xFF << reports);
+
+	float stack[RULE_STACK_SIZE];
+	uint8_t sp = 0;
+	const uint8_t * pc = _program.code;
+
+	for(;;)
+	{
+		switch(*pc++)
+		{
+		case RULE_OP_CONST:
+			memcpy(&stack[sp++], pc, sizeof(float));
+			pc += sizeof(float);
+			break;
+		case RULE_OP_VAR:
+			stack[sp++] = vars[*pc++];
+			break;
+		case RULE_OP_RAIN:
+		{
+			// Bit 0 alone for the current report, bits 1..n for the next n
+			uint8_t n = *pc++;
+			uint8_t mask = n == 0 ? 1 : ((1u << (n + 1)) - 2);
+			stack[sp++] = (rain & mask) != 0;
+			break;
+		}
+		case RULE_OP_LT: sp--; stack[sp-1] = stack[sp-1] < stack[sp]; break;
+		case RULE_OP_LE: sp--; stack[sp-1] = stack[sp-1] <= stack[sp]; break;
+		case RULE_OP_GT: sp--; stack[sp-1] = stack[sp-1] > stack[sp]; break;
+		case RULE_OP_GE: sp--; stack[sp-1] = stack[sp-1] >= stack[sp]; break;
+		case RULE_OP_EQ: sp--; stack[sp-1] = stack[sp-1] == stack[sp]; break;
+		case RULE_OP_NE: sp--; stack[sp-1] = stack[sp-1] != stack[sp]; break;
+		case RULE_OP_IN:
+			sp -= 2;
+			stack[sp-1] = stack[sp-1] >= stack[sp] && stack[sp-1] <= stack[sp+1];
+			break;
+		case RULE_OP_NOT: stack[sp-1] = stack[sp-1] == 0; break;
+		case RULE_OP_AND: sp--; stack[sp-1] = stack[sp-1] != 0 && stack[sp] != 0; break;
+		case RULE_OP_OR: sp--; stack[sp-1] = stack[sp-1] != 0 || stack[sp] != 0; break;
+		default:
+			return sp > 0 && stack[sp-1] != 0;
+		}
+	}
+}
+
+
+bool WindowRule::fail(const char * what)
+{
+	snprintf(_error, sizeof(_error), "Rule error at character %u: %s.", (unsigned)(_pos - _src) + 1, what);
+	return false;
+}
+
+bool WindowRule::emit(uint8_t op, const void * operand, uint8_t size)
+{
+	if(_program.length + 1 + size > RULE_CODE_SIZE)
+		return fail("rule is too long");
+
+	_program.code[_program.length++] = op;
+	memcpy(_program.code + _program.length, operand, size);
+	_program.length += size;
+
+	_depth += effect(op);
+	if(_depth > _maxDepth)
+		_maxDepth = _depth;
+	if(_maxDepth > RULE_STACK_SIZE)
+		return fail("rule is nested too deep");
+	return true;
+}
+
+void WindowRule::skipSpace()
+{
+	while(*_pos == ' ' || *_pos == '\t')
+		_pos++;
+}
+
+bool WindowRule::match(const char * token)
+{
+	skipSpace();
+	size_t n = strlen(token);
+	if(strncmp(_pos, token, n) != 0)
+		return false;
+	_pos += n;
+	return true;
+}
+
+uint8_t WindowRule::word(char * buf, uint8_t size)
+{
+	skipSpace();
+	uint8_t n = 0;
+	while(isalpha((unsigned char)_pos[n]) || (n > 0 && isdigit((unsigned char)_pos[n])))
+	{
+		if(n + 1 < size)
+			buf[n] = tolower((unsigned char)_pos[n]);
+		n++;
+	}
+	buf[n < size ? n : size - 1] = '\0';
+	_pos += n;
+	return n;
+}
+
+// or := and ('||' and)*
+bool WindowRule::parseOr()
+{
+	if(!parseAnd())
+		return false;
+	while(match("||"))
+	{
+		if(!parseAnd() || !emit(RULE_OP_OR))
+			return false;
+	}
+	return true;
+}
+
+// and := unary ('&&' unary)*
+bool WindowRule::parseAnd()
+{
+	if(!parseUnary())
+		return false;
+	while(match("&&"))
+	{
+		if(!parseUnary() || !emit(RULE_OP_AND))
+			return false;
+	}
+	return true;
+}
+
+// unary := '!'* primary
+bool WindowRule::parseUnary()
+{
+	// Counted instead of recursing, "!!!!" must not eat the stack
+	uint8_t nots = 0;
+	while(match("!"))
+	{
+		if(*_pos == '=')
+			return fail("expected a condition");
+		nots++;
+	}
+
+	if(!parsePrimary())
+		return false;
+	for(; nots > 0; nots--)
+	{
+		if(!emit(RULE_OP_NOT))
+			return false;
+	}
+	return true;
+}
+
+// primary := '(' or ')' | rain | value comparison
+bool WindowRule::parsePrimary()
+{
+	if(match("("))
+	{
+		if(++_nesting > RULE_MAX_NESTING)
+			return fail("too many parentheses inside each other");
+		if(!parseOr())
+			return false;
+		if(!match(")"))
+			return fail("expected )");
+		_nesting--;
+		return true;
+	}
+
+	skipSpace();
+	const char * start = _pos;
+	char name[8];
+	word(name, sizeof(name));
+	if(!strcmp(name, "rain"))
+		return parseRain();
+	_pos = start;
+
+	if(!parseValue())
+		return false;
+
+	static const struct
+	{
+		const char * token;
+		uint8_t op;
+	} comparisons[] =
+	{
+		// Two characters first, "<" would take the start of "<="
+		{"<=", RULE_OP_LE}, {">=", RULE_OP_GE}, {"==", RULE_OP_EQ}, {"!=", RULE_OP_NE},
+		{"<", RULE_OP_LT}, {">", RULE_OP_GT}
+	};
+	for(const auto & c : comparisons)
+	{
+		if(match(c.token))
+			return parseValue() && emit(c.op);
+	}
+
+	start = _pos;
+	word(name, sizeof(name));
+	if(strcmp(name, "in") != 0)
+	{
+		_pos = start;
+		return fail("expected a comparison");
+	}
+	if(!parseValue())
+		return false;
+	if(!match(".."))
+		return fail("expected low..high");
+	return parseValue() && emit(RULE_OP_IN);
+}
+
+// rain | rain '(' ('now' | 'next' N) ')'
+bool WindowRule::parseRain()
+{
+	uint8_t n = 0;
+	if(match("("))
+	{
+		skipSpace();
+		char what[8];
+		word(what, sizeof(what));
+		if(!strncmp(what, "next", 4) && isdigit((unsigned char)what[4]) && what[5] == '\0')
+			n = what[4] - '0';
+		else if(strcmp(what, "now") != 0)
+			return fail("expected now or nextN");
+		if(n > RULE_MAX_NEXT)
+			return fail("rain looks at 7 forecasts at most");
+		if(!match(")"))
+			return fail("expected )");
+	}
+
+	if(n > _program.horizon)
+		_program.horizon = n;
+	return emit(RULE_OP_RAIN, &n, 1);
+}
+
+// value := number | id | temp | wind | humidity | (min|max|mean) '(' temp|wind|humidity ')'
+bool WindowRule::parseValue()
+{
+	skipSpace();
+
+	// Numbers by hand: strtod would take the dot of "18..28"
+	const char * p = _pos;
+	if(*p == '-' || isdigit((unsigned char)*p))
+	{
+		bool negative = *p == '-';
+		if(negative)
+			p++;
+		if(!isdigit((unsigned char)*p))
+			return fail("expected a number");
+
+		float value = 0;
+		while(isdigit((unsigned char)*p))
+			value = value*10 + (*p++ - '0');
+		if(p[0] == '.' && isdigit((unsigned char)p[1]))
+		{
+			float scale = 1;
+			for(p++; isdigit((unsigned char)*p); p++)
+			{
+				scale /= 10;
+				value += (*p - '0')*scale;
+			}
+		}
+		if(negative)
+			value = -value;
+
+		_pos = p;
+		return emit(RULE_OP_CONST, &value, sizeof(value));
+	}
+
+	char name[12];
+	const char * start = _pos;
+	word(name, sizeof(name));
+	for(uint8_t v = 0; v < sizeof(RULE_VAR_NAMES)/sizeof(RULE_VAR_NAMES[0]); v++)
+	{
+		if(!strcmp(name, RULE_VAR_NAMES[v]))
+			return emit(RULE_OP_VAR, &v, 1);
+	}
+	for(uint8_t a = 0; a < sizeof(RULE_AGGREGATES)/sizeof(RULE_AGGREGATES[0]); a++)
+	{
+		if(strcmp(name, RULE_AGGREGATES[a]) != 0)
+			continue;
+
+		if(!match("("))
+			return fail("expected (");
+		char metric[12];
+		word(metric, sizeof(metric));
+		// Aggregates exist for temp, wind and humidity, in this order
+		for(uint8_t m = RULE_VAR_TEMP; m <= RULE_VAR_HUMIDITY; m++)
+		{
+			if(strcmp(metric, RULE_VAR_NAMES[m]) != 0)
+				continue;
+			if(!match(")"))
+				return fail("expected )");
+			uint8_t v = RULE_VAR_MIN_TEMP + a*3 + (m - RULE_VAR_TEMP);
+			return emit(RULE_OP_VAR, &v, 1);
+		}
+		return fail("expected temp, wind or humidity");
+	}
+
+	_pos = start;
+	return fail("expected a number or a value");
+}
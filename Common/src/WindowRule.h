@@ -0,0 +1,138 @@
+#ifndef WINDOW_RULE_H
+#define WINDOW_RULE_H
+
+#include <Arduino.h>
+
+// Longest rule source, terminator included
+#define RULE_SOURCE_SIZE 128
+// Longest compiled rule
+#define RULE_CODE_SIZE 96
+#define RULE_STACK_SIZE 12
+// Parentheses inside each other, bounds the recursion of the compiler
+#define RULE_MAX_NESTING 8
+// Forecasts rain(nextN) may look at
+#define RULE_MAX_NEXT 7
+#define RULE_ERROR_SIZE 96
+
+// Values a rule reads, filled in by the caller before evaluate(). The
+// aggregates follow the order of WeatherMetric (see WeatherHistory.h).
+enum RuleVar : uint8_t
+{
+	RULE_VAR_ID = 0,			// Weather id of the current report
+	RULE_VAR_TEMP,
+	RULE_VAR_WIND,
+	RULE_VAR_HUMIDITY,
+	RULE_VAR_MIN_TEMP,			// Rolling aggregates of the history
+	RULE_VAR_MIN_WIND,
+	RULE_VAR_MIN_HUMIDITY,
+	RULE_VAR_MAX_TEMP,
+	RULE_VAR_MAX_WIND,
+	RULE_VAR_MAX_HUMIDITY,
+	RULE_VAR_MEAN_TEMP,
+	RULE_VAR_MEAN_WIND,
+	RULE_VAR_MEAN_HUMIDITY,
+	RULE_VARS
+};
+
+enum RuleOp : uint8_t
+{
+	RULE_OP_END = 0,
+	RULE_OP_CONST,				// + float, 4 bytes
+	RULE_OP_VAR,				// + RuleVar
+	RULE_OP_RAIN,				// + forecasts to look at, 0 for the current report
+	RULE_OP_LT,
+	RULE_OP_LE,
+	RULE_OP_GT,
+	RULE_OP_GE,
+	RULE_OP_EQ,
+	RULE_OP_NE,
+	RULE_OP_IN,					// value, low, high: low <= value <= high
+	RULE_OP_NOT,
+	RULE_OP_AND,
+	RULE_OP_OR,
+	RULE_OP_COUNT
+};
+
+/* Open condition of a window, written as a small expression and compiled
+ * once into stack bytecode.
+ *
+ *   wind < 6 && temp in 18..28 && !rain(next2)
+ *
+ * Values: numbers, id, temp, wind, humidity of the current report and
+ * min(x), max(x), mean(x) of temp, wind or humidity over the history.
+ * Compare them with < <= > >= == != or "x in low..high" (both ends
+ * included). rain is true if the current report has precipitation (weather
+ * id 2xx to 6xx), rain(nextN) if any of the next N forecasts has. Combine
+ * with !, &&, || and parentheses; && binds tighter than ||.
+ *
+ * The compiler checks the syntax and the stack depth, so evaluate() runs
+ * without any checks: a switch per byte over a float stack. Code loaded
+ * from flash is verified the same way before it is used. */
+class WindowRule
+{
+public:
+	// What is saved: the source for /get, the code to run
+	typedef struct
+	{
+		char source[RULE_SOURCE_SIZE];
+		uint8_t code[RULE_CODE_SIZE];
+		uint8_t length;
+		uint8_t horizon;
+	} program_t;
+
+	WindowRule() { clear(); }
+
+	// Replaces the rule, an empty source clears it. On errors the rule stays
+	// as it was and err() tells where the source went wrong.
+	bool compile(const char * source);
+	// Takes a saved program after checking its code
+	bool load(const program_t & program);
+	void clear();
+
+	bool empty() const { return _program.length == 0; }
+	const program_t & program() const { return _program; }
+	const char * source() const { return _program.source; }
+	// Most forecasts a rain(nextN) of the rule looks at
+	uint8_t horizon() const { return _program.horizon; }
+
+	// vars: RULE_VARS values, rain: bit i set if report i has precipitation
+	// (0 current, 1 first forecast, ...), reports: how many there are. A
+	// forecast past them counts as rain, so a short report keeps it closed.
+	bool evaluate(const float * vars, uint8_t rain, uint8_t reports) const;
+
+	static const char * err() { return _error; }
+
+private:
+	// Recursive descent, each emits the code of what it parsed
+	bool parseOr();
+	bool parseAnd();
+	bool parseUnary();
+	bool parsePrimary();
+	bool parseValue();
+	bool parseRain();
+
+	void skipSpace();
+	bool match(const char * token);
+	// Lowercase word at the cursor, advanced past it
+	uint8_t word(char * buf, uint8_t size);
+	bool emit(uint8_t op, const void * operand = nullptr, uint8_t size = 0);
+	bool fail(const char * what);
+
+	// Stack change of op, and the size of its operand
+	static int8_t effect(uint8_t op);
+	static uint8_t operandSize(uint8_t op);
+	static bool verify(const program_t & program);
+
+	program_t _program;
+
+	// Compiler state
+	const char * _src;
+	const char * _pos;
+	uint8_t _depth;
+	uint8_t _maxDepth;
+	uint8_t _nesting;
+
+	static char _error[RULE_ERROR_SIZE];
+};
+
+#endif
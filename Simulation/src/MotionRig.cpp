@@ -0,0 +1,144 @@
+#include "MotionRig.h"
+#include <SimHardware.h>
+
+MotionRig::MotionRig(const rig_t & rig)
+	: _rig(rig)
+{
+
+}
+
+void MotionRig::attach()
+{
+	SimHardware::addWriteListener(onWrite, this);
+
+	// Pull-up switches: LOW while pressed, see LimitSwitch
+	if(_rig.openSwitchPin != 0xFF)
+		SimHardware::setReadHandler(_rig.openSwitchPin, onRead, this);
+	if(_rig.closeSwitchPin != 0xFF)
+		SimHardware::setReadHandler(_rig.closeSwitchPin, onRead, this);
+}
+
+float MotionRig::stepToMm()
+{
+	return 2.0*PI*_rig.radius/_rig.revSteps;
+}
+
+float MotionRig::positionAt(long steps)
+{
+	return _rig.start + (_rig.inverted ? -steps : steps)*stepToMm();
+}
+
+float MotionRig::position()
+{
+	return positionAt(_steps);
+}
+
+long MotionRig::steps()
+{
+	return _steps;
+}
+
+unsigned long MotionRig::lostSteps()
+{
+	return _lost;
+}
+
+unsigned long MotionRig::stepPulses()
+{
+	return _pulses;
+}
+
+unsigned long MotionRig::dirChanges()
+{
+	return _dirChanges;
+}
+
+bool MotionRig::openTriggered()
+{
+	return position() >= _rig.openSwitch;
+}
+
+bool MotionRig::closeTriggered()
+{
+	return position() <= _rig.closeSwitch;
+}
+
+// Called on every pulse. The acceleration is the change of speed between the
+// last two windows of MOTION_RIG_ACC_WINDOW pulses, over the time between
+// their middles. A pause between moves makes a slow window, so the first
+// window of a move does not count as a jump from the last one, and a
+// direction change starts over.
+void MotionRig::measureAcc()
+{
+	if(++_windowPulses < MOTION_RIG_ACC_WINDOW)
+		return;
+
+	uint64_t now = SimHardware::now();
+	float speed = MOTION_RIG_ACC_WINDOW*stepToMm()*1e6/(now - _windowStart);
+	if(_lastWindowStart > 0)
+	{
+		float acc = fabs(speed - _windowSpeed)*2e6/(now - _lastWindowStart);
+		_overAcc = acc > _rig.stallAcc;
+	}
+	_lastWindowStart = _windowStart;
+	_windowStart = now;
+	_windowSpeed = speed;
+	_windowPulses = 0;
+}
+
+
+void MotionRig::onWrite(void * ctx, uint8_t pin, uint8_t level)
+{
+	MotionRig * rig = static_cast<MotionRig*>(ctx);
+
+	if(pin == rig->_rig.dirPin)
+	{
+		if(level != rig->_dirLevel)
+		{
+			rig->_dirChanges++;
+			// The speed is measured again from the new direction on
+			rig->_windowStart = rig->_lastWindowStart = 0;
+			rig->_windowPulses = 0;
+			rig->_overAcc = false;
+		}
+		rig->_dirLevel = level;
+	}
+	else if(pin == rig->_rig.stepPin)
+	{
+		// The driver steps on the rising edge
+		if(level == HIGH && rig->_stepLevel == LOW)
+		{
+			rig->_pulses++;
+
+			long next = rig->_steps + (rig->_dirLevel == HIGH ? 1 : -1);
+			float pos = rig->positionAt(next);
+			uint64_t interval = SimHardware::now() - rig->_lastPulse;
+			rig->_lastPulse = SimHardware::now();
+			if(rig->_rig.stallAcc > 0)
+				rig->measureAcc();
+
+			if(pos > rig->_rig.openSwitch + rig->_rig.endStop ||
+			   pos < rig->_rig.closeSwitch - rig->_rig.endStop)
+				rig->_lost++;
+			else if(rig->_rig.stallSpeed > 0 && rig->_pulses > 1 &&
+			   rig->stepToMm()*1e6 > rig->_rig.stallSpeed*interval)
+				rig->_lost++;
+			else if(rig->_overAcc)
+				rig->_lost++;
+			else
+				rig->_steps = next;
+		}
+		rig->_stepLevel = level;
+	}
+}
+
+int MotionRig::onRead(void * ctx, uint8_t pin)
+{
+	MotionRig * rig = static_cast<MotionRig*>(ctx);
+
+	if(pin == rig->_rig.openSwitchPin)
+		return rig->openTriggered() ? LOW : HIGH;
+	if(pin == rig->_rig.closeSwitchPin)
+		return rig->closeTriggered() ? LOW : HIGH;
+	return HIGH;
+}
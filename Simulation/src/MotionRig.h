@@ -0,0 +1,76 @@
+#ifndef MOTION_RIG_H
+#define MOTION_RIG_H
+
+#include <Arduino.h>
+
+// Steps over which the rig measures the speed, to see the acceleration
+// through the jitter of single steps
+#define MOTION_RIG_ACC_WINDOW 16
+
+/* Mechanical model of one window actuator on the simulated GPIO.
+ * It follows the STEP/DIR pins of a driver to track the carriage, serves the
+ * limit switch pins from the carriage position and stops the carriage at the
+ * hard end stops, counting the steps that would be lost there. A motor driven
+ * faster than it can follow loses its steps as well, and so does one whose
+ * step rate changes faster than its torque can follow. */
+class MotionRig
+{
+public:
+	typedef struct
+	{
+		uint8_t dirPin = 4;
+		uint8_t stepPin = 5;
+		uint8_t openSwitchPin = 0xFF;	// 0xFF: no switch
+		uint8_t closeSwitchPin = 0xFF;
+
+		unsigned revSteps = 200;
+		float radius = 6.35943935;		// mm
+
+		float start = 0;				// Carriage position at power up, mm
+		float closeSwitch = 0;			// Switch trips at or below this position, mm
+		float openSwitch = 500;			// Switch trips at or above this position, mm
+		float endStop = 5;				// Hard stop distance beyond each switch, mm
+		float stallSpeed = 0;			// Steps faster than this are lost, mm/s (0: never)
+		float stallAcc = 0;				// Steps are lost while the speed changes faster, mm/s2 (0: never)
+		bool inverted = false;			// Motor turns the other way round (see config_t)
+	} rig_t;
+
+	MotionRig(const rig_t & rig);
+
+	// Registers the rig with SimHardware
+	void attach();
+
+	float position();			// mm
+	long steps();				// Steps actually travelled, from start
+	unsigned long lostSteps();	// Steps pushed against an end stop or stalled
+	unsigned long stepPulses();
+	unsigned long dirChanges();
+
+	bool openTriggered();
+	bool closeTriggered();
+
+private:
+	static void onWrite(void * ctx, uint8_t pin, uint8_t level);
+	static int onRead(void * ctx, uint8_t pin);
+
+	float stepToMm();
+	float positionAt(long steps);
+	void measureAcc();
+
+	rig_t _rig;
+	long _steps = 0;
+	unsigned long _lost = 0;
+	unsigned long _pulses = 0;
+	unsigned long _dirChanges = 0;
+	uint64_t _lastPulse = 0;
+	// Last two speed windows: start of each, speed of the last one
+	uint64_t _windowStart = 0;
+	uint64_t _lastWindowStart = 0;
+	float _windowSpeed = 0;			// mm/s
+	uint8_t _windowPulses = 0;
+	bool _overAcc = false;			// Last measured acceleration is above stallAcc
+	uint8_t _stepLevel = LOW;
+	uint8_t _dirLevel = LOW;
+};
+
+#endif
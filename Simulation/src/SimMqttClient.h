@@ -0,0 +1,55 @@
+#ifndef SIM_MQTT_CLIENT_H
+#define SIM_MQTT_CLIENT_H
+
+#include <string.h>
+
+#include "uMQTTBroker.h"
+
+/* Node side MQTT client on the host broker stand-in, with the calls of
+ * PubSubClient the services make. Publishes are queued with inject() and
+ * reach the broker on its next loop(); subscribed messages come back through
+ * the callback, terminated copies as PubSubClient hands them over. */
+class SimMqttClient : public SimPeer
+{
+public:
+	typedef void (*Callback)(char * topic, uint8_t * payload, unsigned int length);
+
+	SimMqttClient(uMQTTBroker & broker) : _broker(broker) {}
+
+	bool connect() { return _broker.connect(this); }
+	bool connected() { return true; }
+	void setCallback(Callback callback) { _callback = callback; }
+
+	bool publish(const char * topic, const uint8_t * payload, unsigned int length, bool retained = false)
+	{
+		return _broker.inject(topic, payload, length, retained);
+	}
+
+	bool publish(const char * topic, const char * payload, bool retained = false)
+	{
+		return publish(topic, (const uint8_t*)payload, strlen(payload), retained);
+	}
+
+	bool subscribe(const char * filter) { return _broker.peerSubscribe(this, filter); }
+	bool unsubscribe(const char * filter) { return _broker.peerUnsubscribe(this, filter); }
+
+	void deliver(const char * topic, const uint8_t * payload, uint16_t length)
+	{
+		if(_callback == nullptr || length > SIM_MQTT_PAYLOAD_SIZE)
+			return;
+
+		strncpy(_topic, topic, sizeof(_topic) - 1);
+		_topic[sizeof(_topic) - 1] = '\0';
+		memcpy(_payload, payload, length);
+		_payload[length] = '\0';
+		_callback(_topic, _payload, length);
+	}
+
+private:
+	uMQTTBroker & _broker;
+	Callback _callback = nullptr;
+	char _topic[SIM_MQTT_TOPIC_SIZE];
+	uint8_t _payload[SIM_MQTT_PAYLOAD_SIZE + 1];
+};
+
+#endif
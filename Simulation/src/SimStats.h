@@ -0,0 +1,71 @@
+#ifndef SIM_STATS_H
+#define SIM_STATS_H
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+/* Sample collector for the host tools: keeps every sample so exact
+ * percentiles can be reported at the end of a run. */
+class SimStats
+{
+public:
+	void add(double value)
+	{
+		_samples.push_back(value);
+		_sum += value;
+		_sumSq += value*value;
+		_sorted = false;
+	}
+
+	void clear()
+	{
+		_samples.clear();
+		_sum = 0;
+		_sumSq = 0;
+		_sorted = false;
+	}
+
+	size_t count() const { return _samples.size(); }
+	double sum() const { return _sum; }
+
+	double mean() const
+	{
+		return _samples.empty() ? 0 : _sum/_samples.size();
+	}
+
+	double stddev() const
+	{
+		if(_samples.size() < 2)
+			return 0;
+		double m = mean();
+		double var = _sumSq/_samples.size() - m*m;
+		return var > 0 ? sqrt(var) : 0;
+	}
+
+	// p in [0, 100]
+	double percentile(double p)
+	{
+		if(_samples.empty())
+			return 0;
+		if(!_sorted)
+		{
+			std::sort(_samples.begin(), _samples.end());
+			_sorted = true;
+		}
+		size_t i = (size_t)(p/100.0*(_samples.size() - 1) + 0.5);
+		return _samples[std::min(i, _samples.size() - 1)];
+	}
+
+	double min() { return percentile(0); }
+	double max() { return percentile(100); }
+
+private:
+	std::vector<double> _samples;
+	double _sum = 0;
+	double _sumSq = 0;
+	bool _sorted = false;
+};
+
+#endif
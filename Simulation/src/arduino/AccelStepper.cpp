@@ -0,0 +1,334 @@
+#include "AccelStepper.h"
+
+AccelStepper::StepProbe AccelStepper::_probe = nullptr;
+void * AccelStepper::_probeCtx = nullptr;
+
+
+AccelStepper::AccelStepper(uint8_t interface, uint8_t pin1, uint8_t pin2, uint8_t pin3, uint8_t pin4, bool enable)
+	: _direction(DIRECTION_CCW), _interface(interface), _currentPos(0), _targetPos(0), _speed(0.0),
+	  _maxSpeed(1.0), _acceleration(0.0), _stepInterval(0), _lastStepTime(0), _minPulseWidth(1),
+	  _enableInverted(false), _enablePin(0xff), _n(0), _c0(0.0), _cn(0.0), _cmin(1.0)
+{
+	(void)pin3;
+	(void)pin4;
+
+	// Only the step/dir DRIVER interface is simulated: pin1 = step, pin2 = dir
+	_pin[0] = pin1;
+	_pin[1] = pin2;
+	_pinInverted[0] = false;
+	_pinInverted[1] = false;
+
+	if(enable)
+		enableOutputs();
+
+	setAcceleration(1);
+}
+
+void AccelStepper::setStepProbe(StepProbe probe, void * ctx)
+{
+	_probe = probe;
+	_probeCtx = ctx;
+}
+
+
+void AccelStepper::moveTo(long absolute)
+{
+	if(_targetPos != absolute)
+	{
+		_targetPos = absolute;
+		computeNewSpeed();
+	}
+}
+
+void AccelStepper::move(long relative)
+{
+	moveTo(_currentPos + relative);
+}
+
+boolean AccelStepper::runSpeed()
+{
+	if(!_stepInterval)
+		return false;
+
+	unsigned long time = micros();
+	if(time - _lastStepTime >= _stepInterval)
+	{
+		unsigned long due = _lastStepTime + _stepInterval;
+
+		if(_direction == DIRECTION_CW)
+			_currentPos += 1;
+		else
+			_currentPos -= 1;
+		step(_currentPos);
+
+		_lastStepTime = time;
+
+		if(_probe)
+			_probe(_probeCtx, this, _currentPos, due, time);
+		return true;
+	}
+	return false;
+}
+
+long AccelStepper::distanceToGo()
+{
+	return _targetPos - _currentPos;
+}
+
+long AccelStepper::targetPosition()
+{
+	return _targetPos;
+}
+
+long AccelStepper::currentPosition()
+{
+	return _currentPos;
+}
+
+void AccelStepper::setCurrentPosition(long position)
+{
+	_targetPos = _currentPos = position;
+	_n = 0;
+	_stepInterval = 0;
+	_speed = 0.0;
+}
+
+void AccelStepper::computeNewSpeed()
+{
+	long distanceTo = distanceToGo();
+	long stepsToStop = (long)((_speed * _speed) / (2.0 * _acceleration));
+
+	if(distanceTo == 0 && stepsToStop <= 1)
+	{
+		// At the target and slow enough to stop
+		_stepInterval = 0;
+		_speed = 0.0;
+		_n = 0;
+		return;
+	}
+
+	if(distanceTo > 0)
+	{
+		if(_n > 0)
+		{
+			// Accelerating: decelerate now, or going the wrong way?
+			if((stepsToStop >= distanceTo) || _direction == DIRECTION_CCW)
+				_n = -stepsToStop;
+		}
+		else if(_n < 0)
+		{
+			// Decelerating: accelerate again?
+			if((stepsToStop < distanceTo) && _direction == DIRECTION_CW)
+				_n = -_n;
+		}
+	}
+	else if(distanceTo < 0)
+	{
+		if(_n > 0)
+		{
+			if((stepsToStop >= -distanceTo) || _direction == DIRECTION_CW)
+				_n = -stepsToStop;
+		}
+		else if(_n < 0)
+		{
+			if((stepsToStop < -distanceTo) && _direction == DIRECTION_CCW)
+				_n = -_n;
+		}
+	}
+
+	if(_n == 0)
+	{
+		// First step from stopped
+		_cn = _c0;
+		_direction = (distanceTo > 0) ? DIRECTION_CW : DIRECTION_CCW;
+	}
+	else
+	{
+		// Subsequent step, works for accel (n > 0) and decel (n < 0)
+		_cn = _cn - ((2.0 * _cn) / ((4.0 * _n) + 1));
+		_cn = std::max(_cn, _cmin);
+	}
+	_n++;
+	_stepInterval = _cn;
+	_speed = 1000000.0 / _cn;
+	if(_direction == DIRECTION_CCW)
+		_speed = -_speed;
+}
+
+boolean AccelStepper::run()
+{
+	if(runSpeed())
+		computeNewSpeed();
+	return _speed != 0.0 || distanceToGo() != 0;
+}
+
+void AccelStepper::setMaxSpeed(float speed)
+{
+	if(speed < 0.0)
+		speed = -speed;
+	if(_maxSpeed != speed)
+	{
+		_maxSpeed = speed;
+		_cmin = 1000000.0 / speed;
+		// Recompute _n from current speed and adjust speed if accelerating or cruising
+		if(_n > 0)
+		{
+			_n = (long)((_speed * _speed) / (2.0 * _acceleration));
+			computeNewSpeed();
+		}
+	}
+}
+
+float AccelStepper::maxSpeed()
+{
+	return _maxSpeed;
+}
+
+void AccelStepper::setAcceleration(float acceleration)
+{
+	if(acceleration == 0.0)
+		return;
+	if(acceleration < 0.0)
+		acceleration = -acceleration;
+	if(_acceleration != acceleration)
+	{
+		_n = _n * (_acceleration / acceleration);
+		_c0 = 0.676 * sqrt(2.0 / acceleration) * 1000000.0;
+		_acceleration = acceleration;
+		computeNewSpeed();
+	}
+}
+
+float AccelStepper::acceleration()
+{
+	return _acceleration;
+}
+
+void AccelStepper::setSpeed(float speed)
+{
+	if(speed == _speed)
+		return;
+	speed = constrain(speed, -_maxSpeed, _maxSpeed);
+	if(speed == 0.0)
+		_stepInterval = 0;
+	else
+	{
+		_stepInterval = fabs(1000000.0 / speed);
+		_direction = (speed > 0.0) ? DIRECTION_CW : DIRECTION_CCW;
+	}
+	_speed = speed;
+}
+
+float AccelStepper::speed()
+{
+	return _speed;
+}
+
+void AccelStepper::step(long step)
+{
+	(void)step;
+
+	// Direction first, then the step pulse
+	setOutputPins(_direction ? 0b10 : 0b00);
+	setOutputPins(_direction ? 0b11 : 0b01);
+	delayMicroseconds(_minPulseWidth);
+	setOutputPins(_direction ? 0b10 : 0b00);
+}
+
+void AccelStepper::setOutputPins(uint8_t mask)
+{
+	for(uint8_t i = 0; i < 2; i++)
+		digitalWrite(_pin[i], (mask & (1 << i)) ? (HIGH ^ _pinInverted[i]) : (LOW ^ _pinInverted[i]));
+}
+
+void AccelStepper::disableOutputs()
+{
+	if(!_interface)
+		return;
+
+	setOutputPins(0);
+
+	if(_enablePin != 0xff)
+	{
+		pinMode(_enablePin, OUTPUT);
+		digitalWrite(_enablePin, LOW ^ _enableInverted);
+	}
+}
+
+void AccelStepper::enableOutputs()
+{
+	if(!_interface)
+		return;
+
+	pinMode(_pin[0], OUTPUT);
+	pinMode(_pin[1], OUTPUT);
+
+	if(_enablePin != 0xff)
+	{
+		pinMode(_enablePin, OUTPUT);
+		digitalWrite(_enablePin, HIGH ^ _enableInverted);
+	}
+}
+
+void AccelStepper::setMinPulseWidth(unsigned int minWidth)
+{
+	_minPulseWidth = minWidth;
+}
+
+void AccelStepper::setEnablePin(uint8_t enablePin)
+{
+	_enablePin = enablePin;
+
+	if(_enablePin != 0xff)
+	{
+		pinMode(_enablePin, OUTPUT);
+		digitalWrite(_enablePin, HIGH ^ _enableInverted);
+	}
+}
+
+void AccelStepper::setPinsInverted(bool directionInvert, bool stepInvert, bool enableInvert)
+{
+	_pinInverted[0] = stepInvert;
+	_pinInverted[1] = directionInvert;
+	_enableInverted = enableInvert;
+}
+
+void AccelStepper::runToPosition()
+{
+	while(run())
+		;
+}
+
+boolean AccelStepper::runSpeedToPosition()
+{
+	if(_targetPos == _currentPos)
+		return false;
+	if(_targetPos > _currentPos)
+		_direction = DIRECTION_CW;
+	else
+		_direction = DIRECTION_CCW;
+	return runSpeed();
+}
+
+void AccelStepper::runToNewPosition(long position)
+{
+	moveTo(position);
+	runToPosition();
+}
+
+void AccelStepper::stop()
+{
+	if(_speed != 0.0)
+	{
+		long stepsToStop = (long)((_speed * _speed) / (2.0 * _acceleration)) + 1;
+		if(_speed > 0)
+			move(stepsToStop);
+		else
+			move(-stepsToStop);
+	}
+}
+
+bool AccelStepper::isRunning()
+{
+	return !(_speed == 0.0 && _targetPos == _currentPos);
+}
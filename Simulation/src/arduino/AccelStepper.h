@@ -0,0 +1,96 @@
+#ifndef ACCEL_STEPPER_H
+#define ACCEL_STEPPER_H
+
+#include "Arduino.h"
+
+/* Host implementation of the AccelStepper API used by Driver.
+ * The speed profile follows the library (David Austin's algorithm, as in
+ * AccelStepper 1.61) so step timing on the host matches the firmware. Pulses
+ * go through digitalWrite() and every step is reported to an optional probe
+ * with its due and actual time, which is what the motion simulator measures. */
+class AccelStepper
+{
+public:
+	typedef enum
+	{
+		FUNCTION  = 0,
+		DRIVER    = 1,
+		FULL2WIRE = 2,
+		FULL3WIRE = 3,
+		FULL4WIRE = 4,
+		HALF3WIRE = 6,
+		HALF4WIRE = 8
+	} MotorInterfaceType;
+
+	// Called after every step of any instance. due/actual are in us.
+	typedef void (*StepProbe)(void * ctx, const AccelStepper * stepper, long position,
+		unsigned long due, unsigned long actual);
+
+	AccelStepper(uint8_t interface = AccelStepper::FULL4WIRE, uint8_t pin1 = 2, uint8_t pin2 = 3,
+		uint8_t pin3 = 4, uint8_t pin4 = 5, bool enable = true);
+	virtual ~AccelStepper() {}
+
+	void moveTo(long absolute);
+	void move(long relative);
+	boolean run();
+	boolean runSpeed();
+	void setMaxSpeed(float speed);
+	float maxSpeed();
+	void setAcceleration(float acceleration);
+	float acceleration();
+	void setSpeed(float speed);
+	float speed();
+	long distanceToGo();
+	long targetPosition();
+	long currentPosition();
+	void setCurrentPosition(long position);
+	void runToPosition();
+	boolean runSpeedToPosition();
+	void runToNewPosition(long position);
+	void stop();
+	void disableOutputs();
+	void enableOutputs();
+	void setMinPulseWidth(unsigned int minWidth);
+	void setEnablePin(uint8_t enablePin = 0xff);
+	void setPinsInverted(bool directionInvert = false, bool stepInvert = false, bool enableInvert = false);
+	bool isRunning();
+
+	static void setStepProbe(StepProbe probe, void * ctx);
+
+protected:
+	typedef enum
+	{
+		DIRECTION_CCW = 0,
+		DIRECTION_CW  = 1
+	} Direction;
+
+	void computeNewSpeed();
+	virtual void setOutputPins(uint8_t mask);
+	virtual void step(long step);
+
+	boolean _direction;
+
+private:
+	uint8_t _interface;
+	uint8_t _pin[2];
+	bool _pinInverted[2];
+	long _currentPos;
+	long _targetPos;
+	float _speed;
+	float _maxSpeed;
+	float _acceleration;
+	unsigned long _stepInterval;
+	unsigned long _lastStepTime;
+	unsigned int _minPulseWidth;
+	bool _enableInverted;
+	uint8_t _enablePin;
+	long _n;
+	float _c0;
+	float _cn;
+	float _cmin;
+
+	static StepProbe _probe;
+	static void * _probeCtx;
+};
+
+#endif
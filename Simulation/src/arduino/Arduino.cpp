@@ -0,0 +1,100 @@
+#include "Arduino.h"
+#include "SimHardware.h"
+
+uint64_t SimHardware::_now = 0;
+uint8_t SimHardware::_mode[SIM_PIN_COUNT] = {};
+uint8_t SimHardware::_level[SIM_PIN_COUNT] = {};
+SimHardware::ReadHandler SimHardware::_readers[SIM_PIN_COUNT] = {};
+void * SimHardware::_readerCtx[SIM_PIN_COUNT] = {};
+std::vector<std::pair<SimHardware::WriteListener, void *> > SimHardware::_listeners;
+bool SimHardware::_record = false;
+std::vector<SimHardware::PinEvent> SimHardware::_timeline;
+
+
+void SimHardware::reset()
+{
+	_now = 0;
+	for(unsigned i = 0; i < SIM_PIN_COUNT; i++)
+	{
+		_mode[i] = INPUT;
+		_level[i] = LOW;
+		_readers[i] = nullptr;
+		_readerCtx[i] = nullptr;
+	}
+	_listeners.clear();
+	_timeline.clear();
+}
+
+void SimHardware::addWriteListener(WriteListener listener, void * ctx)
+{
+	_listeners.push_back(std::make_pair(listener, ctx));
+}
+
+void SimHardware::setReadHandler(uint8_t pin, ReadHandler handler, void * ctx)
+{
+	if(pin >= SIM_PIN_COUNT)
+		return;
+	_readers[pin] = handler;
+	_readerCtx[pin] = ctx;
+}
+
+void SimHardware::setInput(uint8_t pin, int level)
+{
+	if(pin < SIM_PIN_COUNT)
+		_level[pin] = level ? HIGH : LOW;
+}
+
+uint8_t SimHardware::mode(uint8_t pin)
+{
+	return pin < SIM_PIN_COUNT ? _mode[pin] : INPUT;
+}
+
+int SimHardware::level(uint8_t pin)
+{
+	return pin < SIM_PIN_COUNT ? _level[pin] : LOW;
+}
+
+void SimHardware::pinMode(uint8_t pin, uint8_t mode)
+{
+	if(pin < SIM_PIN_COUNT)
+		_mode[pin] = mode;
+}
+
+void SimHardware::write(uint8_t pin, uint8_t level)
+{
+	// 0xFF is the "no pin" marker used all over the drivers
+	if(pin >= SIM_PIN_COUNT)
+		return;
+
+	level = level ? HIGH : LOW;
+	_level[pin] = level;
+
+	if(_record)
+		_timeline.push_back({_now, pin, level});
+	for(size_t i = 0; i < _listeners.size(); i++)
+		_listeners[i].first(_listeners[i].second, pin, level);
+}
+
+int SimHardware::read(uint8_t pin)
+{
+	if(pin >= SIM_PIN_COUNT)
+		return LOW;
+	if(_readers[pin])
+		return _readers[pin](_readerCtx[pin], pin);
+	return _level[pin];
+}
+
+
+/* Arduino core */
+
+void pinMode(uint8_t pin, uint8_t mode) { SimHardware::pinMode(pin, mode); }
+void digitalWrite(uint8_t pin, uint8_t val) { SimHardware::write(pin, val); }
+int digitalRead(uint8_t pin) { return SimHardware::read(pin); }
+
+unsigned long millis() { return (unsigned long)(SimHardware::now() / 1000); }
+unsigned long micros() { return (unsigned long)SimHardware::now(); }
+
+void delay(unsigned long ms) { SimHardware::advance((uint64_t)ms * 1000); }
+void delayMicroseconds(unsigned int us) { SimHardware::advance(us); }
+
+void yield() {}
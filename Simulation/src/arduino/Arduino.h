@@ -0,0 +1,65 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+/* Host stand-in for the Arduino core. Only what the node sources use is
+ * declared here. Time is virtual and GPIO goes through the simulated back
+ * end in SimHardware.h, so the firmware classes run unchanged on Linux. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#include "WString.h"
+#include "Print.h"
+
+using std::abs;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x00
+#define OUTPUT 0x01
+#define INPUT_PULLUP 0x02
+
+#ifndef PI
+#define PI 3.1415926535897932384626433832795
+#endif
+
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+// From the SDK headers the core pulls in
+#define os_memcpy memcpy
+
+// The ESP8266 libc has it, older glibc does not
+static inline size_t simStrlcpy(char * dst, const char * src, size_t size)
+{
+	size_t n = strlen(src);
+	if(size > 0)
+	{
+		size_t m = n < size - 1 ? n : size - 1;
+		memcpy(dst, src, m);
+		dst[m] = '\0';
+	}
+	return n;
+}
+#define strlcpy simStrlcpy
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef ESP8266_WIFI_H
+#define ESP8266_WIFI_H
+
+// Host placeholder: only the client of the library is simulated.
+#include "WiFiClient.h"
+
+#endif
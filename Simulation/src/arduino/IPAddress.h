@@ -0,0 +1,25 @@
+#ifndef IP_ADDRESS_H
+#define IP_ADDRESS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "WString.h"
+
+// Host stand-in: an IPv4 address, enough to log peers
+class IPAddress
+{
+public:
+	IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : _bytes{a, b, c, d} {}
+
+	String toString() const
+	{
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%u.%u.%u.%u", _bytes[0], _bytes[1], _bytes[2], _bytes[3]);
+		return String(buf);
+	}
+
+private:
+	uint8_t _bytes[4];
+};
+
+#endif
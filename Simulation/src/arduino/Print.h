@@ -0,0 +1,32 @@
+#ifndef PRINT_H
+#define PRINT_H
+
+/* Host stand-in for the Arduino Print class, writes to stdout unless a
+ * subclass does otherwise. */
+
+#include <stdio.h>
+#include <string.h>
+#include "WString.h"
+
+class Print
+{
+public:
+	virtual ~Print() {}
+
+	virtual size_t write(const uint8_t * buf, size_t size) { return fwrite(buf, 1, size, stdout); }
+
+	size_t print(const char * s) { return write((const uint8_t*)s, strlen(s)); }
+	size_t print(const String & s) { return write((const uint8_t*)s.c_str(), s.length()); }
+	size_t print(unsigned long n) { char buf[24]; return print(buf, snprintf(buf, sizeof(buf), "%lu", n)); }
+	size_t print(long n) { char buf[24]; return print(buf, snprintf(buf, sizeof(buf), "%ld", n)); }
+	size_t print(unsigned int n) { return print((unsigned long)n); }
+	size_t print(int n) { return print((long)n); }
+	size_t println(const char * s) { return print(s) + print("\n"); }
+	size_t println(const String & s) { return print(s) + print("\n"); }
+	size_t println() { return print("\n"); }
+
+private:
+	size_t print(const char * buf, int n) { return n > 0 ? write((const uint8_t*)buf, n) : 0; }
+};
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef PUB_SUB_CLIENT_H
+#define PUB_SUB_CLIENT_H
+
+// Host placeholder: the motion simulator only needs the type to exist.
+class PubSubClient
+{
+};
+
+#endif
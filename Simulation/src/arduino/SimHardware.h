@@ -0,0 +1,60 @@
+#ifndef SIM_HARDWARE_H
+#define SIM_HARDWARE_H
+
+#include <stdint.h>
+#include <vector>
+#include <utility>
+
+#define SIM_PIN_COUNT 64
+
+/* Virtual clock and GPIO back end behind the host Arduino.h.
+ * Time only moves when the harness (or delay()) advances it, so runs are
+ * fully deterministic. Pin writes can be recorded as a timeline and observed
+ * by models such as MotionRig; pin reads can be served by them as well. */
+class SimHardware
+{
+public:
+	typedef struct
+	{
+		uint64_t time;		// us
+		uint8_t pin;
+		uint8_t level;
+	} PinEvent;
+
+	// Called on every digitalWrite()
+	typedef void (*WriteListener)(void * ctx, uint8_t pin, uint8_t level);
+	// Serves digitalRead() for a pin
+	typedef int (*ReadHandler)(void * ctx, uint8_t pin);
+
+	static uint64_t now() { return _now; }
+	static void advance(uint64_t us) { _now += us; }
+	static void reset();
+
+	static void addWriteListener(WriteListener listener, void * ctx);
+	static void setReadHandler(uint8_t pin, ReadHandler handler, void * ctx);
+	static void setInput(uint8_t pin, int level);
+
+	static uint8_t mode(uint8_t pin);
+	static int level(uint8_t pin);
+
+	static void record(bool enable) { _record = enable; }
+	static const std::vector<PinEvent> & timeline() { return _timeline; }
+	static void clearTimeline() { _timeline.clear(); }
+
+	// Arduino core entry points
+	static void pinMode(uint8_t pin, uint8_t mode);
+	static void write(uint8_t pin, uint8_t level);
+	static int read(uint8_t pin);
+
+private:
+	static uint64_t _now;
+	static uint8_t _mode[SIM_PIN_COUNT];
+	static uint8_t _level[SIM_PIN_COUNT];
+	static ReadHandler _readers[SIM_PIN_COUNT];
+	static void * _readerCtx[SIM_PIN_COUNT];
+	static std::vector<std::pair<WriteListener, void *> > _listeners;
+	static bool _record;
+	static std::vector<PinEvent> _timeline;
+};
+
+#endif
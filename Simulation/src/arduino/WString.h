@@ -0,0 +1,88 @@
+#ifndef WSTRING_H
+#define WSTRING_H
+
+/* Host stand-in for the Arduino String, on top of std::string. Only what
+ * the node sources and ArduinoJson (with ARDUINOJSON_ENABLE_ARDUINO_STRING)
+ * use is here. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+class String
+{
+public:
+	String() {}
+	String(const char * s) : _s(s != nullptr ? s : "") {}
+	String(const std::string & s) : _s(s) {}
+	explicit String(char c) : _s(1, c) {}
+	explicit String(int value) : _s(std::to_string(value)) {}
+	explicit String(unsigned value) : _s(std::to_string(value)) {}
+	explicit String(long value) : _s(std::to_string(value)) {}
+	explicit String(unsigned long value) : _s(std::to_string(value)) {}
+	explicit String(unsigned char value) : _s(std::to_string(value)) {}
+	// Two decimals, as on the ESP8266
+	explicit String(float value, unsigned char decimals = 2) { number(value, decimals); }
+	explicit String(double value, unsigned char decimals = 2) { number(value, decimals); }
+
+	const char * c_str() const { return _s.c_str(); }
+	unsigned length() const { return _s.size(); }
+	bool reserve(unsigned size) { _s.reserve(size); return true; }
+
+	long toInt() const { return atol(_s.c_str()); }
+	float toFloat() const { return atof(_s.c_str()); }
+
+	bool concat(const String & s) { _s += s._s; return true; }
+	bool concat(const char * s) { if(s != nullptr) _s += s; return s != nullptr; }
+	bool concat(const char * s, unsigned length) { _s.append(s, length); return true; }
+	bool concat(char c) { _s += c; return true; }
+
+	String & operator+=(const String & s) { _s += s._s; return *this; }
+	String & operator+=(const char * s) { concat(s); return *this; }
+	String & operator+=(char c) { _s += c; return *this; }
+
+	bool operator==(const String & s) const { return _s == s._s; }
+	bool operator==(const char * s) const { return _s == (s != nullptr ? s : ""); }
+	bool operator!=(const String & s) const { return !(*this == s); }
+	bool operator!=(const char * s) const { return !(*this == s); }
+	bool operator<(const String & s) const { return _s < s._s; }
+	char operator[](unsigned i) const { return i < _s.size() ? _s[i] : '\0'; }
+
+	bool endsWith(const String & s) const
+	{
+		return _s.size() >= s._s.size() && _s.compare(_s.size() - s._s.size(), s._s.size(), s._s) == 0;
+	}
+	bool startsWith(const String & s) const { return _s.compare(0, s._s.size(), s._s) == 0; }
+	int indexOf(char c, unsigned from = 0) const
+	{
+		size_t i = _s.find(c, from);
+		return i == std::string::npos ? -1 : (int)i;
+	}
+	String substring(unsigned from, unsigned to = (unsigned)-1) const
+	{
+		if(from >= _s.size() || to <= from)
+			return String();
+		return String(_s.substr(from, to - from));
+	}
+	void remove(unsigned index) { if(index < _s.size()) _s.erase(index); }
+	void remove(unsigned index, unsigned count) { if(index < _s.size()) _s.erase(index, count); }
+
+private:
+	void number(double value, unsigned char decimals)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+		_s = buf;
+	}
+
+	std::string _s;
+};
+
+inline String operator+(const String & a, const String & b) { String s(a); s += b; return s; }
+inline String operator+(const String & a, const char * b) { String s(a); s += b; return s; }
+inline String operator+(const char * a, const String & b) { String s(a); s += b; return s; }
+inline String operator+(const String & a, char b) { String s(a); s += b; return s; }
+inline bool operator==(const char * a, const String & b) { return b == a; }
+
+#endif
@@ -0,0 +1,64 @@
+#include "WiFiClient.h"
+#include "SimHardware.h"
+
+WiFiClient::Responder WiFiClient::_responder = nullptr;
+void * WiFiClient::_context = nullptr;
+
+int WiFiClient::connect(const char * host, uint16_t port)
+{
+	(void)port;
+	stop();
+	if(_responder == nullptr)
+		return 0;
+
+	_host = host;
+	_connected = true;
+	return 1;
+}
+
+void WiFiClient::stop()
+{
+	_request.clear();
+	_reply.clear();
+	_read = 0;
+	_connected = false;
+	_answered = false;
+}
+
+int WiFiClient::available()
+{
+	if(_connected && !_answered)
+	{
+		_answered = true;
+		if(!_responder(_context, _host.c_str(), _request, _reply))
+			_reply.clear();
+	}
+	if(_read < _reply.size())
+		return (int)(_reply.size() - _read);
+
+	SimHardware::advance(1000);
+	return 0;
+}
+
+int WiFiClient::read()
+{
+	if(_read >= _reply.size())
+		return -1;
+	return (uint8_t)_reply[_read++];
+}
+
+size_t WiFiClient::readBytes(char * buf, size_t size)
+{
+	size_t n = 0;
+	for(int c; n < size && (c = read()) >= 0; n++)
+		buf[n] = (char)c;
+	return n;
+}
+
+size_t WiFiClient::write(const uint8_t * buf, size_t size)
+{
+	if(!_connected)
+		return 0;
+	_request.append((const char*)buf, size);
+	return size;
+}
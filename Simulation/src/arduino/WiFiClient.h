@@ -0,0 +1,46 @@
+#ifndef WIFI_CLIENT_H
+#define WIFI_CLIENT_H
+
+/* Host stand-in for the ESP8266 WiFiClient, without a network. What is
+ * written after connect() is the request; on the first available() it goes
+ * to the responder set with setResponder(), and its reply is read back.
+ * Without a reply nothing ever becomes available and each available() takes
+ * a virtual millisecond, so the timeouts of the callers run out as they
+ * would on the node. */
+
+#include <string>
+
+#include "Arduino.h"
+
+class WiFiClient : public Print
+{
+public:
+	// Builds the whole reply to request, status line and headers included.
+	// False leaves the connection silent.
+	typedef bool (*Responder)(void * context, const char * host, const std::string & request, std::string & reply);
+
+	static void setResponder(Responder responder, void * context) { _responder = responder; _context = context; }
+
+	int connect(const char * host, uint16_t port);
+	void stop();
+	uint8_t connected() { return _connected; }
+
+	int available();
+	int read();
+	// What ArduinoJson reads a reply with
+	size_t readBytes(char * buf, size_t size);
+	size_t write(const uint8_t * buf, size_t size);
+
+private:
+	std::string _host;
+	std::string _request;
+	std::string _reply;
+	size_t _read = 0;
+	bool _connected = false;
+	bool _answered = false;
+
+	static Responder _responder;
+	static void * _context;
+};
+
+#endif
@@ -0,0 +1,246 @@
+#include "uMQTTBroker.h"
+
+#include <chrono>
+
+// Wall clock: the load harness measures the host, not the virtual time
+static uint64_t hostUs()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+uMQTTBroker * uMQTTBroker::_instance = nullptr;
+
+bool MQTT_local_publish(uint8_t * topic, uint8_t * data, uint16_t data_length, uint8_t qos, uint8_t retain)
+{
+	if(uMQTTBroker::_instance == nullptr)
+		return false;
+	uMQTTBroker::_instance->dispatch((const char*)topic, data, data_length, retain != 0);
+	return true;
+}
+
+uMQTTBroker::uMQTTBroker(uint16_t portno, uint16_t max_subscriptions, uint16_t max_retained_topics)
+	: _maxRetained(max_retained_topics)
+{
+	setQueueSize(64);
+	_instance = this;
+}
+
+void uMQTTBroker::setQueueSize(size_t slots)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_queue.assign(slots > 0 ? slots : 1, slot_t());
+	_head = 0;
+	_count = 0;
+}
+
+bool uMQTTBroker::topicMatches(const char * filter, const char * topic)
+{
+	while(*filter != '\0')
+	{
+		if(filter[0] == '#')
+			return true;
+		if(filter[0] == '+')
+		{
+			while(*topic != '\0' && *topic != '/')
+				topic++;
+			filter++;
+			continue;
+		}
+		if(*filter != *topic)
+			return *topic == '\0' && !strcmp(filter, "/#");
+		filter++;
+		topic++;
+	}
+	return *topic == '\0';
+}
+
+bool uMQTTBroker::subscribe(String topic, uint8_t qos)
+{
+	_local.push_back(topic.c_str());
+	retained(nullptr, topic.c_str());
+	return true;
+}
+
+bool uMQTTBroker::unsubscribe(String topic)
+{
+	for(size_t i = 0; i < _local.size(); i++)
+	{
+		if(_local[i] == topic.c_str())
+		{
+			_local.erase(_local.begin() + i);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool uMQTTBroker::publish(String topic, uint8_t * data, uint16_t data_length, uint8_t qos, uint8_t retain)
+{
+	dispatch(topic.c_str(), data, data_length, retain != 0);
+	return true;
+}
+
+bool uMQTTBroker::publish(String topic, String data, uint8_t qos, uint8_t retain)
+{
+	return publish(topic, (uint8_t*)data.c_str(), data.length(), qos, retain);
+}
+
+bool uMQTTBroker::connect(SimPeer * peer)
+{
+	_peers.push_back(peer);
+	return onConnect(IPAddress(127, 0, 0, (uint8_t)_peers.size()), (uint16_t)_peers.size());
+}
+
+bool uMQTTBroker::peerSubscribe(SimPeer * peer, const char * filter)
+{
+	_subscriptions.push_back(std::make_pair(peer, std::string(filter)));
+	retained(peer, filter);
+	return true;
+}
+
+bool uMQTTBroker::peerUnsubscribe(SimPeer * peer, const char * filter)
+{
+	for(size_t i = 0; i < _subscriptions.size(); i++)
+	{
+		if(_subscriptions[i].first == peer && _subscriptions[i].second == filter)
+		{
+			_subscriptions.erase(_subscriptions.begin() + i);
+			return true;
+		}
+	}
+	return false;
+}
+
+void uMQTTBroker::disconnect(SimPeer * peer)
+{
+	for(size_t i = _subscriptions.size(); i > 0; i--)
+	{
+		if(_subscriptions[i-1].first == peer)
+			_subscriptions.erase(_subscriptions.begin() + i - 1);
+	}
+	for(size_t i = 0; i < _peers.size(); i++)
+	{
+		if(_peers[i] == peer)
+		{
+			onDisconnect(IPAddress(127, 0, 0, (uint8_t)(i + 1)), String("peer"));
+			_peers.erase(_peers.begin() + i);
+			return;
+		}
+	}
+}
+
+void uMQTTBroker::retained(SimPeer * peer, const char * filter)
+{
+	for(const auto & r : _retained)
+	{
+		if(!topicMatches(filter, r.first.c_str()))
+			continue;
+		if(peer != nullptr)
+			peer->deliver(r.first.c_str(), (const uint8_t*)r.second.data(), r.second.size());
+		else
+			onData(String(r.first.c_str()), r.second.data(), r.second.size());
+	}
+}
+
+void uMQTTBroker::dispatch(const char * topic, const uint8_t * payload, uint16_t length, bool retain)
+{
+	if(retain)
+	{
+		// An empty retained message clears the topic
+		if(length == 0)
+			_retained.erase(topic);
+		else if(_retained.count(topic) > 0 || _retained.size() < _maxRetained)
+			_retained[topic] = std::string((const char*)payload, length);
+	}
+
+	// One local delivery per matching subscription, as the library does
+	for(size_t i = 0; i < _local.size(); i++)
+	{
+		if(topicMatches(_local[i].c_str(), topic))
+			onData(String(topic), (const char*)payload, length);
+	}
+
+	for(size_t i = 0; i < _subscriptions.size(); i++)
+	{
+		if(topicMatches(_subscriptions[i].second.c_str(), topic))
+		{
+			_subscriptions[i].first->deliver(topic, payload, length);
+			_delivered++;
+		}
+	}
+}
+
+bool uMQTTBroker::inject(const char * topic, const uint8_t * payload, uint16_t length, bool retain)
+{
+	if(strlen(topic) >= SIM_MQTT_TOPIC_SIZE || length > SIM_MQTT_PAYLOAD_SIZE)
+		return false;
+
+	std::lock_guard<std::mutex> guard(_lock);
+	if(_count == _queue.size())
+	{
+		_dropped++;
+		return false;
+	}
+
+	slot_t & s = _queue[(_head + _count) % _queue.size()];
+	strcpy(s.topic, topic);
+	memcpy(s.payload, payload, length);
+	s.length = length;
+	s.retain = retain;
+	s.queuedUs = hostUs();
+	_count++;
+	if(_count > _maxCount)
+		_maxCount = _count;
+	return true;
+}
+
+size_t uMQTTBroker::loop(size_t max)
+{
+	size_t n = 0;
+	while(n < max)
+	{
+		// The slot stays valid: only this thread frees slots
+		slot_t * s;
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			if(_count == 0)
+				break;
+			s = &_queue[_head];
+		}
+
+		uint64_t start = hostUs();
+		dispatch(s->topic, s->payload, s->length, s->retain);
+		uint64_t end = hostUs();
+		_handled++;
+		n++;
+		if(_hook != nullptr)
+			_hook(_hookContext, s->topic, (double)(start - s->queuedUs), (double)(end - start));
+
+		std::lock_guard<std::mutex> guard(_lock);
+		_head = (_head + 1) % _queue.size();
+		_count--;
+	}
+	return n;
+}
+
+uint64_t uMQTTBroker::dropped()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _dropped;
+}
+
+size_t uMQTTBroker::maxQueued()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	return _maxCount;
+}
+
+void uMQTTBroker::resetCounters()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_dropped = 0;
+	_maxCount = _count;
+	_handled = 0;
+	_delivered = 0;
+}
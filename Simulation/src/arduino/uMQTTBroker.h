@@ -0,0 +1,130 @@
+#ifndef UMQTT_BROKER_H
+#define UMQTT_BROKER_H
+
+/* Host stand-in for uMQTTBroker, to run myMQTTBroker and the services on
+ * it against simulated peers.
+ *
+ * Peers publish from their own threads with inject(): the message waits in
+ * a bounded queue, as it would in the lwIP buffers, and a full queue drops
+ * it. The broker thread calls loop(), which hands each message to onData()
+ * if a local subscription matches and to every peer subscribed, like the
+ * library does from its TCP callbacks. publish() on the broker thread is
+ * delivered at once. Retained messages are kept per topic and sent to new
+ * subscriptions.
+ *
+ * Queue slots are allocated once, so injecting does not allocate. Only the
+ * broker thread touches subscriptions and the retained store. */
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "IPAddress.h"
+
+#define SIM_MQTT_TOPIC_SIZE 128
+#define SIM_MQTT_PAYLOAD_SIZE 2048
+
+// Simulated client; deliver() runs on the broker thread and must not block
+class SimPeer
+{
+public:
+	virtual ~SimPeer() {}
+	virtual void deliver(const char * topic, const uint8_t * payload, uint16_t length) = 0;
+};
+
+class uMQTTBroker;
+
+// The C call of the library under publish(), without a String. Goes to the
+// broker constructed last.
+bool MQTT_local_publish(uint8_t * topic, uint8_t * data, uint16_t data_length, uint8_t qos, uint8_t retain);
+
+class uMQTTBroker
+{
+	friend bool MQTT_local_publish(uint8_t * topic, uint8_t * data, uint16_t data_length, uint8_t qos, uint8_t retain);
+
+public:
+	// After each message loop() handled: time in the queue and in delivery, us
+	typedef void (*MessageHook)(void * context, const char * topic, double waitUs, double serviceUs);
+
+	uMQTTBroker(uint16_t portno = 1883, uint16_t max_subscriptions = 30, uint16_t max_retained_topics = 30);
+	virtual ~uMQTTBroker() {}
+
+	void init() {}
+
+	virtual bool onConnect(IPAddress addr, uint16_t client_count) { (void)addr; (void)client_count; return true; }
+	virtual void onDisconnect(IPAddress addr, String client_id) { (void)addr; (void)client_id; }
+	virtual bool onAuth(String username, String password) { (void)username; (void)password; return true; }
+	virtual void onData(String topic, const char * data, uint32_t length) { (void)topic; (void)data; (void)length; }
+
+	bool publish(String topic, uint8_t * data, uint16_t data_length, uint8_t qos = 0, uint8_t retain = 0);
+	bool publish(String topic, String data, uint8_t qos = 0, uint8_t retain = 0);
+	bool subscribe(String topic, uint8_t qos = 0);
+	bool unsubscribe(String topic);
+	int getClientCount() { return (int)_peers.size(); }
+
+	/* Host side */
+
+	// Before peers start publishing
+	void setQueueSize(size_t slots);
+	void setHook(MessageHook hook, void * context) { _hook = hook; _hookContext = context; }
+
+	// Broker thread, like the TCP callbacks
+	bool connect(SimPeer * peer);
+	bool peerSubscribe(SimPeer * peer, const char * filter);
+	bool peerUnsubscribe(SimPeer * peer, const char * filter);
+	// Drops its subscriptions too
+	void disconnect(SimPeer * peer);
+
+	// Any thread. False if the queue is full or the message too large.
+	bool inject(const char * topic, const uint8_t * payload, uint16_t length, bool retain);
+
+	// Broker thread: delivers up to max queued messages, returns how many
+	size_t loop(size_t max = (size_t)-1);
+
+	// Counters since the last resetCounters()
+	uint64_t handled() const { return _handled; }
+	uint64_t delivered() const { return _delivered; }
+	uint64_t dropped();
+	size_t maxQueued();
+	void resetCounters();
+
+	static bool topicMatches(const char * filter, const char * topic);
+
+private:
+	typedef struct
+	{
+		char topic[SIM_MQTT_TOPIC_SIZE];
+		uint8_t payload[SIM_MQTT_PAYLOAD_SIZE];
+		uint16_t length;
+		bool retain;
+		uint64_t queuedUs;
+	} slot_t;
+
+	void dispatch(const char * topic, const uint8_t * payload, uint16_t length, bool retain);
+	void retained(SimPeer * peer, const char * filter);
+
+	static uMQTTBroker * _instance;
+
+	uint16_t _maxRetained;
+	std::vector<std::string> _local;
+	std::vector<std::pair<SimPeer *, std::string> > _subscriptions;
+	std::vector<SimPeer *> _peers;
+	std::map<std::string, std::string> _retained;
+
+	std::mutex _lock;
+	std::vector<slot_t> _queue;
+	size_t _head = 0;
+	size_t _count = 0;
+	size_t _maxCount = 0;
+	uint64_t _dropped = 0;
+
+	uint64_t _handled = 0;
+	uint64_t _delivered = 0;
+	MessageHook _hook = nullptr;
+	void * _hookContext = nullptr;
+};
+
+#endif
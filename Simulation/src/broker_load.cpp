@@ -0,0 +1,476 @@
+/* Load test of the broker and the Automated Window.
+ *
+ * Runs myMQTTBroker with the Automated Window, routed like Broker.ino does,
+ * on the host stand-in of uMQTTBroker (see arduino/uMQTTBroker.h). Each
+ * simulated WeatherClient and SmartWindow is a thread that publishes like
+ * the real node:
+ *   - WeatherClient: the retained weather report with its forecasts and
+ *     trace, every --weather-ms;
+ *   - SmartWindow: a log line every --status-ms and, after each open/close
+ *     command, the finished trace once the move took --move-ms.
+ * The main thread plays the broker task: it delivers the queued messages
+ * and keeps the virtual clock on the host clock.
+ *
+ * Each load level ("WxS": W windows, S weather sources) runs for --seconds
+ * and reports the throughput, the latency of every message from its publish
+ * to the end of its delivery and the heap the broker used. See
+ * Simulation/README.md. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "SimHardware.h"
+#include "SimStats.h"
+#include "myBroker.h"
+#include "AutomationClient.h"
+
+typedef struct
+{
+	std::vector<std::pair<unsigned, unsigned> > levels;	// Windows x weather sources
+	double seconds = 5;
+	unsigned weatherMs = 1000;
+	unsigned statusMs = 2000;
+	unsigned moveMs = 200;
+	unsigned npredictions = 2;
+	unsigned queue = 256;
+	double maxP99Us = -1;
+	double maxAlloc = -1;		// Allocations per message
+	const char * capture = nullptr;
+	bool verbose = false;
+} options_t;
+
+static options_t opt;
+static FILE * captureFile = nullptr;
+static std::atomic<bool> running(false);
+static std::atomic<uint32_t> traceIds(0);
+// Worst level, checked against --max-p99-us and --max-alloc
+static double worstP99 = 0, worstAlloc = 0;
+
+myMQTTBroker myBroker(1883, 10000, 64);
+AutomatedWindow<myMQTTBroker> autoWindow(&myBroker);
+
+// Host time since start, the virtual clock follows it
+static uint64_t hostUs()
+{
+	using namespace std::chrono;
+	static const steady_clock::time_point start = steady_clock::now();
+	return duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+static uint32_t hostMs() { return hostUs()/1000; }
+
+// Peers sleep in steps, so stopping a level takes at most one step
+static bool sleepUntil(uint64_t us)
+{
+	while(running)
+	{
+		uint64_t now = hostUs();
+		if(now >= us)
+			return true;
+		usleep(us - now < 10000 ? us - now : 10000);
+	}
+	return false;
+}
+
+
+/* Simulated peers. They never allocate from their threads: the heap
+ * counters of MemStats belong to the broker thread. */
+
+class WeatherPeer : public SimPeer
+{
+public:
+	WeatherPeer(unsigned index, unsigned count)
+		: _index(index), _count(count), _seed(index*2654435761u + 1) {}
+
+	void deliver(const char * topic, const uint8_t * payload, uint16_t length) {}
+
+	void run()
+	{
+		// Sources spread over the period, as if started at random
+		uint64_t next = hostUs() + (uint64_t)opt.weatherMs*1000*_index/_count;
+		char json[SIM_MQTT_PAYLOAD_SIZE];
+
+		while(sleepUntil(next))
+		{
+			size_t n = report(json, sizeof(json));
+			myBroker.inject("weather", (const uint8_t*)json, n, true);
+			next += opt.weatherMs*1000UL;
+		}
+	}
+
+private:
+	// Same fields as Weather::get(), values drifting like a real day
+	size_t report(char * buf, size_t len)
+	{
+		static const struct { int id; const char * main; const char * description; } conditions[] =
+		{
+			{800, "Clear", "clear sky"},
+			{801, "Clouds", "few clouds"},
+			{803, "Clouds", "broken clouds"},
+			{500, "Rain", "light rain"}
+		};
+
+		uint32_t fetch = hostMs();
+		int n = snprintf(buf, len, "{\"weather\":[");
+		for(unsigned i = 0; i <= opt.npredictions && n > 0 && (size_t)n < len; i++)
+		{
+			const auto & c = conditions[random(4)];
+			float temp = 12 + random(160)/10.0;
+			n += snprintf(buf + n, len - n,
+				"%s{\"id\":%d,\"main\":\"%s\",\"description\":\"%s\",\"temp\":%.2f,\"feels_like\":%.2f,"
+				"\"humidity\":%u,\"wind\":%.2f,\"dt\":%lu}",
+				i == 0 ? "" : ",", c.id, c.main, c.description, temp, temp - random(30)/10.0,
+				20 + random(60), random(90)/10.0, 1700000000UL + i*10800UL);
+		}
+		if(n > 0 && (size_t)n < len)
+			n += snprintf(buf + n, len - n, "],\"trace\":{\"id\":%lu,\"fetch\":%lu,\"pub\":%lu}}",
+				(unsigned long)++traceIds, (unsigned long)fetch, (unsigned long)hostMs());
+		return n > 0 && (size_t)n < len ? n : 0;
+	}
+
+	unsigned random(unsigned range)
+	{
+		_seed = _seed*1103515245u + 12345u;
+		return (_seed >> 16) % range;
+	}
+
+	unsigned _index;
+	unsigned _count;
+	uint32_t _seed;
+};
+
+class WindowPeer : public SimPeer
+{
+public:
+	WindowPeer(unsigned index)
+	{
+		snprintf(_root, sizeof(_root), "window%u/0", index);
+	}
+
+	const char * root() const { return _root; }
+
+	// Broker thread: keeps the command for run(). A newer one replaces it
+	// but the move already running goes on.
+	void deliver(const char * topic, const uint8_t * payload, uint16_t length)
+	{
+		char json[TRACE_JSON_SIZE];
+		size_t n = length < sizeof(json) - 1 ? length : sizeof(json) - 1;
+		memcpy(json, payload, n);
+		json[n] = '\0';
+
+		const char * id = strstr(json, "\"id\":");
+		std::lock_guard<std::mutex> guard(_lock);
+		_command = id != nullptr ? strtoul(id + 5, nullptr, 10) : 0;
+		if(!_pending)
+			_received = hostMs();
+		_pending = true;
+	}
+
+	void run()
+	{
+		char topic[64];
+		char payload[TRACE_JSON_SIZE];
+		uint64_t nextStatus = hostUs() + opt.statusMs*1000UL;
+
+		while(sleepUntil(hostUs() + 1000))
+		{
+			uint32_t id = 0, received = 0;
+			{
+				std::lock_guard<std::mutex> guard(_lock);
+				if(_pending && hostMs() - _received >= opt.moveMs)
+				{
+					id = _command;
+					received = _received;
+					_pending = false;
+				}
+			}
+			if(id != 0)
+			{
+				// Moves start right away in the simulation
+				snprintf(topic, sizeof(topic), "%s%s", _root, TRACE_TOPIC);
+				int n = snprintf(payload, sizeof(payload), "{\"id\":%lu,\"recv\":%lu,\"start\":%lu,\"end\":%lu}",
+					(unsigned long)id, (unsigned long)received, (unsigned long)received, (unsigned long)hostMs());
+				myBroker.inject(topic, (const uint8_t*)payload, n, false);
+			}
+
+			if(hostUs() >= nextStatus)
+			{
+				snprintf(topic, sizeof(topic), "%s/log", _root);
+				int n = snprintf(payload, sizeof(payload), "%lu.%03lu [INFO] Window 0 at %u of %u steps.",
+					(unsigned long)hostMs()/1000, (unsigned long)hostMs()%1000, 1200u, 4800u);
+				myBroker.inject(topic, (const uint8_t*)payload, n, false);
+				nextStatus += opt.statusMs*1000UL;
+			}
+		}
+	}
+
+private:
+	char _root[32];
+	std::mutex _lock;
+	uint32_t _command = 0;
+	uint32_t _received = 0;
+	bool _pending = false;
+};
+
+template<typename P>
+static void * peerThread(void * peer)
+{
+	((P*)peer)->run();
+	return nullptr;
+}
+
+
+/* Broker side, as in Broker.ino */
+
+void autoWindowHandler(const char* topic, const char* payload, uint32_t length, void* context)
+{
+	MemScope mem(MEM_OP_CALLBACK);
+	autoWindow.callback(topic,payload,length);
+}
+
+bool logPublish(const char * topic, const char * payload)
+{
+	return myBroker.publish(topic, (uint8_t*)payload, strlen(payload));
+}
+
+unsigned long logClock()
+{
+	return 1700000000UL + millis()/1000;
+}
+
+// Segments of the capture go to the file as they fill
+bool captureWrite(const uint8_t * data, size_t length)
+{
+	return fwrite(data, 1, length, captureFile) == length;
+}
+
+typedef struct
+{
+	SimStats latency;			// Publish to end of delivery, us
+	SimStats weather;			// Delivery of the weather reports: decide and fan-out, us
+	uint32_t allocations = 0;	// While delivering
+	uint32_t mark = 0;
+} measure_t;
+
+static void messageHook(void * context, const char * topic, double waitUs, double serviceUs)
+{
+	measure_t & m = *(measure_t*)context;
+	m.allocations += MemStats::allocations() - m.mark;
+	m.latency.add(waitUs + serviceUs);
+	if(!strcmp(topic, "weather"))
+		m.weather.add(serviceUs);
+	m.mark = MemStats::allocations();
+}
+
+// Runs one level
+static void runLevel(unsigned windows, unsigned sources)
+{
+	// Heap the broker still holds after the level, the retained topics mostly
+	uint32_t inUse = MemStats::bytesInUse();
+	std::vector<WindowPeer*> windowPeers;
+	std::vector<WeatherPeer*> weatherPeers;
+	for(unsigned i = 0; i < windows; i++)
+	{
+		WindowPeer * p = new WindowPeer(i);
+		myBroker.connect(p);
+		RingLog::flush(true);
+		myBroker.peerSubscribe(p, "smarthome/window/open");
+		myBroker.peerSubscribe(p, "smarthome/window/close");
+		windowPeers.push_back(p);
+	}
+	for(unsigned i = 0; i < sources; i++)
+	{
+		WeatherPeer * p = new WeatherPeer(i, sources);
+		myBroker.connect(p);
+		RingLog::flush(true);
+		weatherPeers.push_back(p);
+	}
+	std::vector<pthread_t> threads(windows + sources);
+
+	measure_t * m = new measure_t;
+	MemStats::reset();
+	myBroker.resetCounters();
+	myBroker.setHook(messageHook, m);
+	m->mark = MemStats::allocations();
+
+	running = true;
+	for(unsigned i = 0; i < windows; i++)
+		pthread_create(&threads[i], nullptr, peerThread<WindowPeer>, windowPeers[i]);
+	for(unsigned i = 0; i < sources; i++)
+		pthread_create(&threads[windows + i], nullptr, peerThread<WeatherPeer>, weatherPeers[i]);
+
+	uint64_t start = hostUs();
+	uint64_t end = start + (uint64_t)(opt.seconds*1e6);
+	while(hostUs() < end)
+	{
+		SimHardware::advance(hostUs() - SimHardware::now());
+		if(myBroker.loop(64) == 0)
+			usleep(100);
+		RingLog::flush();
+	}
+	running = false;
+	for(pthread_t & t : threads)
+		pthread_join(t, nullptr);
+	// Whatever the peers published before they stopped
+	while(myBroker.loop() > 0);
+	double elapsed = (hostUs() - start)/1e6;
+	myBroker.setHook(nullptr, nullptr);
+
+	uint64_t handled = myBroker.handled();
+	const MemStats::op_t & callback = MemStats::op(MEM_OP_CALLBACK);
+	const MemStats::op_t & decide = MemStats::op(MEM_OP_DECIDE);
+	double p99 = m->latency.percentile(99);
+	double perMessage = handled > 0 ? (double)m->allocations/handled : 0.0;
+	worstP99 = std::max(worstP99, p99);
+	worstAlloc = std::max(worstAlloc, perMessage);
+	printf("%4ux%-3u %8.0f %9.0f %7lu %6lu %8.0f %8.0f %8.0f %8.0f %7lu %7lu %7.1f",
+		windows, sources, handled/elapsed, myBroker.delivered()/elapsed,
+		(unsigned long)myBroker.dropped(), (unsigned long)myBroker.maxQueued(),
+		m->latency.percentile(50), p99, m->latency.max(), m->weather.percentile(99),
+		(unsigned long)callback.maxPeak, (unsigned long)decide.maxPeak, perMessage);
+	delete m;
+
+	for(WindowPeer * p : windowPeers)
+	{
+		myBroker.disconnect(p);
+		delete p;
+	}
+	for(WeatherPeer * p : weatherPeers)
+	{
+		myBroker.disconnect(p);
+		delete p;
+	}
+	std::vector<WindowPeer*>().swap(windowPeers);
+	std::vector<WeatherPeer*>().swap(weatherPeers);
+	std::vector<pthread_t>().swap(threads);
+	printf(" %+8ld\n", (long)MemStats::bytesInUse() - (long)inUse);
+}
+
+static bool parseLevels(const char * s)
+{
+	opt.levels.clear();
+	while(*s != '\0')
+	{
+		unsigned w, n;
+		int used = 0;
+		if(sscanf(s, "%ux%u%n", &w, &n, &used) != 2 || w == 0 || n == 0)
+			return false;
+		opt.levels.push_back(std::make_pair(w, n));
+		s += used;
+		if(*s == ',')
+			s++;
+	}
+	return !opt.levels.empty();
+}
+
+static void usage(const char * name)
+{
+	printf("Usage: %s [options]\n"
+		"  --levels WxS,..          windows x weather sources per level (1x1,8x1,32x2,128x4)\n"
+		"  --seconds S              duration of each level (5)\n"
+		"  --weather-ms MS          weather report period of each source (1000)\n"
+		"  --status-ms MS           log line period of each window (2000)\n"
+		"  --move-ms MS             time from command to trace report (200)\n"
+		"  --npredictions N         forecasts in each weather report, 0 to 2 (2)\n"
+		"  --queue N                messages the broker holds before dropping (256)\n"
+		"  --max-p99-us US          exit code 1 if the latency p99 of a level exceeds US\n"
+		"  --max-alloc N            exit code 1 if the allocations per message of a level exceed N\n"
+		"  --capture FILE           capture the broker traffic to FILE, see capture_replay\n"
+		"  --verbose                print the broker log\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+	parseLevels("1x1,8x1,32x2,128x4");
+
+	for(int i = 1; i < argc; i++)
+	{
+		const char * a = argv[i];
+		const char * v = i + 1 < argc ? argv[i+1] : "";
+
+		if(!strcmp(a, "--levels")) { if(!parseLevels(v)) { usage(argv[0]); return 2; } i++; }
+		else if(!strcmp(a, "--seconds")) { opt.seconds = atof(v); i++; }
+		else if(!strcmp(a, "--weather-ms")) { opt.weatherMs = atoi(v); i++; }
+		else if(!strcmp(a, "--status-ms")) { opt.statusMs = atoi(v); i++; }
+		else if(!strcmp(a, "--move-ms")) { opt.moveMs = atoi(v); i++; }
+		else if(!strcmp(a, "--npredictions")) { opt.npredictions = atoi(v) <= 2 ? atoi(v) : 2; i++; }
+		else if(!strcmp(a, "--queue")) { opt.queue = atoi(v); i++; }
+		else if(!strcmp(a, "--max-p99-us")) { opt.maxP99Us = atof(v); i++; }
+		else if(!strcmp(a, "--max-alloc")) { opt.maxAlloc = atof(v); i++; }
+		else if(!strcmp(a, "--capture")) { opt.capture = v; i++; }
+		else if(!strcmp(a, "--verbose")) { opt.verbose = true; }
+		else { usage(argv[0]); return 2; }
+	}
+	if(opt.weatherMs == 0 || opt.statusMs == 0 || opt.seconds <= 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	static Print serial;
+	RingLog::setLevel(RingLog::LEVEL_INFO);
+	if(opt.verbose)
+		RingLog::setSerial(&serial);
+	RingLog::setPrefix("Broker");
+	RingLog::setClock(logClock);
+	RetainedSnapshot::setClock(logClock);
+	TrafficCapture::setClock(logClock);
+
+	myBroker.setQueueSize(opt.queue);
+	myBroker.init();
+	RingLog::setSink(logPublish, "log");
+	char rootTopic[TOPIC_BUFFER_SIZE];
+	myBroker.on(autoWindow.getMqttTopic().join(rootTopic, sizeof(rootTopic), "/#"), autoWindowHandler);
+	myBroker.on(autoWindow.getWeatherTopic().c_str(), autoWindowHandler);
+	autoWindow.subscribe();
+
+	// Configuration first, as captureStart() in Broker.ino does
+	if(opt.capture != nullptr)
+	{
+		captureFile = fopen(opt.capture, "wb");
+		if(captureFile == nullptr)
+		{
+			fprintf(stderr, "Could not create <%s>.\n", opt.capture);
+			return 2;
+		}
+		myBroker.capture.setSink(captureWrite);
+		myBroker.startCapture("");
+		char config[AUTOMATED_WINDOW_CONFIG_SIZE];
+		size_t n = autoWindow.getConfig(config, sizeof(config));
+		char configTopic[TOPIC_BUFFER_SIZE];
+		autoWindow.getMqttTopic().join(configTopic, sizeof(configTopic), CAPTURE_CONFIG_TOPIC);
+		myBroker.capture.record(configTopic, (const uint8_t*)config, n, CAPTURE_IN);
+	}
+
+	printf("level       msg/s  deliv/s dropped queued  p50[us]  p99[us]  max[us] wx99[us] cbPeak decPeak alloc/m   heap[B]\n");
+	for(const auto & level : opt.levels)
+		runLevel(level.first, level.second);
+
+	if(captureFile != nullptr)
+	{
+		myBroker.stopCapture();
+		myBroker.capture.flush();
+		fclose(captureFile);
+	}
+
+	bool ok = true;
+	if(opt.maxP99Us >= 0 && worstP99 > opt.maxP99Us)
+	{
+		printf("FAILED: latency p99 of %.0f us exceeds %.0f us.\n", worstP99, opt.maxP99Us);
+		ok = false;
+	}
+	if(opt.maxAlloc >= 0 && worstAlloc > opt.maxAlloc)
+	{
+		printf("FAILED: %.1f allocations per message exceed %.1f.\n", worstAlloc, opt.maxAlloc);
+		ok = false;
+	}
+	return ok ? 0 : 1;
+}
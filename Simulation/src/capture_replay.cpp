@@ -0,0 +1,282 @@
+/* Replays captured broker traffic into the Automated Window.
+ *
+ * Reads a capture of myMQTTBroker (see Broker/src/TrafficCapture.h), e.g.
+ *   mosquitto_sub -h <broker> -t capture/dump -N -W 5 > capture.bin &
+ *   mosquitto_pub -h <broker> -t automatedWindow/capture/get -m capture/dump
+ * and hands every received message the broker routes to the Automated
+ * Window to AutomatedWindow::callback(), like Broker.ino does. Virtual time
+ * follows the capture, so the rolling weather aggregates age as they did.
+ * The configuration the broker captured first is applied before.
+ *
+ * The broker captures its own publishes too. The open/close commands a
+ * message caused on the broker are compared to the ones the replay
+ * publishes for it, and every message is timed on this host.
+ * See Simulation/README.md. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "SimHardware.h"
+#include "SimStats.h"
+#include "AutomationClient.h"
+#include "RetainedSnapshot.h"
+#include "TrafficCapture.h"
+
+typedef struct
+{
+	bool paced = false;			// Original pacing instead of flat out
+	double speed = 1;			// Pacing factor
+	const char * config = nullptr;
+	double maxP99Us = -1;
+	double maxAlloc = -1;		// Allocations per message
+	bool verbose = false;
+} options_t;
+
+static bool endsWith(const char * s, const char * suffix)
+{
+	size_t n = strlen(s), m = strlen(suffix);
+	return n >= m && !strcmp(s + n - m, suffix);
+}
+
+static bool isCommand(const char * topic)
+{
+	return endsWith(topic, "/open") || endsWith(topic, "/close");
+}
+
+// Stands in for the broker: keeps the commands the Automated Window publishes
+class ReplayClient
+{
+public:
+	bool subscribe(const char * topic) { return true; }
+	bool unsubscribe(const char * topic) { return true; }
+
+	bool publish(const char * topic, const uint8_t * payload, size_t length)
+	{
+		if(isCommand(topic))
+			commands.push_back(topic);
+		return true;
+	}
+
+	bool publish(const char * topic, const char * payload, bool retained = false)
+	{
+		return publish(topic, (const uint8_t*)payload, strlen(payload));
+	}
+
+	std::vector<std::string> commands;
+};
+
+ReplayClient client;
+AutomatedWindow<ReplayClient> autoWindow(&client);
+
+// Messages Broker.ino routes to the Automated Window
+static bool routed(const char * topic)
+{
+	char filter[TOPIC_BUFFER_SIZE];
+	return topic == autoWindow.getWeatherTopic() ||
+		RetainedSnapshot::topicMatches(autoWindow.getMqttTopic().join(filter, sizeof(filter), "/#"), topic);
+}
+
+// Configuration recorded at the start of the capture, see CAPTURE_CONFIG_TOPIC.
+// The weather topic cannot be set through setConfig().
+static bool applyConfig(const uint8_t * payload, uint16_t length)
+{
+	DynamicJsonDocument doc(AUTOMATED_WINDOW_CONFIG_JSON_SIZE);
+	if(deserializeJson(doc, (const char*)payload, length) || !doc.is<JsonObject>())
+		return false;
+
+	if(doc["weatherTopic"].is<const char*>())
+		autoWindow.setWeatherTopic(doc["weatherTopic"].as<const char*>());
+	doc.remove("weatherTopic");
+
+	char json[AUTOMATED_WINDOW_CONFIG_SIZE];
+	size_t n = serializeJson(doc, json, sizeof(json));
+	return autoWindow.setConfig(json, n);
+}
+
+static uint64_t hostUs()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage(const char * name)
+{
+	printf("Usage: %s [options] FILE\n"
+		"  --paced                  keep the captured pacing instead of running flat out\n"
+		"  --speed X                with --paced, run X times faster\n"
+		"  --config JSON            Automated Window configuration instead of the captured one\n"
+		"  --max-p99-us US          exit code 1 if the callback p99 exceeds US\n"
+		"  --max-alloc N            exit code 1 if the allocations per message exceed N\n"
+		"  --verbose                print every replayed message\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+	options_t opt;
+	const char * path = nullptr;
+
+	for(int i = 1; i < argc; i++)
+	{
+		const char * a = argv[i];
+		const char * v = i + 1 < argc ? argv[i+1] : "";
+
+		if(!strcmp(a, "--paced")) { opt.paced = true; }
+		else if(!strcmp(a, "--speed")) { opt.speed = atof(v); i++; }
+		else if(!strcmp(a, "--config")) { opt.config = v; i++; }
+		else if(!strcmp(a, "--max-p99-us")) { opt.maxP99Us = atof(v); i++; }
+		else if(!strcmp(a, "--max-alloc")) { opt.maxAlloc = atof(v); i++; }
+		else if(!strcmp(a, "--verbose")) { opt.verbose = true; }
+		else if(a[0] != '-' && path == nullptr) { path = a; }
+		else { usage(argv[0]); return 2; }
+	}
+	if(path == nullptr || opt.speed <= 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		fprintf(stderr, "Could not open <%s> or it is empty.\n", path);
+		return 2;
+	}
+	const uint8_t * data = (const uint8_t*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		fprintf(stderr, "Could not map <%s>.\n", path);
+		return 2;
+	}
+
+	if(opt.config != nullptr && !autoWindow.setConfig(opt.config))
+	{
+		fprintf(stderr, "Configuration was not applied: %s\n", autoWindow.err());
+		return 2;
+	}
+
+	TrafficCapture reader;
+	TrafficCapture::cursor_t cursor;
+	TrafficCapture::entry_t e;
+	SimStats weather, other;
+	unsigned long records = 0, replayed = 0, decisions = 0, mismatches = 0;
+	uint32_t allocations = 0;
+
+	// Commands of the message being compared: recorded ones follow it
+	std::vector<std::string> recorded;
+	bool comparing = false;
+	uint32_t comparedMs = 0;
+
+	uint64_t start = hostUs();
+	bool more = true;
+	while(more)
+	{
+		more = reader.next(data, st.st_size, cursor, e);
+		bool received = more && !(e.flags & CAPTURE_OUT);
+
+		if(more && (e.flags & CAPTURE_OUT) && isCommand(e.topic))
+			recorded.push_back(e.topic);
+		if(comparing && (!more || received))
+		{
+			// The broker publishes the command while it handles the message
+			comparing = false;
+			decisions += recorded.size();
+			if(recorded != client.commands)
+			{
+				mismatches++;
+				printf("MISMATCH at %lu ms: captured", (unsigned long)comparedMs);
+				for(const auto & c : recorded)
+					printf(" %s", c.c_str());
+				printf(", replayed");
+				for(const auto & c : client.commands)
+					printf(" %s", c.c_str());
+				printf("\n");
+			}
+		}
+		if(!more)
+			break;
+		records++;
+		if(!received)
+			continue;
+		recorded.clear();
+		client.commands.clear();
+		if(endsWith(e.topic, CAPTURE_CONFIG_TOPIC) && opt.config == nullptr)
+		{
+			if(!applyConfig(e.payload, e.length))
+				printf("Captured configuration was not applied: %s\n", autoWindow.err());
+			continue;
+		}
+		if(!routed(e.topic))
+			continue;
+
+		if(opt.paced)
+		{
+			uint64_t due = start + (uint64_t)(e.ms*1000.0/opt.speed);
+			uint64_t now = hostUs();
+			if(due > now)
+				usleep(due - now);
+		}
+		if((uint64_t)e.ms*1000 > SimHardware::now())
+			SimHardware::advance((uint64_t)e.ms*1000 - SimHardware::now());
+
+		uint32_t allocated = MemStats::allocations();
+		uint64_t t0 = hostUs();
+		autoWindow.callback(e.topic, (const char*)e.payload, e.length);
+		double us = hostUs() - t0;
+		allocations += MemStats::allocations() - allocated;
+
+		replayed++;
+		(e.topic == autoWindow.getWeatherTopic() ? weather : other).add(us);
+		comparing = true;
+		comparedMs = e.ms;
+		if(opt.verbose)
+			printf("%8lu ms %-40s %6u B %8.0f us\n", (unsigned long)e.ms, e.topic, e.length, us);
+	}
+	munmap((void*)data, st.st_size);
+
+	if(reader.err()[0] != '\0')
+		printf("Stopped early: %s\n", reader.err());
+	printf("%lu records, %lu replayed, %lu dropped by the broker, capture started at epoch %lu\n",
+		records, replayed, (unsigned long)cursor.dropped, (unsigned long)cursor.epoch);
+	printf("message  count  p50[us]  p99[us]  max[us]\n");
+	printf("weather %6lu %8.0f %8.0f %8.0f\n", (unsigned long)weather.count(),
+		weather.percentile(50), weather.percentile(99), weather.max());
+	printf("other   %6lu %8.0f %8.0f %8.0f\n", (unsigned long)other.count(),
+		other.percentile(50), other.percentile(99), other.max());
+	double perMessage = replayed > 0 ? (double)allocations/replayed : 0.0;
+	printf("%.1f allocations per message\n", perMessage);
+
+	bool ok = true;
+	if(decisions == 0)
+		printf("No captured commands to compare with.\n");
+	else if(mismatches > 0)
+	{
+		printf("FAILED: %lu messages decided otherwise than captured.\n", mismatches);
+		ok = false;
+	}
+	else
+		printf("All %lu captured commands replayed alike.\n", decisions);
+
+	double p99 = std::max(weather.percentile(99), other.percentile(99));
+	if(opt.maxP99Us >= 0 && p99 > opt.maxP99Us)
+	{
+		printf("FAILED: callback p99 exceeds %.0f us.\n", opt.maxP99Us);
+		ok = false;
+	}
+	if(opt.maxAlloc >= 0 && perMessage > opt.maxAlloc)
+	{
+		printf("FAILED: %.1f allocations per message exceed %.1f.\n", perMessage, opt.maxAlloc);
+		ok = false;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+/* Round trips through the configuration journal on the host flash.
+ *
+ * Every case writes records, then reads them back through a fresh
+ * ConfigJournal, as the next boot would: the scan has to find each record
+ * where it was written, and appending after the scan must not touch any of
+ * them. The exit code is 1 if any case fails. See Simulation/README.md. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <Arduino.h>
+#include <ConfigJournal.h>
+
+#define VERSION 1
+
+static unsigned failures = 0;
+
+static void check(bool ok, const char * name, const char * detail = "")
+{
+	printf("%-4s %s%s%s\n", ok ? "ok" : "FAIL", name, *detail ? ": " : "", detail);
+	if(!ok)
+		failures++;
+}
+
+// Reads id through a journal that scans the flash again
+static bool readBack(uint8_t id, const void * expected, size_t length)
+{
+	uint8_t buf[256];
+	ConfigJournal journal;
+	return journal.read(id, VERSION, buf, length) && memcmp(buf, expected, length) == 0;
+}
+
+static void format()
+{
+	ConfigJournal journal;
+	journal.format();
+}
+
+// The padding of a record once read as erased flash, so a record whose
+// payload ended in 0xFF looked cut and the next append overwrote it
+static void trailingFF()
+{
+	format();
+	const uint8_t first[8] = {8, 7, 6, 5, 4, 3, 2, 1};
+	const uint8_t last[5] = {1, 2, 3, 4, 0xFF};
+	{
+		ConfigJournal journal;
+		journal.write(3, VERSION, first, sizeof(first));
+		journal.write(2, VERSION, last, sizeof(last));
+	}
+	check(readBack(2, last, sizeof(last)) && readBack(3, first, sizeof(first)), "payload ending in 0xFF");
+
+	// Appended after a boot, next to it
+	const uint8_t next[4] = {9, 9, 9, 9};
+	{
+		ConfigJournal journal;
+		journal.write(4, VERSION, next, sizeof(next));
+	}
+	check(readBack(2, last, sizeof(last)) && readBack(4, next, sizeof(next)), "append after a payload ending in 0xFF");
+}
+
+// Every length and alignment, the payloads all 0xFF
+static void erasedPayloads()
+{
+	format();
+	uint8_t ff[12];
+	memset(ff, 0xFF, sizeof(ff));
+	for(uint8_t length = 1; length <= sizeof(ff); length++)
+	{
+		ConfigJournal journal;
+		journal.write(length, VERSION, ff, length);
+	}
+
+	bool ok = true;
+	for(uint8_t length = 1; length <= sizeof(ff); length++)
+		ok = readBack(length, ff, length) && ok;
+	check(ok, "payloads of 0xFF, 1 to 12 bytes");
+}
+
+// Rollovers carry every id forward, the newest record of each wins
+static void rollovers()
+{
+	format();
+	uint8_t data[200];
+	uint32_t erases = 0;
+	for(unsigned i = 0; i < 200; i++)
+	{
+		ConfigJournal journal;
+		memset(data, 0xFF, sizeof(data));
+		data[0] = i;
+		journal.write(i % 3, VERSION, data, sizeof(data));
+		erases += journal.erases();
+	}
+
+	bool ok = erases > 0;
+	for(unsigned i = 197; i < 200; i++)
+	{
+		memset(data, 0xFF, sizeof(data));
+		data[0] = i;
+		ok = readBack(i % 3, data, sizeof(data)) && ok;
+	}
+	char detail[32];
+	snprintf(detail, sizeof(detail), "%lu erases", (unsigned long)erases);
+	check(ok, "rollovers", detail);
+}
+
+int main()
+{
+	trailingFF();
+	erasedPayloads();
+	rollovers();
+
+	printf("%u failure(s)\n", failures);
+	return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,320 @@
+/* Host motion simulator for the SmartWindow actuator.
+ *
+ * Runs the firmware's SmartWindow/WindowActuator/Driver classes on the
+ * simulated AccelStepper and GPIO back end, the same way SmartWindow.ino
+ * drives them through the StepScheduler, and reports per-run() CPU cost,
+ * step timing and move times.
+ * Thresholds turn it into a regression check: the exit code is 1 when any
+ * of them is exceeded. See Simulation/README.md for the build line. */
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <vector>
+
+#include <Arduino.h>
+#include <SimHardware.h>
+#include <TimerWheel.h>
+#include "SmartWindow.h"
+#include "StepScheduler.h"
+#include "Calibration.h"
+#include "MotionRig.h"
+#include "SimStats.h"
+
+typedef struct
+{
+	unsigned windows = 1;			// Identical windows moving together
+	unsigned loopUs = 10;			// Virtual time spent per loop iteration besides run()
+	double cpuScale = 0;			// Adds host run() time * scale to the virtual clock
+	const char * moves = "close,open,close";
+	const char * trace = nullptr;	// CSV pin timeline
+	double maxJitterUs = -1;
+	double maxLateUs = -1;
+	double maxRunNs = -1;			// p99 of run() cost
+	double maxMoveMs = -1;
+} options_t;
+
+typedef struct
+{
+	SimStats runNs;			// Host CPU per run() call
+	SimStats lateUs;		// Step lateness against its due time
+	std::map<const AccelStepper*, unsigned long> stepsInMove;
+} probe_t;
+
+typedef struct
+{
+	config_t config;
+	MotionRig * rig;
+	SmartWindow * window;
+	LimitSwitch * openSens;
+	LimitSwitch * closeSens;
+	Calibration calibration;
+} node_window_t;
+
+static void stepProbe(void * ctx, const AccelStepper * stepper, long position,
+	unsigned long due, unsigned long actual)
+{
+	(void)position;
+	probe_t * probe = static_cast<probe_t*>(ctx);
+
+	// The first step of a move has no meaningful due time
+	if(probe->stepsInMove[stepper]++ > 0)
+		probe->lateUs.add((double)(actual - due));
+}
+
+static void usage(const char * name)
+{
+	printf("Usage: %s [options]\n"
+		"  --length MM --radius MM --rev-steps N --max-speed DEG/S --acc DEG/S2 --inverted\n"
+		"  --start MM --close-at MM --open-at MM --end-stop MM   (rig geometry)\n"
+		"  --stall-speed MM/S       the rig loses the steps faster than this\n"
+		"  --stall-acc MM/S2        the rig loses the steps while the speed changes faster\n"
+		"  --no-switches            run without limit switches\n"
+		"  --moves LIST             e.g. close,open,close or calibrate,open,close\n"
+		"  --windows N              move N identical windows at once (default 1, max %d)\n"
+		"  --loop-us US             virtual loop overhead per run() call (default 10)\n"
+		"  --cpu-scale F            add host run() time * F to the virtual clock\n"
+		"  --trace FILE             write the STEP/DIR/switch pin timeline as CSV\n"
+		"  --max-jitter-us US --max-late-us US --max-run-ns NS --max-move-ms MS\n", name,
+		STEP_SCHEDULER_SIZE);
+}
+
+int main(int argc, char ** argv)
+{
+	options_t opt;
+	config_t config;
+	MotionRig::rig_t rig;
+	bool switches = true;
+
+	config.limOpenSwitch = 14;
+	config.limCloseSwitch = 12;
+
+	for(int i = 1; i < argc; i++)
+	{
+		const char * a = argv[i];
+		const char * v = i + 1 < argc ? argv[i+1] : "";
+
+		if(!strcmp(a, "--length")) { config.length = atof(v); i++; }
+		else if(!strcmp(a, "--radius")) { config.radius = atof(v); i++; }
+		else if(!strcmp(a, "--rev-steps")) { config.revSteps = atoi(v); i++; }
+		else if(!strcmp(a, "--max-speed")) { config.maxSpeed = atof(v); i++; }
+		else if(!strcmp(a, "--acc")) { config.acc = atof(v); i++; }
+		else if(!strcmp(a, "--inverted")) { config.inverted = true; }
+		else if(!strcmp(a, "--start")) { rig.start = atof(v); i++; }
+		else if(!strcmp(a, "--close-at")) { rig.closeSwitch = atof(v); i++; }
+		else if(!strcmp(a, "--open-at")) { rig.openSwitch = atof(v); i++; }
+		else if(!strcmp(a, "--end-stop")) { rig.endStop = atof(v); i++; }
+		else if(!strcmp(a, "--stall-speed")) { rig.stallSpeed = atof(v); i++; }
+		else if(!strcmp(a, "--stall-acc")) { rig.stallAcc = atof(v); i++; }
+		else if(!strcmp(a, "--no-switches")) { switches = false; }
+		else if(!strcmp(a, "--moves")) { opt.moves = v; i++; }
+		else if(!strcmp(a, "--windows")) { opt.windows = atoi(v); i++; }
+		else if(!strcmp(a, "--loop-us")) { opt.loopUs = atoi(v); i++; }
+		else if(!strcmp(a, "--cpu-scale")) { opt.cpuScale = atof(v); i++; }
+		else if(!strcmp(a, "--trace")) { opt.trace = v; i++; }
+		else if(!strcmp(a, "--max-jitter-us")) { opt.maxJitterUs = atof(v); i++; }
+		else if(!strcmp(a, "--max-late-us")) { opt.maxLateUs = atof(v); i++; }
+		else if(!strcmp(a, "--max-run-ns")) { opt.maxRunNs = atof(v); i++; }
+		else if(!strcmp(a, "--max-move-ms")) { opt.maxMoveMs = atof(v); i++; }
+		else { usage(argv[0]); return 2; }
+	}
+
+	if(opt.windows < 1 || opt.windows > STEP_SCHEDULER_SIZE)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	SimHardware::reset();
+	SimHardware::record(opt.trace != nullptr);
+
+	probe_t probe;
+	AccelStepper::setStepProbe(stepProbe, &probe);
+
+	// Window 0 uses the default pins, the others get four pins each above
+	// the ESP8266 range: dir, step, open and close switch
+	std::vector<node_window_t> windows(opt.windows);
+	for(unsigned w = 0; w < opt.windows; w++)
+	{
+		node_window_t & nw = windows[w];
+		nw.config = config;
+		if(w > 0)
+		{
+			nw.config.dirPin = 13 + 4*w;
+			nw.config.stepPin = 14 + 4*w;
+			nw.config.slpPin = 0xFF;
+			nw.config.limOpenSwitch = 15 + 4*w;
+			nw.config.limCloseSwitch = 16 + 4*w;
+		}
+
+		MotionRig::rig_t r = rig;
+		r.dirPin = nw.config.dirPin;
+		r.stepPin = nw.config.stepPin;
+		r.revSteps = nw.config.revSteps;
+		r.radius = nw.config.radius;
+		r.inverted = nw.config.inverted;
+		if(switches)
+		{
+			r.openSwitchPin = nw.config.limOpenSwitch;
+			r.closeSwitchPin = nw.config.limCloseSwitch;
+		}
+		nw.rig = new MotionRig(r);
+		nw.rig->attach();
+
+		// Same bring-up as SmartWindow.ino
+		nw.window = new SmartWindow(nw.config);
+		nw.openSens = nullptr;
+		nw.closeSens = nullptr;
+		if(switches)
+		{
+			nw.openSens = new LimitSwitch(nw.config.limOpenSwitch);
+			nw.closeSens = new LimitSwitch(nw.config.limCloseSwitch);
+			nw.window->setSensor(nw.openSens, nw.closeSens);
+		}
+	}
+
+	StepScheduler scheduler;
+
+	// Totals over every rig
+	auto pulses = [&]() { unsigned long n = 0; for(node_window_t & nw : windows) n += nw.rig->stepPulses(); return n; };
+	auto lost = [&]() { unsigned long n = 0; for(node_window_t & nw : windows) n += nw.rig->lostSteps(); return n; };
+	auto dirChanges = [&]() { unsigned long n = 0; for(node_window_t & nw : windows) n += nw.rig->dirChanges(); return n; };
+
+	bool failed = false;
+	SimStats moveMs;
+
+	printf("move   steps  lost  time[ms]  pos[mm]  late p50/p99/max[us]  jitter[us]  run p50/p99/max[ns]  cpu/step[ns]\n");
+
+	char moves[256];
+	strncpy(moves, opt.moves, sizeof(moves) - 1);
+	moves[sizeof(moves) - 1] = '\0';
+
+	for(char * move = strtok(moves, ","); move; move = strtok(nullptr, ","))
+	{
+		probe.runNs.clear();
+		probe.lateUs.clear();
+		probe.stepsInMove.clear();
+		unsigned long stepsBefore = pulses();
+		unsigned long lostBefore = lost();
+		bool calibrate = !strcmp(move, "calibrate");
+
+		if(calibrate && !switches)
+		{
+			fprintf(stderr, "Calibrating needs the limit switches.\n");
+			return 2;
+		}
+
+		for(node_window_t & nw : windows)
+		{
+			if(calibrate)
+				nw.calibration.begin(nw.window);
+			else if(!strcmp(move, "open"))
+				nw.window->open();
+			else if(!strcmp(move, "close"))
+				nw.window->close();
+			else
+			{
+				fprintf(stderr, "Unknown move <%s>.\n", move);
+				return 2;
+			}
+		}
+
+		uint64_t start = SimHardware::now();
+
+		// loop() of SmartWindow.ino: blocking run until every move is done,
+		// or every calibration with all of its moves
+		for(node_window_t & nw : windows)
+		{
+			if(!calibrate && nw.window->isRunning())
+				scheduler.start(nw.window);
+		}
+
+		bool running = calibrate || scheduler.isRunning();
+		while(running)
+		{
+			auto t0 = std::chrono::steady_clock::now();
+			running = scheduler.run();
+			auto t1 = std::chrono::steady_clock::now();
+
+			for(node_window_t & nw : windows)
+				running = nw.calibration.run(scheduler) || running;
+			Timers.run();
+
+			double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+			probe.runNs.add(ns);
+			SimHardware::advance(opt.loopUs + (uint64_t)(ns*opt.cpuScale/1000.0));
+		}
+
+		double ms = (SimHardware::now() - start)/1000.0;
+		moveMs.add(ms);
+
+		unsigned long steps = pulses() - stepsBefore;
+		printf("%-6s %6lu %5lu %9.1f %8.2f  %6.1f/%6.1f/%6.1f  %10.2f  %6.0f/%6.0f/%6.0f  %12.0f\n",
+			move, steps, lost() - lostBefore, ms,
+			windows[0].rig->position(), probe.lateUs.percentile(50), probe.lateUs.percentile(99),
+			probe.lateUs.max(), probe.lateUs.stddev(), probe.runNs.percentile(50),
+			probe.runNs.percentile(99), probe.runNs.max(), steps ? probe.runNs.sum()/steps : 0.0);
+
+		for(unsigned w = 0; calibrate && w < opt.windows; w++)
+		{
+			node_window_t & nw = windows[w];
+			if(nw.calibration.phase() == Calibration::FAILED)
+			{
+				printf("  window %u: calibration failed: %s\n", w, nw.calibration.err());
+				nw.window->setConfig(nw.config);
+				failed = true;
+				continue;
+			}
+
+			// As SmartWindow.ino applies it
+			nw.config.length = nw.calibration.length();
+			nw.config.maxSpeed = nw.calibration.maxSpeed();
+			nw.config.acc = nw.calibration.acc();
+			nw.window->setConfig(nw.config);
+			printf("  window %u: length %.2f mm, max speed %.0f deg/s, acc %.0f deg/s2\n",
+				w, nw.config.length, nw.config.maxSpeed, nw.config.acc);
+		}
+
+		if(opt.maxJitterUs >= 0 && probe.lateUs.stddev() > opt.maxJitterUs)
+			failed = true;
+		if(opt.maxLateUs >= 0 && probe.lateUs.max() > opt.maxLateUs)
+			failed = true;
+		if(opt.maxRunNs >= 0 && probe.runNs.percentile(99) > opt.maxRunNs)
+			failed = true;
+		if(opt.maxMoveMs >= 0 && ms > opt.maxMoveMs)
+			failed = true;
+	}
+
+	printf("total: %.1f ms of motion, %lu step pulses, %lu lost, %lu direction changes\n",
+		moveMs.sum(), pulses(), lost(), dirChanges());
+
+	if(opt.trace)
+	{
+		FILE * f = fopen(opt.trace, "w");
+		if(!f)
+		{
+			fprintf(stderr, "Could not open <%s>.\n", opt.trace);
+			return 2;
+		}
+		fprintf(f, "time_us,pin,level\n");
+		for(const SimHardware::PinEvent & e : SimHardware::timeline())
+			fprintf(f, "%llu,%u,%u\n", (unsigned long long)e.time, e.pin, e.level);
+		fclose(f);
+	}
+
+	for(node_window_t & nw : windows)
+	{
+		delete nw.window;
+		delete nw.openSens;
+		delete nw.closeSens;
+		delete nw.rig;
+	}
+
+	if(failed)
+	{
+		printf("FAILED: a timing threshold was exceeded or a calibration failed.\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,677 @@
+/* Deterministic simulation of the whole weather -> broker -> window chain.
+ *
+ * Everything runs in one thread on the virtual clock of SimHardware:
+ *   - WeatherMQTT from WeatherClient fetches from a simulated weather API
+ *     (the WiFiClient stand-in) that serves a recorded weather series, or a
+ *     synthetic one, as OpenWeatherMap would;
+ *   - myMQTTBroker with the Automated Window, routed like Broker.ino does;
+ *   - the SmartWindow node: its windows on MotionRig models with limit
+ *     switches, fed through CommandQueue and StepScheduler as SmartWindow.ino
+ *     does.
+ * Time moves in --loop-us steps while a motor runs and in --idle-ms steps
+ * otherwise, so a simulated week takes seconds and two runs give the same
+ * result.
+ *
+ * The timeline lists the weather fetched, the commands and every move. The
+ * summary counts moves, motor runtime, duplicated moves (the window was at
+ * the target already, or had moved toward it since the decision) and missed
+ * ones (a decision the window never carried out). More moves than decisions
+ * fail the run. See Simulation/README.md. */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "SimHardware.h"
+#include "SimMqttClient.h"
+#include "MotionRig.h"
+#include "myBroker.h"
+#include "AutomationClient.h"
+#include "weather.h"
+#include "SmartWindow.h"
+#include "StepScheduler.h"
+#include "CommandQueue.h"
+#include "TimerWheel.h"
+
+#define SERIES_EPOCH 1700000000UL		// Start of the synthetic series
+#define FORECAST_STEP_S 10800UL			// OpenWeatherMap forecasts are 3 h apart
+
+typedef struct
+{
+	const char * weather = nullptr;	// CSV series, synthetic if none
+	double days = 0;				// 0: 7, or the span of the series
+	unsigned seed = 1;
+	unsigned periodMin = 10;		// WeatherClient fetch period
+	unsigned npredictions = 2;
+	unsigned windows = 1;
+	unsigned loopUs = 10;			// Virtual time per loop while a motor runs
+	unsigned idleMs = 1000;			// ... and while all stand still
+	float start = 0;				// Carriage position at power up, mm
+	const char * config = nullptr;	// Automated Window configuration
+	const char * timeline = nullptr;
+	long maxMissed = -1;
+	long maxDuplicated = -1;
+	bool aliases = false;			// The window node registers topic aliases
+	bool verbose = false;
+} options_t;
+
+// One weather observation, t in seconds since the start of the series
+typedef struct
+{
+	uint32_t t;
+	int id;
+	float temp;
+	float humidity;
+	float wind;
+} sample_t;
+
+typedef struct
+{
+	MotionRig * rig;
+	SmartWindow * window;
+	LimitSwitch * openSens;
+	LimitSwitch * closeSens;
+
+	// Last decision of the Automated Window and whether the window got there
+	CommandQueue::Command wanted = CommandQueue::NONE;
+	bool satisfied = true;
+	// A move toward it started since
+	bool moved = false;
+
+	// Move in progress
+	bool moving = false;
+	CommandQueue::Command target = CommandQueue::NONE;
+	uint64_t startUs = 0;
+	unsigned long pulses = 0;
+	unsigned long lost = 0;
+} node_window_t;
+
+typedef struct
+{
+	unsigned long fetches = 0;
+	unsigned long fetchErrors = 0;
+	unsigned long commands[3] = {0, 0, 0};	// By CommandQueue::Command
+	unsigned long decisions = 0;			// Commands that differ from the one before
+	unsigned long moves = 0;
+	unsigned long duplicated = 0;
+	unsigned long interrupted = 0;			// Stopped short by a newer command
+	unsigned long missed = 0;
+	uint64_t runtimeUs = 0;
+	uint64_t longestUs = 0;
+	unsigned long steps = 0;
+	unsigned long lost = 0;
+	unsigned long topicBytes = 0;			// Of the commands the window node received
+} summary_t;
+
+static options_t opt;
+static std::vector<sample_t> series;
+static uint32_t epoch = SERIES_EPOCH;
+static std::vector<node_window_t> windows;
+static std::vector<SmartWindow*> windowPtrs;
+static summary_t summary;
+static FILE * timeline = nullptr;
+
+myMQTTBroker myBroker(1883, 10000, 64);
+AutomatedWindow<myMQTTBroker> autoWindow(&myBroker);
+
+SimMqttClient weatherMqtt(myBroker);
+WiFiClient weatherWiFi;
+WeatherMQTT<SimMqttClient> weatherService("simulated", &weatherWiFi, &weatherMqtt);
+
+SimMqttClient windowMqtt(myBroker);
+StepScheduler scheduler;
+CommandQueue commands;
+// With --aliases, command i of WINDOW_TOPICS is CommandQueue::Command i+1
+TopicAlias windowAliases;
+
+static const char * const WINDOW_TOPICS[] = {"smarthome/window/open", "smarthome/window/close"};
+#define WINDOW_ALIAS_REPLY "smarthome/node/alias"
+
+static const char * const COMMAND_NAMES[] = {"none", "open", "close"};
+
+
+/* Weather series */
+
+static const char * describe(int id, const char ** description)
+{
+	switch(id)
+	{
+		case 800: *description = "clear sky"; return "Clear";
+		case 801: *description = "few clouds"; return "Clouds";
+		case 803: *description = "broken clouds"; return "Clouds";
+		case 500: *description = "light rain"; return "Rain";
+		case 501: *description = "moderate rain"; return "Rain";
+	}
+	*description = id >= 800 ? "clouds" : id >= 700 ? "mist" : id >= 600 ? "snow" : id >= 300 ? "rain" : "thunderstorm";
+	return id >= 800 ? "Clouds" : id >= 700 ? "Mist" : id >= 600 ? "Snow" : id >= 300 ? "Rain" : "Thunderstorm";
+}
+
+// Lines of unix time, weather id, temperature, humidity, wind speed; the
+// others (headers, comments) are skipped
+static bool loadSeries(const char * path)
+{
+	FILE * f = fopen(path, "r");
+	if(f == nullptr)
+		return false;
+
+	char line[256];
+	unsigned long first = 0;
+	while(fgets(line, sizeof(line), f) != nullptr)
+	{
+		unsigned long t;
+		sample_t s;
+		if(sscanf(line, "%lu,%d,%f,%f,%f", &t, &s.id, &s.temp, &s.humidity, &s.wind) != 5)
+			continue;
+		if(series.empty())
+			first = t;
+		if(t < first)
+			continue;
+		s.t = t - first;
+		series.push_back(s);
+	}
+	fclose(f);
+
+	epoch = first;
+	std::stable_sort(series.begin(), series.end(), [](const sample_t & a, const sample_t & b) { return a.t < b.t; });
+	return !series.empty();
+}
+
+// Hourly weather with a daily cycle, drifting over the days, and spells of
+// rain and wind. The same seed gives the same series.
+static void synthesize(double days, unsigned seed)
+{
+	uint32_t state = seed*2654435761u + 1;
+	auto random = [&](unsigned range) { state = state*1103515245u + 12345u; return (state >> 16) % range; };
+
+	unsigned rain = 0, windy = 0;
+	unsigned hours = (unsigned)ceil(days*24) + 24;
+	for(unsigned h = 0; h <= hours; h++)
+	{
+		double day = sin(2*PI*((h % 24) - 9)/24.0);
+		sample_t s;
+		s.t = h*3600;
+		s.temp = 15 + 3*sin(2*PI*h/(24.0*5)) + 6*day + random(20)/10.0;
+		s.humidity = 52 - 22*day + random(8);
+		s.wind = 2.5 + 1.5*sin(2*PI*h/17.0) + random(10)/10.0;
+
+		if(rain == 0 && random(100) < 4)
+			rain = 2 + random(5);
+		if(windy == 0 && random(100) < 3)
+			windy = 3 + random(6);
+		if(rain > 0)
+		{
+			rain--;
+			s.humidity = std::min(100.0f, s.humidity + 30);
+			s.temp -= 3;
+		}
+		if(windy > 0)
+		{
+			windy--;
+			s.wind += 6 + random(40)/10.0;
+		}
+
+		s.id = rain > 0 ? (random(3) == 0 ? 501 : 500) : s.humidity > 70 ? 803 : s.humidity > 55 ? 801 : 800;
+		series.push_back(s);
+	}
+}
+
+// Weather at t: the last observation before, as a station reports it
+static const sample_t & sampleAt(uint32_t t)
+{
+	auto it = std::upper_bound(series.begin(), series.end(), t,
+		[](uint32_t t, const sample_t & s) { return t < s.t; });
+	return it == series.begin() ? series.front() : *(it - 1);
+}
+
+static double seconds() { return SimHardware::now()/1e6; }
+
+static void logEvent(const char * event, int window, const char * fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void logEvent(const char * event, int window, const char * fmt, ...)
+{
+	if(timeline == nullptr && !opt.verbose)
+		return;
+
+	char detail[160];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(detail, sizeof(detail), fmt, args);
+	va_end(args);
+
+	if(timeline != nullptr)
+		fprintf(timeline, "%.3f,%u,%s,%d,%s\n", seconds(), (unsigned)(seconds()/86400) + 1, event, window, detail);
+	if(opt.verbose)
+		printf("%12.3f %-10s %2d %s\n", seconds(), event, window, detail);
+}
+
+// Same fields as the OpenWeatherMap replies Weather::get() parses
+static int printSample(char * buf, size_t len, const sample_t & s, uint32_t t)
+{
+	const char * description;
+	const char * main = describe(s.id, &description);
+	return snprintf(buf, len,
+		"\"weather\":[{\"id\":%d,\"main\":\"%s\",\"description\":\"%s\"}],"
+		"\"main\":{\"temp\":%.2f,\"feels_like\":%.2f,\"humidity\":%.0f},\"wind\":{\"speed\":%.2f},\"dt\":%lu",
+		s.id, main, description, s.temp, s.temp - 0.3*s.wind, s.humidity, s.wind, (unsigned long)(epoch + t));
+}
+
+// The weather API: current weather or the forecasts after now
+static bool weatherApi(void * context, const char * host, const std::string & request, std::string & reply)
+{
+	uint32_t now = SimHardware::now()/1000000;
+	char body[4096];
+	int n;
+
+	if(request.find("/data/2.5/forecast") != std::string::npos)
+	{
+		size_t cnt = request.find("&cnt=");
+		unsigned count = cnt != std::string::npos ? strtoul(request.c_str() + cnt + 5, nullptr, 10) : 0;
+		uint32_t t = (now/FORECAST_STEP_S + 1)*FORECAST_STEP_S;
+
+		n = snprintf(body, sizeof(body), "{\"cod\":\"200\",\"cnt\":%u,\"list\":[", count);
+		for(unsigned i = 0; i < count && n > 0 && (size_t)n < sizeof(body); i++, t += FORECAST_STEP_S)
+		{
+			n += snprintf(body + n, sizeof(body) - n, "%s{", i == 0 ? "" : ",");
+			if((size_t)n < sizeof(body))
+				n += printSample(body + n, sizeof(body) - n, sampleAt(t), t);
+			if((size_t)n < sizeof(body))
+				n += snprintf(body + n, sizeof(body) - n, "}");
+		}
+		if(n > 0 && (size_t)n < sizeof(body))
+			n += snprintf(body + n, sizeof(body) - n, "]}");
+	}
+	else
+	{
+		const sample_t & s = sampleAt(now);
+		n = snprintf(body, sizeof(body), "{");
+		n += printSample(body + n, sizeof(body) - n, s, now);
+		if(n > 0 && (size_t)n < sizeof(body))
+			n += snprintf(body + n, sizeof(body) - n, "}");
+
+		summary.fetches++;
+		logEvent("weather", -1, "id=%d temp=%.1f humidity=%.0f wind=%.1f", s.id, s.temp, s.humidity, s.wind);
+	}
+	if(n <= 0 || (size_t)n >= sizeof(body))
+		return false;
+
+	reply = "HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\nConnection: close\r\n\r\n";
+	reply += body;
+	return true;
+}
+
+
+/* Broker side, as in Broker.ino */
+
+void autoWindowHandler(const char* topic, const char* payload, uint32_t length, void* context)
+{
+	MemScope mem(MEM_OP_CALLBACK);
+	autoWindow.callback(topic,payload,length);
+}
+
+void aliasRegister(const char* topic, const char* payload, uint32_t length, void* context)
+{
+	myBroker.registerAliases(payload);
+}
+
+bool logPublish(const char * topic, const char * payload)
+{
+	return myBroker.publish(topic, (uint8_t*)payload, strlen(payload));
+}
+
+unsigned long logClock()
+{
+	return epoch + millis()/1000;
+}
+
+
+/* Node sides */
+
+void weatherCallback(char* topic, byte* payload, unsigned int length)
+{
+	weatherService.callback(topic, payload, length);
+}
+
+static bool atTarget(node_window_t & nw, CommandQueue::Command command)
+{
+	return command == CommandQueue::OPEN ? nw.rig->openTriggered() : nw.rig->closeTriggered();
+}
+
+// Every window of the node follows the Automated Window, as SmartWindow.ino
+// queues the commands of its root topics
+void windowCallback(char* topic, byte* payload, unsigned int length)
+{
+	// Aliases in place of the full topics, as SmartWindow.ino does
+	if(!strcmp(topic, WINDOW_ALIAS_REPLY))
+	{
+		windowAliases.accept((const char*)payload, 2);
+		char alias[ALIAS_TOPIC_SIZE];
+		for(uint8_t i = 0; i < 2; i++)
+		{
+			uint8_t id = windowAliases.id(i);
+			if(id != 0 && windowMqtt.subscribe(TopicAlias::print(id, alias, sizeof(alias))))
+				windowMqtt.unsubscribe(WINDOW_TOPICS[i]);
+		}
+		logEvent("aliases", -1, "count=%u", windowAliases.count());
+		return;
+	}
+
+	size_t n = strlen(topic);
+	int alias = windowAliases.command(topic);
+	CommandQueue::Command command = alias >= 0 ? (CommandQueue::Command)(alias + 1) :
+		n >= 5 && !strcmp(topic + n - 5, "/open") ? CommandQueue::OPEN :
+		n >= 6 && !strcmp(topic + n - 6, "/close") ? CommandQueue::CLOSE : CommandQueue::NONE;
+	if(command == CommandQueue::NONE)
+		return;
+
+	summary.commands[command]++;
+	summary.topicBytes += n;
+	for(uint8_t w = 0; w < windows.size(); w++)
+	{
+		node_window_t & nw = windows[w];
+		if(command != nw.wanted)
+		{
+			summary.decisions++;
+			if(!nw.satisfied)
+			{
+				summary.missed++;
+				logEvent("missed", w, "command=%s", COMMAND_NAMES[nw.wanted]);
+			}
+			nw.wanted = command;
+			nw.satisfied = atTarget(nw, command);
+			nw.moved = false;
+			logEvent("command", w, "command=%s", COMMAND_NAMES[command]);
+		}
+		if(!commands.push(w, command))
+			LOG_ERROR("Command for window %u was not queued.", w);
+	}
+}
+
+// Notices moves that started or ended since the last call
+static void track()
+{
+	for(uint8_t w = 0; w < windows.size(); w++)
+	{
+		node_window_t & nw = windows[w];
+		bool moving = nw.window->isRunning();
+		if(moving == nw.moving)
+			continue;
+		nw.moving = moving;
+
+		if(moving)
+		{
+			nw.target = nw.window->getStatus() == SmartWindow::OPENING ? CommandQueue::OPEN : CommandQueue::CLOSE;
+			nw.startUs = SimHardware::now();
+			nw.pulses = nw.rig->stepPulses();
+			nw.lost = nw.rig->lostSteps();
+			summary.moves++;
+			// A second move for the same decision is one too many, wherever the first stopped
+			bool duplicated = atTarget(nw, nw.target) || (nw.target == nw.wanted && nw.moved);
+			if(nw.target == nw.wanted)
+				nw.moved = true;
+			if(duplicated)
+				summary.duplicated++;
+			logEvent("move", w, "target=%s position=%.1f%s", COMMAND_NAMES[nw.target], nw.rig->position(),
+				duplicated ? " duplicated" : "");
+			continue;
+		}
+
+		uint64_t duration = SimHardware::now() - nw.startUs;
+		unsigned long steps = nw.rig->stepPulses() - nw.pulses;
+		unsigned long lost = nw.rig->lostSteps() - nw.lost;
+		bool reached = atTarget(nw, nw.target);
+		summary.runtimeUs += duration;
+		summary.longestUs = std::max(summary.longestUs, duration);
+		summary.steps += steps;
+		summary.lost += lost;
+		if(!reached && commands.pending(w))
+			summary.interrupted++;
+		if(reached && nw.target == nw.wanted)
+			nw.satisfied = true;
+		logEvent("stop", w, "target=%s position=%.1f steps=%lu lost=%lu ms=%.0f%s", COMMAND_NAMES[nw.target],
+			nw.rig->position(), steps, lost, duration/1000.0, reached ? "" : " short");
+	}
+}
+
+
+static void usage(const char * name)
+{
+	printf("Usage: %s [options]\n"
+		"  --weather FILE           CSV series: unix time,weather id,temp,humidity,wind\n"
+		"  --days D                 simulated days (7, or the span of --weather)\n"
+		"  --seed N                 of the synthetic series (1)\n"
+		"  --period-min M           WeatherClient fetch period (10)\n"
+		"  --npredictions N         forecasts per weather report (2)\n"
+		"  --config JSON            Automated Window configuration\n"
+		"  --windows N              windows on the SmartWindow node (1, max %d)\n"
+		"  --start MM               carriage position at power up (0, closed)\n"
+		"  --loop-us US             virtual time per loop while a motor runs (10)\n"
+		"  --idle-ms MS             virtual time per loop while none does (1000)\n"
+		"  --timeline FILE          write the events as CSV\n"
+		"  --max-missed N --max-duplicated N   exit code 1 above N\n"
+		"  --aliases                the window node gets its commands on topic aliases\n"
+		"  --verbose                print the events and the log\n", name, STEP_SCHEDULER_SIZE);
+}
+
+int main(int argc, char ** argv)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		const char * a = argv[i];
+		const char * v = i + 1 < argc ? argv[i+1] : "";
+
+		if(!strcmp(a, "--weather")) { opt.weather = v; i++; }
+		else if(!strcmp(a, "--days")) { opt.days = atof(v); i++; }
+		else if(!strcmp(a, "--seed")) { opt.seed = atoi(v); i++; }
+		else if(!strcmp(a, "--period-min")) { opt.periodMin = atoi(v); i++; }
+		else if(!strcmp(a, "--npredictions")) { opt.npredictions = atoi(v); i++; }
+		else if(!strcmp(a, "--config")) { opt.config = v; i++; }
+		else if(!strcmp(a, "--windows")) { opt.windows = atoi(v); i++; }
+		else if(!strcmp(a, "--start")) { opt.start = atof(v); i++; }
+		else if(!strcmp(a, "--loop-us")) { opt.loopUs = atoi(v); i++; }
+		else if(!strcmp(a, "--idle-ms")) { opt.idleMs = atoi(v); i++; }
+		else if(!strcmp(a, "--timeline")) { opt.timeline = v; i++; }
+		else if(!strcmp(a, "--max-missed")) { opt.maxMissed = atol(v); i++; }
+		else if(!strcmp(a, "--max-duplicated")) { opt.maxDuplicated = atol(v); i++; }
+		else if(!strcmp(a, "--aliases")) { opt.aliases = true; }
+		else if(!strcmp(a, "--verbose")) { opt.verbose = true; }
+		else { usage(argv[0]); return 2; }
+	}
+	if(opt.windows < 1 || opt.windows > STEP_SCHEDULER_SIZE || opt.periodMin == 0 || opt.loopUs == 0 ||
+		opt.idleMs == 0 || opt.days < 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	if(opt.weather != nullptr)
+	{
+		if(!loadSeries(opt.weather))
+		{
+			fprintf(stderr, "Could not read a weather series from <%s>.\n", opt.weather);
+			return 2;
+		}
+		if(opt.days == 0)
+			opt.days = series.back().t/86400.0;
+	}
+	else
+	{
+		if(opt.days == 0)
+			opt.days = 7;
+		synthesize(opt.days, opt.seed);
+	}
+	if(opt.timeline != nullptr)
+	{
+		timeline = fopen(opt.timeline, "w");
+		if(timeline == nullptr)
+		{
+			fprintf(stderr, "Could not create <%s>.\n", opt.timeline);
+			return 2;
+		}
+		fprintf(timeline, "time[s],day,event,window,detail\n");
+	}
+
+	SimHardware::reset();
+	static Print serial;
+	RingLog::setLevel(RingLog::LEVEL_INFO);
+	if(opt.verbose)
+		RingLog::setSerial(&serial);
+	RingLog::setPrefix("Pipeline");
+	RingLog::setClock(logClock);
+	RetainedSnapshot::setClock(logClock);
+	TrafficCapture::setClock(logClock);
+
+	// Broker
+	myBroker.init();
+	RingLog::setSink(logPublish, "log");
+	char rootTopic[TOPIC_BUFFER_SIZE];
+	myBroker.on(autoWindow.getMqttTopic().join(rootTopic, sizeof(rootTopic), "/#"), autoWindowHandler);
+	myBroker.on(autoWindow.getWeatherTopic().c_str(), autoWindowHandler);
+	myBroker.on(ALIAS_REGISTER_TOPIC, aliasRegister);
+	myBroker.subscribe(ALIAS_REGISTER_TOPIC);
+	autoWindow.subscribe();
+	if(opt.config != nullptr && !autoWindow.setConfig(opt.config))
+	{
+		fprintf(stderr, "Configuration was not applied: %s\n", autoWindow.err());
+		return 2;
+	}
+
+	// WeatherClient
+	WiFiClient::setResponder(weatherApi, nullptr);
+	weatherMqtt.connect();
+	weatherMqtt.setCallback(weatherCallback);
+	weatherService.setCity("Simulated");
+	weatherService.setnPredictions(opt.npredictions);
+	weatherService.setPeriod(opt.periodMin*60UL);
+	weatherService.subscribe();
+
+	// SmartWindow: window 0 on the default pins, the others on four pins each
+	// above the ESP8266 range, as motion_sim does
+	windows.resize(opt.windows);
+	for(unsigned w = 0; w < opt.windows; w++)
+	{
+		node_window_t & nw = windows[w];
+		config_t config;
+		config.limOpenSwitch = 14;
+		config.limCloseSwitch = 12;
+		if(w > 0)
+		{
+			config.dirPin = 13 + 4*w;
+			config.stepPin = 14 + 4*w;
+			config.slpPin = 0xFF;
+			config.limOpenSwitch = 15 + 4*w;
+			config.limCloseSwitch = 16 + 4*w;
+		}
+
+		MotionRig::rig_t r;
+		r.dirPin = config.dirPin;
+		r.stepPin = config.stepPin;
+		r.openSwitchPin = config.limOpenSwitch;
+		r.closeSwitchPin = config.limCloseSwitch;
+		r.revSteps = config.revSteps;
+		r.radius = config.radius;
+		r.inverted = config.inverted;
+		r.start = opt.start;
+		nw.rig = new MotionRig(r);
+		nw.rig->attach();
+
+		nw.window = new SmartWindow(config);
+		nw.openSens = new LimitSwitch(config.limOpenSwitch);
+		nw.closeSens = new LimitSwitch(config.limCloseSwitch);
+		nw.window->setSensor(nw.openSens, nw.closeSens);
+		windowPtrs.push_back(nw.window);
+	}
+	windowMqtt.connect();
+	windowMqtt.setCallback(windowCallback);
+	for(const char * topic : WINDOW_TOPICS)
+		windowMqtt.subscribe(topic);
+	if(opt.aliases)
+	{
+		windowMqtt.subscribe(WINDOW_ALIAS_REPLY);
+		std::string request = WINDOW_ALIAS_REPLY;
+		for(const char * topic : WINDOW_TOPICS)
+			request += std::string("\n") + topic;
+		windowMqtt.publish(ALIAS_REGISTER_TOPIC, request.c_str());
+	}
+
+	uint64_t endUs = (uint64_t)(opt.days*86400e6);
+	auto wallStart = std::chrono::steady_clock::now();
+	unsigned long loops = 0;
+
+	// Past the end only the moves still running finish
+	while(SimHardware::now() < endUs || scheduler.isRunning())
+	{
+		Timers.run();
+		if(SimHardware::now() < endUs && !weatherService.run())
+			summary.fetchErrors++;
+		while(myBroker.loop() > 0);
+		RingLog::flush();
+
+		// Before and after dispatch, which may end one move and start the next
+		track();
+		commands.dispatch(windowPtrs.data(), windowPtrs.size(), scheduler);
+		track();
+
+		if(scheduler.isRunning())
+		{
+			scheduler.run();
+			SimHardware::advance(opt.loopUs);
+		}
+		else
+			SimHardware::advance(opt.idleMs*1000UL);
+		loops++;
+	}
+	track();
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+	for(uint8_t w = 0; w < windows.size(); w++)
+	{
+		if(!windows[w].satisfied)
+		{
+			summary.missed++;
+			logEvent("missed", w, "command=%s", COMMAND_NAMES[windows[w].wanted]);
+		}
+	}
+	if(timeline != nullptr)
+		fclose(timeline);
+
+	double days = seconds()/86400;
+	printf("%.2f days simulated in %.2f s (%lu loops), %u window(s), %lu weather fetches, %lu failed\n",
+		days, wall, loops, opt.windows, summary.fetches, summary.fetchErrors);
+	printf("commands: %lu open, %lu close, %lu decisions (a change for a window)\n",
+		summary.commands[CommandQueue::OPEN], summary.commands[CommandQueue::CLOSE], summary.decisions);
+	printf("moves: %lu, %.1f per day; %lu coalesced and %lu preempted by the queue, %lu interrupted\n",
+		summary.moves, days > 0 ? summary.moves/days : 0.0, (unsigned long)commands.coalesced(),
+		(unsigned long)commands.preempted(), summary.interrupted);
+	printf("motor runtime: %.1f s, %.1f s per day, longest move %.0f ms, %lu steps, %lu lost at the end stops\n",
+		summary.runtimeUs/1e6, days > 0 ? summary.runtimeUs/1e6/days : 0.0, summary.longestUs/1000.0,
+		summary.steps, summary.lost);
+	printf("duplicated moves: %lu, missed moves: %lu\n", summary.duplicated, summary.missed);
+	unsigned long received = summary.commands[CommandQueue::OPEN] + summary.commands[CommandQueue::CLOSE];
+	printf("window node: %.1f topic bytes per command%s\n", received > 0 ? (double)summary.topicBytes/received : 0.0,
+		windowAliases.count() > 0 ? ", on aliases" : "");
+
+	bool ok = true;
+	if(summary.moves > summary.decisions)
+	{
+		printf("FAILED: %lu moves for %lu decisions.\n", summary.moves, summary.decisions);
+		ok = false;
+	}
+	if(opt.maxMissed >= 0 && (long)summary.missed > opt.maxMissed)
+	{
+		printf("FAILED: more than %ld missed moves.\n", opt.maxMissed);
+		ok = false;
+	}
+	if(opt.maxDuplicated >= 0 && (long)summary.duplicated > opt.maxDuplicated)
+	{
+		printf("FAILED: more than %ld duplicated moves.\n", opt.maxDuplicated);
+		ok = false;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+/* Compiles window rules and evaluates them on the host.
+ *
+ * Every case compiles a rule, fills in the values and the precipitation of
+ * the reports, and compares what evaluate() returns with what the rule
+ * means. Forecasts a report does not have must count as rain, so a short
+ * report never opens a window on !rain(nextN). The exit code is 1 if any
+ * case fails. See Simulation/README.md. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <Arduino.h>
+#include <WindowRule.h>
+
+static unsigned failures = 0;
+
+static void check(bool ok, const char * name, const char * detail = "")
+{
+	printf("%-4s %s%s%s\n", ok ? "ok" : "FAIL", name, *detail ? ": " : "", detail);
+	if(!ok)
+		failures++;
+}
+
+// Evaluates source on reports reports, the current weather and the
+// forecasts after it, with rain as in WindowRule::evaluate()
+static bool evaluate(const char * source, uint8_t rain, uint8_t reports, bool expected)
+{
+	WindowRule rule;
+	if(!rule.compile(source))
+	{
+		printf("     %s\n", WindowRule::err());
+		return false;
+	}
+
+	float vars[RULE_VARS] = {};
+	vars[RULE_VAR_ID] = 800;
+	vars[RULE_VAR_TEMP] = 21;
+	vars[RULE_VAR_WIND] = 3;
+	vars[RULE_VAR_HUMIDITY] = 40;
+	return rule.evaluate(vars, rain, reports) == expected;
+}
+
+static void values()
+{
+	check(evaluate("wind < 6 && temp in 18..28", 0, 1, true), "values in range");
+	check(evaluate("wind < 6 && temp in 22..28", 0, 1, false), "value out of range");
+	check(evaluate("humidity > 50 || id == 800", 0, 1, true), "or");
+}
+
+static void rain()
+{
+	check(evaluate("!rain", 0, 1, true), "no rain now");
+	check(evaluate("!rain", 1, 1, false), "rain now");
+	check(evaluate("!rain(next2)", 0, 3, true), "no rain in the next 2");
+	check(evaluate("!rain(next2)", 1 << 2, 3, false), "rain in the second forecast");
+	check(evaluate("!rain(next2)", 1 << 3, 4, true), "rain past the forecasts looked at");
+}
+
+// The report has fewer forecasts than the rule looks at
+static void missingForecasts()
+{
+	check(evaluate("!rain(next2)", 0, 2, false), "one of two forecasts missing");
+	check(evaluate("!rain(next2)", 0, 1, false), "both forecasts missing");
+	check(evaluate("rain(next3)", 0, 2, true), "rain(next3) with one forecast");
+	check(evaluate("!rain && wind < 6", 0, 1, true), "current report alone, no forecast looked at");
+	check(evaluate("!rain", 0, 0, false), "no report at all");
+}
+
+static void errors()
+{
+	WindowRule rule;
+	check(!rule.compile("wind <"), "incomplete rule rejected");
+	check(!rule.compile("rain(next8)"), "rain(next8) rejected");
+	check(rule.compile("") && rule.empty(), "empty source clears the rule");
+}
+
+int main()
+{
+	values();
+	rain();
+	missingForecasts();
+	errors();
+
+	printf("%u failure(s)\n", failures);
+	return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+/* Latency report for the weather to window traces.
+ *
+ * Reads MQTT traffic captured with
+ *   mosquitto_sub -h <broker> -R -t '#' -F '%U %t %p'
+ * i.e. one "<unix time> <topic> <payload>" line per message, and reports
+ * percentiles of every stage of the traces SmartWindow publishes to
+ * <root>/trace (see Common/src/Trace.h).
+ *
+ * Each node stamps the trace with its own millis(). The arrival times of
+ * the weather report and of the window command on this host tie the clocks
+ * together: it is the only clock that sees messages of all three nodes.
+ * Lines without a leading time are accepted too; then only the stages
+ * inside one node are reported. See Simulation/README.md. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+
+#include "SimStats.h"
+
+typedef struct
+{
+	double maxMs = -1;			// Traces taking longer are ignored (stale retained reports)
+	double maxTotalMs = -1;		// p99 threshold
+	bool verbose = false;
+} options_t;
+
+typedef struct
+{
+	double weather = -1;		// Host arrival of the weather report, ms
+	double command = -1;		// Host arrival of the open/close command, ms
+} arrival_t;
+
+enum Stage
+{
+	STAGE_FETCH,		// WeatherClient: request sent -> weather published
+	STAGE_DECIDE,		// Weather published -> command published by the broker
+	STAGE_QUEUE,		// SmartWindow: command received -> move started
+	STAGE_MOTION,		// SmartWindow: move started -> move finished
+	STAGE_TOTAL,		// Request sent -> move finished
+	STAGE_COUNT
+};
+
+static const char * const STAGE_NAMES[STAGE_COUNT] = {"fetch", "decide", "queue", "motion", "total"};
+
+// Unsigned value of "key": inside the JSON object starting at obj. Trace
+// objects are flat, so the search stops at the first closing brace.
+static bool field(const char * obj, const char * key, double & value)
+{
+	const char * end = strchr(obj, '}');
+	std::string pattern = std::string("\"") + key + "\":";
+
+	const char * p = strstr(obj, pattern.c_str());
+	if(p == nullptr || (end != nullptr && p > end))
+		return false;
+
+	char * stop = nullptr;
+	value = strtod(p + pattern.size(), &stop);
+	return stop != p + pattern.size();
+}
+
+static bool endsWith(const std::string & s, const char * suffix)
+{
+	size_t n = strlen(suffix);
+	return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static void usage(const char * name)
+{
+	printf("Usage: %s [options] [FILE]   (reads stdin without FILE)\n"
+		"  --max-ms MS              ignore traces whose total exceeds MS\n"
+		"  --max-total-ms MS        exit code 1 if the total p99 exceeds MS\n"
+		"  --verbose                print every trace\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+	options_t opt;
+	const char * path = nullptr;
+
+	for(int i = 1; i < argc; i++)
+	{
+		const char * a = argv[i];
+		const char * v = i + 1 < argc ? argv[i+1] : "";
+
+		if(!strcmp(a, "--max-ms")) { opt.maxMs = atof(v); i++; }
+		else if(!strcmp(a, "--max-total-ms")) { opt.maxTotalMs = atof(v); i++; }
+		else if(!strcmp(a, "--verbose")) { opt.verbose = true; }
+		else if(a[0] != '-' && path == nullptr) { path = a; }
+		else { usage(argv[0]); return 2; }
+	}
+
+	FILE * in = path != nullptr ? fopen(path, "r") : stdin;
+	if(in == nullptr)
+	{
+		fprintf(stderr, "Could not open <%s>.\n", path);
+		return 2;
+	}
+
+	std::map<unsigned long, arrival_t> arrivals;
+	SimStats stages[STAGE_COUNT];
+	unsigned long traces = 0, ignored = 0;
+	char line[4096];
+
+	while(fgets(line, sizeof(line), in))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+
+		// Optional "<unix time> " in front of "<topic> <payload>"
+		char * rest = line;
+		double hostMs = -1;
+		char * stop = nullptr;
+		double t = strtod(line, &stop);
+		if(stop != line && *stop == ' ')
+		{
+			hostMs = t*1000;
+			rest = stop + 1;
+		}
+
+		char * space = strchr(rest, ' ');
+		if(space == nullptr)
+			continue;
+		std::string topic(rest, space - rest);
+		const char * payload = space + 1;
+
+		double id;
+		const char * weather = strstr(payload, "\"trace\":{");
+		if(weather != nullptr)
+		{
+			// Weather report with the trace WeatherClient started
+			if(field(weather + 8, "id", id) && arrivals[(unsigned long)id].weather < 0)
+				arrivals[(unsigned long)id].weather = hostMs;
+			continue;
+		}
+		if(payload[0] != '{' || !field(payload, "id", id))
+			continue;
+
+		if(endsWith(topic, "/open") || endsWith(topic, "/close"))
+		{
+			if(arrivals[(unsigned long)id].command < 0)
+				arrivals[(unsigned long)id].command = hostMs;
+			continue;
+		}
+		if(!endsWith(topic, "/trace"))
+			continue;
+
+		// Report of a finished move
+		double fetch = -1, pub = -1, recv = -1, start = -1, end = -1;
+		field(payload, "fetch", fetch);
+		field(payload, "pub", pub);
+		field(payload, "recv", recv);
+		field(payload, "start", start);
+		field(payload, "end", end);
+
+		double value[STAGE_COUNT] = {-1, -1, -1, -1, -1};
+		const arrival_t & arrival = arrivals[(unsigned long)id];
+
+		// Stamps are unsigned 32-bit millis(), differences wrap around
+		if(fetch >= 0 && pub >= 0)
+			value[STAGE_FETCH] = (uint32_t)((uint32_t)pub - (uint32_t)fetch);
+		if(arrival.weather >= 0 && arrival.command >= 0)
+			value[STAGE_DECIDE] = arrival.command - arrival.weather;
+		if(recv >= 0 && start >= 0)
+			value[STAGE_QUEUE] = (uint32_t)((uint32_t)start - (uint32_t)recv);
+		if(start >= 0 && end >= 0)
+			value[STAGE_MOTION] = (uint32_t)((uint32_t)end - (uint32_t)start);
+		// The command reaches the window when it reaches this host
+		if(value[STAGE_FETCH] >= 0 && value[STAGE_DECIDE] >= 0 && recv >= 0 && end >= 0)
+			value[STAGE_TOTAL] = value[STAGE_FETCH] + value[STAGE_DECIDE] + (uint32_t)((uint32_t)end - (uint32_t)recv);
+
+		if(opt.maxMs >= 0 && value[STAGE_TOTAL] > opt.maxMs)
+		{
+			ignored++;
+			continue;
+		}
+
+		traces++;
+		for(int s = 0; s < STAGE_COUNT; s++)
+		{
+			if(value[s] >= 0)
+				stages[s].add(value[s]);
+		}
+
+		if(opt.verbose)
+		{
+			printf("%s id %lu:", topic.c_str(), (unsigned long)id);
+			for(int s = 0; s < STAGE_COUNT; s++)
+				printf(value[s] >= 0 ? " %s %.0f" : " %s -", STAGE_NAMES[s], value[s]);
+			printf("\n");
+		}
+	}
+
+	if(in != stdin)
+		fclose(in);
+
+	printf("%lu traces", traces);
+	if(ignored > 0)
+		printf(", %lu ignored (--max-ms)", ignored);
+	printf("\n");
+	printf("stage    count  p50[ms]  p90[ms]  p99[ms]  max[ms]\n");
+	for(int s = 0; s < STAGE_COUNT; s++)
+	{
+		SimStats & st = stages[s];
+		printf("%-7s %6lu %8.0f %8.0f %8.0f %8.0f\n", STAGE_NAMES[s], (unsigned long)st.count(),
+			st.percentile(50), st.percentile(90), st.percentile(99), st.max());
+	}
+	if(stages[STAGE_DECIDE].count() == 0 && traces > 0)
+		printf("decide and total need the host arrival times, capture with -F '%%U %%t %%p'.\n");
+
+	if(opt.maxTotalMs >= 0 && stages[STAGE_TOTAL].count() > 0 && stages[STAGE_TOTAL].percentile(99) > opt.maxTotalMs)
+	{
+		printf("FAILED: total p99 exceeds %.0f ms.\n", opt.maxTotalMs);
+		return 1;
+	}
+	return 0;
+}
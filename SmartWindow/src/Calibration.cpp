@@ -0,0 +1,224 @@
+#include "Calibration.h"
+
+void Calibration::begin(SmartWindow * window)
+{
+	_window = window;
+	_err = "";
+	_goodSpeed = 0;
+	_goodAcc = 0;
+	_length = _maxSpeed = _acc = 0;
+
+	_phase = HOME;
+	home(true, CALIBRATION_MAX_TRAVEL);
+	// close() does not move on a pressed switch
+	if(_window->limitReached())
+	{
+		_phase = RELEASE;
+		home(false, CALIBRATION_BACKOFF);
+	}
+}
+
+void Calibration::abort()
+{
+	if(!running())
+		return;
+
+	_window->stop();
+	fail("Calibration aborted.");
+}
+
+bool Calibration::run(StepScheduler & scheduler)
+{
+	if(!running())
+		return false;
+
+	if(_pending)
+	{
+		_pending = false;
+		// A move that does not start ends right away, on the next call
+		if(_window->isRunning())
+			scheduler.start(_window);
+	}
+	else if(!scheduler.isScheduled(_window))
+		next();
+
+	return running();
+}
+
+// The move of the current phase has ended
+void Calibration::next()
+{
+	switch(_phase)
+	{
+	case RELEASE:
+		_phase = HOME;
+		home(true, CALIBRATION_MAX_TRAVEL);
+		if(_window->limitReached())
+			fail("Close switch does not release.");
+		break;
+
+	case HOME:
+		if(!_window->limitReached())
+		{
+			fail("Close switch was not reached.");
+			break;
+		}
+		_closed = _window->getLimitPosition();
+		_phase = MEASURE;
+		home(false, CALIBRATION_MAX_TRAVEL);
+		break;
+
+	case MEASURE:
+	{
+		if(!_window->limitReached())
+		{
+			fail("Open switch was not reached.");
+			break;
+		}
+		_opened = _window->getLimitPosition();
+
+		long steps = labs(_opened - _closed);
+		if(steps <= 2*CALIBRATION_TOLERANCE)
+		{
+			fail("Limit switches are too close.");
+			break;
+		}
+		_travel = 360.0*steps/_window->getRevolutionSteps();
+		_length = distance(steps) + CALIBRATION_OVERTRAVEL;
+
+		_phase = SEARCH;
+		_trial = 0;
+		trial();
+		break;
+	}
+
+	case SEARCH:
+		if(!legPassed())
+			rehome();
+		else if(++_leg < 2)
+			leg();
+		else
+		{
+			_goodSpeed = _speed;
+			_goodAcc = _trialAcc;
+			_trial++;
+			trial();
+		}
+		break;
+
+	case REHOME:
+	{
+		if(!_window->limitReached())
+		{
+			fail("Close switch was not reached.");
+			break;
+		}
+		// Steps were lost, the switches are where they were
+		long shift = _window->getLimitPosition() - _closed;
+		_closed += shift;
+		_opened += shift;
+
+		if(_goodSpeed == 0)
+			fail("Not even the slowest profile reached the switches.");
+		else
+			finish();
+		break;
+	}
+
+	case PARK:
+		if(legPassed())
+			_phase = DONE;
+		else
+			fail("Close switch was missed with the final profile.");
+		break;
+
+	default:
+		break;
+	}
+}
+
+void Calibration::move(bool closing, float length, float speed, float acc)
+{
+	_window->setLength(length);
+	_window->setMaxSpeed(speed);
+	_window->setAcceleration(acc);
+	_closing = closing;
+	if(closing)
+		_window->close();
+	else
+		_window->open();
+	_pending = true;
+}
+
+void Calibration::home(bool closing, float length)
+{
+	move(closing, length, CALIBRATION_HOME_SPEED, CALIBRATION_HOME_ACC);
+}
+
+// Every move ends on a switch, so a leg goes back the other way. It starts
+// where the last move stopped, which may be past the switch.
+void Calibration::leg()
+{
+	long target = _closing ? _opened : _closed;
+	move(!_closing, distance(labs(target - _window->getPosition())) + CALIBRATION_OVERTRAVEL, _speed, _trialAcc);
+}
+
+float Calibration::distance(long steps)
+{
+	return 2.0*PI*_window->getRadius()*steps/_window->getRevolutionSteps();
+}
+
+bool Calibration::legPassed()
+{
+	long expected = _closing ? _closed : _opened;
+	return _window->limitReached() && labs(_window->getLimitPosition() - expected) <= CALIBRATION_TOLERANCE;
+}
+
+// Starts round trip _trial, or ends the search
+void Calibration::trial()
+{
+	float speed = CALIBRATION_START_SPEED*pow(CALIBRATION_FACTOR, _trial);
+	if(_trial >= CALIBRATION_TRIALS || speed > 360.0*CALIBRATION_MAX_STEP_RATE/_window->getRevolutionSteps())
+	{
+		// The first trial is the slowest, it has to pass
+		if(_trial == 0)
+			fail("Maximum step rate is below the start speed.");
+		else
+			finish();
+		return;
+	}
+	// Full speed after a quarter of the travel
+	_speed = speed;
+	_trialAcc = 2*speed*speed/_travel;
+
+	_leg = 0;
+	leg();
+}
+
+void Calibration::rehome()
+{
+	_phase = REHOME;
+	home(true, CALIBRATION_MAX_TRAVEL);
+}
+
+void Calibration::finish()
+{
+	_maxSpeed = CALIBRATION_MARGIN*_goodSpeed;
+	_acc = CALIBRATION_MARGIN*_goodAcc;
+
+	if(_closing)
+	{
+		_phase = DONE;
+		return;
+	}
+	_phase = PARK;
+	_speed = _maxSpeed;
+	_trialAcc = _acc;
+	leg();
+}
+
+void Calibration::fail(const char * err)
+{
+	_err = err;
+	_phase = FAILED;
+}
@@ -0,0 +1,110 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <Arduino.h>
+#include "SmartWindow.h"
+#include "StepScheduler.h"
+
+// Homing profile, slow enough for the switches to trip within a step
+#ifndef CALIBRATION_HOME_SPEED
+#define CALIBRATION_HOME_SPEED 180		// deg/s
+#endif
+#ifndef CALIBRATION_HOME_ACC
+#define CALIBRATION_HOME_ACC 720		// deg/s2
+#endif
+// Longest travel searched for a switch, and the move off a pressed one, mm
+#define CALIBRATION_MAX_TRAVEL 3000
+#define CALIBRATION_BACKOFF 20
+// Added to the measured travel, so moves end just past the switch, mm
+#define CALIBRATION_OVERTRAVEL 2
+// First speed tried, the factor between two trials and the most trials
+#define CALIBRATION_START_SPEED 360		// deg/s
+#define CALIBRATION_FACTOR 1.5
+#define CALIBRATION_TRIALS 8
+// Fastest the loop steps a motor, steps/s
+#ifndef CALIBRATION_MAX_STEP_RATE
+#define CALIBRATION_MAX_STEP_RATE 4000
+#endif
+// Share of the fastest passing profile that is kept
+#define CALIBRATION_MARGIN 0.8
+// Steps a switch may trip away from where it tripped when homing
+#define CALIBRATION_TOLERANCE 3
+
+/* Measures the travel of a window between its limit switches and finds the
+ * fastest profile it completes without losing steps.
+ *
+ * 1. Homes slowly on the close switch, moving off it first if it is pressed.
+ * 2. Opens slowly until the open switch trips, counting the steps.
+ * 3. Runs round trips with a rising maximum speed, the acceleration reaching
+ *    it within a quarter of the travel, and stops at the first one that
+ *    fails.
+ *
+ * A move fails when its switch does not trip, or trips more than
+ * CALIBRATION_TOLERANCE steps away from where it did when homing: the motor
+ * lost steps on the way. After the failure the window homes again. The
+ * results keep CALIBRATION_MARGIN of the last profile that passed, speed and
+ * acceleration, and the window ends closed.
+ *
+ * Nothing blocks: each move runs on the step scheduler like any other. */
+class Calibration
+{
+public:
+	enum Phase : uint8_t {IDLE, RELEASE, HOME, MEASURE, SEARCH, REHOME, PARK, DONE, FAILED};
+
+	// Starts with window, which must stand still and have both limit switches
+	void begin(SmartWindow * window);
+	// Gives up, decelerating the running move
+	void abort();
+
+	// Hands the next move to scheduler once the last one has ended. Call it
+	// on every loop. Returns true while calibrating.
+	bool run(StepScheduler & scheduler);
+
+	bool running() { return _phase != IDLE && _phase != DONE && _phase != FAILED; }
+	Phase phase() { return _phase; }
+	// Window being calibrated, nullptr if none ever was
+	SmartWindow * window() { return _window; }
+
+	// The window keeps the profile of the last move. Once DONE these are the
+	// values for config_t: mm, deg/s and deg/s2.
+	float length() { return _length; }
+	float maxSpeed() { return _maxSpeed; }
+	float acc() { return _acc; }
+
+	const char * err() { return _err; }
+
+private:
+	void next();
+	void move(bool closing, float length, float speed, float acc);
+	void home(bool closing, float length);
+	void leg();
+	float distance(long steps);		// mm
+	bool legPassed();
+	void trial();
+	void rehome();
+	void finish();
+	void fail(const char * err);
+
+	SmartWindow * _window = nullptr;
+	Phase _phase = IDLE;
+	bool _pending = false;	// Move not handed to the scheduler yet
+	bool _closing = false;	// Direction of the last move
+
+	long _closed = 0;		// Step positions where the switches trip
+	long _opened = 0;
+	float _travel = 0;		// Between the switches, deg
+
+	uint8_t _trial = 0;
+	uint8_t _leg = 0;
+	float _speed = 0;		// Profile of the running trial
+	float _trialAcc = 0;
+	float _goodSpeed = 0;	// Last that passed
+	float _goodAcc = 0;
+
+	float _length = 0;
+	float _maxSpeed = 0;
+	float _acc = 0;
+	const char * _err = "";
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include "CommandQueue.h"
+
+bool CommandQueue::push(uint8_t window, Command command)
+{
+	for(uint8_t i = 0; i < _count; i++)
+	{
+		if(_entries[i].window == window)
+		{
+			remove(i);
+			_coalesced++;
+			break;
+		}
+	}
+
+	if(_count >= COMMAND_QUEUE_SIZE)
+		return false;
+
+	_entries[_count].window = window;
+	_entries[_count].command = command;
+	_count++;
+	return true;
+}
+
+void CommandQueue::dispatch(SmartWindow * windows[], uint8_t count, StepScheduler & scheduler)
+{
+	for(uint8_t i = 0; i < _count;)
+	{
+		const entry_t & e = _entries[i];
+		SmartWindow * window = e.window < count ? windows[e.window] : nullptr;
+
+		if(window == nullptr)
+		{
+			remove(i);
+			continue;
+		}
+
+		SmartWindow::Status status = window->getStatus();
+
+		if(!window->isRunning())
+		{
+			if(e.command == OPEN)
+				window->open();
+			else if(e.command == CLOSE)
+				window->close();
+
+			if(window->isRunning())
+				scheduler.start(window);
+			remove(i);
+		}
+		else if((e.command == OPEN && status == SmartWindow::OPENING) ||
+			(e.command == CLOSE && status == SmartWindow::CLOSING))
+		{
+			remove(i);
+		}
+		else
+		{
+			// Keep the command until the window has come to a halt
+			if(status == SmartWindow::OPENING || status == SmartWindow::CLOSING)
+			{
+				window->stop();
+				_preempted++;
+			}
+			i++;
+		}
+	}
+}
+
+bool CommandQueue::pending(uint8_t window)
+{
+	for(uint8_t i = 0; i < _count; i++)
+	{
+		if(_entries[i].window == window)
+			return true;
+	}
+	return false;
+}
+
+void CommandQueue::remove(uint8_t i)
+{
+	for(; i + 1 < _count; i++)
+		_entries[i] = _entries[i + 1];
+	_count--;
+}
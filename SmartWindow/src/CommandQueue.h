@@ -0,0 +1,52 @@
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <Arduino.h>
+#include "SmartWindow.h"
+#include "StepScheduler.h"
+
+#ifndef COMMAND_QUEUE_SIZE
+#define COMMAND_QUEUE_SIZE STEP_SCHEDULER_SIZE
+#endif
+
+/* Pending window moves, received while windows may be moving.
+ * Only the last command of each window counts: open, close, open queues a
+ * single open. Commands are handed to the windows in arrival order. */
+class CommandQueue
+{
+public:
+	enum Command : uint8_t {NONE, OPEN, CLOSE};
+
+	// Queues command for window, replacing the one still pending for it
+	bool push(uint8_t window, Command command);
+
+	// Starts the pending commands on their windows. A command for a window
+	// moving the other way first stops it with a normal deceleration and
+	// stays queued until it stands still. A command for the direction the
+	// window already moves in is dropped.
+	void dispatch(SmartWindow * windows[], uint8_t count, StepScheduler & scheduler);
+
+	uint8_t size() { return _count; }
+	// Whether a command for window is still waiting
+	bool pending(uint8_t window);
+
+	// Commands replaced by a newer one, and moves stopped by a newer one
+	uint32_t coalesced() { return _coalesced; }
+	uint32_t preempted() { return _preempted; }
+
+private:
+	typedef struct
+	{
+		uint8_t window;
+		Command command;
+	} entry_t;
+
+	void remove(uint8_t i);
+
+	entry_t _entries[COMMAND_QUEUE_SIZE];
+	uint8_t _count = 0;
+	uint32_t _coalesced = 0;
+	uint32_t _preempted = 0;
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "ConfigSchema.h"
+
+const char * ConfigSchema::_err = "";
+
+
+int ConfigSchema::find(const char * name, size_t len)
+{
+	if(len == 0)
+		len = strlen(name);
+
+	for(size_t i = 0; i < CONFIG_FIELD_COUNT; i++)
+	{
+		if(strncmp(CONFIG_FIELDS[i].name, name, len) == 0 && CONFIG_FIELDS[i].name[len] == '\0')
+			return i;
+	}
+	return -1;
+}
+
+
+void ConfigSchema::serialize(const struct config_t & conf, JsonObject obj)
+{
+	const uint8_t * base = (const uint8_t*)&conf;
+
+	for(size_t i = 0; i < CONFIG_FIELD_COUNT; i++)
+	{
+		const config_field_t & f = CONFIG_FIELDS[i];
+		const uint8_t * p = base + f.offset;
+
+		switch(f.type)
+		{
+			case CONFIG_BOOL: obj[f.name] = *(const bool*)p; break;
+			case CONFIG_UINT8: obj[f.name] = *(const uint8_t*)p; break;
+			case CONFIG_INT8: obj[f.name] = *(const int8_t*)p; break;
+			case CONFIG_UINT: obj[f.name] = *(const unsigned*)p; break;
+			case CONFIG_FLOAT: obj[f.name] = *(const float*)p; break;
+			case CONFIG_STRING: obj[f.name] = (const char*)p; break;
+		}
+	}
+}
+
+String ConfigSchema::serialize(const struct config_t & conf)
+{
+	StaticJsonDocument<CONFIG_JSON_CAPACITY> doc;
+	serialize(conf, doc.to<JsonObject>());
+
+	String output = "";
+	serializeJson(doc, output);
+	return output;
+}
+
+
+bool ConfigSchema::write(struct config_t & conf, const config_field_t & f, JsonVariantConst v)
+{
+	uint8_t * p = (uint8_t*)&conf + f.offset;
+
+	switch(f.type)
+	{
+		case CONFIG_BOOL:
+		if(!v.is<bool>())
+			return false;
+		*(bool*)p = v.as<bool>();
+		return true;
+
+		case CONFIG_UINT8:
+		case CONFIG_INT8:
+		case CONFIG_UINT:
+		{
+			if(!v.is<long>())
+				return false;
+			long x = v.as<long>();
+			if(f.type == CONFIG_UINT8 && (x < 0 || x > 0xFF))
+				return false;
+			if(f.type == CONFIG_INT8 && (x < -128 || x > 127))
+				return false;
+			if(f.type == CONFIG_UINT && x < 0)
+				return false;
+
+			if(f.type == CONFIG_UINT8) *(uint8_t*)p = x;
+			else if(f.type == CONFIG_INT8) *(int8_t*)p = x;
+			else *(unsigned*)p = x;
+			return true;
+		}
+
+		case CONFIG_FLOAT:
+		if(!v.is<float>())
+			return false;
+		*(float*)p = v.as<float>();
+		return true;
+
+		case CONFIG_STRING:
+		{
+			if(!v.is<const char*>())
+				return false;
+			const char * s = v.as<const char*>();
+			if(strlen(s) >= f.size)
+				return false;
+			strlcpy((char*)p, s, f.size);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ConfigSchema::equal(const struct config_t & a, const struct config_t & b, const config_field_t & f)
+{
+	const uint8_t * pa = (const uint8_t*)&a + f.offset;
+	const uint8_t * pb = (const uint8_t*)&b + f.offset;
+
+	if(f.type == CONFIG_STRING)
+		return strncmp((const char*)pa, (const char*)pb, f.size) == 0;
+	return memcmp(pa, pb, f.size) == 0;
+}
+
+bool ConfigSchema::patch(struct config_t & conf, JsonObjectConst patch, uint8_t & hooks)
+{
+	if(patch.isNull())
+	{
+		_err = "Configuration patch is not a JSON object.";
+		return false;
+	}
+
+	config_t staged = conf;
+
+	for(JsonPairConst kv : patch)
+	{
+		int i = find(kv.key().c_str());
+		if(i < 0)
+		{
+			_err = "Unknown configuration field.";
+			return false;
+		}
+		if(!write(staged, CONFIG_FIELDS[i], kv.value()))
+		{
+			_err = "Invalid value type or range for configuration field.";
+			return false;
+		}
+	}
+
+	hooks = diff(conf, staged);
+	conf = staged;
+	return true;
+}
+
+
+size_t ConfigSchema::print(const struct config_t & conf, int field, char * buf, size_t len)
+{
+	if(field < 0 || (size_t)field >= CONFIG_FIELD_COUNT)
+		return 0;
+
+	const config_field_t & f = CONFIG_FIELDS[field];
+	const uint8_t * p = (const uint8_t*)&conf + f.offset;
+	int n = 0;
+
+	switch(f.type)
+	{
+		case CONFIG_BOOL: n = snprintf(buf, len, "%s", *(const bool*)p ? "true" : "false"); break;
+		case CONFIG_UINT8: n = snprintf(buf, len, "%u", *(const uint8_t*)p); break;
+		case CONFIG_INT8: n = snprintf(buf, len, "%d", *(const int8_t*)p); break;
+		case CONFIG_UINT: n = snprintf(buf, len, "%u", *(const unsigned*)p); break;
+		case CONFIG_FLOAT: n = snprintf(buf, len, "%g", (double)*(const float*)p); break;
+		case CONFIG_STRING: n = snprintf(buf, len, "%s", (const char*)p); break;
+	}
+	return n < 0 ? 0 : (size_t)n;
+}
+
+bool ConfigSchema::parse(struct config_t & conf, int field, const char * text, uint8_t & hooks)
+{
+	if(field < 0 || (size_t)field >= CONFIG_FIELD_COUNT)
+	{
+		_err = "Unknown configuration field.";
+		return false;
+	}
+
+	const config_field_t & f = CONFIG_FIELDS[field];
+	config_t staged = conf;
+	uint8_t * p = (uint8_t*)&staged + f.offset;
+	char * end = nullptr;
+	bool ok = true;
+
+	switch(f.type)
+	{
+		case CONFIG_BOOL:
+		if(!strcmp(text, "true") || !strcmp(text, "1"))
+			*(bool*)p = true;
+		else if(!strcmp(text, "false") || !strcmp(text, "0"))
+			*(bool*)p = false;
+		else
+			ok = false;
+		break;
+
+		case CONFIG_UINT8:
+		case CONFIG_INT8:
+		case CONFIG_UINT:
+		{
+			long x = strtol(text, &end, 10);
+			ok = end != text && *end == '\0';
+			if(f.type == CONFIG_UINT8)
+			{
+				ok &= x >= 0 && x <= 0xFF;
+				*(uint8_t*)p = x;
+			}
+			else if(f.type == CONFIG_INT8)
+			{
+				ok &= x >= -128 && x <= 127;
+				*(int8_t*)p = x;
+			}
+			else
+			{
+				ok &= x >= 0;
+				*(unsigned*)p = x;
+			}
+			break;
+		}
+
+		case CONFIG_FLOAT:
+		{
+			float x = strtod(text, &end);
+			ok = end != text && *end == '\0';
+			*(float*)p = x;
+			break;
+		}
+
+		case CONFIG_STRING:
+		ok = strlen(text) < f.size;
+		if(ok)
+			strlcpy((char*)p, text, f.size);
+		break;
+	}
+
+	if(!ok)
+	{
+		_err = "Invalid value type or range for configuration field.";
+		return false;
+	}
+
+	hooks = diff(conf, staged);
+	conf = staged;
+	return true;
+}
+
+
+uint8_t ConfigSchema::diff(const struct config_t & from, const struct config_t & to)
+{
+	uint8_t hooks = CONFIG_HOOK_NONE;
+
+	for(size_t i = 0; i < CONFIG_FIELD_COUNT; i++)
+	{
+		if(!equal(from, to, CONFIG_FIELDS[i]))
+			hooks |= CONFIG_FIELDS[i].hooks;
+	}
+	return hooks;
+}
+
+uint32_t ConfigSchema::signature()
+{
+	// FNV-1a over names, offsets, types and sizes
+	uint32_t h = 2166136261u;
+
+	for(size_t i = 0; i < CONFIG_FIELD_COUNT; i++)
+	{
+		const config_field_t & f = CONFIG_FIELDS[i];
+		for(const char * c = f.name; *c; c++)
+			h = (h ^ (uint8_t)*c) * 16777619u;
+
+		uint8_t layout[4] = {(uint8_t)f.offset, (uint8_t)(f.offset >> 8), f.type, f.size};
+		for(uint8_t b : layout)
+			h = (h ^ b) * 16777619u;
+	}
+	return h ^ sizeof(config_t);
+}
+
+
+bool ConfigSchema::save(const struct config_t & conf, uint8_t id)
+{
+	// Copied field by field into a zeroed record, so padding and the bytes
+	// after a string terminator never make an unchanged config look dirty
+	config_t record;
+	memset(&record, 0, sizeof(record));
+
+	for(size_t i = 0; i < CONFIG_FIELD_COUNT; i++)
+	{
+		const config_field_t & f = CONFIG_FIELDS[i];
+		if(f.type == CONFIG_STRING)
+			strlcpy((char*)&record + f.offset, (const char*)&conf + f.offset, f.size);
+		else
+			memcpy((uint8_t*)&record + f.offset, (const uint8_t*)&conf + f.offset, f.size);
+	}
+
+	if(ConfigStore.write(id, signature(), &record, sizeof(record)) == ConfigJournal::JOURNAL_ERROR)
+	{
+		_err = ConfigStore.err();
+		return false;
+	}
+	return true;
+}
+
+bool ConfigSchema::load(struct config_t & conf, uint8_t id)
+{
+	config_t record;
+	if(!ConfigStore.read(id, signature(), &record, sizeof(record)))
+	{
+		_err = ConfigStore.err();
+		return false;
+	}
+
+	// Fields outside the table keep their current value
+	for(size_t i = 0; i < CONFIG_FIELD_COUNT; i++)
+	{
+		const config_field_t & f = CONFIG_FIELDS[i];
+		memcpy((uint8_t*)&conf + f.offset, (const uint8_t*)&record + f.offset, f.size);
+	}
+
+	// Never trust the terminator of a string read back from flash
+	for(size_t i = 0; i < CONFIG_FIELD_COUNT; i++)
+	{
+		if(CONFIG_FIELDS[i].type == CONFIG_STRING)
+			((char*)&conf)[CONFIG_FIELDS[i].offset + CONFIG_FIELDS[i].size - 1] = '\0';
+	}
+	return true;
+}
+
+
+const char * ConfigSchema::err()
+{
+	return _err;
+}
@@ -0,0 +1,122 @@
+#ifndef CONFIG_SCHEMA_H
+#define CONFIG_SCHEMA_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ConfigJournal.h>
+#include <stddef.h>
+#include "definitions.h"
+
+// Side effects of changing a field. Patches collect them so the node applies
+// each one once, after every field of the patch has been written.
+enum ConfigHook : uint8_t
+{
+	CONFIG_HOOK_NONE	= 0,
+	CONFIG_HOOK_MOTOR	= 1 << 0,	// Recompute motor parameters
+	CONFIG_HOOK_TIME	= 1 << 1,	// NTP time offset
+	CONFIG_HOOK_SERIAL	= 1 << 2,	// Serial log output
+	CONFIG_HOOK_TOPIC	= 1 << 3,	// MQTT root topic, topic aliases
+	CONFIG_HOOK_LOG		= 1 << 4,	// Log level
+	CONFIG_HOOK_REBOOT	= 1 << 5	// Only takes effect after a restart (pins)
+};
+
+enum ConfigType : uint8_t
+{
+	CONFIG_BOOL,
+	CONFIG_UINT8,
+	CONFIG_INT8,
+	CONFIG_UINT,
+	CONFIG_FLOAT,
+	CONFIG_STRING
+};
+
+typedef struct
+{
+	const char * name;		// JSON key and MQTT sub-topic
+	uint16_t offset;		// Inside config_t
+	uint8_t type;
+	uint8_t size;
+	uint8_t hooks;
+} config_field_t;
+
+template<typename T> struct config_type_of;
+template<> struct config_type_of<bool> { static constexpr uint8_t value = CONFIG_BOOL; };
+template<> struct config_type_of<uint8_t> { static constexpr uint8_t value = CONFIG_UINT8; };
+template<> struct config_type_of<int8_t> { static constexpr uint8_t value = CONFIG_INT8; };
+template<> struct config_type_of<unsigned> { static constexpr uint8_t value = CONFIG_UINT; };
+template<> struct config_type_of<float> { static constexpr uint8_t value = CONFIG_FLOAT; };
+template<size_t N> struct config_type_of<char[N]> { static constexpr uint8_t value = CONFIG_STRING; };
+
+#define CONFIG_FIELD(member, hooks) \
+	{ #member, offsetof(config_t, member), config_type_of<decltype(config_t::member)>::value, \
+	  sizeof(config_t::member), hooks }
+
+/* Every persistent field of config_t, in the order they are serialized.
+ * Adding a field to config_t only takes a line here: JSON, MQTT get/set and
+ * persistence are all driven by this table. */
+constexpr config_field_t CONFIG_FIELDS[] =
+{
+	CONFIG_FIELD(dirPin,			CONFIG_HOOK_REBOOT),
+	CONFIG_FIELD(stepPin,			CONFIG_HOOK_REBOOT),
+	CONFIG_FIELD(slpPin,			CONFIG_HOOK_REBOOT),
+	CONFIG_FIELD(inverted,			CONFIG_HOOK_MOTOR),
+	CONFIG_FIELD(revSteps,			CONFIG_HOOK_MOTOR),
+	CONFIG_FIELD(radius,			CONFIG_HOOK_MOTOR),
+	CONFIG_FIELD(length,			CONFIG_HOOK_MOTOR),
+	CONFIG_FIELD(maxSpeed,			CONFIG_HOOK_MOTOR),
+	CONFIG_FIELD(acc,				CONFIG_HOOK_MOTOR),
+	CONFIG_FIELD(limOpenSwitch,		CONFIG_HOOK_REBOOT),
+	CONFIG_FIELD(limCloseSwitch,	CONFIG_HOOK_REBOOT),
+	CONFIG_FIELD(timeUTC,			CONFIG_HOOK_TIME),
+	CONFIG_FIELD(serialOutput,		CONFIG_HOOK_SERIAL),
+	CONFIG_FIELD(mqttTopicRoot,		CONFIG_HOOK_TOPIC),
+	CONFIG_FIELD(logLevel,			CONFIG_HOOK_LOG),
+	CONFIG_FIELD(topicAliases,		CONFIG_HOOK_TOPIC)
+};
+
+constexpr size_t CONFIG_FIELD_COUNT = sizeof(CONFIG_FIELDS)/sizeof(CONFIG_FIELDS[0]);
+
+// Keys are copied out of read-only input, plus room for the root topic
+constexpr size_t CONFIG_JSON_CAPACITY = JSON_OBJECT_SIZE(CONFIG_FIELD_COUNT) + DEVICE_ID_MAX_LENGTH + 256;
+
+
+class ConfigSchema
+{
+public:
+	// Field index by name, -1 if unknown. len = 0 means name is null terminated.
+	static int find(const char * name, size_t len = 0);
+
+	static void serialize(const struct config_t & conf, JsonObject obj);
+	static String serialize(const struct config_t & conf);
+
+	// Writes every field present in patch into conf. Nothing is written
+	// unless all fields are known and valid. hooks receives the side effects
+	// of the fields whose value actually changed.
+	static bool patch(struct config_t & conf, JsonObjectConst patch, uint8_t & hooks);
+
+	// Single field as plain text, as used by <root>/config/<field>/get|set
+	static size_t print(const struct config_t & conf, int field, char * buf, size_t len);
+	static bool parse(struct config_t & conf, int field, const char * text, uint8_t & hooks);
+
+	// Side effects needed to go from one configuration to the other
+	static uint8_t diff(const struct config_t & from, const struct config_t & to);
+
+	// Fingerprint of the table layout, changes whenever config_t changes
+	static uint32_t signature();
+
+	// Journal record versioned with signature(). Records written with
+	// another layout are rejected instead of being loaded as garbage.
+	// Saving an unchanged configuration does not write to flash.
+	static bool save(const struct config_t & conf, uint8_t id = JOURNAL_ID_SMART_WINDOW);
+	static bool load(struct config_t & conf, uint8_t id = JOURNAL_ID_SMART_WINDOW);
+
+	static const char * err();
+
+private:
+	static bool write(struct config_t & conf, const config_field_t & field, JsonVariantConst value);
+	static bool equal(const struct config_t & a, const struct config_t & b, const config_field_t & field);
+
+	static const char * _err;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "LoopStats.h"
+
+void Histogram::clear()
+{
+	memset(_buckets, 0, sizeof(_buckets));
+	_count = 0;
+	_max = 0;
+	_sum = 0;
+}
+
+size_t Histogram::print(char * buf, size_t len)
+{
+	uint8_t used = STATS_BUCKETS;
+	while(used > 0 && _buckets[used - 1] == 0)
+		used--;
+
+	int n = snprintf(buf, len, "{\"n\":%lu,\"mean\":%lu,\"max\":%lu,\"log2\":[",
+		(unsigned long)_count, (unsigned long)mean(), (unsigned long)_max);
+
+	for(uint8_t i = 0; i < used && n >= 0 && (size_t)n < len; i++)
+		n += snprintf(buf + n, len - n, i == 0 ? "%lu" : ",%lu", (unsigned long)_buckets[i]);
+
+	if(n >= 0 && (size_t)n < len)
+		n += snprintf(buf + n, len - n, "]}");
+	if(n < 0 || (size_t)n >= len)
+		return 0;
+	return n;
+}
+
+
+void LoopStats::reset()
+{
+	loop.clear();
+	runInterval.clear();
+	stepLate.clear();
+	mqttPoll.clear();
+	callback.clear();
+	_lateSteps = 0;
+	_since = millis();
+}
+
+size_t LoopStats::print(char * buf, size_t len)
+{
+	const struct
+	{
+		const char * name;
+		Histogram * histogram;
+	} entries[] =
+	{
+		{"loop", &loop},
+		{"runInterval", &runInterval},
+		{"stepLate", &stepLate},
+		{"mqttPoll", &mqttPoll},
+		{"callback", &callback}
+	};
+
+	int n = snprintf(buf, len, "{\"ms\":%lu,\"lateSteps\":%lu,\"lateUs\":%u",
+		millis() - _since, (unsigned long)_lateSteps, STATS_LATE_US);
+
+	for(const auto & e : entries)
+	{
+		if(n < 0 || (size_t)n >= len)
+			return 0;
+		n += snprintf(buf + n, len - n, ",\"%s\":", e.name);
+		if(n < 0 || (size_t)n >= len)
+			return 0;
+
+		size_t h = e.histogram->print(buf + n, len - n);
+		if(h == 0)
+			return 0;
+		n += h;
+	}
+
+	if(n < 0 || (size_t)n + 2 > len)
+		return 0;
+	buf[n++] = '}';
+	buf[n] = '\0';
+	return n;
+}
@@ -0,0 +1,79 @@
+#ifndef LOOP_STATS_H
+#define LOOP_STATS_H
+
+#include <Arduino.h>
+
+// Buckets per histogram, the last one also counts everything above
+#define STATS_BUCKETS 24
+// Steps later than this count as late
+#ifndef STATS_LATE_US
+#define STATS_LATE_US 100
+#endif
+// Longest LoopStats::print() output, terminator included
+#define STATS_JSON_SIZE 2048
+
+/* Counts values by their power of two: bucket 0 holds 0, bucket i holds
+ * [2^(i-1), 2^i). Adding a value is a bit scan and an increment, cheap
+ * enough for every step and every loop. */
+class Histogram
+{
+public:
+	void add(uint32_t value)
+	{
+		uint8_t i = value == 0 ? 0 : 32 - __builtin_clz(value);
+		_buckets[i < STATS_BUCKETS ? i : STATS_BUCKETS - 1]++;
+		_count++;
+		_sum += value;
+		if(value > _max)
+			_max = value;
+	}
+
+	void clear();
+
+	uint32_t count() { return _count; }
+	uint32_t max() { return _max; }
+	uint32_t mean() { return _count > 0 ? _sum/_count : 0; }
+	uint32_t bucket(uint8_t i) { return _buckets[i]; }
+
+	// {"n":..,"mean":..,"max":..,"log2":[..]}, trailing empty buckets left out
+	size_t print(char * buf, size_t len);
+
+private:
+	uint32_t _buckets[STATS_BUCKETS] = {0};
+	uint32_t _count = 0;
+	uint32_t _max = 0;
+	uint64_t _sum = 0;
+};
+
+/* Timing of the SmartWindow main loop, all times in microseconds.
+ * One static block: nothing is allocated while measuring or printing. */
+class LoopStats
+{
+public:
+	Histogram loop;				// One loop() iteration
+	Histogram runInterval;		// Between two scheduler.run() calls while moving
+	Histogram stepLate;			// Step lateness against its due time
+	Histogram mqttPoll;			// mqttClient.loop(), callbacks included
+	Histogram callback;			// One mqttCallback()
+
+	// Called by the StepScheduler hook
+	void step(unsigned long lateUs)
+	{
+		stepLate.add(lateUs);
+		if(lateUs > STATS_LATE_US)
+			_lateSteps++;
+	}
+
+	uint32_t lateSteps() { return _lateSteps; }
+
+	void reset();
+
+	// JSON with the time since the last reset and every histogram
+	size_t print(char * buf, size_t len);
+
+private:
+	uint32_t _lateSteps = 0;
+	unsigned long _since = 0;		// millis() of the last reset
+};
+
+#endif
@@ -17,10 +17,11 @@ void SmartWindow::setConfig(const struct config_t config)
 {
 	_length = config.length;
 	_inverted = config.inverted;
+	// Speed and acceleration are converted with the revolution steps
+	setRevolutionSteps(config.revSteps);
 	setRadius(config.radius);
 	setMaxSpeed(config.maxSpeed);
 	setAcceleration(config.acc);
-	setRevolutionSteps(config.revSteps);
 }
 
 SmartWindow::SmartWindow(const struct config_t config)
@@ -44,13 +45,18 @@ void SmartWindow::open()
 {
 	if(_sensType == LIMIT_SWITCH)
 	{
+		_limitReached = false;
 		if(_limOpenSwitch != nullptr)
 		{
 			if(_limOpenSwitch->read())
+			{
+				reachLimit();
 				return;
+			}
 		}
 
-		move(_inverted ? -1.0*_length : _length);
+		float length = _length + (_limOpenSwitch != nullptr ? SMART_WINDOW_OVERTRAVEL : 0);
+		move(_inverted ? -1.0*length : length);
 		_status =  OPENING;
 	}
 }
@@ -60,13 +66,18 @@ void SmartWindow::close()
 {
 	if(_sensType == LIMIT_SWITCH)
 	{
+		_limitReached = false;
 		if(_limCloseSwitch != nullptr)
 		{
 			if(_limCloseSwitch->read())
+			{
+				reachLimit();
 				return;
+			}
 		}
 
-		move(_inverted ? _length : -1.0*_length);
+		float length = _length + (_limCloseSwitch != nullptr ? SMART_WINDOW_OVERTRAVEL : 0);
+		move(_inverted ? length : -1.0*length);
 		_status =  CLOSING;
 	}
 }
@@ -82,6 +93,14 @@ bool SmartWindow::run()
 			return WindowActuator::run();
 			break;
 
+			case STOPPING:
+			{
+				bool ret = WindowActuator::run();
+				if(!ret) _status = IDLE;
+				return ret;
+			}
+			break;
+
 			case OPENING:
 			if(!_limOpenSwitch->read())
 			{
@@ -91,9 +110,11 @@ bool SmartWindow::run()
 			}
 			else
 			{
-				stop();
+				// On the switch, the move ends here
+				reachLimit();
+				halt();
 				_status = IDLE;
-				return WindowActuator::run();
+				return false;
 			}			
 			break;
 
@@ -106,15 +127,37 @@ bool SmartWindow::run()
 			}
 			else
 			{
-				stop();
+				// On the switch, the move ends here
+				reachLimit();
+				halt();
 				_status = IDLE;
-				return WindowActuator::run();
+				return false;
 			}			
 			break;
 		}
+		// Not a status of the enum
+		return false;
 	}
 
-	else return WindowActuator::run();
+	else
+	{
+		bool ret = WindowActuator::run();
+		if(!ret) _status = IDLE;
+		return ret;
+	}
+}
+
+
+void SmartWindow::stop()
+{
+	WindowActuator::stop();
+	if(_status != IDLE)
+		_status = STOPPING;
+}
+
+SmartWindow::Status SmartWindow::getStatus()
+{
+	return _status;
 }
 
 
@@ -142,3 +185,22 @@ float SmartWindow::getLength()
 {
 	return _length;
 }
+
+
+bool SmartWindow::limitReached()
+{
+	return _limitReached;
+}
+
+
+long SmartWindow::getLimitPosition()
+{
+	return _limitPosition;
+}
+
+
+void SmartWindow::reachLimit()
+{
+	_limitReached = true;
+	_limitPosition = getPosition();
+}
@@ -5,6 +5,12 @@
 #include "WindowActuator.h"
 #include "definitions.h"
 
+// A move with a limit switch goes this far past the length, so it ends on
+// the switch even if the length is a little short of the travel, mm
+#ifndef SMART_WINDOW_OVERTRAVEL
+#define SMART_WINDOW_OVERTRAVEL 2
+#endif
+
 class LimitSwitch
 {
 public:
@@ -28,9 +34,13 @@ public:
 	void close();
 
 	bool run();
+	// Decelerates to a standstill, ending the current move
+	void stop();
 
 	enum SensorType {LIMIT_SWITCH};
-	enum Status {IDLE, OPENING, CLOSING};
+	enum Status {IDLE, OPENING, CLOSING, STOPPING};
+
+	Status getStatus();
 
 	void setSensor(LimitSwitch * openSens, LimitSwitch * closeSens);
 	SensorType getSensorType();
@@ -38,15 +48,24 @@ public:
 	void setLength(float length);
 	float getLength();
 
+	// Whether the last open() or close() ended on its limit switch, and the
+	// step position at which the switch tripped
+	bool limitReached();
+	long getLimitPosition();
+
 	void setConfig(const struct config_t config);
 
 private:
+	void reachLimit();
+
 	SensorType _sensType;
 	Status _status;
 	LimitSwitch * _limOpenSwitch = nullptr;
 	LimitSwitch * _limCloseSwitch = nullptr;
 	float _length;
 	bool _inverted;
+	bool _limitReached = false;
+	long _limitPosition = 0;
 };
 
 #endif
\ No newline at end of file
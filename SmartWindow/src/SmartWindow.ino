@@ -5,322 +5,889 @@
 #include <ArduinoJson.h>
 #include <inttypes.h>
 #include <stdarg.h>
-#include <EEPROM.h>
 
 #include "definitions.h"
 #include "SmartWindow.h"
-#include <Logger.h>
-
-typedef Logger<PubSubClient> Log;
-
-config_t config;
+#include "StepScheduler.h"
+#include "CommandQueue.h"
+#include "Calibration.h"
+#include "ConfigSchema.h"
+#include "LoopStats.h"
+#include <RingLog.h>
+#include <Trace.h>
+#include <MemStats.h>
+#include <MqttSession.h>
+#include <WiFiJoin.h>
+#include <BootStats.h>
+#include <TopicAlias.h>
+#include <TimerWheel.h>
+#include <RtcState.h>
+
+static_assert(SMART_WINDOW_COUNT >= 1 && SMART_WINDOW_COUNT <= STEP_SCHEDULER_SIZE &&
+  JOURNAL_ID_SMART_WINDOW + SMART_WINDOW_COUNT <= JOURNAL_ID_AUTOMATED_WINDOW, "Unsupported number of windows.");
+
+config_t config[SMART_WINDOW_COUNT];
 
 WiFiClient espClient;
 PubSubClient mqttClient(espClient);
+MqttSession session(mqttClient);
 
 WiFiUDP ntpUDP;
 NTPClient timeClient(ntpUDP, "pool.ntp.org");
-
-SmartWindow* sWindow = nullptr;
-LimitSwitch* openSens = nullptr;
-LimitSwitch* closeSens = nullptr;
-
-void mqttUpdateTopic()
+// Marks the NTP resync due, loop() runs it between moves
+bool ntpDue = false;
+void ntpResyncDue(void *) { ntpDue = true; }
+Timer ntpResync(ntpResyncDue);
+
+SmartWindow* sWindow[SMART_WINDOW_COUNT] = {nullptr};
+LimitSwitch* openSens[SMART_WINDOW_COUNT] = {nullptr};
+LimitSwitch* closeSens[SMART_WINDOW_COUNT] = {nullptr};
+
+// Interleaves the steps of all windows that are moving
+StepScheduler scheduler;
+// Open and close commands waiting for their window
+CommandQueue commands;
+// Travel and profile calibration of each window, see <root>/calibrate
+Calibration calibration[SMART_WINDOW_COUNT];
+
+// Where the windows last stood still, kept in RTC memory through a reset so
+// the homing at boot takes the nearest switch. Bump the version whenever it
+// changes.
+#define HOME_STATE_VERSION 1
+typedef struct
 {
-  String mqttTopicRoot = String(config.mqttTopicRoot);
-  Log::setMQTT(&mqttClient,String(mqttTopicRoot + "/log"));
-  mqttClient.subscribe(String(mqttTopicRoot + "/open").c_str());
-  mqttClient.subscribe(String(mqttTopicRoot + "/close").c_str());
-  mqttClient.subscribe(String(mqttTopicRoot + "/config/read").c_str());
-  mqttClient.subscribe(String(mqttTopicRoot + "/config/write").c_str());
-  mqttClient.subscribe(String(mqttTopicRoot + "/config/save").c_str());
-  mqttClient.subscribe(String(mqttTopicRoot + "/config/load").c_str());
-  mqttClient.subscribe(String(mqttTopicRoot + "/config/reset").c_str());
-}
-
-String configSerialize(const struct config_t * confObj)
+  int8_t side[SMART_WINDOW_COUNT];      // Last switch the window was on: 1 open, -1 close, 0 none
+  uint32_t steps[SMART_WINDOW_COUNT];   // How far it stood from it
+} home_state_t;
+home_state_t home = {};
+// Step position of the switch in home.side, for each window
+long homePosition[SMART_WINDOW_COUNT] = {0};
+
+unsigned long lastMqttPoll = 0;
+bool windowsMoving = false;
+
+// Loop timing, see <root>/stats/get
+LoopStats stats;
+unsigned long lastRun = 0;
+
+// Latency trace of the last traced command of each window, see Trace.h
+enum TraceState : uint8_t {TRACE_IDLE, TRACE_QUEUED, TRACE_MOVING, TRACE_DONE};
+trace_t trace[SMART_WINDOW_COUNT];
+TraceState traceState[SMART_WINDOW_COUNT] = {TRACE_IDLE};
+
+bool logPublish(const char * topic, const char * payload)
 {
-  const size_t capacity = JSON_OBJECT_SIZE(CONFIG_SIZE);
-  StaticJsonDocument<capacity> doc;
+  return mqttClient.publish(topic, payload);
+}
 
-  doc["dirPin"] = confObj->dirPin;
-  doc["stepPin"] = confObj->stepPin;
-  doc["slpPin"] = confObj->slpPin;
-  doc["revSteps"] = confObj->revSteps;
-  doc["radius"] = confObj->radius;
-  doc["length"] = confObj->length;
-  doc["maxSpeed"] = confObj->maxSpeed;
-  doc["acc"] = confObj->acc;
-  doc["limOpenSwitch"] = confObj->limOpenSwitch;
-  doc["limCloseSwitch"] = confObj->limCloseSwitch;
-  doc["timeUTC"] = confObj->timeUTC;
-  doc["serialOutput"] = confObj->serialOutput;
-  doc["mqttTopicRoot"] = confObj->mqttTopicRoot;
-  doc["logLevel"] = confObj->logLevel;
+unsigned long logClock()
+{
+  return timeClient.getEpochTime();
+}
 
-  String output = "";
+// Command topics below DEVICE_ID
+const char * const DEVICE_TOPICS[] = {"/topic/write", "/topic/read", "/reset"};
+enum DeviceCommand : uint8_t {DEVICE_TOPIC_WRITE, DEVICE_TOPIC_READ, DEVICE_RESET, DEVICE_COMMANDS};
+
+// Command topics below the root topic of each window
+const char * const ROOT_TOPICS[] = {
+  "/open", "/close", "/calibrate",
+  "/config/read", "/config/write", "/config/save", "/config/load", "/config/reset",
+  "/config/+/get", "/config/+/set",
+  "/stats/get", "/stats/reset",
+  "/mem/get", "/mem/reset"
+};
+enum RootCommand : uint8_t {
+  ROOT_OPEN, ROOT_CLOSE, ROOT_CALIBRATE,
+  ROOT_CONFIG_READ, ROOT_CONFIG_WRITE, ROOT_CONFIG_SAVE, ROOT_CONFIG_LOAD, ROOT_CONFIG_RESET,
+  ROOT_CONFIG_GET, ROOT_CONFIG_SET,
+  ROOT_STATS_GET, ROOT_STATS_RESET,
+  ROOT_MEM_GET, ROOT_MEM_RESET,
+  ROOT_COMMANDS
+};
+static_assert(sizeof(ROOT_TOPICS)/sizeof(ROOT_TOPICS[0]) == ROOT_COMMANDS, "ROOT_TOPICS and RootCommand differ.");
+
+// Commands of the node are numbered: those of DEVICE_TOPICS, then those of
+// ROOT_TOPICS window after window
+#define COMMAND_COUNT (DEVICE_COMMANDS + SMART_WINDOW_COUNT*ROOT_COMMANDS)
+// Below DEVICE_ID, where the broker answers the alias request
+#define ALIAS_REPLY_TOPIC "/alias"
+
+// Aliases of the command topics while config[0].topicAliases is set
+TopicAlias aliases;
+
+// Window whose root topic prefixes topic, -1 if none. The longest root wins,
+// so DEVICE_ID/1/open goes to window 1 and not to window 0.
+int windowOf(const char * topic)
+{
+  int window = -1;
+  size_t best = 0;
 
-  serializeJson(doc, output);
+  for(uint8_t w = 0; w < SMART_WINDOW_COUNT; w++)
+  {
+    size_t rootLength = strlen(config[w].mqttTopicRoot);
+    if(rootLength > best && strncmp(topic, config[w].mqttTopicRoot, rootLength) == 0 && topic[rootLength] == '/')
+    {
+      window = w;
+      best = rootLength;
+    }
+  }
+  return window;
+}
 
-  return output;
+// Full topic of command c in buf, which it returns
+const char * commandTopic(uint8_t c, char * buf, size_t size)
+{
+  if(c < DEVICE_COMMANDS)
+    snprintf(buf, size, "%s%s", DEVICE_ID, DEVICE_TOPICS[c]);
+  else
+  {
+    c -= DEVICE_COMMANDS;
+    snprintf(buf, size, "%s%s", config[c/ROOT_COMMANDS].mqttTopicRoot, ROOT_TOPICS[c%ROOT_COMMANDS]);
+  }
+  return buf;
 }
 
-void configDeserealize(struct config_t * confObj, String str)
+// Command of topic, -1 if it is none. An alias is a lookup, a full topic is
+// compared with the commands of the device and of its window.
+int commandOf(const char * topic)
 {
-  const size_t capacity = JSON_OBJECT_SIZE(CONFIG_SIZE);
-  StaticJsonDocument<capacity> doc;
+  int c = aliases.command(topic);
+  if(c >= 0)
+    return c;
 
-  DeserializationError error = deserializeJson(doc, str);
-  if (error)
+  size_t n = strlen(DEVICE_ID);
+  for(uint8_t i = 0; i < DEVICE_COMMANDS; i++)
+  {
+    if(strncmp(topic, DEVICE_ID, n) == 0 && strcmp(topic + n, DEVICE_TOPICS[i]) == 0)
+      return i;
+  }
+
+  int w = windowOf(topic);
+  if(w < 0)
+    return -1;
+  const char * suffix = topic + strlen(config[w].mqttTopicRoot);
+  for(uint8_t i = 0; i < ROOT_COMMANDS; i++)
   {
-    Log::error("Failed to deserialize payload message. Error code: " + String(error.c_str()));
+    if(strcmp(suffix, ROOT_TOPICS[i]) == 0)
+      return DEVICE_COMMANDS + w*ROOT_COMMANDS + i;
+  }
+  return -1;
+}
+
+void configDefaults(uint8_t w, struct config_t & conf)
+{
+  conf = config_t();
+  if(w == 0)
     return;
+
+  conf.dirPin = 0xFF;
+  conf.stepPin = 0xFF;
+  conf.slpPin = 0xFF;
+  snprintf(conf.mqttTopicRoot, sizeof(conf.mqttTopicRoot), "%s/%u", DEVICE_ID, w);
+}
+
+void mqttUpdateTopic(uint8_t w)
+{
+  String mqttTopicRoot = String(config[w].mqttTopicRoot);
+  if(w == 0)
+  {
+    // Copied by the log
+    char logTopic[DEVICE_ID_MAX_LENGTH + 4];
+    snprintf(logTopic, sizeof(logTopic), "%s/log", config[0].mqttTopicRoot);
+    RingLog::setSink(logPublish, logTopic);
   }
+  for(const char * topic : ROOT_TOPICS)
+    mqttClient.subscribe(String(mqttTopicRoot + topic).c_str());
+}
 
-  // Pin changes only take effect after reinitializing the microcontroler
-  if(doc["dirPin"])
-     confObj->dirPin = doc["dirPin"];
-  if(doc["stepPin"])
-     confObj->stepPin = doc["stepPin"];
-  if(doc["slpPin"])
-     confObj->slpPin = doc["slpPin"];
-
-  if(doc["revSteps"])
+// Applies a new configuration to window w. Each side effect runs once,
+// whatever the number of fields that asked for it.
+void configCommit(uint8_t w, const struct config_t & staged, uint8_t hooks)
+{
+  if(hooks & CONFIG_HOOK_TOPIC)
   {
-     confObj->revSteps = doc["revSteps"];
-     sWindow->setRevolutionSteps(confObj->revSteps);
+    aliasDrop();
+    for(const char * topic : ROOT_TOPICS)
+      mqttClient.unsubscribe(String(String(config[w].mqttTopicRoot) + topic).c_str());
   }
-  if(doc["radius"])
+
+  config[w] = staged;
+
+  // A calibration drives its own profile and applies the configuration when it ends
+  if((hooks & CONFIG_HOOK_MOTOR) && sWindow[w] != nullptr && !calibration[w].running())
+    sWindow[w]->setConfig(config[w]);
+  if(hooks & CONFIG_HOOK_TOPIC)
   {
-     confObj->radius = doc["radius"];
-     sWindow->setRadius(confObj->radius);
+    mqttUpdateTopic(w);
+    aliasRegister();
   }
-  if(doc["length"])
+  // Pin changes only take effect after reinitializing the microcontroler
+  if(hooks & CONFIG_HOOK_REBOOT)
+    LOG_WARNING("Pin changes take effect after saving and restarting.");
+
+  // Node settings are taken from the first window only
+  if(w != 0)
+    return;
+  if(hooks & CONFIG_HOOK_TIME)
+    timeClient.setTimeOffset(3600*config[0].timeUTC);
+  if(hooks & CONFIG_HOOK_SERIAL)
+    RingLog::setSerial(config[0].serialOutput ? &Serial : nullptr);
+  if(hooks & CONFIG_HOOK_LOG)
+    RingLog::setLevel(config[0].logLevel);
+}
+
+// Partial update from a JSON object, applied as a whole or not at all
+bool configWrite(uint8_t w, const char * json)
+{
+  MemScope mem(MEM_OP_CONFIG_WRITE);
+  StaticJsonDocument<CONFIG_JSON_CAPACITY> doc;
+
+  DeserializationError error = deserializeJson(doc, json);
+  if (error)
   {
-     confObj->length = doc["length"];
-     sWindow->setLength(confObj->length);
+    LOG_ERROR("Failed to deserialize payload message. Error code: %s", error.c_str());
+    return false;
   }
-  if(doc["maxSpeed"])
+
+  config_t staged = config[w];
+  uint8_t hooks = CONFIG_HOOK_NONE;
+  if(!ConfigSchema::patch(staged, doc.as<JsonObjectConst>(), hooks))
   {
-     confObj->maxSpeed = doc["maxSpeed"];
-     sWindow->setMaxSpeed(confObj->maxSpeed);
+    LOG_ERROR("%s", ConfigSchema::err());
+    return false;
   }
-  if(doc["acc"])
+
+  configCommit(w, staged, hooks);
+  return true;
+}
+
+bool configFieldWrite(uint8_t w, int field, const char * value)
+{
+  config_t staged = config[w];
+  uint8_t hooks = CONFIG_HOOK_NONE;
+  if(!ConfigSchema::parse(staged, field, value, hooks))
   {
-     confObj->acc = doc["acc"];
-     sWindow->setAcceleration(confObj->acc);
+    LOG_ERROR("%s", ConfigSchema::err());
+    return false;
   }
 
-  if(doc["limOpenSwitch"])
-     confObj->limOpenSwitch = doc["limOpenSwitch"];
-  if(doc["limCloseSwitch"])
-     confObj->limCloseSwitch = doc["limCloseSwitch"];
+  configCommit(w, staged, hooks);
+  return true;
+}
+
+// Handles <root>/config/<field>/get and <root>/config/<field>/set
+bool configFieldCommand(uint8_t w, const char * topic, const char * msg)
+{
+  size_t rootLength = strlen(config[w].mqttTopicRoot);
+  if(strncmp(topic, config[w].mqttTopicRoot, rootLength) != 0 || strncmp(topic + rootLength, "/config/", 8) != 0)
+    return false;
+
+  const char * name = topic + rootLength + 8;
+  const char * command = strchr(name, '/');
+  if(command == nullptr)
+    return false;
+
+  int field = ConfigSchema::find(name, command - name);
+  if(field < 0)
+    return false;
 
-  if(doc["timeUTC"])
+  if(strcmp(command, "/get") == 0)
   {
-     confObj->timeUTC = doc["timeUTC"];
-     timeClient.setTimeOffset(3600*config.timeUTC);
+    char value[DEVICE_ID_MAX_LENGTH];
+    ConfigSchema::print(config[w], field, value, sizeof(value));
+    if(!mqttClient.publish(msg, value))
+      LOG_ERROR("Publish error!");
   }
-  if(doc["serialOutput"])
+  else if(strcmp(command, "/set") == 0)
+    configFieldWrite(w, field, msg);
+  else
+    return false;
+
+  return true;
+}
+
+void configReset(uint8_t w)
+{
+  config_t defaults;
+  configDefaults(w, defaults);
+  configCommit(w, defaults, ConfigSchema::diff(config[w], defaults));
+}
+
+bool configLoad(uint8_t w)
+{
+  config_t staged = config[w];
+  if(!ConfigSchema::load(staged, JOURNAL_ID_SMART_WINDOW + w))
   {
-    confObj->serialOutput = doc["serialOutput"];
-    if(confObj->serialOutput)
-      Log::setSerial(&Serial);
-    else
-      Log::setSerial(nullptr);
+    LOG_WARNING("%s", ConfigSchema::err());
+    return false;
   }
-  if(doc["mqttTopicRoot"])
+
+  configCommit(w, staged, ConfigSchema::diff(config[w], staged));
+  return true;
+}
+
+void windowInit(uint8_t w)
+{
+  if(config[w].dirPin == 0xFF || config[w].stepPin == 0xFF)
   {
-     mqttClient.unsubscribe(String(String(confObj->mqttTopicRoot) + "/#").c_str());
-     // confObj->mqttTopicRoot = doc["mqttTopicRoot"];
-     strlcpy(confObj->mqttTopicRoot,(const char*)doc["mqttTopicRoot"],DEVICE_ID_MAX_LENGTH);
-     mqttUpdateTopic();
+    LOG_WARNING("Window %u has no pins configured.", w);
+    return;
   }
-  if(doc["logLevel"])
+
+  sWindow[w] = new SmartWindow(config[w]);
+
+  if(config[w].limOpenSwitch != 0 && config[w].limCloseSwitch != 0)
   {
-     confObj->logLevel = doc["logLevel"];
-     Log::setLevel(confObj->logLevel);
+    openSens[w] = new LimitSwitch(config[w].limOpenSwitch);
+    closeSens[w] = new LimitSwitch(config[w].limCloseSwitch);
+    sWindow[w]->setSensor(openSens[w], closeSens[w]);
   }
 }
 
  
 void setup() {
     Serial.begin(115200);
-    Log::setSerial(&Serial);
-    Log::setLevel(Log::LOG_LEVEL_INFO);
-    Log::info("Reading data from EEPROM.");
+    RingLog::setSerial(&Serial);
+    RingLog::setLevel(RingLog::LEVEL_INFO);
+    LOG_INFO("Reading configuration from flash.");
+
+    BootStats::start(BOOT_CONFIG);
+    if(!ConfigStore.begin())
+      LOG_ERROR("%s", ConfigStore.err());
+    for(uint8_t w = 0; w < SMART_WINDOW_COUNT; w++)
+    {
+      configDefaults(w, config[w]);
+      if(!ConfigSchema::load(config[w], JOURNAL_ID_SMART_WINDOW + w))
+      {
+        LOG_WARNING("%s", ConfigSchema::err());
+        LOG_INFO("Using default configuration for window %u.", w);
+      }
+    }
+    BootStats::finish(BOOT_CONFIG);
 
-    EEPROM.begin(512);    
-    EEPROM.get<struct config_t>(0,config);
-    // config.limOpenSwitch = 14;
-    // config.limCloseSwitch = 12;
-    // EEPROM.put<struct config_t>(0,config);
-    // EEPROM.commit();
+    // The windows do not wait for the network
+    BootStats::start(BOOT_ACTUATOR);
+    for(uint8_t w = 0; w < SMART_WINDOW_COUNT; w++)
+    {
+      LOG_INFO("MQTT Topic: %s", config[w].mqttTopicRoot);
+      LOG_INFO("Initializing window actuator.");
+      windowInit(w);
+    }
+    scheduler.setStepHook(statsStep);
+    BootStats::finish(BOOT_ACTUATOR);
+    homeStart();
 
     timeClient.begin();
-    timeClient.setTimeOffset(3600*config.timeUTC);
-    Log::setNTP(&timeClient);
+    timeClient.setTimeOffset(3600*config[0].timeUTC);
+    RingLog::setClock(logClock);
 
-    setup_wifi();
     mqttClient.setBufferSize(mqttClient. getBufferSize() *3);
     mqttClient.setServer(mqtt_broker, mqtt_broker_port);
     mqttClient.setCallback(mqttCallback);
+    session.begin(espClient, mqtt_id, mqtt_username, mqtt_password, mqttSubscribe);
 
-    Log::info("MQTT Topic: " + String(config.mqttTopicRoot));
-
-    Log::info("Initializing window actuator.");
-    sWindow = new SmartWindow(config);
+    // Joined from loop(), see bootRun()
+    BootStats::start(BOOT_WIFI);
+    WiFiJoin::begin(ssid, psk);
+    stats.reset();
+}
 
-    if(config.limOpenSwitch != 0 && config.limOpenSwitch != 0)
+// Brings the network up from loop(), so the windows move meanwhile
+void bootRun() {
+    if(!BootStats::done(BOOT_WIFI))
     {
-      openSens = new LimitSwitch(config.limOpenSwitch);
-      closeSens = new LimitSwitch(config.limCloseSwitch);
-      sWindow->setSensor(openSens, closeSens);
+      if(!WiFiJoin::run())
+        return;
+      BootStats::finish(BOOT_WIFI);
+      LOG_INFO("IP address: %s", WiFi.localIP().toString().c_str());
     }
-}
- 
-void setup_wifi() {
-    delay(10);
-    Log::info("Connecting to " + String(ssid));
- 
-    WiFi.begin(ssid, psk);
- 
-    while (WiFi.status() != WL_CONNECTED) {
-        delay(500);
-        Log::info("Trying to connect...");
+    // The update blocks for up to a second, so it waits for the windows too
+    if(!BootStats::done(BOOT_NTP))
+    {
+      if(scheduler.isRunning())
+        return;
+      BootStats::start(BOOT_NTP);
+      if(!timeClient.update())
+        LOG_WARNING("Could not get the time.");
+      BootStats::finish(BOOT_NTP);
+      Timers.start(ntpResync, NTP_RESYNC_MS, NTP_RESYNC_MS);
+      BootStats::start(BOOT_MQTT);
+    }
+    if(!BootStats::done(BOOT_MQTT) && session.ready())
+    {
+      BootStats::finish(BOOT_MQTT);
+      bootPublish();
     }
+}
 
-    timeClient.update();
+// Retained, so the report is there whenever a client looks
+void bootPublish() {
+    char json[BOOT_JSON_SIZE];
+    if(BootStats::print(json, sizeof(json)) == 0 ||
+      !mqttClient.publish(String(String(config[0].mqttTopicRoot) + BOOT_TOPIC).c_str(), json, true))
+      LOG_WARNING("Boot report was not published.");
+}
  
-    Log::info("WiFi Connected!");
-    Log::info("IP address: " + WiFi.localIP().toString());
+void deviceCommand(uint8_t c, const char * msg)
+{
+  switch(c)
+  {
+  case DEVICE_TOPIC_WRITE:
+    LOG_INFO("Changing topic via device root topic to: %s", msg);
+    configFieldWrite(0, ConfigSchema::find("mqttTopicRoot"), msg);
+    break;
+  case DEVICE_TOPIC_READ:
+    LOG_INFO("Reading and sending topic via device root topic.");
+    if(!mqttClient.publish(msg, config[0].mqttTopicRoot))
+      LOG_ERROR("Publish error!");
+    break;
+  case DEVICE_RESET:
+    LOG_INFO("Reseting config. parameters.");
+    for(uint8_t i = 0; i < SMART_WINDOW_COUNT; i++)
+      configReset(i);
+    break;
+  }
+}
+
+void windowCommand(uint8_t w, uint8_t c, const char * msg)
+{
+  switch(c)
+  {
+  case ROOT_CONFIG_READ:
+  {
+    LOG_INFO("Reading config. parameters.");
+    MemScope memPublish(MEM_OP_PUBLISH);
+    String output = ConfigSchema::serialize(config[w]);
+    if(!mqttClient.publish(msg, output.c_str()))
+      LOG_ERROR("Publish error!");
+    break;
+  }
+  case ROOT_CONFIG_WRITE:
+    LOG_INFO("Writing config. parameters.");
+    configWrite(w, msg);
+    break;
+  case ROOT_CONFIG_RESET:
+    LOG_INFO("Reseting config. parameters.");
+    configReset(w);
+    break;
+  case ROOT_CONFIG_SAVE:
+    LOG_INFO("Saving config. parameters.");
+    if(!ConfigSchema::save(config[w], JOURNAL_ID_SMART_WINDOW + w))
+      LOG_ERROR("%s", ConfigSchema::err());
+    break;
+  case ROOT_CONFIG_LOAD:
+    LOG_INFO("Loading config. parameters.");
+    configLoad(w);
+    break;
+  case ROOT_STATS_GET:
+    statsPublish(msg[0] != '\0' ? String(msg) : String(config[w].mqttTopicRoot) + "/stats");
+    break;
+  case ROOT_STATS_RESET:
+    LOG_INFO("Reseting loop statistics.");
+    stats.reset();
+    break;
+  case ROOT_MEM_GET:
+    memPublish(msg[0] != '\0' ? String(msg) : String(config[w].mqttTopicRoot) + "/mem");
+    break;
+  case ROOT_MEM_RESET:
+    LOG_INFO("Reseting memory statistics.");
+    MemStats::reset();
+    break;
+  case ROOT_OPEN:
+  case ROOT_CLOSE:
+    if(sWindow[w] == nullptr)
+    {
+      LOG_ERROR("Window %d has no actuator.", w);
+      break;
+    }
+    if(calibration[w].running())
+    {
+      LOG_WARNING("Window %u is calibrating, send /calibrate again to abort.", w);
+      break;
+    }
+    LOG_INFO("%s window.", c == ROOT_OPEN ? "Opening" : "Closing");
+    // Implementar parâmetros de abrir/fechar janela: acc, vel. etc
+    if(!commands.push(w, c == ROOT_OPEN ? CommandQueue::OPEN : CommandQueue::CLOSE))
+      LOG_ERROR("Command queue is full!");
+    else
+      traceCommand(w, msg);
+    break;
+  case ROOT_CALIBRATE:
+    calibrationStart(w);
+    break;
+  }
 }
  
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
-    String stopic = String(topic);
-    String mqttTopicRoot = String(config.mqttTopicRoot);
+    unsigned long callbackStart = micros();
+    MemScope mem(MEM_OP_CALLBACK);
+    if(session.handle(topic))
+      return;
+
     char msg[length+1];
     for (int i = 0; i < length; i++) {
         msg[i] = (char)payload[i];
     }
     msg[length] = '\0';
 
-    Log::info("Received message [" + stopic + "]: " + String(msg));
- 
-    if(stopic == (String(DEVICE_ID) + "/topic/write"))
-    {
-      Log::info("Changing topic via device root topic to: " + String(msg));
-      //config.mqttTopicRoot = String(msg);
-      configDeserealize(&config, "{\"mqttTopicRoot\":\""  + String(msg) + "\"}");
-    }
-    if(stopic == (String(DEVICE_ID) + "/topic/read"))
-    {
-      Log::info("Reading and sending topic via device root topic.");
-      if(!mqttClient.publish(msg, mqttTopicRoot.c_str()))
-        Log::error("Publish error!");
-    }
-    else if(stopic == (String(DEVICE_ID) + "/reset"))
-    {
-      Log::info("Reseting config. parameters.");
-      config = config_t();
-    }
+    LOG_INFO("Received message [%s]: %s", topic, msg);
 
-    else if(stopic == (mqttTopicRoot + "/config/read"))
+    // A command index, whether the topic is an alias or a full one
+    int c = commandOf(topic);
+    if(c >= DEVICE_COMMANDS)
+      windowCommand((c - DEVICE_COMMANDS)/ROOT_COMMANDS, (c - DEVICE_COMMANDS)%ROOT_COMMANDS, msg);
+    else if(c >= 0)
+      deviceCommand(c, msg);
+    else if(aliasAccept(topic, msg))
     {
-      Log::info("Reading config. parameters.");
-      String output = configSerialize(&config);
-      // Log::info(String("Sending output: " + output));
-      if(!mqttClient.publish(msg, output.c_str()))
-        Log::error("Publish error!");
+      LOG_INFO("%u topic aliases in use.", aliases.count());
     }
-    else if(stopic == (mqttTopicRoot + "/config/write"))
+    else
     {
-      Log::info("Writing config. parameters.");
-      configDeserealize(&config, String(msg));
+      // Field commands are filters and never have an alias
+      int w = windowOf(topic);
+      if(w >= 0 && configFieldCommand(w, topic, msg))
+        LOG_INFO("Config. parameter command handled.");
     }
-    else if(stopic == (mqttTopicRoot + "/config/reset"))
+
+    stats.callback.add(micros() - callbackStart);
+}
+ 
+// Called by the session when the broker lost the subscriptions, and with
+// them the aliases
+void mqttSubscribe() {
+    aliases.clear();
+    for(const char * topic : DEVICE_TOPICS)
+      mqttClient.subscribe(String(DEVICE_ID + String(topic)).c_str());
+    for(uint8_t w = 0; w < SMART_WINDOW_COUNT; w++)
+      mqttUpdateTopic(w);
+    aliasRegister();
+}
+
+// Asks the broker for aliases of all command topics, if enabled. The full
+// topics stay subscribed until the reply comes, see aliasAccept().
+void aliasRegister()
+{
+  if(!config[0].topicAliases)
+    return;
+
+  char reply[DEVICE_ID_MAX_LENGTH + 8];
+  snprintf(reply, sizeof(reply), "%s" ALIAS_REPLY_TOPIC, DEVICE_ID);
+  mqttClient.subscribe(reply);
+
+  // Streamed, the request is longer than the MQTT buffer
+  char topic[DEVICE_ID_MAX_LENGTH + 16];
+  size_t n = strlen(reply);
+  for(uint8_t c = 0; c < COMMAND_COUNT; c++)
+    n += 1 + strlen(commandTopic(c, topic, sizeof(topic)));
+
+  bool ok = mqttClient.beginPublish(ALIAS_REGISTER_TOPIC, n, false);
+  ok = ok && mqttClient.write((const uint8_t*)reply, strlen(reply)) == strlen(reply);
+  for(uint8_t c = 0; ok && c < COMMAND_COUNT; c++)
+  {
+    commandTopic(c, topic, sizeof(topic));
+    ok = mqttClient.write('\n') == 1 && mqttClient.write((const uint8_t*)topic, strlen(topic)) == strlen(topic);
+  }
+  if(!ok || !mqttClient.endPublish())
+    LOG_ERROR("Alias request was not published.");
+}
+
+// Takes the reply of the broker if topic is the reply topic: subscribes to
+// the aliases instead of their full topics
+bool aliasAccept(const char * topic, const char * msg)
+{
+  char reply[DEVICE_ID_MAX_LENGTH + 8];
+  snprintf(reply, sizeof(reply), "%s" ALIAS_REPLY_TOPIC, DEVICE_ID);
+  if(strcmp(topic, reply) != 0)
+    return false;
+
+  aliasDrop();
+  if(!config[0].topicAliases)
+    return true;
+  aliases.accept(msg, COMMAND_COUNT);
+
+  char full[DEVICE_ID_MAX_LENGTH + 16];
+  char alias[ALIAS_TOPIC_SIZE];
+  for(uint8_t c = 0; c < COMMAND_COUNT; c++)
+  {
+    uint8_t id = aliases.id(c);
+    if(id == 0)
+      continue;
+    mqttClient.subscribe(TopicAlias::print(id, alias, sizeof(alias)));
+    mqttClient.unsubscribe(commandTopic(c, full, sizeof(full)));
+  }
+  return true;
+}
+
+// Back to the full topics, e.g. before the root topics change
+void aliasDrop()
+{
+  char full[DEVICE_ID_MAX_LENGTH + 16];
+  char alias[ALIAS_TOPIC_SIZE];
+  for(uint8_t c = 0; c < COMMAND_COUNT; c++)
+  {
+    uint8_t id = aliases.id(c);
+    if(id == 0)
+      continue;
+    mqttClient.subscribe(commandTopic(c, full, sizeof(full)));
+    mqttClient.unsubscribe(TopicAlias::print(id, alias, sizeof(alias)));
+  }
+  aliases.clear();
+}
+
+// Starts calibrating window w, or aborts its running calibration
+void calibrationStart(uint8_t w)
+{
+  if(calibration[w].running())
+  {
+    calibration[w].abort();
+    LOG_WARNING("Calibration of window %u aborted.", w);
+    sWindow[w]->setConfig(config[w]);
+    return;
+  }
+  if(sWindow[w] == nullptr || closeSens[w] == nullptr)
+  {
+    LOG_ERROR("Window %u needs an actuator and limit switches to calibrate.", w);
+    return;
+  }
+  if(scheduler.isScheduled(sWindow[w]) || commands.pending(w))
+  {
+    LOG_ERROR("Window %u is moving, calibrate it standing still.", w);
+    return;
+  }
+
+  LOG_INFO("Calibrating window %u.", w);
+  calibration[w].begin(sWindow[w]);
+}
+
+// Runs the calibrations on every loop. A finished one is applied and saved,
+// a failed one leaves the configuration as it was.
+void calibrationUpdate()
+{
+  for(uint8_t w = 0; w < SMART_WINDOW_COUNT; w++)
+  {
+    Calibration & c = calibration[w];
+    if(!c.running() || c.run(scheduler))
+      continue;
+
+    if(c.phase() == Calibration::FAILED)
     {
-      Log::info("Reseting config. parameters.");
-      config = config_t();
+      LOG_ERROR("Calibration of window %u failed: %s", w, c.err());
+      sWindow[w]->setConfig(config[w]);
+      continue;
     }
-    else if(stopic == (mqttTopicRoot + "/config/save"))
+
+    config_t staged = config[w];
+    staged.length = c.length();
+    staged.maxSpeed = c.maxSpeed();
+    staged.acc = c.acc();
+    configCommit(w, staged, CONFIG_HOOK_MOTOR);
+    LOG_INFO("Window %u calibrated: length %.1f mm, speed %.0f deg/s, acceleration %.0f deg/s2.",
+      w, config[w].length, config[w].maxSpeed, config[w].acc);
+
+    if(!ConfigSchema::save(config[w], JOURNAL_ID_SMART_WINDOW + w))
+      LOG_ERROR("%s", ConfigSchema::err());
+  }
+}
+
+// The step positions are lost with a reset, so each window with limit
+// switches moves onto one. It takes the switch it stood nearest to, from RTC
+// memory; after a power-up nothing is kept there and it closes. A window
+// already on a switch does not move. The homing moves are queued like
+// commands, so a command from MQTT replaces them.
+void homeStart()
+{
+  home_state_t kept = {};
+  if(RtcState::read(HOME_STATE_VERSION, &kept, sizeof(kept)) != sizeof(kept))
+    memset(&kept, 0, sizeof(kept));
+
+  BootStats::start(BOOT_HOME);
+  for(uint8_t w = 0; w < SMART_WINDOW_COUNT; w++)
+  {
+    if(sWindow[w] == nullptr || closeSens[w] == nullptr || closeSens[w]->read() || openSens[w]->read())
+      continue;
+
+    bool open = false;
+    if(kept.side[w] != 0)
     {
-      Log::info("Saving config. parameters.");
-      EEPROM.put<struct config_t>(0,config);
-      EEPROM.commit();
+      float travel = config[w].length*config[w].revSteps/(2.0*PI*config[w].radius);
+      open = (kept.side[w] > 0) == (kept.steps[w] <= travel/2);
     }
-    else if(stopic == (mqttTopicRoot + "/config/load"))
+    LOG_INFO("Homing window %u on its %s switch.", w, open ? "open" : "close");
+    commands.push(w, open ? CommandQueue::OPEN : CommandQueue::CLOSE);
+  }
+  homeSave();
+  if(commands.size() == 0)
+    BootStats::finish(BOOT_HOME);
+}
+
+// Called whenever every window stands still
+void homeSave()
+{
+  for(uint8_t w = 0; w < SMART_WINDOW_COUNT; w++)
+  {
+    if(sWindow[w] == nullptr || closeSens[w] == nullptr)
+      continue;
+
+    long position = sWindow[w]->getPosition();
+    if(closeSens[w]->read() || openSens[w]->read())
     {
-      Log::info("Loading config. parameters.");
-      EEPROM.get<struct config_t>(0,config);
+      home.side[w] = closeSens[w]->read() ? -1 : 1;
+      homePosition[w] = position;
     }
+    home.steps[w] = home.side[w] != 0 ? labs(position - homePosition[w]) : 0;
+  }
+
+  if(!RtcState::write(HOME_STATE_VERSION, &home, sizeof(home)))
+    LOG_WARNING("%s", RtcState::err());
+}
+
+// Open and close commands sent by the broker carry a trace
+void traceCommand(uint8_t w, const char * msg)
+{
+  trace_t t;
+  if(!Trace::parse(msg, t))
+    return;
 
-    else if(stopic == (mqttTopicRoot + "/open"))
+  t.received = millis();
+  trace[w] = t;
+  traceState[w] = TRACE_QUEUED;
+}
+
+// Stamps the start and the end of traced moves, on every loop
+void traceUpdate()
+{
+  for(uint8_t w = 0; w < SMART_WINDOW_COUNT; w++)
+  {
+    if(traceState[w] == TRACE_QUEUED && !commands.pending(w))
     {
-      Log::info("Opening window.");
-      // OPEN WINDOW // Implementar parâmetros de abrir/fechar janela: acc, vel. etc
-      sWindow->open();
+      trace[w].started = millis();
+      traceState[w] = TRACE_MOVING;
     }
-    else if(stopic == (mqttTopicRoot + "/close"))
+    // A command that did not move the window ends right away
+    if(traceState[w] == TRACE_MOVING && !scheduler.isScheduled(sWindow[w]))
     {
-      Log::info("Closing window.");
-      // CLOSE WINDOW
-      sWindow->close();
+      trace[w].finished = millis();
+      traceState[w] = TRACE_DONE;
     }
+  }
+}
 
+// Reports finished traces to <root>/trace
+void tracePublish()
+{
+  char json[TRACE_JSON_SIZE];
 
+  for(uint8_t w = 0; w < SMART_WINDOW_COUNT; w++)
+  {
+    if(traceState[w] != TRACE_DONE)
+      continue;
 
+    traceState[w] = TRACE_IDLE;
+    if(Trace::print(trace[w], json, sizeof(json)) == 0 ||
+      !mqttClient.publish(String(String(config[w].mqttTopicRoot) + TRACE_TOPIC).c_str(), json))
+      LOG_WARNING("Trace %lu of window %u was not reported.", (unsigned long)trace[w].id, w);
+  }
+}
 
-    if(strcmp(msg,"on")==0){
-        Log::info("Lights on");
-    }
-    else if(strcmp(msg,"off")==0){
-        Log::info("Lights off");
-    }
+void statsStep(unsigned long lateUs)
+{
+  stats.step(lateUs);
 }
- 
-void mqttReconnect() {
-    while (!mqttClient.connected()) {
-        Log::info("Reconnecting MQTT.");
-        if (!mqttClient.connect(mqtt_id,mqtt_username,mqtt_password)) {
-            Log::error("Failed to connect, rc=" + mqttClient.state());
-            if(WiFi.status() != WL_CONNECTED)
-              Log::warning("WiFi is not connected!");
-            Log::info("Connect retry in 5 seconds.");
-            delay(5000);
-        }
-    }
-    mqttClient.subscribe(String(DEVICE_ID + String("/topic/write")).c_str());
-    mqttClient.subscribe(String(DEVICE_ID + String("/topic/read")).c_str());
-    mqttClient.subscribe(String(DEVICE_ID + String("/reset")).c_str());
-    mqttUpdateTopic();
-    Log::info("MQTT Connected!");
+
+// Streamed, so the report does not need an MQTT buffer of its size
+void statsPublish(const String & topic)
+{
+  MemScope mem(MEM_OP_PUBLISH);
+  static char json[STATS_JSON_SIZE];
+  size_t n = stats.print(json, sizeof(json));
+
+  if(n == 0 || !mqttClient.beginPublish(topic.c_str(), n, false) ||
+    mqttClient.write((const uint8_t*)json, n) != n || !mqttClient.endPublish())
+    LOG_ERROR("Publish error!");
+}
+
+void memPublish(const String & topic)
+{
+  static char json[MEM_STATS_JSON_SIZE];
+  size_t n = MemStats::print(json, sizeof(json));
+
+  if(n == 0 || !mqttClient.beginPublish(topic.c_str(), n, false) ||
+    mqttClient.write((const uint8_t*)json, n) != n || !mqttClient.endPublish())
+    LOG_ERROR("Publish error!");
+}
+
+// While windows move, MQTT is polled every MOTION_MQTT_POLL_MS, right after a
+// step when the next one is not due soon, so polling does not delay steps.
+// Not a timer on Timers: the windows standing still poll every loop, and the
+// gap between two steps is only known right after a step.
+bool mqttPollDue()
+{
+  unsigned long elapsed = millis() - lastMqttPoll;
+
+  if(!scheduler.isRunning())
+    return true;
+  if(elapsed >= 2*MOTION_MQTT_POLL_MS)
+    return true;
+  return elapsed >= MOTION_MQTT_POLL_MS && scheduler.idleTime() >= MOTION_MQTT_MIN_IDLE_US;
 }
  
 void loop() {
-    if (!mqttClient.connected())
-        mqttReconnect();
+    unsigned long loopStart = micros();
 
-    mqttClient.loop();
+    Timers.run();
+    bootRun();
+    // A connect attempt blocks for a moment, so it waits until the windows stand still
+    session.run(BootStats::done(BOOT_NTP) && !scheduler.isRunning());
 
-    // Checks if there is some task staked on SmartWindow
-    if(sWindow->isRunning())
+    // Log lines go out with the MQTT polls, so they do not delay steps either
+    if(mqttPollDue())
     {
-      Log::info("Starting window operation.");
-      String mqttTopicRoot = String(config.mqttTopicRoot);
-      // Do not listen to commands!
-      mqttClient.unsubscribe(String(mqttTopicRoot + "/open").c_str());
-      mqttClient.unsubscribe(String(mqttTopicRoot + "/close").c_str());
-      sWindow->enable();
-      while(sWindow->run())
+      unsigned long pollStart = micros();
+      mqttClient.loop();
+      stats.mqttPoll.add(micros() - pollStart);
+      tracePublish();
+      RingLog::flush();
+      lastMqttPoll = millis();
+    }
+
+    // Starts queued commands, preempting moves in the other direction
+    commands.dispatch(sWindow, SMART_WINDOW_COUNT, scheduler);
+    calibrationUpdate();
+    traceUpdate();
+
+    if(scheduler.isRunning())
+    {
+      unsigned long now = micros();
+      // The first call of a move has no interval yet
+      if(lastRun != 0)
+        stats.runInterval.add(now - lastRun);
+      lastRun = now;
+    }
+    else
+      lastRun = 0;
+    scheduler.run();
+
+    if(scheduler.isRunning() != windowsMoving)
+    {
+      windowsMoving = scheduler.isRunning();
+      if(windowsMoving)
+        LOG_INFO("Starting window operation.");
+      else
       {
-        yield();
+        LOG_INFO("Finished window operation.");
+        homeSave();
+        BootStats::finish(BOOT_HOME);
       }
-      sWindow->disable();
-      // Reenable listening
-      mqttClient.subscribe(String(mqttTopicRoot + "/open").c_str());
-      mqttClient.subscribe(String(mqttTopicRoot + "/close").c_str());
-      Log::info("Finished window operation.");
     }
-    // timeClient.update();
-}
\ No newline at end of file
+    // The update blocks for up to a second, so it waits for the windows too
+    if(ntpDue && !scheduler.isRunning())
+    {
+      ntpDue = false;
+      if(!timeClient.forceUpdate())
+        LOG_WARNING("Could not get the time.");
+    }
+
+    stats.loop.add(micros() - loopStart);
+}
@@ -0,0 +1,122 @@
+#include "StepScheduler.h"
+
+bool StepScheduler::start(Driver * driver)
+{
+	for(uint8_t i = 0; i < _count; i++)
+	{
+		if(_heap[i].driver == driver)
+		{
+			_heap[i].due = driver->nextStepDue();
+			siftUp(i);
+			siftDown(i);
+			return true;
+		}
+	}
+
+	if(_count >= STEP_SCHEDULER_SIZE)
+		return false;
+
+	driver->enable();
+	_heap[_count].driver = driver;
+	_heap[_count].due = driver->nextStepDue();
+	_heap[_count].stepped = false;
+	siftUp(_count++);
+	return true;
+}
+
+bool StepScheduler::run()
+{
+	unsigned long now = micros();
+
+	// Each driver is visited at most once per pass. A driver whose due time
+	// was estimated a little early stays on top without spinning here.
+	for(uint8_t visits = _count; visits > 0 && _count > 0 && !before(now, _heap[0].due); visits--)
+	{
+		Driver * driver = _heap[0].driver;
+		unsigned long lastStep = driver->lastStepTime();
+		bool running = driver->run();
+
+		if(driver->lastStepTime() != lastStep)
+		{
+			if(_stepHook != nullptr && _heap[0].stepped)
+			{
+				unsigned long step = driver->lastStepTime();
+				_stepHook(before(_heap[0].due, step) ? step - _heap[0].due : 0);
+			}
+			_heap[0].stepped = true;
+		}
+
+		if(running)
+		{
+			_heap[0].due = driver->nextStepDue();
+			siftDown(0);
+		}
+		else
+		{
+			driver->sleep(STEP_SCHEDULER_HOLD_MS);
+			_heap[0] = _heap[--_count];
+			siftDown(0);
+		}
+	}
+
+	return _count > 0;
+}
+
+bool StepScheduler::isScheduled(Driver * driver)
+{
+	for(uint8_t i = 0; i < _count; i++)
+	{
+		if(_heap[i].driver == driver)
+			return true;
+	}
+	return false;
+}
+
+unsigned long StepScheduler::idleTime()
+{
+	if(_count == 0)
+		return 0;
+
+	unsigned long now = micros();
+	return before(now, _heap[0].due) ? _heap[0].due - now : 0;
+}
+
+
+void StepScheduler::siftUp(uint8_t i)
+{
+	while(i > 0)
+	{
+		uint8_t parent = (i - 1) / 2;
+		if(!before(_heap[i].due, _heap[parent].due))
+			break;
+		swap(i, parent);
+		i = parent;
+	}
+}
+
+void StepScheduler::siftDown(uint8_t i)
+{
+	for(;;)
+	{
+		uint8_t first = i;
+		uint8_t left = 2*i + 1;
+		uint8_t right = left + 1;
+
+		if(left < _count && before(_heap[left].due, _heap[first].due))
+			first = left;
+		if(right < _count && before(_heap[right].due, _heap[first].due))
+			first = right;
+		if(first == i)
+			return;
+
+		swap(i, first);
+		i = first;
+	}
+}
+
+void StepScheduler::swap(uint8_t a, uint8_t b)
+{
+	slot_t t = _heap[a];
+	_heap[a] = _heap[b];
+	_heap[b] = t;
+}
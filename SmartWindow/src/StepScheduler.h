@@ -0,0 +1,65 @@
+#ifndef STEP_SCHEDULER_H
+#define STEP_SCHEDULER_H
+
+#include <Arduino.h>
+#include "WindowActuator.h"
+
+#ifndef STEP_SCHEDULER_SIZE
+#define STEP_SCHEDULER_SIZE 8
+#endif
+// Time a driver stays on after its move, so a move right after it (the
+// next leg, a reversal) skips the wake-up. 0 puts it to sleep at once.
+#ifndef STEP_SCHEDULER_HOLD_MS
+#define STEP_SCHEDULER_HOLD_MS 500
+#endif
+
+/* Runs the moves of several drivers from one loop.
+ * Drivers are kept in a min-heap ordered by the time their next step is due,
+ * so a pass only touches the drivers that have to step now. A step costs
+ * O(log n) heap work instead of polling every driver on every pass. */
+class StepScheduler
+{
+public:
+	// Called with the lateness of every step against its due time in us.
+	// The first step of a move has no due time and is not reported.
+	typedef void (*StepHook)(unsigned long lateUs);
+
+	// Powers the driver and schedules it. Call it after giving the driver a
+	// new target. Scheduling a driver twice only moves its due time.
+	bool start(Driver * driver);
+
+	// Steps every driver that is due. Drivers that reach their target leave
+	// the schedule and sleep after STEP_SCHEDULER_HOLD_MS, on Timers.
+	// Returns true while any driver is still running.
+	bool run();
+
+	bool isRunning() { return _count > 0; }
+	bool isScheduled(Driver * driver);
+	uint8_t size() { return _count; }
+
+	// Microseconds until the next step is due, 0 if one is already due
+	unsigned long idleTime();
+
+	void setStepHook(StepHook hook) { _stepHook = hook; }
+
+private:
+	typedef struct
+	{
+		unsigned long due;
+		Driver * driver;
+		bool stepped;		// Stepped since it was scheduled
+	} slot_t;
+
+	// micros() wraps around, so times are compared by their difference
+	static bool before(unsigned long a, unsigned long b) { return (long)(a - b) < 0; }
+
+	void siftUp(uint8_t i);
+	void siftDown(uint8_t i);
+	void swap(uint8_t a, uint8_t b);
+
+	slot_t _heap[STEP_SCHEDULER_SIZE];
+	uint8_t _count = 0;
+	StepHook _stepHook = nullptr;
+};
+
+#endif
@@ -12,8 +12,11 @@ Driver::Driver(uint8_t dirPin, uint8_t stepPin, uint8_t sleepPin, unsigned revol
   : Driver(dirPin, stepPin, revolutionSteps)
 {
   _sleepPin = sleepPin;
-  pinMode(_sleepPin, OUTPUT);
-  digitalWrite(_sleepPin, LOW);
+  if(_sleepPin != 0xFF)
+  {
+    pinMode(_sleepPin, OUTPUT);
+    digitalWrite(_sleepPin, LOW);
+  }
 }
 
 Driver::Driver(uint8_t dirPin, uint8_t stepPin, uint8_t sleepPin, uint8_t enablePin,
@@ -34,6 +37,11 @@ Driver::Driver(uint8_t dirPin, uint8_t stepPin, uint8_t sleepPin, uint8_t enable
 
 void Driver::enable()
 {
+  Timers.stop(_sleep);
+  if(_enabled)
+    return;
+  _enabled = true;
+
   _driver.enableOutputs();
   _driver.setPinsInverted(false,false,false);
   _driver.setEnablePin(_enablePin);
@@ -54,6 +62,9 @@ void Driver::enable()
 
 void Driver::disable()
 {
+  Timers.stop(_sleep);
+  _enabled = false;
+
   if(_resetPin != 0xFF)
     digitalWrite(_resetPin, LOW);
   if(_sleepPin != 0xFF)
@@ -63,6 +74,15 @@ void Driver::disable()
 }
 
 
+void Driver::sleep(uint32_t holdMs)
+{
+  if(holdMs == 0)
+    disable();
+  else if(_enabled)
+    Timers.start(_sleep, holdMs);
+}
+
+
 void Driver::setDegree()
 {
   _unit = UNIT_DEGREE;
@@ -180,12 +200,26 @@ bool Driver::isRunning()
   return _driver.isRunning();
 }
 
+unsigned long Driver::nextStepDue()
+{
+  float speed = abs(_driver.speed());
+  if(speed == 0.0)
+    return micros();
+  return _driver.lastStepTime() + (unsigned long)(1000000.0/speed);
+}
+
 
 void Driver::stop()
 {
   return _driver.stop();
 }
 
+void Driver::halt()
+{
+  // Also sets the speed to zero
+  _driver.setCurrentPosition(_driver.currentPosition());
+}
+
 
 
 // % WindowActuator
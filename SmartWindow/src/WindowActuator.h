@@ -3,6 +3,29 @@
 
 #include <Arduino.h>
 #include <AccelStepper.h>
+#include <TimerWheel.h>
+
+// AccelStepper keeps its step timing private. This one remembers when it
+// last stepped, so a scheduler can tell when the next step is due.
+class TimedStepper : public AccelStepper
+{
+public:
+	TimedStepper(uint8_t interface, uint8_t pin1, uint8_t pin2)
+		: AccelStepper(interface, pin1, pin2) {}
+
+	unsigned long lastStepTime() { return _lastStep; }
+
+protected:
+	void step(long step) override
+	{
+		_lastStep = micros();
+		AccelStepper::step(step);
+	}
+
+private:
+	unsigned long _lastStep = 0;
+};
+
 
 class Driver
 {
@@ -16,11 +39,16 @@ public:
 	Driver(uint8_t dirPin, uint8_t stepPin, uint8_t sleepPin, unsigned revolutionSteps = 200);
 	Driver(uint8_t dirPin, uint8_t stepPin, uint8_t sleepPin, uint8_t enablePin,
 			uint8_t resetPin, unsigned revolutionSteps = 200);
+	virtual ~Driver() {}
 
-	// Enable pins and turn on the driver if enablePin is set.
+	// Enable pins and turn on the driver if enablePin is set. Cancels a
+	// pending sleep(), a driver that is still on is not woken again.
 	void enable();
 	// Disable pin, disables driver and puts it to sleep if pins are set.
 	void disable();
+	// disable() once the driver stood still for holdMs, on Timers
+	void sleep(uint32_t holdMs);
+	bool isEnabled() { return _enabled; }
 
 	void setDegree();
 	void setRadian();
@@ -49,16 +77,31 @@ public:
   /// preferably in your main loop. Note that each call to run() will make at most one step, and then only when a step is due,
   /// based on the current speed and the time since the last step.
   /// \return true if the motor is still running to the target position.
-	bool run();
+	virtual bool run();
 	/// Checks to see if the motor is currently running to a target
   /// \return true if the speed is not zero or not at the target position
 	bool isRunning();
 	bool blockingRun(); 	// Blocking!
 
+	/// Time in micros() at which the next step is due, estimated from the
+	/// last step and the current speed. Calling run() earlier does no harm.
+	unsigned long nextStepDue();
+	// Time in micros() of the last step
+	unsigned long lastStepTime() { return _driver.lastStepTime(); }
+	// Steps taken since power up, negative ones counted down
+	long getPosition() { return _driver.currentPosition(); }
+
 	void stop();
+	// Stops at once, without decelerating: for a limit switch, past which
+	// the window must not go on
+	void halt();
 
 private:
-	AccelStepper _driver;
+	static void sleepDue(void * ctx) { ((Driver*)ctx)->disable(); }
+
+	TimedStepper _driver;
+	Timer _sleep{sleepDue, this};
+	bool _enabled = false;
 	unsigned _revolutionSteps;
 	uint8_t _enablePin = 0xFF;
 	uint8_t _resetPin = 0xFF;
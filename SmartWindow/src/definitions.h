@@ -2,7 +2,7 @@
 #define DEFINITIONS_H
 
 #include <PubSubClient.h>
-#include <Logger.h>
+#include <RingLog.h>
 
 /* ************************************************************************* 
  * MAKE CHANGES HERE IF NEEDED!! 
@@ -22,7 +22,22 @@
 
 #define DEVICE_ID "SWALPHA01\0"
 #define DEVICE_ID_MAX_LENGTH 128
-#define CONFIG_SIZE 15
+
+// Windows driven by this node, up to 8. Each one has its own pins, saved
+// configuration and MQTT root topic: DEVICE_ID for the first window,
+// DEVICE_ID/<n> for the others. Windows after the first have no pins by
+// default, set them via MQTT, save and restart.
+// The first window also holds the node settings: timeUTC, serialOutput,
+// logLevel and topicAliases.
+#define SMART_WINDOW_COUNT 1
+
+// While windows move, MQTT is polled at this interval, when the next step
+// is at least MOTION_MQTT_MIN_IDLE_US away (or after twice the interval)
+#define MOTION_MQTT_POLL_MS 50
+#define MOTION_MQTT_MIN_IDLE_US 1000
+
+// The clock is set again from NTP this often, once the windows stand still
+#define NTP_RESYNC_MS (60*60*1000UL)
 
 /* THIS ARE THE DEAFULT VALUES! CHANGE IT IF YOU WANT BUT WATCH OUT! */
 typedef struct config_t
@@ -48,7 +63,10 @@ typedef struct config_t
 
   char mqttTopicRoot[DEVICE_ID_MAX_LENGTH] = DEVICE_ID;
 
-  uint8_t logLevel = Logger<PubSubClient>::LOG_LEVEL_INFO;
+  uint8_t logLevel = RingLog::LEVEL_INFO;
+
+  // Short broker aliases for the command topics, see TopicAlias.h
+  bool topicAliases = false;
 };
 
 #endif
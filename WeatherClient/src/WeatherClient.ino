@@ -3,85 +3,224 @@
 #include <ESP8266WiFi.h>
 #include <WiFiClient.h>
 #include <PubSubClient.h>
-#include <Logger.h>
+#include <RingLog.h>
+#include <MemStats.h>
+#include <MqttSession.h>
+#include <WiFiJoin.h>
+#include <BootStats.h>
+#include <RtcState.h>
+#include <TimerWheel.h>
 #include "weather.h"
 #include "definitions.h"
 
 
-typedef Logger<PubSubClient> Log;
-
 WiFiClient client;
 PubSubClient mqttClient(client);
+MqttSession session(mqttClient);
 WiFiClient httpClient;
 
 int status = WL_IDLE_STATUS;
 
+// What a wake from deep sleep needs, kept in RTC memory instead of the
+// journal. Bump the version whenever it changes.
+#define WAKE_STATE_VERSION 1
+typedef struct
+{
+  WiFiJoin::ap_t ap;
+  uint32_t wakes;       // Since the last power-up
+  uint8_t service[RTC_STATE_MAX_LENGTH - sizeof(WiFiJoin::ap_t) - sizeof(uint32_t)];   // WeatherMQTT::pack()
+} wake_state_t;
+
+wake_state_t wake;
+// Woke from deep sleep: report once and sleep again, see wakeRun()
+bool waking = false;
+// Time left awake with WEATHER_SLEEP: setup window or wake timeout
+Timer awake;
+
 // Get an API Key on https://openweathermap.org/ 
 WeatherMQTT<PubSubClient> weatherService("your_API_key_from_OpenWeatherMap", &httpClient, &mqttClient);
 
+bool logPublish(const char * topic, const char * payload)
+{
+  return mqttClient.publish(topic, payload);
+}
+
 void setup() {
   Serial.begin(115200);
-  Log::setLevel(Log::LOG_LEVEL_INFO);
-  Log::setSerial(&Serial);
-  Log::setPrefix("Weather");
-
-  WiFi.begin(ssid,psk);
-
-  Log::info("Connecting to WiFi...");
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
+  RingLog::setLevel(RingLog::LEVEL_INFO);
+  RingLog::setSerial(&Serial);
+  RingLog::setPrefix("Weather");
+
+  BootStats::start(BOOT_CONFIG);
+  // A wake takes its state from RTC memory, a power-up from the journal
+  waking = WEATHER_SLEEP && RtcState::woke();
+  size_t n = waking ? RtcState::read(WAKE_STATE_VERSION, &wake, sizeof(wake)) : 0;
+  bool restored = n > offsetof(wake_state_t, service) &&
+    weatherService.unpack(wake.service, n - offsetof(wake_state_t, service));
+  if(!restored)
+  {
+    if(waking)
+      LOG_WARNING("%s", RtcState::err());
+    memset(&wake, 0, sizeof(wake));
+    weatherService.load();
   }
-  Log::info("WiFi Connected");
-  printWiFiStatus();
-
-  weatherService.load();
+  if(waking)
+    wake.wakes++;
+  if(WEATHER_SLEEP)
+    Timers.start(awake, waking ? WEATHER_WAKE_TIMEOUT_MS : WEATHER_SETUP_MS);
+  BootStats::finish(BOOT_CONFIG);
 
   mqttClient.setBufferSize(weatherService.minBufferSize());
 	mqttClient.setServer(mqtt_broker, mqtt_broker_port);
 	mqttClient.setCallback(mqttCallback);
+  session.begin(client, mqtt_id, mqtt_username, mqtt_password, mqttSubscribe);
+
+  // Joined from loop(), see bootRun()
+  BootStats::start(BOOT_WIFI);
+  WiFiJoin::begin(ssid, psk, restored ? &wake.ap : nullptr);
 }
 
-void mqttReconnect() {
-    while (!mqttClient.connected())
-    {
-        Log::info("Reconnecting MQTT.");
-        if (!mqttClient.connect(mqtt_id,mqtt_username,mqtt_password)) {
-            Log::error(String("Failed to connect to MQTT, rc=") + String(mqttClient.state()));
-            if(WiFi.status() != WL_CONNECTED)
-              Log::error("WiFi is not connected!");
-            Log::info("Connect retry in 5 seconds.");
-            delay(5000);
-        }
-    }
-    Log::setMQTT(&mqttClient);
+// Tracks the boot phases that finish in loop()
+void bootRun() {
+  if(!BootStats::done(BOOT_WIFI))
+  {
+    if(!WiFiJoin::run())
+      return;
+    BootStats::finish(BOOT_WIFI);
+    printWiFiStatus();
+    BootStats::start(BOOT_MQTT);
+  }
+  if(!BootStats::done(BOOT_MQTT) && session.ready())
+  {
+    BootStats::finish(BOOT_MQTT);
+    // A wake reports its boot once the weather is out, see wakeRun()
+    if(!waking)
+      bootPublish();
+  }
+}
+
+// Retained, so the report is there whenever a client looks
+void bootPublish() {
+  char json[BOOT_JSON_SIZE];
+  char topic[TOPIC_BUFFER_SIZE];
+  if(BootStats::print(json, sizeof(json)) == 0 ||
+    !mqttClient.publish(weatherService.getMqttTopic().join(topic, sizeof(topic), BOOT_TOPIC), json, true))
+    LOG_WARNING("Boot report was not published.");
+}
+
+// Called by the session when the broker lost the subscriptions
+void mqttSubscribe() {
+    RingLog::setSink(logPublish);
+    // A wake only publishes, commands are taken after a power-up or a reset
+    if(waking)
+      return;
 
     weatherService.subscribe();
-    Log::info("MQTT Connected!");
+    char topic[TOPIC_BUFFER_SIZE];
+    mqttClient.subscribe(weatherService.getMqttTopic().join(topic, sizeof(topic), "/mem/get"));
+    mqttClient.subscribe(weatherService.getMqttTopic().join(topic, sizeof(topic), "/mem/reset"));
 }
 
 void loop() { 
-	if (!mqttClient.connected())
-	  mqttReconnect();
+  Timers.run();
+  bootRun();
+  session.run(BootStats::done(BOOT_WIFI));
+  mqttClient.loop();
+  if(waking)
+    wakeRun();
+  // Reports wait for the connection, a due one goes out once it is back
+  else if(session.ready())
+    weatherService.run();
+  RingLog::flush();
+
+  if(WEATHER_SLEEP && !waking && !awake.active())
+    sleepUntilDue();
+}
 
+// One report per wake, timed from the wake on: the publish phase of the
+// boot report ends when the weather is out
+void wakeRun() {
+  if(session.ready())
+  {
+    BootStats::start(BOOT_PUBLISH);
+    bool published = weatherService.report();
+    BootStats::finish(BOOT_PUBLISH);
+    if(published)
+      LOG_INFO("Wake %lu published after %lu ms.", (unsigned long)wake.wakes, millis());
+    bootPublish();
+    sleepUntilDue();
+  }
+  else if(!awake.active())
+  {
+    LOG_WARNING("No connection %lu ms after waking.", millis());
+    sleepUntilDue();
+  }
+}
+
+// Keeps the state in RTC memory and sleeps until the next report is due
+void sleepUntilDue() {
+  if(WiFi.status() == WL_CONNECTED)
+    WiFiJoin::current(wake.ap);
+  size_t n = weatherService.pack(wake.service, sizeof(wake.service));
+  if(n == 0 || !RtcState::write(WAKE_STATE_VERSION, &wake, offsetof(wake_state_t, service) + n))
+  {
+    LOG_WARNING("State does not fit in RTC memory, waking will read the journal.");
+    RtcState::clear();
+  }
+
+  unsigned long period = weatherService.getPeriod();
+  unsigned long ms = period > millis() + 1000 ? period - millis() : 1000;
+  LOG_INFO("Sleeping for %lu ms.", ms);
+  // loop() flushed already in this pass, the last lines would wait for the next
+  RingLog::flush(true);
   mqttClient.loop();
-  weatherService.run();
+  mqttClient.disconnect();
+  client.stop();
+  ESP.deepSleep(1000ULL*ms);
 }
 
 void mqttCallback(char* topic, byte* payload, unsigned int length)
 {
+  MemScope mem(MEM_OP_CALLBACK);
+
+  if(session.handle(topic))
+    return;
+
+  if(weatherService.getMqttTopic().equals(topic, "/mem/get"))
+  {
+    // Payload: response topic
+    static char memJson[MEM_STATS_JSON_SIZE];
+    char response[TOPIC_BUFFER_SIZE];
+    if(length >= sizeof(response))
+    {
+      LOG_ERROR("Response topic is too long.");
+      return;
+    }
+    memcpy(response, payload, length);
+    response[length] = '\0';
+    size_t n = MemStats::print(memJson, sizeof(memJson));
+    mqttClient.publish(response, (uint8_t*)memJson, n);
+    return;
+  }
+  if(weatherService.getMqttTopic().equals(topic, "/mem/reset"))
+  {
+    MemStats::reset();
+    return;
+  }
+
 	weatherService.callback(topic,payload,length);
 }
 
 // print Wifi status
 void printWiFiStatus() {
   // print the SSID of the network you're attached to:
-  Log::info(String("SSID: ") + WiFi.SSID());
+  LOG_INFO("SSID: %s", WiFi.SSID().c_str());
 
   // print your WiFi shield's IP address:
   IPAddress ip = WiFi.localIP();
-  Log::info(String("IP Address: ") + ip.toString());
+  LOG_INFO("IP Address: %s", ip.toString().c_str());
 
   // print the received signal strength:
   long rssi = WiFi.RSSI();
-  Log::info(String("Signal strength (RSSI): ") + String(rssi) + " dBm");
+  LOG_INFO("Signal strength (RSSI): %ld dBm", rssi);
 }
@@ -15,4 +15,13 @@
 #define mqtt_password ""
 /* ************************************************************************* */
 
+// Deep sleep between two reports, 0 keeps the node always on. GPIO16 (D0)
+// must be wired to RST for the node to wake up.
+#define WEATHER_SLEEP 0
+// After a power-up or a reset the node stays awake this long, taking
+// commands, before it first sleeps
+#define WEATHER_SETUP_MS (2*60*1000UL)
+// A wake that could not publish by then sleeps again
+#define WEATHER_WAKE_TIMEOUT_MS 10000
+
 #endif
@@ -5,164 +5,230 @@
 #include <ArduinoJson.h>
 #include <ESP8266WiFi.h>
 #include <WiFiClient.h>
-#include <EEPROM.h>
-#include <Logger.h>
+#include <ConfigJournal.h>
+#include <RingLog.h>
+#include <Trace.h>
+#include <MemStats.h>
+#include <StateCache.h>
+#include <FixedString.h>
+#include <TimerWheel.h>
 
 #define CITY_MAX_LENGTH 128
 #define TOPIC_MAX_LENGTH 128
 #define APIKEY_MAX_LENGTH 64
+// A root topic and the longest subtopic below it
+#define TOPIC_BUFFER_SIZE (TOPIC_MAX_LENGTH + 32)
+// Document of /config/get and /config/set, strings copied in
+#define WEATHER_CONFIG_JSON_SIZE (JSON_OBJECT_SIZE(5) + CITY_MAX_LENGTH + TOPIC_MAX_LENGTH + APIKEY_MAX_LENGTH + 48)
+// Text of that document, keys and numbers around the strings
+#define WEATHER_CONFIG_SIZE (CITY_MAX_LENGTH + TOPIC_MAX_LENGTH + APIKEY_MAX_LENGTH + 96)
+// Longest message of err()
+#define WEATHER_ERROR_SIZE 160
+// Forecasts a report carries at most
+#define WEATHER_PREDICTIONS_MAX 8
+// Fields of one entry of an API reply the filter keeps, strings copied in
+#define WEATHER_ENTRY_JSON_SIZE (JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(1) + 2*JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(1) + 96)
+// Document either reply is parsed into: the forecasts at most
+#define WEATHER_REPLY_JSON_SIZE (JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(WEATHER_PREDICTIONS_MAX) + WEATHER_PREDICTIONS_MAX*WEATHER_ENTRY_JSON_SIZE)
+// Filter of that document, the fields of the current weather and of the forecasts
+#define WEATHER_FILTER_JSON_SIZE (JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(1) + 2*(JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(1) + 2*JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(1)))
+// Text of a report with the most forecasts, an entry each, and the trace
+#define WEATHER_REPORT_SIZE (16 + (1 + WEATHER_PREDICTIONS_MAX)*240 + WEATHER_TRACE_SIZE)
+// ,"trace": and the trace, appended to the report
+#define WEATHER_TRACE_SIZE (TRACE_JSON_SIZE + 10)
+
+// Command topics below the root topic
+static const char * const WEATHER_COMMANDS[] = {
+	"/city/get", "/city/set", "/npredictions/get", "/npredictions/set", "/topic/get", "/topic/set",
+	"/apiKey/get", "/apiKey/set", "/period/get", "/period/set", "/save", "/load", "/config/get", "/config/set"
+};
+
+// Bump whenever args_t changes
+#define WEATHER_RECORD_VERSION 2
 
 class Weather
 {
 public:
-	Weather(String apiKey, WiFiClient* wifiClient)
-		: _apiKey(apiKey), _wifiClient(wifiClient)
+	Weather(WiFiClient* wifiClient)
+		: _wifiClient(wifiClient)
 	{
-		_err = "";
+		// Only the fields of the report are kept, of the current weather and
+		// of each forecast alike
+		filterEntry(_filter.to<JsonObject>());
+		filterEntry(_filter["list"][0].to<JsonObject>());
 	}
 
-	String get(String city, unsigned npredictions = 2)
+	// Writes the report of the current weather and npredictions forecasts
+	// to buf, terminated, as {"weather":[...]}. Each reply is parsed right
+	// from the client into the same document. Returns the length, 0 in case
+	// of error or if it does not fit in size.
+	size_t get(const char * apiKey, const char * city, unsigned npredictions, char * buf, size_t size)
 	{
-		// Get first current weather data
-		String weather = "";
-		if(!httpJsonRequest("/data/2.5/weather?q=" + city + "&APPID=" + _apiKey + "&mode=json&units=metric", weather))
-			return String(""); // Error occured
+		MemScope mem(MEM_OP_WEATHER_GET);
 
-		// Get forecast data
-		String forecast = "";
-		if(npredictions > 0)
+		if(npredictions > WEATHER_PREDICTIONS_MAX)
 		{
-			if(!httpJsonRequest("/data/2.5/forecast?q=" + city + "&APPID=" + _apiKey + "&mode=json&units=metric&cnt=" + String(npredictions), forecast))
-				return String(""); // Error occured
+			snprintf(_err, sizeof(_err), "At most %u predictions.", WEATHER_PREDICTIONS_MAX);
+			return 0;
 		}
 
-		// Deserialize current weather data
-		DynamicJsonDocument docWeather(JSON_ARRAY_SIZE(1) + JSON_OBJECT_SIZE(1) + 2*JSON_OBJECT_SIZE(2) + JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(6) + JSON_OBJECT_SIZE(13) + 270);
-		deserializeJson(docWeather,weather);
+		// Get first current weather data
+		if(!request("/data/2.5/weather", apiKey, city, 0))
+			return 0; // Error occured
 
-		// Parse to output json
-		DynamicJsonDocument docOutput(JSON_ARRAY_SIZE(1+npredictions) + JSON_OBJECT_SIZE(1) + (1+npredictions)*JSON_OBJECT_SIZE(8) + 150 + 80*npredictions);
-		
-		JsonArray w = docOutput.createNestedArray("weather");
-		JsonObject w0 = w.createNestedObject();
-		w0["id"] = docWeather["weather"][0]["id"];
-		w0["main"] = docWeather["weather"][0]["main"];
-		w0["description"] = docWeather["weather"][0]["description"];
-		w0["temp"] = docWeather["main"]["temp"];
-		w0["feels_like"] = docWeather["main"]["feels_like"];
-		w0["humidity"] = docWeather["main"]["humidity"];
-		w0["wind"] = docWeather["wind"]["speed"];
-		w0["dt"] = docWeather["dt"];
+		size_t n = snprintf(buf, size, "{\"weather\":[");
+		if(n >= size || !printEntry(_doc.as<JsonVariantConst>(), buf, size, n))
+			return full();
 
+		// Get forecast data
 		if(npredictions > 0)
 		{
-			// Deserialize forecast data
-			const size_t capacity = (npredictions == 1 ? 2 : npredictions)*JSON_ARRAY_SIZE(1) + JSON_ARRAY_SIZE(npredictions) + (2*npredictions)*JSON_OBJECT_SIZE(1) + (1+npredictions)*JSON_OBJECT_SIZE(2) 
-									+ npredictions*JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(8) + (2*npredictions)*JSON_OBJECT_SIZE(9) + 370 + (npredictions-1)*50;
-			DynamicJsonDocument docForecast(capacity);
-			deserializeJson(docForecast,forecast);
+			if(!request("/data/2.5/forecast", apiKey, city, npredictions))
+				return 0; // Error occured
 
+			// Forecasts missing from the reply are all null
 			for(unsigned i = 0; i < npredictions; i++)
 			{
-				JsonObject wi = w.createNestedObject();
-				wi["id"] = docForecast["list"][i]["weather"][0]["id"];
-				wi["main"] = docForecast["list"][i]["weather"][0]["main"];
-				wi["description"] = docForecast["list"][i]["weather"][0]["description"];
-				wi["temp"] = docForecast["list"][i]["main"]["temp"];
-				wi["feels_like"] = docForecast["list"][i]["main"]["feels_like"];
-				wi["humidity"] = docForecast["list"][i]["main"]["humidity"];
-				wi["wind"] = docForecast["list"][i]["wind"]["speed"];
-				wi["dt"] = docForecast["list"][i]["dt"];
+				if(!append(buf, size, n, ",") || !printEntry(_doc["list"][i], buf, size, n))
+					return full();
 			}
 		}
 
-		String output = "";
-		serializeJson(docOutput, output);
-
-		return output;
-	}
-
-	String err()
-	{
-		String ret = _err;
-		_err = "";
-		return ret;
+		if(!append(buf, size, n, "]}"))
+			return full();
+		return n;
 	}
 
-	void setApiKey(String apiKey) {_apiKey = apiKey;}
-	String getApiKey() {return _apiKey;}
+	// Message of the last error
+	const char * err() const {return _err;}
 
 
 
 protected:
-	bool httpJsonRequest(const String url, String &output)
+	// Sends a GET of path for city, with the count of forecasts unless it is
+	// 0, and parses the JSON body of the reply into _doc
+	bool request(const char * path, const char * apiKey, const char * city, unsigned cnt)
 	{
 	  	// close any connection before send a new request to allow wifiClient make connection to server
 		_wifiClient->stop();
 
-		if(_wifiClient->connect(_server,80))
+		if(!_wifiClient->connect(_server,80))
 		{
-			_wifiClient->println("GET " + url + " HTTP/1.1");
-			_wifiClient->println("Host: " + String(_server));
-			_wifiClient->println("User-Agent: ArduinoWiFi/1.1");
-			_wifiClient->println("Connection: close");
-			_wifiClient->println();
-
-			unsigned long timeout = millis();
-			while(_wifiClient->available() == 0)
+			snprintf(_err, sizeof(_err), "Connection to server has failed.");
+			return false;
+		}
+
+		_wifiClient->print("GET ");
+		_wifiClient->print(path);
+		_wifiClient->print("?q=");
+		_wifiClient->print(city);
+		_wifiClient->print("&APPID=");
+		_wifiClient->print(apiKey);
+		_wifiClient->print("&mode=json&units=metric");
+		if(cnt > 0)
+		{
+			_wifiClient->print("&cnt=");
+			_wifiClient->print(cnt);
+		}
+		_wifiClient->println(" HTTP/1.1");
+		_wifiClient->print("Host: ");
+		_wifiClient->println(_server);
+		_wifiClient->println("User-Agent: ArduinoWiFi/1.1");
+		_wifiClient->println("Connection: close");
+		_wifiClient->println();
+
+		unsigned long timeout = millis();
+		while(_wifiClient->available() == 0)
+		{
+			if(millis() - timeout > 5000)
 			{
-				if(millis() - timeout > 5000)
-				{
-					_err = "Client timeout (5s).";
-					_wifiClient->stop();
-					return false;
-				}
+				snprintf(_err, sizeof(_err), "Client timeout (5s).");
+				_wifiClient->stop();
+				return false;
 			}
+		}
 
-			char c = 0;
-			int jsonend = 0;
-			bool startJson = false;
-			while(_wifiClient->available())
-			{
-				c = _wifiClient->read();
+		// The body starts after the first empty line
+		static const char end[] = "\r\n\r\n";
+		uint8_t matched = 0;
+		while(matched < 4 && _wifiClient->available())
+		{
+			int c = _wifiClient->read();
+			matched = c == end[matched] ? matched + 1 : c == '\r' ? 1 : 0;
+		}
+		if(matched < 4)
+		{
+			snprintf(_err, sizeof(_err), "Reply of the weather host ended in its headers.");
+			return false;
+		}
 
-				if(c == '{')
-				{
-					startJson = true;
-					jsonend++;
-				}
+		DeserializationError error = deserializeJson(_doc, *_wifiClient, DeserializationOption::Filter(_filter));
+		if(error)
+		{
+			snprintf(_err, sizeof(_err), "Reply of the weather host is not valid: %s", error.c_str());
+			return false;
+		}
+		return true;
+	}
 
-				else if(c == '}')
-					jsonend--;
+private:
+	// Marks the fields of one entry of an API reply
+	static void filterEntry(JsonObject entry)
+	{
+		entry["weather"][0]["id"] = true;
+		entry["weather"][0]["main"] = true;
+		entry["weather"][0]["description"] = true;
+		entry["main"]["temp"] = true;
+		entry["main"]["feels_like"] = true;
+		entry["main"]["humidity"] = true;
+		entry["wind"]["speed"] = true;
+		entry["dt"] = true;
+	}
 
-				if(startJson)
-					output += c;
+	// Appends entry of an API reply to buf at n as an object of the report,
+	// null where a field is missing. False if buf is full.
+	static bool printEntry(JsonVariantConst entry, char * buf, size_t size, size_t & n)
+	{
+		static const char * const names[] = {"id", "main", "description", "temp", "feels_like", "humidity", "wind", "dt"};
+		JsonVariantConst values[] = {entry["weather"][0]["id"], entry["weather"][0]["main"], entry["weather"][0]["description"],
+			entry["main"]["temp"], entry["main"]["feels_like"], entry["main"]["humidity"], entry["wind"]["speed"], entry["dt"]};
 
-				if(jsonend == 0 && startJson)
-				{
-					startJson = false;
-					return true;
-				}
-			}
+		for(uint8_t i = 0; i < sizeof(names)/sizeof(names[0]); i++)
+		{
+			if(!append(buf, size, n, i == 0 ? "{\"" : ",\"") || !append(buf, size, n, names[i]) || !append(buf, size, n, "\":"))
+				return false;
+			n += serializeJson(values[i], buf + n, size - n);
+			// Filled up, it may have been cut
+			if(n + 1 >= size)
+				return false;
 		}
+		return append(buf, size, n, "}");
+	}
 
-		else
-		{
-			_err = "Connection to server has failed.";
+	static bool append(char * buf, size_t size, size_t & n, const char * s)
+	{
+		size_t length = strlen(s);
+		if(n + length >= size)
 			return false;
-		}
+		memcpy(buf + n, s, length + 1);
+		n += length;
+		return true;
+	}
 
-		_err = "Something went wrong on trying to request json data. Connection to weather host has might broken.";
-		return false;
+	size_t full()
+	{
+		snprintf(_err, sizeof(_err), "Report does not fit in its buffer.");
+		return 0;
 	}
 
-private:
-	String _apiKey;
 	WiFiClient* _wifiClient;
 	const char* _server = "api.openweathermap.org";
+	StaticJsonDocument<WEATHER_FILTER_JSON_SIZE> _filter;
+	// Either reply, the forecasts at most. Allocated once, with the client.
+	StaticJsonDocument<WEATHER_REPLY_JSON_SIZE> _doc;
 
 protected:
-	String _err;
+	char _err[WEATHER_ERROR_SIZE] = "";
 };
 
 
@@ -177,57 +243,88 @@ template<typename T>
 class WeatherMQTT: public Weather
 {
 public:
-	typedef Logger<T> Log;
-
 	typedef struct
 	{
-		char city[CITY_MAX_LENGTH];
-		char mqttTopic[TOPIC_MAX_LENGTH];
-		char apiKey[APIKEY_MAX_LENGTH];
-		unsigned npredictions;
-		unsigned long period;
-		unsigned long lastConnectionTime;
+		FixedString<CITY_MAX_LENGTH> city = "";
+		FixedString<TOPIC_MAX_LENGTH> mqttTopic = "";
+		FixedString<APIKEY_MAX_LENGTH> apiKey = "";
+		unsigned npredictions = 2;
+		unsigned long period = 60*1000;		// ms, 60 s
 	} args_t;
 
-	WeatherMQTT(String apiKey, WiFiClient * wifiClient, T * mqttClient, String mqttTopic = "weather")
-		: _wifiClient(wifiClient), _mqttClient(mqttClient), _mqttTopic(mqttTopic), Weather(apiKey, wifiClient)
+	// Fields of the retained <root>/state/<field> topics. The API key is
+	// left out: retained, any client would get it on subscribe.
+	enum StateField : uint8_t
+	{
+		STATE_CITY = 0,
+		STATE_NPREDICTIONS,
+		STATE_PERIOD,
+		STATE_FIELDS
+	};
+
+	// Commands, in the order of WEATHER_COMMANDS
+	enum Command : uint8_t
+	{
+		CMD_CITY_GET = 0, CMD_CITY_SET, CMD_NPREDICTIONS_GET, CMD_NPREDICTIONS_SET, CMD_TOPIC_GET, CMD_TOPIC_SET,
+		CMD_APIKEY_GET, CMD_APIKEY_SET, CMD_PERIOD_GET, CMD_PERIOD_SET, CMD_SAVE, CMD_LOAD, CMD_CONFIG_GET, CMD_CONFIG_SET,
+		CMD_COUNT
+	};
+	static_assert(sizeof(WEATHER_COMMANDS)/sizeof(WEATHER_COMMANDS[0]) == CMD_COUNT,
+		"Command and WEATHER_COMMANDS differ.");
+
+	WeatherMQTT(const char * apiKey, WiFiClient * wifiClient, T * mqttClient, const char * mqttTopic = "weather")
+		: Weather(wifiClient), _wifiClient(wifiClient), _mqttClient(mqttClient), _fetch(fetchDue, this)
 	{
-		// ...
+		_args.apiKey.assign(apiKey);
+		_args.mqttTopic.assign(mqttTopic);
 	}
 
-	void setCity(String city) {_city = city;}
-	String getCity() {return _city;}
+	// False, keeping the value, if it is too long
+	bool setCity(const char * city) {return _args.city.assign(city);}
+	const FixedString<CITY_MAX_LENGTH> & getCity() const {return _args.city;}
 
-	void setMqttTopic(String topic) {_mqttTopic = topic;}
-	String getMqttTopic() {return _mqttTopic;}
+	bool setMqttTopic(const char * topic) {return _args.mqttTopic.assign(topic);}
+	const FixedString<TOPIC_MAX_LENGTH> & getMqttTopic() const {return _args.mqttTopic;}
 
-	void setPeriod(unsigned long period) {_period = period*1000; _lastConnectionTime = _period;}
-	unsigned long getPeriod() {return _period;}
+	bool setApiKey(const char * apiKey) {return _args.apiKey.assign(apiKey);}
+	const FixedString<APIKEY_MAX_LENGTH> & getApiKey() const {return _args.apiKey;}
+
+	// Restarts the period, the next report is one period away
+	void setPeriod(unsigned long period)
+	{
+		_args.period = period*1000;
+		restartFetch();
+	}
+	unsigned long getPeriod() {return _args.period;}
 
 	// Specifies the number of the n following forecast data
-	void setnPredictions(unsigned val) {_npredictions = val;}
-	unsigned getnPredictions(void) {return _npredictions;}
+	// False, keeping the value, above WEATHER_PREDICTIONS_MAX
+	bool setnPredictions(unsigned val)
+	{
+		if(val > WEATHER_PREDICTIONS_MAX)
+			return false;
+		_args.npredictions = val;
+		return true;
+	}
+	unsigned getnPredictions(void) {return _args.npredictions;}
 
 	bool subscribe()
 	{
 		bool ret = true;
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/city/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/city/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/npredictions/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/npredictions/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/topic/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/topic/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/apiKey/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/apiKey/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/period/get").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/period/set").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/save").c_str());
-		ret &= _mqttClient->subscribe(String(getMqttTopic() +"/load").c_str());
+		char topic[TOPIC_BUFFER_SIZE];
+		for(const char * command : WEATHER_COMMANDS)
+			ret &= _mqttClient->subscribe(getMqttTopic().join(topic, sizeof(topic), command));
 
 		if(!ret)
 		{
-			_err = "Failed to subscribe to weather related topic.";
-			Log::error(_err);
+			snprintf(_err, sizeof(_err), "Failed to subscribe to weather related topic.");
+			LOG_ERROR("%s", _err);
+		}
+		else
+		{
+			// New root topic or new connection: the whole state again
+			_state.clear();
+			publishState();
 		}
 
 		return ret;
@@ -236,23 +333,14 @@ public:
 	bool unsubscribe()
 	{
 		bool ret = true;
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/city/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/city/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/npredictions/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/npredictions/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/topic/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/topic/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/apiKey/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/apiKey/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/period/get").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/period/set").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/save").c_str());
-		ret &= _mqttClient->unsubscribe(String(getMqttTopic() +"/load").c_str());
+		char topic[TOPIC_BUFFER_SIZE];
+		for(const char * command : WEATHER_COMMANDS)
+			ret &= _mqttClient->unsubscribe(getMqttTopic().join(topic, sizeof(topic), command));
 
 		if(!ret)
 		{
-			_err = "Failed to unsubscribe from weather related topics.";
-			Log::error(_err);
+			snprintf(_err, sizeof(_err), "Failed to unsubscribe from weather related topics.");
+			LOG_ERROR("%s", _err);
 		}
 		
 		return ret;
@@ -265,224 +353,517 @@ public:
 		return subscribe();
 	}
 
-	void setEEPROMAddress(int add) {_eepromAdd = add;}
-	int getEEPROMAddress() {return _eepromAdd;}
+	// Moves every subscription to the new root topic, keeps the old one on failure
+	bool changeMqttTopic(const char * topic)
+	{
+		if(strlen(topic) > TOPIC_MAX_LENGTH - 1)
+		{
+			snprintf(_err, sizeof(_err), "Given topic is too long.");
+			LOG_ERROR("%s", _err);
+			return false;
+		}
+
+		clearState();
+		if(!unsubscribe())
+			return false;
+
+		FixedString<TOPIC_MAX_LENGTH> hold = getMqttTopic();
+
+		setMqttTopic(topic);
+
+		if(!subscribe())
+		{
+			snprintf(_err, sizeof(_err), "Given topic is might unvalid.");
+			LOG_ERROR("%s", _err);
+			_args.mqttTopic = hold;
+			if(!subscribe())
+			{
+				snprintf(_err, sizeof(_err), "Could not resubscribe to MQTT topic. New given topic was discarded.");
+				LOG_ERROR("%s", _err);
+			}
+			return false;
+		}
+		return true;
+	}
+
+	// Publishes the fields that changed since the last call to their retained
+	// <root>/state/<field> topic. Runs after every command, so clients only
+	// need to subscribe to follow the configuration.
+	bool publishState()
+	{
+		bool ret = true;
+		char value[CITY_MAX_LENGTH];
+		char topic[TOPIC_BUFFER_SIZE];
+		for(uint8_t i = 0; i < STATE_FIELDS; i++)
+		{
+			stateValue(i, value, sizeof(value));
+			if(!_state.update(i, value))
+				continue;
 
+			snprintf(topic, sizeof(topic), "%s" STATE_TOPIC "%s", getMqttTopic().c_str(), stateName(i));
+			if(!_mqttClient->publish(topic, value, true))
+			{
+				_state.forget(i);
+				snprintf(_err, sizeof(_err), "Publish error! Could not publish <%.24s> to topic <%.80s>.", value, topic);
+				LOG_ERROR("%s", _err);
+				ret = false;
+			}
+		}
+		return ret;
+	}
 
-	// Returns the last saved address. You still need to begin EEPROM and commit it!
-	// Begin recommended: EEPROM.begin(sizeof(args_t));
-	// To commit (after calling save): EEPROM.commit();
-	int save(int const address)
+	// Removes the retained state topics below the current root topic
+	void clearState()
 	{
-		args_t s;
-		EEPROM.begin(sizeof(args_t));
+		char topic[TOPIC_BUFFER_SIZE];
+		for(uint8_t i = 0; i < STATE_FIELDS; i++)
+		{
+			snprintf(topic, sizeof(topic), "%s" STATE_TOPIC "%s", getMqttTopic().c_str(), stateName(i));
+			_mqttClient->publish(topic, "", true);
+		}
+		_state.clear();
+	}
 
-		if(EEPROM.length() < sizeof(s))
+	// Every parameter in one JSON document in buf, see /config/get. The
+	// period is in seconds, as for /period/set. Returns the length of the
+	// document, 0 if it does not fit.
+	size_t getConfig(char * buf, size_t size)
+	{
+		StaticJsonDocument<WEATHER_CONFIG_JSON_SIZE> doc;
+		doc["city"] = getCity().c_str();
+		doc["npredictions"] = getnPredictions();
+		doc["period"] = getPeriod()/1000;
+		doc["apiKey"] = getApiKey().c_str();
+		doc["topic"] = getMqttTopic().c_str();
+
+		if(measureJson(doc) >= size)
 		{
-			_err = "EEPROM length is too small. Please initialize it with EEPROM.begin(sizeof(s_t))";
-			Log::error(_err);
+			snprintf(_err, sizeof(_err), "Configuration does not fit in %u bytes.", (unsigned)size);
+			LOG_ERROR("%s", _err);
 			return 0;
 		}
+		return serializeJson(doc, buf, size);
+	}
+
+	// Partial update from a JSON object with any keys of getConfig(). Every
+	// value is checked before anything changes, so a bad one leaves the
+	// configuration as it was. Of the changes only the topic can fail
+	// afterwards: it goes first and undoes itself. json need not be
+	// terminated.
+	bool setConfig(const char * json, size_t length)
+	{
+		StaticJsonDocument<WEATHER_CONFIG_JSON_SIZE> doc;
+		DeserializationError error = deserializeJson(doc, json, length);
+		if(error || !doc.is<JsonObject>())
+		{
+			snprintf(_err, sizeof(_err), "Configuration is not a JSON object: %s", error.c_str());
+			LOG_ERROR("%s", _err);
+			return false;
+		}
+
+		FixedString<CITY_MAX_LENGTH> city = getCity();
+		unsigned npredictions = getnPredictions();
+		unsigned long period = getPeriod()/1000;
+		FixedString<APIKEY_MAX_LENGTH> apiKey = getApiKey();
+		FixedString<TOPIC_MAX_LENGTH> topic = getMqttTopic();
+
+		for(JsonPair kv : doc.as<JsonObject>())
+		{
+			const char * key = kv.key().c_str();
+			JsonVariant value = kv.value();
+			bool valid = false;
+
+			if(!strcmp(key, "city") && value.is<const char*>())
+			{
+				valid = city.assign(value.as<const char*>()) && !city.empty();
+			}
+			else if(!strcmp(key, "npredictions") && value.is<int>() && value.as<int>() >= 0 && value.as<int>() <= WEATHER_PREDICTIONS_MAX)
+			{
+				npredictions = value.as<int>();
+				valid = true;
+			}
+			else if(!strcmp(key, "period") && value.is<long>() && value.as<long>() > 0)
+			{
+				period = value.as<long>();
+				valid = true;
+			}
+			else if(!strcmp(key, "apiKey") && value.is<const char*>())
+			{
+				valid = apiKey.assign(value.as<const char*>());
+			}
+			else if(!strcmp(key, "topic") && value.is<const char*>())
+			{
+				valid = topic.assign(value.as<const char*>()) && !topic.empty();
+			}
+
+			if(!valid)
+			{
+				snprintf(_err, sizeof(_err), "Configuration parameter <%s> is unknown or out of bonds. Nothing was changed.", key);
+				LOG_ERROR("%s", _err);
+				return false;
+			}
+		}
 
-		strlcpy(s.city,(const char*)getCity().c_str(),CITY_MAX_LENGTH);
-		strlcpy(s.mqttTopic,(const char*)getMqttTopic().c_str(),TOPIC_MAX_LENGTH);
-		strlcpy(s.apiKey,(const char*)getApiKey().c_str(),APIKEY_MAX_LENGTH);
-		s.npredictions = getnPredictions();
-		s.period = getPeriod();
-		s.lastConnectionTime = _lastConnectionTime;
+		if(topic != getMqttTopic() && !changeMqttTopic(topic.c_str()))
+			return false;
 
-		EEPROM.put<args_t>(address,s);
-		EEPROM.commit();
-		EEPROM.end();
+		_args.city = city;
+		setnPredictions(npredictions);
+		_args.apiKey = apiKey;
+		// Only when it changed, setting it also restarts the period
+		if(period != getPeriod()/1000)
+			setPeriod(period);
+		return true;
+	}
+
+	bool setConfig(const char * json) {return setConfig(json, strlen(json));}
+
+	// Journal record the configuration is saved under
+	void setRecordId(uint8_t id) {_recordId = id;}
+	uint8_t getRecordId() {return _recordId;}
 
-		return address + sizeof(s) -1;
+
+	// Only writes to flash if the configuration changed since the last save
+	bool save(uint8_t const id)
+	{
+		// The state is the record, its unused string bytes are kept zero
+		if(ConfigStore.write(id, WEATHER_RECORD_VERSION, &_args, sizeof(_args)) == ConfigJournal::JOURNAL_ERROR)
+		{
+			snprintf(_err, sizeof(_err), "Could not save configuration: %s", ConfigStore.err());
+			LOG_ERROR("%s", _err);
+			return false;
+		}
+		return true;
 	}
 
-	int save(void)
+	bool save(void)
 	{
-		return save(_eepromAdd);
+		return save(_recordId);
 	}
 
-	bool load(int const address)
+	bool load(uint8_t const id)
 	{
 		args_t s;
-		EEPROM.begin(sizeof(args_t));
 
-		if(EEPROM.length() < sizeof(s))
+		if(!ConfigStore.read(id, WEATHER_RECORD_VERSION, &s, sizeof(s)))
 		{
-			_err = "EEPROM length is too small. Please initialize it with EEPROM.begin(sizeof(s_t))";
-			Log::error(_err);
+			snprintf(_err, sizeof(_err), "Could not load configuration: %s", ConfigStore.err());
+			LOG_WARNING("%s", _err);
 			return false;
 		}
 
-		EEPROM.get<args_t>(address,s);
-		EEPROM.end();
-
-		setCity(String(s.city));
-		setMqttTopic(String(s.mqttTopic));
-		setApiKey(String(s.apiKey));
-		setnPredictions(s.npredictions);
-		_period = s.period; // setPeriod multiplies it by 1000!
-		_lastConnectionTime = s.lastConnectionTime;
-
+		s.city.terminate();
+		s.mqttTopic.terminate();
+		s.apiKey.terminate();
 
+		memcpy(&_args, &s, sizeof(_args));
+		restartFetch();
 		return true;
 	}
 
 	bool load(void)
 	{
-		return load(_eepromAdd);
+		return load(_recordId);
 	}
 
-	// Call this method inside your callback functions with raw arguments
-	// returns false in case of error
-	bool callback(String topic, String payload)
+	// The configuration and the trace counter in few bytes, for RTC memory
+	// across deep sleep: the numbers, then the strings with their
+	// terminators. 0 if it does not fit in size.
+	size_t pack(uint8_t * buf, size_t size)
 	{
-		if(topic == getMqttTopic() +"/city/get")
+		uint32_t numbers[3] = {_args.npredictions, (uint32_t)_args.period, _traceId};
+		const char * strings[3] = {getCity().c_str(), getMqttTopic().c_str(), getApiKey().c_str()};
+
+		size_t n = sizeof(numbers);
+		for(const char * s : strings)
+			n += strlen(s) + 1;
+		if(n > size)
+			return 0;
+
+		memcpy(buf, numbers, sizeof(numbers));
+		n = sizeof(numbers);
+		for(const char * s : strings)
 		{
-			if(!_mqttClient->publish(payload.c_str(),getCity().c_str()))
-			{
-				_err = "Publish error! Could not publish <" + getCity() + "> to topic <" + payload + ">.";
-				Log::error(_err);
-				return false;
-			}
+			size_t length = strlen(s) + 1;
+			memcpy(buf + n, s, length);
+			n += length;
 		}
-		else if(topic == getMqttTopic() +"/city/set")
-			setCity(payload);
+		return n;
+	}
+
+	// Takes what pack() wrote, or nothing if it does not look like it
+	bool unpack(const uint8_t * buf, size_t length)
+	{
+		uint32_t numbers[3];
+		const char * strings[3];
+		if(length < sizeof(numbers))
+			return false;
+		memcpy(numbers, buf, sizeof(numbers));
 
-		else if(topic == getMqttTopic() +"/npredictions/get")
+		const char * p = (const char*)buf + sizeof(numbers);
+		const char * end = (const char*)buf + length;
+		for(const char * & s : strings)
 		{
-			if(!_mqttClient->publish(payload.c_str(),String(getnPredictions()).c_str()))
-			{
-				_err = "Publish error! Could not publish <" + String(getnPredictions()) + "> to topic <" + payload + ">.";
-				Log::error(_err);
+			const char * terminator = (const char*)memchr(p, '\0', end - p);
+			if(terminator == nullptr)
 				return false;
-			}
+			s = p;
+			p = terminator + 1;
 		}
-		else if(topic == getMqttTopic() +"/npredictions/set")
-			setnPredictions(payload.toInt());
 
-		else if(topic == getMqttTopic() +"/topic/get")
+		args_t s;
+		if(!s.city.assign(strings[0]) || !s.mqttTopic.assign(strings[1]) || !s.apiKey.assign(strings[2]))
+			return false;
+		s.npredictions = numbers[0];
+		s.period = numbers[1];
+
+		_args = s;
+		_traceId = numbers[2];
+		restartFetch();
+		return true;
+	}
+
+	// Call this method inside your callback functions with raw arguments,
+	// the payload need not be terminated. Returns false in case of error.
+	bool callback(const char* topic, const char* payload, unsigned int length)
+	{
+		// A command index: the topic is compared with the command table once
+		int c = commandOf(topic);
+		if(c < 0)
+			return true;
+
+		// Terminated, on the stack: the reply topic or the value to set.
+		// /config/set parses the payload as it is.
+		char msg[TOPIC_BUFFER_SIZE] = "";
+		if(c != CMD_CONFIG_SET)
 		{
-			if(!_mqttClient->publish(payload.c_str(),getMqttTopic().c_str()))
+			if(length >= sizeof(msg))
 			{
-				_err = "Publish error! Could not publish <" + getMqttTopic() + "> to topic <" + payload + ">.";
-				Log::error(_err);
+				snprintf(_err, sizeof(_err), "Payload of %u bytes is too long.", length);
+				LOG_ERROR("%s", _err);
 				return false;
 			}
+			memcpy(msg, payload, length);
+			msg[length] = '\0';
 		}
-		else if(topic == getMqttTopic() +"/topic/set")
+		char data[24];
+
+		switch(c)
 		{
-			if(!unsubscribe())
+		case CMD_CITY_GET:
+			if(!reply(msg, getCity().c_str()))
 				return false;
-
-			String hold = getMqttTopic();
-
-			setMqttTopic(payload);
-
-			if(!subscribe())
+			break;
+		case CMD_CITY_SET:
+			if(!setCity(msg))
 			{
-				_err = "Given topic is might unvalid.";
-				Log::error(_err);
-				setMqttTopic(hold);
-				if(!subscribe())
-				{
-					_err = "Could not resubscribe to MQTT topic. New given topic was discarded.";
-					Log::error(_err);
-				}
+				snprintf(_err, sizeof(_err), "City is too long.");
+				LOG_ERROR("%s", _err);
 				return false;
 			}
-		}
+			break;
 
-		else if(topic == getMqttTopic() +"/period/get")
-		{
-			if(!_mqttClient->publish(payload.c_str(),String(getPeriod()).c_str()))
+		case CMD_NPREDICTIONS_GET:
+			snprintf(data, sizeof(data), "%u", getnPredictions());
+			if(!reply(msg, data))
+				return false;
+			break;
+		case CMD_NPREDICTIONS_SET:
+			if(!setnPredictions(atoi(msg)))
 			{
-				_err = "Publish error! Could not publish <" + String(getPeriod()) + "> to topic <" + payload + ">.";
-				Log::error(_err);
+				snprintf(_err, sizeof(_err), "At most %u predictions.", WEATHER_PREDICTIONS_MAX);
+				LOG_ERROR("%s", _err);
 				return false;
 			}
-		}
-		else if(topic == getMqttTopic() +"/period/set")
-			setPeriod((unsigned long)payload.toInt());
+			break;
 
-		else if(topic == getMqttTopic() +"/apiKey/get")
-		{
-			if(!_mqttClient->publish(payload.c_str(),getApiKey().c_str()))
+		case CMD_TOPIC_GET:
+			if(!reply(msg, getMqttTopic().c_str()))
+				return false;
+			break;
+		case CMD_TOPIC_SET:
+			if(!changeMqttTopic(msg))
+				return false;
+			break;
+
+		case CMD_APIKEY_GET:
+			if(!reply(msg, getApiKey().c_str()))
+				return false;
+			break;
+		case CMD_APIKEY_SET:
+			if(!setApiKey(msg))
 			{
-				_err = "Publish error! Could not publish <" + getApiKey() + "> to topic <" + payload + ">.";
-				Log::error(_err);
+				snprintf(_err, sizeof(_err), "API key is too long.");
+				LOG_ERROR("%s", _err);
 				return false;
 			}
-		}
-		else if(topic == getMqttTopic() +"/apiKey/set")
-			setApiKey(payload);
+			break;
+
+		case CMD_PERIOD_GET:
+			snprintf(data, sizeof(data), "%lu", getPeriod());
+			if(!reply(msg, data))
+				return false;
+			break;
+		case CMD_PERIOD_SET:
+			setPeriod((unsigned long)atol(msg));
+			break;
+
+		case CMD_SAVE:
+			if(!save(getRecordId()))
+				return false;
+			break;
+		case CMD_LOAD:
+			if(!load(getRecordId()))
+				return false;
+			break;
 
-		else if(topic == getMqttTopic() +"/save")
+		case CMD_CONFIG_GET:
 		{
-			if(!save(getEEPROMAddress()))
+			char config[WEATHER_CONFIG_SIZE];
+			if(getConfig(config, sizeof(config)) == 0 || !reply(msg, config))
 				return false;
+			break;
 		}
-		else if(topic == getMqttTopic() +"/load")
-		{
-			if(!load(getEEPROMAddress()))
+		case CMD_CONFIG_SET:
+			if(!setConfig(payload, length))
 				return false;
+			break;
 		}
 
+		// Any command may have changed a field
+		publishState();
 		return true;
 	}
 
 	bool callback(char* topic, byte* payload, unsigned int length)
 	{
-		String stopic = String(topic);
-		char msg[length+1];
-	    for (int i = 0; i < length; i++) {
-	        msg[i] = (char)payload[i];
-	    }
-	    msg[length] = '\0';
-
-	    return this->callback(stopic, String(msg));
+		return callback((const char*)topic, (const char*)payload, length);
 	}
 
-	uint16_t minBufferSize() {return _minMqttBuff + _buffSizeInc*_npredictions;}
+	uint16_t minBufferSize() {return _minMqttBuff + _traceBuff + _buffSizeInc*_args.npredictions;}
 
-	// Call this method inside your loop
+	// Call this method inside your loop, with Timers.run(). The first call
+	// reports right away, then the fetch timer marks a report due every
+	// period. One that is due waits for the next call.
 	bool run()
 	{
-		if(millis() - _lastConnectionTime > _period)
+		if(!_fetch.active())
 		{
-			_lastConnectionTime = millis();
-			
-			String payload = get(_city, _npredictions);
-			
-			if(payload == "")
-			{
-				Log::error(_err);
-				return false;
-			}
+			Timers.start(_fetch, _args.period, _args.period);
+			_due = true;
+		}
+		if(!_due)
+			return true;
 
-			if(!_mqttClient->publish(_mqttTopic.c_str(), payload.c_str(), true)) // true -> retained
-			{
-				_err = "Publish failed. Check if the MQTT Client buffer size matches the minimum required for your given npredictions, given by WeatherClient::minBufferSize().";
-				Log::error(_err);
-				return false;
-			}
+		_due = false;
+		return report();
+	}
+
+	// Fetches the weather and publishes it right away, whether it is due or not
+	bool report()
+	{
+		trace_t trace;
+		trace.id = ++_traceId;
+		trace.fetch = millis();
+		
+		// One report at a time, so one buffer for all instances
+		static char payload[WEATHER_REPORT_SIZE];
+		size_t n = get(_args.apiKey.c_str(), _args.city.c_str(), _args.npredictions, payload, sizeof(payload) - WEATHER_TRACE_SIZE);
+		
+		if(n == 0)
+		{
+			LOG_ERROR("%s", _err);
+			return false;
+		}
+
+		MemScope mem(MEM_OP_PUBLISH);
+
+		// Carried along to the window command, see Trace.h. The room for it
+		// was kept.
+		char traceJson[TRACE_JSON_SIZE];
+		trace.publish = millis();
+		if(Trace::print(trace, traceJson, sizeof(traceJson)) > 0)
+			snprintf(payload + n - 1, sizeof(payload) - n + 1, ",\"trace\":%s}", traceJson);
+
+		if(!_mqttClient->publish(_args.mqttTopic.c_str(), payload, true)) // true -> retained
+		{
+			snprintf(_err, sizeof(_err), "Publish failed. Check if the MQTT Client buffer size matches the minimum required for your given npredictions, given by WeatherClient::minBufferSize().");
+			LOG_ERROR("%s", _err);
+			return false;
 		}
 
 		return true;
 	}
 
 private:
+	static void fetchDue(void * ctx) {((WeatherMQTT*)ctx)->_due = true;}
+
+	// Command of topic, -1 if it is none: the subtopic below the root topic
+	// looked up in WEATHER_COMMANDS
+	int commandOf(const char * topic) const
+	{
+		const char * suffix = getMqttTopic().after(topic);
+		if(suffix == nullptr)
+			return -1;
+		for(uint8_t c = 0; c < CMD_COUNT; c++)
+		{
+			if(!strcmp(suffix, WEATHER_COMMANDS[c]))
+				return c;
+		}
+		return -1;
+	}
+
+	// Publishes the value a /get command asked for to its reply topic
+	bool reply(const char * topic, const char * value)
+	{
+		if(_mqttClient->publish(topic, value))
+			return true;
+		snprintf(_err, sizeof(_err), "Publish error! Could not publish <%.24s> to topic <%.80s>.", value, topic);
+		LOG_ERROR("%s", _err);
+		return false;
+	}
+
+	static const char * stateName(uint8_t field)
+	{
+		static const char * const names[STATE_FIELDS] = {"city", "npredictions", "period"};
+		return names[field];
+	}
+
+	// Payload of a state topic, the period in seconds as for /period/set
+	void stateValue(uint8_t field, char * buf, size_t size)
+	{
+		switch(field)
+		{
+		case STATE_CITY:
+			snprintf(buf, size, "%s", getCity().c_str());
+			break;
+		case STATE_NPREDICTIONS:
+			snprintf(buf, size, "%u", getnPredictions());
+			break;
+		default:
+			snprintf(buf, size, "%lu", getPeriod()/1000);
+			break;
+		}
+	}
+
+	// Runs the fetch timer on the current period, once run() armed it
+	void restartFetch()
+	{
+		if(_fetch.active())
+			Timers.start(_fetch, _args.period, _args.period);
+	}
+
 	WiFiClient * _wifiClient;
 	T * _mqttClient;
-	String _city;
-	String _mqttTopic;
-	unsigned _npredictions = 2;
-	unsigned long _period = 60*1000; // 60 seg = 1 min
-	unsigned long _lastConnectionTime = 60*1000;
+	args_t _args;	// Saved and loaded as it is
 	const uint16_t _minMqttBuff = 280;
 	const uint16_t _buffSizeInc = 242;
-	int _eepromAdd = 0;
+	const uint16_t _traceBuff = 64;		// "trace" with the fetch and publish stamps
+	uint32_t _traceId = 0;
+	Timer _fetch;		// Periodic on Timers, armed by the first run()
+	bool _due = false;
+	uint8_t _recordId = JOURNAL_ID_WEATHER;
+	StateCache _state;
 };
 
 